@@ -0,0 +1,176 @@
+/** \file benchmark.cpp
+ *  \brief Benchmark driver: times libmolgrid operations and writes JSON.
+ */
+
+#include "benchmark.h"
+#include "libmolgrid/common.h"
+#include "libmolgrid/config.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <boost/program_options.hpp>
+
+using namespace std;
+
+namespace libmolgrid {
+namespace benchmark {
+
+bool Runner::enabled(const string& name) const {
+  return opts.filter.empty() || name.find(opts.filter) != string::npos;
+}
+
+void Runner::run(const string& name, const Params& params, double items, const string& item_name,
+    const function<void()>& f, bool gpu) {
+  if(!enabled(name)) return;
+  typedef chrono::steady_clock clock;
+
+  auto call = [&]() {
+    f();
+    if(gpu) LMG_CUDA_CHECK(cudaDeviceSynchronize());
+  };
+  call(); //warm up
+
+  vector<double> times;
+  double total = 0;
+  while(times.size() < opts.max_iterations && (times.size() < opts.min_iterations || total < opts.min_time)) {
+    auto start = clock::now();
+    call();
+    double secs = chrono::duration<double>(clock::now() - start).count();
+    times.push_back(secs);
+    total += secs;
+  }
+
+  Result r;
+  r.name = name;
+  r.params = params;
+  r.device = gpu ? "gpu" : "cpu";
+  r.iterations = times.size();
+  double mean = total / times.size();
+  double var = 0;
+  for(double t : times) var += (t - mean) * (t - mean);
+  r.mean_ms = mean * 1000;
+  r.min_ms = *min_element(times.begin(), times.end()) * 1000;
+  r.max_ms = *max_element(times.begin(), times.end()) * 1000;
+  r.stddev_ms = sqrt(var / times.size()) * 1000;
+  r.items = items;
+  r.item_name = item_name;
+  r.items_per_second = mean > 0 ? items / mean : 0;
+  results.push_back(r);
+
+  cerr << name;
+  for(const auto& p : params) cerr << " " << p.first << "=" << p.second;
+  cerr << " [" << r.device << "]: " << r.mean_ms << " ms, " << r.items_per_second << " " << item_name << "/s\n";
+}
+
+//quote and escape s as a JSON string
+static string json_string(const string& s) {
+  string ret = "\"";
+  for(char c : s) {
+    switch(c) {
+      case '"': ret += "\\\""; break;
+      case '\\': ret += "\\\\"; break;
+      case '\n': ret += "\\n"; break;
+      case '\t': ret += "\\t"; break;
+      default:
+        if((unsigned char)c < 0x20) {
+          char buf[8];
+          snprintf(buf, sizeof(buf), "\\u%04x", c);
+          ret += buf;
+        } else {
+          ret += c;
+        }
+    }
+  }
+  return ret + "\"";
+}
+
+//JSON has no representation of inf or nan
+static string json_number(double v) {
+  if(!std::isfinite(v)) return "null";
+  return boost::lexical_cast<string>(v);
+}
+
+void Runner::write_json(ostream& out) const {
+  out << "{\n";
+  out << "  \"libmolgrid\": {\"version\": \"" << VERSION_MAJOR << "." << VERSION_MINOR << "." << VERSION_PATCH
+      << "\", \"git_revision\": " << json_string(GIT_REVISION) << "},\n";
+  out << "  \"settings\": {\"min_time\": " << json_number(opts.min_time) << ", \"min_iterations\": " << opts.min_iterations
+      << ", \"max_iterations\": " << opts.max_iterations << "},\n";
+  out << "  \"benchmarks\": [";
+  for(unsigned i = 0, n = results.size(); i < n; i++) {
+    const Result& r = results[i];
+    out << (i ? ",\n" : "\n") << "    {\"name\": " << json_string(r.name) << ", \"device\": " << json_string(r.device)
+        << ", \"params\": {";
+    for(unsigned p = 0, np = r.params.size(); p < np; p++) {
+      out << (p ? ", " : "") << json_string(r.params[p].first) << ": " << json_string(r.params[p].second);
+    }
+    out << "}, \"iterations\": " << r.iterations
+        << ", \"mean_ms\": " << json_number(r.mean_ms) << ", \"min_ms\": " << json_number(r.min_ms)
+        << ", \"max_ms\": " << json_number(r.max_ms) << ", \"stddev_ms\": " << json_number(r.stddev_ms)
+        << ", \"items\": " << json_number(r.items) << ", \"item_name\": " << json_string(r.item_name)
+        << ", \"items_per_second\": " << json_number(r.items_per_second) << "}";
+  }
+  out << "\n  ]\n}\n";
+}
+
+} /* namespace benchmark */
+} /* namespace libmolgrid */
+
+using namespace libmolgrid::benchmark;
+namespace po = boost::program_options;
+
+int main(int argc, char *argv[]) {
+  Options opts;
+  string output;
+  po::options_description desc("Time libmolgrid gridding, typing and example providers and report JSON");
+  desc.add_options()
+      ("help,h", "show this message")
+      ("data", po::value<string>(&opts.data_root)->required(), "libmolgrid test data directory (test/data)")
+      ("output,o", po::value<string>(&output), "JSON output file, default stdout")
+      ("filter", po::value<string>(&opts.filter), "only run benchmarks whose name contains this")
+      ("min_time", po::value<double>(&opts.min_time)->default_value(opts.min_time), "minimum seconds to time each benchmark")
+      ("min_iterations", po::value<unsigned>(&opts.min_iterations)->default_value(opts.min_iterations), "minimum timed iterations")
+      ("max_iterations", po::value<unsigned>(&opts.max_iterations)->default_value(opts.max_iterations), "maximum timed iterations")
+      ("no_gpu", "skip GPU benchmarks");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if(vm.count("help")) {
+      cout << desc << "\n";
+      return 0;
+    }
+    po::notify(vm);
+  } catch(po::error& e) {
+    cerr << e.what() << "\n" << desc << "\n";
+    return 1;
+  }
+
+  int ndevices = 0;
+  if(cudaGetDeviceCount(&ndevices) != cudaSuccess) {
+    cudaGetLastError();
+    ndevices = 0;
+  }
+  opts.gpu = !vm.count("no_gpu") && ndevices > 0;
+  if(!opts.gpu && !vm.count("no_gpu")) cerr << "No GPU available, skipping GPU benchmarks\n";
+
+  Runner runner(opts);
+  gridmaker_benchmarks(runner);
+  cache_benchmarks(runner);
+  provider_benchmarks(runner);
+
+  if(output.empty()) {
+    runner.write_json(cout);
+  } else {
+    ofstream out(output.c_str());
+    if(!out) {
+      cerr << "Could not open " << output << "\n";
+      return 1;
+    }
+    runner.write_json(out);
+  }
+  return 0;
+}
@@ -0,0 +1,94 @@
+/** \file benchmark.h
+ *  \brief Harness for timing libmolgrid operations and reporting the results as JSON.
+ */
+
+#ifndef LIBMOLGRID_BENCHMARK_H_
+#define LIBMOLGRID_BENCHMARK_H_
+
+#include <functional>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <boost/lexical_cast.hpp>
+
+namespace libmolgrid {
+namespace benchmark {
+
+/// parameters of a benchmark, reported in order
+typedef std::vector<std::pair<std::string, std::string> > Params;
+
+template <typename T>
+std::string param(const T& v) { return boost::lexical_cast<std::string>(v); }
+
+/// timing of one benchmark
+struct Result {
+    std::string name;
+    Params params;
+    std::string device; ///cpu or gpu
+    size_t iterations = 0;
+    double mean_ms = 0;
+    double min_ms = 0;
+    double max_ms = 0;
+    double stddev_ms = 0;
+    double items = 0; ///items processed by each iteration
+    std::string item_name; ///what an item is, e.g. atoms or examples
+    double items_per_second = 0; ///throughput at the mean time
+};
+
+/// settings shared by all benchmarks
+struct Options {
+    std::string data_root; ///libmolgrid test data directory
+    std::string filter; ///only run benchmarks whose name contains this
+    double min_time = 0.5; ///minimum seconds to time each benchmark
+    unsigned min_iterations = 3;
+    unsigned max_iterations = 1000;
+    bool gpu = true; ///run GPU benchmarks
+};
+
+/** \brief Time benchmarks and collect their results.
+ * Each benchmark is called once untimed to warm up caches and allocations,
+ * then repeatedly until both the minimum time and iterations are reached.
+ */
+class Runner {
+    Options opts;
+    std::vector<Result> results;
+
+  public:
+    explicit Runner(const Options& o): opts(o) {}
+
+    const Options& options() const { return opts; }
+
+    /// return true if benchmark name passes the filter
+    bool enabled(const std::string& name) const;
+
+    /** \brief Time f and record the result.
+     * @param[in] name benchmark name, shared by runs with different params
+     * @param[in] params parameters distinguishing this run
+     * @param[in] items number of items f processes per call
+     * @param[in] item_name what an item is
+     * @param[in] f operation to time
+     * @param[in] gpu f queues GPU work, which is waited on after every call
+     */
+    void run(const std::string& name, const Params& params, double items, const std::string& item_name,
+        const std::function<void()>& f, bool gpu = false);
+
+    const std::vector<Result>& get_results() const { return results; }
+
+    /// write all results as a JSON document
+    void write_json(std::ostream& out) const;
+};
+
+/// gridding and gradients of GridMaker
+void gridmaker_benchmarks(Runner& runner);
+
+/// reading and typing structures with CoordCache
+void cache_benchmarks(Runner& runner);
+
+/// batches from ExampleProvider
+void provider_benchmarks(Runner& runner);
+
+} /* namespace benchmark */
+} /* namespace libmolgrid */
+
+#endif /* LIBMOLGRID_BENCHMARK_H_ */
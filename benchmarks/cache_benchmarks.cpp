@@ -0,0 +1,67 @@
+/** \file cache_benchmarks.cpp
+ *  \brief Throughput of reading and typing structures with CoordCache.
+ */
+
+#include "benchmark.h"
+#include "libmolgrid/coord_cache.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace libmolgrid {
+namespace benchmark {
+
+//interned names of the receptor (first) or ligand (second) structures of a types file
+static vector<const char*> structure_names(const string& types, bool receptor, unsigned max_names) {
+  ifstream in(types.c_str());
+  if(!in) throw invalid_argument("Could not open " + types);
+  vector<const char*> names;
+  string line;
+  while(getline(in, line) && names.size() < max_names) {
+    //label, affinity and rmsd precede the structures
+    stringstream str(line);
+    string label, affinity, rmsd, rec, lig;
+    if(!(str >> label >> affinity >> rmsd >> rec >> lig)) continue;
+    const char *name = string_cache.get(receptor ? rec : lig);
+    if(find(names.begin(), names.end(), name) == names.end()) names.push_back(name);
+  }
+  return names;
+}
+
+//time setting every name, with and without retaining structures in memory
+static void time_cache(Runner& runner, const string& format, shared_ptr<AtomTyper> typer, const string& data_root,
+    const string& molcache, const vector<const char*>& names) {
+  for(bool cache_structs : {false, true}) {
+    ExampleProviderSettings settings;
+    settings.data_root = data_root;
+    settings.cache_structs = cache_structs;
+    CoordCache cache(typer, settings, molcache);
+    CoordinateSet coords;
+    Params params = {{"format", format}, {"files", param(names.size())}, {"cache_structs", param(cache_structs)}};
+    runner.run("coordcache_set_coords", params, names.size(), "files", [&]() {
+      for(const char *name : names) cache.set_coords(name, coords);
+    });
+  }
+}
+
+void cache_benchmarks(Runner& runner) {
+  if(!runner.enabled("coordcache_set_coords")) return;
+  const string& data = runner.options().data_root;
+  shared_ptr<AtomTyper> rectyper = make_shared<FileMappedGninaTyper>(defaultGninaReceptorTyper);
+  shared_ptr<AtomTyper> ligtyper = make_shared<FileMappedGninaTyper>(defaultGninaLigandTyper);
+  string types = data + "/small.types";
+
+  vector<const char*> ligands = structure_names(types, false, 100);
+  time_cache(runner, "gninatypes", ligtyper, data + "/structs", "", ligands);
+  time_cache(runner, "molcache2", ligtyper, data, data + "/lig.molcache2", ligands);
+
+  //OpenBabel parses and types the molecule
+  time_cache(runner, "pdb", rectyper, data, "", {string_cache.get("REC.pdb")});
+  time_cache(runner, "mol", ligtyper, data, "", {string_cache.get("LIG.mol")});
+}
+
+} /* namespace benchmark */
+} /* namespace libmolgrid */
@@ -0,0 +1,102 @@
+/** \file gridmaker_benchmarks.cpp
+ *  \brief Throughput of GridMaker forward and backward.
+ */
+
+#include "benchmark.h"
+#include "libmolgrid/grid_maker.h"
+#include <random>
+
+using namespace std;
+
+namespace libmolgrid {
+namespace benchmark {
+
+static const unsigned NTYPES = 14;
+
+//n atoms of random type and radius, uniformly placed in a cube of side width centered at the origin
+static CoordinateSet random_atoms(unsigned n, float width, bool vector_types, unsigned seed) {
+  default_random_engine engine(seed);
+  uniform_real_distribution<float> position(-width / 2, width / 2);
+  uniform_real_distribution<float> radius(1.0, 2.0);
+  uniform_int_distribution<int> type(0, NTYPES - 1);
+
+  vector<float3> coords(n);
+  vector<float> radii(n);
+  vector<int> types(n);
+  for(unsigned i = 0; i < n; i++) {
+    coords[i] = make_float3(position(engine), position(engine), position(engine));
+    radii[i] = radius(engine);
+    types[i] = type(engine);
+  }
+  if(!vector_types) return CoordinateSet(coords, types, radii, NTYPES);
+
+  vector<vector<float> > tvec(n, vector<float>(NTYPES, 0));
+  for(unsigned i = 0; i < n; i++) tvec[i][types[i]] = 1.0;
+  return CoordinateSet(coords, tvec, radii);
+}
+
+void gridmaker_benchmarks(Runner& runner) {
+  const unsigned atom_counts[] = {100, 1000, 10000};
+  const float resolutions[] = {0.5, 0.25};
+  const float dimensions[] = {11.5, 23.5};
+  float3 center = make_float3(0, 0, 0);
+
+  for(bool vector_types : {false, true}) {
+    for(unsigned natoms : atom_counts) {
+      for(float dimension : dimensions) {
+        //atoms fill a box a little larger than the grid, as a receptor does
+        CoordinateSet atoms = random_atoms(natoms, dimension + 4, vector_types, natoms);
+        for(float resolution : resolutions) {
+          GridMaker gmaker(resolution, dimension);
+          float3 dims = gmaker.get_grid_dims();
+          Params params = {{"atoms", param(natoms)}, {"resolution", param(resolution)},
+              {"dimension", param(dimension)}, {"types", vector_types ? "vector" : "index"}};
+
+          MGrid4f grid(NTYPES, dims.x, dims.y, dims.z);
+          MGrid4f diff(NTYPES, dims.x, dims.y, dims.z);
+          MGrid2f gradients(natoms, 3);
+          MGrid2f type_gradients(natoms, NTYPES);
+          diff.cpu();
+          float *d = diff.data();
+          for(unsigned i = 0, n = diff.size(); i < n; i++) d[i] = (i % 7) * 0.1 - 0.3;
+
+          runner.run("gridmaker_forward", params, natoms, "atoms", [&]() {
+            Grid4f g = grid.cpu();
+            gmaker.forward(center, atoms, g);
+          });
+          runner.run("gridmaker_backward", params, natoms, "atoms", [&]() {
+            Grid4f g = diff.cpu();
+            Grid2f a = gradients.cpu();
+            if(vector_types) {
+              Grid2f t = type_gradients.cpu();
+              gmaker.backward(center, atoms, g, a, t);
+            } else {
+              gmaker.backward(center, atoms, g, a);
+            }
+          });
+
+          if(!runner.options().gpu) continue;
+          atoms.togpu();
+          runner.run("gridmaker_forward", params, natoms, "atoms", [&]() {
+            Grid4fCUDA g = grid.gpu();
+            gmaker.forward(center, atoms, g);
+          }, true);
+          runner.run("gridmaker_backward", params, natoms, "atoms", [&]() {
+            Grid4fCUDA g = diff.gpu();
+            Grid2fCUDA a = gradients.gpu();
+            if(vector_types) {
+              Grid2fCUDA t = type_gradients.gpu();
+              gmaker.backward(center, atoms, g, a, t);
+            } else {
+              gmaker.backward(center, atoms, g, a);
+            }
+          }, true);
+          atoms.tocpu();
+        }
+      }
+    }
+  }
+}
+
+} /* namespace benchmark */
+} /* namespace libmolgrid */
@@ -0,0 +1,45 @@
+/** \file provider_benchmarks.cpp
+ *  \brief Throughput of batches from ExampleProvider.
+ */
+
+#include "benchmark.h"
+#include "libmolgrid/example_provider.h"
+
+using namespace std;
+
+namespace libmolgrid {
+namespace benchmark {
+
+void provider_benchmarks(Runner& runner) {
+  if(!runner.enabled("exampleprovider_next_batch")) return;
+  const string& data = runner.options().data_root;
+
+  for(bool molcache : {false, true}) {
+    for(unsigned prefetch : {0, 4}) {
+      for(unsigned batch_size : {16, 64}) {
+        ExampleProviderSettings settings;
+        settings.shuffle = true;
+        settings.num_prefetch_threads = prefetch;
+        if(molcache) {
+          settings.data_root = data;
+          settings.recmolcache = data + "/rec.molcache2";
+          settings.ligmolcache = data + "/lig.molcache2";
+        } else {
+          settings.data_root = data + "/structs";
+        }
+        ExampleProvider provider(settings);
+        provider.populate(data + "/small.types");
+
+        vector<Example> batch;
+        Params params = {{"format", molcache ? "molcache2" : "gninatypes"}, {"batch_size", param(batch_size)},
+            {"prefetch_threads", param(prefetch)}};
+        runner.run("exampleprovider_next_batch", params, batch_size, "examples", [&]() {
+          provider.next_batch(batch, batch_size);
+        });
+      }
+    }
+  }
+}
+
+} /* namespace benchmark */
+} /* namespace libmolgrid */
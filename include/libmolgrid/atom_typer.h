@@ -10,6 +10,7 @@
 #define ATOMTYPER_H_
 
 #include <openbabel/atom.h>
+#include <openbabel/mol.h>
 #include <openbabel/elements.h>
 #include <vector>
 #include <memory>
@@ -35,6 +36,23 @@ class AtomTyper {
     virtual std::pair<int,float> get_atom_type_index(OpenBabel::OBAtom *a) const { throw std::logic_error("Unimplemented atom typing function called"); }
     virtual std::pair<int,float> get_int_type(int t) const { throw std::logic_error("Unimplemented atom typing function called"); }
 
+    /** \brief Index type every atom of mol, in atom order.
+     * Typers that can share work between atoms, such as neighbour queries,
+     * override this.  By default each atom is typed with get_atom_type_index.
+     * @param[in] mol molecule to type
+     * @param[out] types type of each atom, negative if the atom is ignored
+     * @param[out] radii radius of each atom
+     */
+    virtual void type_molecule(OpenBabel::OBMol& mol, std::vector<int>& types, std::vector<float>& radii) const;
+
+    /** \brief Vector type every atom of mol, in atom order.
+     * By default each atom is typed with get_atom_type_vector.
+     * @param[in] mol molecule to type
+     * @param[out] type_vectors num_types() values for each atom
+     * @param[out] radii radius of each atom, the atom is ignored if not positive
+     */
+    virtual void type_molecule(OpenBabel::OBMol& mol, std::vector<float>& type_vectors, std::vector<float>& radii) const;
+
     virtual std::vector<std::string> get_type_names() const { throw std::logic_error("Base class AtomTyper function called"); }
     virtual bool is_vector_typer() const { throw std::logic_error("Base class AtomTyper function called"); }
 };
@@ -178,10 +196,21 @@ class GninaIndexTyper: public AtomIndexTyper {
     static const info default_data[NumTypes];
     const info *data = NULL; //data to use
 
+    ///elements with precomputed types
+    static const unsigned table_elements = 119;
+    ///type of each element, alternate name, and bonding to hydrogen and heteroatoms
+    std::vector<int> type_table;
+
+    //type of an atom of element anum named with its alternate name (polar
+    //hydrogen, aromatic carbon or acceptor) and bonding flags
+    int resolve_type(unsigned anum, bool alternate, unsigned bonding) const;
+    //type of a given the bonding flags of its neighbours
+    int atom_type(OpenBabel::OBAtom* a, unsigned bonding) const;
+
   public:
 
     //Create a gnina typer.  If usec is true, use the gnina determined covalent radius.
-    GninaIndexTyper(bool usec = false, const info *d = default_data): use_covalent(usec), data(d) {}
+    GninaIndexTyper(bool usec = false, const info *d = default_data);
     virtual ~GninaIndexTyper() {}
 
     /// return number of types
@@ -190,6 +219,14 @@ class GninaIndexTyper: public AtomIndexTyper {
     ///return type index of a
     virtual std::pair<int,float> get_atom_type_index(OpenBabel::OBAtom* a) const;
 
+    using AtomIndexTyper::type_molecule;
+    /** \brief Type every atom of mol.
+     * Neighbours are classified in one sweep over the bonds, and types are
+     * looked up in a table instead of by name.  Results are identical to
+     * get_atom_type_index.
+     */
+    virtual void type_molecule(OpenBabel::OBMol& mol, std::vector<int>& types, std::vector<float>& radii) const;
+
     /// basically look up the radius of the given gnina type
     virtual std::pair<int,float> get_int_type(int t) const;
 
@@ -357,6 +394,13 @@ class MappedAtomIndexTyper: public AtomIndexTyper {
       return std::make_pair(ret, res_rad.second);
     }
 
+    using AtomIndexTyper::type_molecule;
+    ///type every atom of mol with the underlying typer, then map the types
+    virtual void type_molecule(OpenBabel::OBMol& mol, std::vector<int>& types, std::vector<float>& radii) const {
+      typer.type_molecule(mol, types, radii);
+      for(int& t : types) t = mapper.get_new_type(t);
+    }
+
     //map the type
     virtual std::pair<int,float> get_int_type(int t) const {
       auto res_rad = typer.get_int_type(t);
@@ -384,6 +428,9 @@ class MappedAtomIndexTyper: public AtomIndexTyper {
 class GninaVectorTyper: public AtomVectorTyper {
     GninaIndexTyper ityper;
     static std::vector<std::string> vtype_names;
+
+    //fill the NumTypes values of typ for atom a of gnina type t
+    void set_type_vector(int t, OpenBabel::OBAtom* a, float *typ) const;
   public:
     enum vtype {
       /* 0 */Hydrogen,
@@ -424,6 +471,10 @@ class GninaVectorTyper: public AtomVectorTyper {
     ///return type index of a
     virtual float get_atom_type_vector(OpenBabel::OBAtom* a, std::vector<float>& typ) const;
 
+    using AtomVectorTyper::type_molecule;
+    ///type every atom of mol, gnina types are computed for the whole molecule at once
+    virtual void type_molecule(OpenBabel::OBMol& mol, std::vector<float>& type_vectors, std::vector<float>& radii) const;
+
     ///return radii of types
     virtual std::vector<float> get_vector_type_radii() const;
 
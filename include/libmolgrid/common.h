@@ -9,8 +9,12 @@
 
 #include <memory>
 #include <cstring>
+#include <iostream>
+#include <stdexcept>
 #include <cuda_runtime_api.h>
 #include <cuda.h>
+#include <cuda_fp16.h>
+#include <cuda_bf16.h>
 
 #ifdef __CUDACC__
 #define CUDA_CALLABLE_MEMBER __host__ __device__
@@ -50,5 +54,40 @@
 #define LMG_CUDA_CHECK(condition) condition
 #endif
 
+namespace libmolgrid {
+
+/** \brief Make a device current for the lifetime of the guard.
+ * The previously current device is restored on destruction.  A negative
+ * device leaves the current device unchanged.
+ */
+class DeviceGuard {
+    int previous = -1;
+  public:
+    explicit DeviceGuard(int device) {
+      if(device < 0) return;
+      int current = current_device();
+      if(current != device) {
+        LMG_CUDA_CHECK(cudaSetDevice(device));
+        previous = current;
+      }
+    }
+    ~DeviceGuard() {
+      if(previous >= 0) cudaSetDevice(previous);
+    }
+    DeviceGuard(const DeviceGuard&) = delete;
+    DeviceGuard& operator=(const DeviceGuard&) = delete;
+
+    /// return the current device of the calling thread, 0 if there is none
+    static int current_device() {
+      int device = 0;
+      if(cudaGetDevice(&device) != cudaSuccess) {
+        cudaGetLastError();
+        device = 0;
+      }
+      return device;
+    }
+};
+
+}
 
 #endif /* COMMON_H_ */
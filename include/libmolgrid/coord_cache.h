@@ -11,28 +11,146 @@
 #include "libmolgrid/atom_typer.h"
 #include "libmolgrid/example.h"
 #include <boost/iostreams/device/mapped_file.hpp>
+#include <mutex>
+#include <list>
+#include <map>
+#include <unordered_map>
 
 namespace libmolgrid {
 
+/// counters of the structures cached by an AtomStore
+struct CacheStats {
+    size_t hits = 0; ///requests answered from stored atoms
+    size_t misses = 0; ///requests that read a file because it was not stored or not yet typed by the typer
+    size_t evictions = 0; ///files evicted to stay within the byte budget
+    size_t bytes = 0; ///bytes of stored coordinates, types and radii
+    size_t entries = 0; ///number of stored files
+};
+
+/** \brief Atoms read from structure files, shared by every CoordCache.
+ *
+ *  Coordinates of every atom are stored once per file.  Each typer adds only
+ *  a projection of the atoms it keeps along with their types and radii.
+ *  Typing needs the parsed molecule, so typers that have been asked for the
+ *  same file (e.g., by providers with different typers reading one data set)
+ *  are paired, and files later read for one of them are typed by all of them
+ *  while parsed.  Only the first file a typer shares is parsed again; typers
+ *  that never share files, such as separate receptor and ligand typers, don't
+ *  type each other's files.
+ *
+ *  Stored atoms are never handed out: requested sets are filled with a copy,
+ *  so they can be transformed, transferred to the GPU or modified by any
+ *  thread without affecting the store or other sets.
+ *
+ *  Stores are reference counted and shared by all caches that use the same
+ *  protonation setting and byte budget.  When the budget is exceeded the least
+ *  recently used files are evicted.  All functions may be called concurrently.
+ */
+class AtomStore {
+  public:
+    ///a typer and whether its index types are converted to vector types
+    typedef std::pair<std::shared_ptr<AtomTyper>, bool> Typing;
+
+    ///types and radii of the atoms of a file kept by one typer
+    struct Projection {
+      std::shared_ptr<AtomTyper> typer; //held so the typer's address identifies it
+      bool vector_types = false; ///index types were converted to vector types
+      std::vector<unsigned> atoms; ///index into the file's atoms of each typed atom
+      CoordinateSet types; ///types and radii of the typed atoms, without coordinates
+    };
+
+  private:
+    struct Record {
+      MGrid2f coords; //every atom of the file
+      std::vector<Projection> projections;
+      size_t bytes = 0;
+      std::list<const std::string*>::iterator lru_pos; //position in lru
+    };
+
+    bool addh = true;
+    size_t max_bytes = 0; //zero is unlimited
+    std::mutex records_mutex; //protects records, lru and stats
+    std::unordered_map<std::string, Record> records;
+    std::list<const std::string*> lru; //record names, most recently used first
+    CacheStats stats;
+    //typings that have been asked for the same files as each typing
+    std::map<std::pair<const AtomTyper*, bool>, std::vector<Typing> > companions;
+
+    //record that a and b type the same files
+    void pair_typers(const Typing& a, const Typing& b);
+
+    //evict least recently used records, other than keep, until within budget
+    void evict(const Record& keep);
+
+  public:
+    explicit AtomStore(bool h, size_t budget = 0): addh(h), max_bytes(budget) {}
+
+    /// return the store shared by all caches with protonation setting addh and byte budget
+    static std::shared_ptr<AtomStore> shared(bool addh, size_t budget = 0);
+
+    /** \brief Read the atoms of a file once and type them with several typers, without storing them.
+     * @param[in] fname full path of a molecular structure or gninatypes file
+     * @param[in] addh protonate molecules read with OpenBabel
+     * @param[out] coords coordinates of every atom of the file
+     * @param[in,out] projs typer and vector_types of each projection are read, the typed atoms are set.
+     *   Errors typing the first projection are thrown, other projections that fail are removed.
+     */
+    static void read(const std::string& fname, bool addh, MGrid2f& coords, std::vector<Projection>& projs);
+
+    /// fill coord with the typed atoms of proj, reusing coord's memory only where it is not shared
+    static void set_coords(const MGrid2f& coords, const Projection& proj, CoordinateSet& coord);
+
+    /** \brief Set coord to the atoms of fname as typed by typer.
+     *  The file is only read if it is not stored or has not been typed by typer.
+     * @param[in] fname full path of a molecular structure or gninatypes file
+     * @param[in] typer typer to apply
+     * @param[in] vector_types convert index types to vector types with type radii
+     * @param[out] coord typed atoms, a copy of the stored atoms
+     */
+    void set_coords(const std::string& fname, const std::shared_ptr<AtomTyper>& typer, bool vector_types, CoordinateSet& coord);
+
+    /// number of stored files
+    size_t size();
+
+    /// return current counters
+    CacheStats get_stats();
+};
+
 /** \brief Load and cache molecular coordinates and atom types.
  *
  *  Precalculated molcache2 files are supported and are
  *  memory mapped for efficient memory usage when running multiple
  *  training runs.
+ *
+ *  set_coords may be called concurrently (e.g., by prefetching threads).
  */
 class CoordCache {
-    using MemCache = std::unordered_map<const char*, CoordinateSet>;
-    MemCache memcache;
+    std::shared_ptr<AtomStore> store; //null if caching is disabled
     std::shared_ptr<AtomTyper> typer;
     std::string data_root;
     std::string molcache;
-    bool use_cache = true; //is possible to disable caching
     bool addh = true; ///protonate
     bool make_vector_types = false; ///convert index types to vector, will also convert to type based radii and add a dummy type
 
     //for memory mapped cache
     boost::iostreams::mapped_file_source cache_map;
     std::unordered_map<const char*, size_t> offsets; //map from names to position in cache_map
+    //typer output for each molcache type, empty if the typer must be called per atom
+    std::vector<std::pair<int,float> > molcache_types;
+    //recently read ahead regions of cache_map, null unless molcache_readahead is set
+    struct Readahead;
+    std::shared_ptr<Readahead> readahead;
+    bool prefetch_referenced = false; //molcache_prefetch is referenced
+    //threads reading ahead in cache_map, shared by copies and joined when the last is destroyed;
+    //null unless molcache_prefetch is background or referenced
+    struct Prefetcher;
+    std::shared_ptr<Prefetcher> prefetcher;
+
+    //have the kernel read the [start,end) ranges of cache_map on a background thread
+    void prefetch_ranges(std::vector<std::pair<size_t, size_t> > ranges) const;
+
+    //fill coord from a memory mapped molcache entry, reusing the memory of coord's grids that are not shared
+    void set_molcache_coords(const char *data, CoordinateSet& coord) const;
 
   public:
     CoordCache() {}
@@ -41,17 +159,52 @@ class CoordCache {
     ~CoordCache() {}
 
     /** \brief Set coord to the appropriate CoordinateSet for fname
+     * Molecules are written into the existing memory of coord when it is large
+     * enough and not shared with another set.  Atoms of files other than
+     * molcaches are kept in a store shared with other caches.
      * @param[in] fname file name, not including root directory prefix, of molecular data
      * @param[out] coord  CoordinateSet for passed molecule
      */
     void set_coords(const char *fname, CoordinateSet& coord);
 
+    /** \brief Prefetch the molcache entries of names in the background.
+     *  Only has an effect if molcache_prefetch is referenced.
+     * @param[in] names interned file names, as in ExampleRef::files
+     */
+    void prefetch(const std::vector<const char*>& names) const;
+
+    /// return true if prefetch should be given the names of populated examples
+    bool prefetches_referenced() const { return prefetch_referenced && offsets.size(); }
+
     /// return the number of types (channels) each example will have
     size_t num_types() const { return typer->num_types(); }
 
     std::vector<std::string> get_type_names() const { return typer->get_type_names(); }
+
+    /// return the shared store of read atoms, null if caching is disabled
+    std::shared_ptr<AtomStore> get_store() const { return store; }
 };
 
+// Docstring_write_molcache
+/** \brief Write a molcache2 file of the structures of an example file.
+ *
+ *  Structures are read and gnina typed by nthreads threads and written once
+ *  each in the order they are first referenced, so a provider that does not
+ *  shuffle reads the cache sequentially.  As with CoordCache, the cached types
+ *  are remapped by the typer used when reading, so the cache does not need to
+ *  be rebuilt when typing changes.  OpenBabel is not reentrant, so only file
+ *  reads and gninatypes files are fully parallel.
+ * @param[in] molcache output file
+ * @param[in] types example file, as passed to ExampleProvider::populate
+ * @param[in] settings data_root, add_hydrogens and max_group_size (for the group column) are used
+ * @param[in] column index of the structure in each example to cache, negative for all
+ * @param[in] numlabels number of labels, negative to detect per line
+ * @param[in] nthreads number of threads, zero uses all hardware threads
+ * @return number of structures written
+ */
+size_t write_molcache(const std::string& molcache, const std::string& types, const ExampleProviderSettings& settings,
+    int column = -1, int numlabels = -1, unsigned nthreads = 0);
+
 } /* namespace libmolgrid */
 
 #endif /* COORD_CACHE_H_ */
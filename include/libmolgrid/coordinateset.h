@@ -25,6 +25,12 @@ class AtomTyper;
  * Typically, only one type formated will be initialized although
  * a vector one-hot encoding of an index type can be created.
  *
+ * Copying a set, as when receptors are duplicated for each pose, shares
+ * the memory of its grids rather than copying it.  Transform::forward
+ * of a set and merge_coordinates into a set replace shared grids before
+ * writing them, but writing through the grids themselves (e.g. transforming
+ * coords.cpu() in place) modifies every set that shares them.  Call
+ * own_coords (or clone for all the grids) before such writes.
  */
 struct CoordinateSet {
   MGrid2f coords{0,3}; //coordinates
@@ -98,7 +104,7 @@ struct CoordinateSet {
 
   /// compute the sum of each type class across vector types for this set, if zerofirst is false, add to existing elements of sum
   void sum_types(Grid<float, 1, false>& sum, bool zerofirst=true) const;
-  void sum_types(Grid<float, 1, true>& sum, bool zerofirst=true) const;
+  void sum_types(Grid<float, 1, true>& sum, bool zerofirst=true, cudaStream_t stream=0) const;
 
   ///number of atoms
   unsigned size() const { return coords.dimension(0); }
@@ -106,8 +112,10 @@ struct CoordinateSet {
   ///return mean of coordinates
   float3 center() const;
 
-  void togpu(bool copy=true) { coords.togpu(copy); type_index.togpu(copy); type_vector.togpu(copy); radii.togpu(copy);}
+  void togpu(bool copy=true) const { coords.togpu(copy); type_index.togpu(copy); type_vector.togpu(copy); radii.togpu(copy);}
   void tocpu(bool copy=true) { coords.tocpu(copy); type_index.tocpu(copy); type_vector.tocpu(copy); radii.tocpu(copy);}
+  ///transfer to the gpu asynchronously on stream, host data must not be modified until the stream is synchronized
+  void togpu(cudaStream_t stream) const { coords.togpu(stream); type_index.togpu(stream); type_vector.togpu(stream); radii.togpu(stream);}
 
   //test for pointer equality, not particularly useful, but needed by boost::python
   bool operator==(const CoordinateSet& rhs) const {
@@ -125,6 +133,15 @@ struct CoordinateSet {
     return ret;
   }
 
+  /** \brief Give this set its own copy of its coordinates if they are shared.
+   * Copies of a set share memory, so coordinates must be owned before they are
+   * modified in place.  Types and radii are not modified by transforms and stay shared.
+   */
+  void own_coords() { if(coords.shared()) coords = coords.clone(); }
+
+  /// release any grids shared with other sets, so their memory can be overwritten
+  void drop_shared();
+
   /// size this to have the same size as s without copying data
   void size_like(const CoordinateSet& s); 
 
@@ -14,6 +14,10 @@
 
 #include <vector>
 #include <unordered_set>
+#include <mutex>
+#include <memory>
+#include <cstring>
+#include <cstdint>
 #include "libmolgrid/coordinateset.h"
 
 namespace libmolgrid {
@@ -22,6 +26,8 @@ namespace libmolgrid {
 
 #define MAKE_SETTINGS() \
     EXSET(bool, shuffle, false, "randomize order of examples") \
+    EXSET(unsigned, shuffle_block_size, 0, "when shuffling, permute blocks of this many consecutive examples so structure files and molcaches are read mostly sequentially; zero shuffles individual examples") \
+    EXSET(unsigned, shuffle_window, 8, "number of consecutive permuted blocks whose examples are shuffled together when shuffle_block_size is set") \
     EXSET(bool, balanced, false, "provide equal number of positive and negative examples as determined by label") \
     EXSET(bool, stratify_receptor, false, "sample uniformly across receptors (first molecule)") \
     EXSET(int, labelpos, 0, "position of binary label") \
@@ -30,15 +36,25 @@ namespace libmolgrid {
     EXSET(float, stratify_min, 0, "minimum range for value stratification") \
     EXSET(float, stratify_max, 0, "maximum range for value stratification") \
     EXSET(float, stratify_step, 0, "step size for value stratification, together with min and max determines number of bins") \
+    EXSET(unsigned, rank, 0, "index of this process among world_size processes that each provide a disjoint shard of the examples, as in distributed training") \
+    EXSET(unsigned, world_size, 1, "number of processes the examples are sharded across; each shard is padded to the same number of examples, or of groups, so all ranks have equal epochs") \
     EXSET(int, group_batch_size, 1, "slice time series (groups) by batches of this size") \
     EXSET(int, max_group_size, 0, "maximum group size, all groups are padded out to this size; example file must contain group number in first column") \
     EXSET(bool, cache_structs, true, "retain coordinates in memory for faster training") \
+    EXSET(size_t, cache_bytes, 0, "maximum bytes of retained coordinates, least recently used structures are evicted beyond this; zero is unlimited") \
     EXSET(bool, add_hydrogens, true, "protonate read in molecule using openbabel") \
     EXSET(bool, duplicate_first, false, "clone the first coordinate set to be paired with each of the remaining (receptor-ligand pairs)") \
     EXSET(size_t, num_copies, 1, "number of times to repeatedly produce an example") \
     EXSET(bool, make_vector_types, false, "convert index types into one-hot encoded vector types") \
+    EXSET(unsigned, num_prefetch_threads, 0, "number of background threads that asynchronously prepare upcoming examples; zero disables prefetching") \
+    EXSET(unsigned, prefetch_depth, 2, "maximum number of batches to prepare in advance when prefetching") \
+    EXSET(unsigned, num_parse_threads, 0, "number of threads used to parse example files; zero uses all hardware threads") \
+    EXSET(bool, index_example_files, false, "save parsed example files to a binary index (the file name with .refidx appended) and load it instead of parsing when it is up to date") \
     EXSET(std::string, data_root, "", "prefix for data files") \
     EXSET(std::string, recmolcache, "", "precalculated molcache2 file for receptor (first molecule); if doesn't exist, will look in data _root") \
+    EXSET(size_t, molcache_readahead, 0, "bytes of a molcache to read ahead from each structure not near a recent read, for molcaches larger than memory; zero leaves readahead to the kernel") \
+    EXSET(std::string, molcache_prefetch, "all", "how molcaches are brought into the file cache when opened: all reads the whole file before returning, background has the kernel read it in the background, referenced has the kernel read only the structures of populated example files in the background, none reads structures as they are used") \
+    EXSET(bool, molcache_huge_pages, false, "request transparent huge pages for molcache mappings where the kernel supports them") \
     EXSET(std::string, ligmolcache, "", "precalculated molcache2 file for ligand; if doesn't exist, will look in data_root")
 
 /** Description of how examples should be provided
@@ -53,7 +69,10 @@ struct ExampleProviderSettings {
 
 // Docstring_Example
 /** \brief A single example represented by its typed coordinates and label(s)
- *
+ * Copies of an example share the memory of their coordinate sets, as do the
+ * receptors an ExampleProvider duplicates for each pose.
+ * See CoordinateSet for how to modify coordinates without affecting the
+ * other copies.
  */
 struct Example {
 
@@ -82,6 +101,19 @@ struct Example {
      */
     CoordinateSet merge_coordinates(unsigned start = 0, bool unique_index_types=true) const;
 
+    // Docstring_Example_merge_coordinates_4
+    /** \brief Combine all coordinate sets into out, reusing its memory.
+     * The result is that of merge_coordinates(start, unique_index_types), but
+     * the grids of out are only reallocated when they are too small, so
+     * merging into the same set repeatedly does not allocate.  Grids of out
+     * that are shared with other sets are replaced, not overwritten.
+     * @param[out] out merged coordinates
+     * @param[in] start ignore coordinates sets prior to this index (default zero)
+     * @param[in] unique_indexed_types if true, different coordinate sets will have unique, non-overlapping types
+     * @param[in] gpu merge into gpu memory of out, copying from wherever each set is
+     */
+    void merge_coordinates(CoordinateSet& out, unsigned start = 0, bool unique_index_types=true, bool gpu=false) const;
+
     // Docstring_Example_merge_coordinates_2
     /** \brief Combine all coordinate sets into one.
      * All coordinate sets must have index typing
@@ -125,6 +157,43 @@ struct Example {
     template <bool isCUDA>
     static void extract_label(const std::vector<Example>& examples, unsigned labelpos, Grid<float, 1, isCUDA>& out);
     
+    // Docstring_Example_extract_coordinates_1
+    /** \brief Write the merged index typed coordinates of a batch of examples into padded grids.
+     * Each example is merged as by merge_coordinates.  Atoms past an example's
+     * count are padded with zero coordinates and radii and a type of -1, which
+     * gridding ignores.
+     * @param[in] examples  vector of examples
+     * @param[out] coords BxNx3 coordinates, N must be at least the largest number of atoms
+     * @param[out] type_index BxN types
+     * @param[out] radii BxN radii
+     * @param[out] counts B number of atoms of each example
+     * @param[in] start ignore coordinates sets prior to this index (default zero)
+     * @param[in] unique_indexed_types if true, different coordinate sets will have unique, non-overlapping types
+     * @param[in] stream CUDA stream of the copies to device grids, which are packed in page-locked memory
+     */
+    template <bool isCUDA>
+    static void extract_coordinates(const std::vector<Example>& examples, Grid<float, 3, isCUDA>& coords,
+        Grid<float, 2, isCUDA>& type_index, Grid<float, 2, isCUDA>& radii, Grid<float, 1, isCUDA>& counts,
+        unsigned start=0, bool unique_index_types=true, cudaStream_t stream=0);
+
+    // Docstring_Example_extract_coordinates_2
+    /** \brief Write the merged vector typed coordinates of a batch of examples into padded grids.
+     * Each example is merged as by merge_coordinates.  Atoms past an example's
+     * count are padded with zero coordinates, types and radii.
+     * @param[in] examples  vector of examples
+     * @param[out] coords BxNx3 coordinates, N must be at least the largest number of atoms
+     * @param[out] type_vector BxNxT types
+     * @param[out] radii BxN radii
+     * @param[out] counts B number of atoms of each example
+     * @param[in] start ignore coordinates sets prior to this index (default zero)
+     * @param[in] unique_indexed_types if true, different coordinate sets will have unique, non-overlapping types
+     * @param[in] stream CUDA stream of the copies to device grids, which are packed in page-locked memory
+     */
+    template <bool isCUDA>
+    static void extract_coordinates(const std::vector<Example>& examples, Grid<float, 3, isCUDA>& coords,
+        Grid<float, 3, isCUDA>& type_vector, Grid<float, 2, isCUDA>& radii, Grid<float, 1, isCUDA>& counts,
+        unsigned start=0, bool unique_index_types=true, cudaStream_t stream=0);
+
     //pointer equality, implemented for python vector
     bool operator==(const Example& rhs) const {
       return sets == rhs.sets && labels == rhs.labels;
@@ -159,16 +228,73 @@ struct ExampleRef {
 };
 
 
-//for memory efficiency, only store a given string once and use the const char*
+/** \brief Compact storage of example references.
+ * The files and labels of all refs are packed into shared contiguous arrays
+ * indexed by per-ref offsets, rather than two heap allocated vectors per ref,
+ * so large training sets can be held cheaply and providers shuffle 32-bit
+ * indices into a store instead of copying refs.
+ */
+class ExampleRefStore {
+    std::vector<const char*> files;
+    std::vector<float> labels;
+    std::vector<uint32_t> file_end; ///one past the last file of each ref
+    std::vector<uint32_t> label_end; ///one past the last label of each ref
+    std::vector<int> groups;
+    std::vector<bool> seqconts;
+
+    uint32_t file_start(size_t i) const { return i ? file_end[i-1] : 0; }
+    uint32_t label_start(size_t i) const { return i ? label_end[i-1] : 0; }
+  public:
+    ///number of refs, at most 2^32-1
+    size_t size() const { return groups.size(); }
+    bool empty() const { return groups.empty(); }
+    void reserve(size_t nrefs, size_t nfiles = 0, size_t nlabels = 0);
+    void clear();
+    void swap(ExampleRefStore& other);
+
+    ///append a copy of ref
+    void push_back(const ExampleRef& ref);
+    ///append a copy of ref i of other
+    void push_back(const ExampleRefStore& other, size_t i);
+    ///append all of other
+    void append(const ExampleRefStore& other);
+
+    ///copy ref i into ex, reusing its storage
+    void get(size_t i, ExampleRef& ex) const;
+    ExampleRef operator[](size_t i) const { ExampleRef ex; get(i, ex); return ex; }
+
+    unsigned num_files(size_t i) const { return file_end[i] - file_start(i); }
+    const char* const* file_data(size_t i) const { return files.data() + file_start(i); }
+    unsigned num_labels(size_t i) const { return label_end[i] - label_start(i); }
+    const float* label_data(size_t i) const { return labels.data() + label_start(i); }
+    int group(size_t i) const { return groups[i]; }
+};
+
+/** \brief Store a given string only once and use the const char* as its identity.
+ * Strings are copied into large blocks of characters that are never freed or
+ * moved, and each of the locked shards only indexes the strings of its blocks,
+ * so parsing threads rarely contend and a string costs little more than its length.
+ */
 class StringCache {
-  std::unordered_set<std::string> strings;
+  static constexpr unsigned num_shards = 64;
+  static constexpr size_t block_size = 1 << 16;
+
+  struct cstring_hash {
+    size_t operator()(const char *s) const;
+  };
+  struct cstring_equal {
+    bool operator()(const char *a, const char *b) const { return strcmp(a, b) == 0; }
+  };
+
+  struct Shard {
+    std::mutex mutex;
+    std::unordered_set<const char*, cstring_hash, cstring_equal> strings;
+    std::vector<std::unique_ptr<char[]> > blocks;
+    size_t used = block_size; ///characters used of the last block
+  };
+  Shard shards[num_shards];
 public:
-  const char* get(const std::string& s)
-  {
-    strings.insert(s);
-    //we assume even as the set is resized that strings never get allocated
-    return strings.find(s)->c_str();
-  }
+  const char* get(const std::string& s);
 };
 
 extern StringCache string_cache;
@@ -31,7 +31,7 @@ namespace libmolgrid {
  */
 class ExampleExtractor {
 
-    std::vector<CoordCache> coord_caches; //different typers have duplicated caches
+    std::vector<CoordCache> coord_caches; //one per typer, atoms read from files are shared through AtomStore
     bool duplicate_poses = false;
 
     size_t count_types(unsigned n) const;
@@ -62,9 +62,19 @@ class ExampleExtractor {
 
     virtual ~ExampleExtractor() {}
 
-    /// Extract ref into ex
+    /** \brief Extract ref into ex.
+     * The memory of grids of ex's sets that no other grid shares is reused,
+     * so Grid views (cpu(), gpu()) of them see the new coordinates.  Shared
+     * grids are replaced rather than overwritten.
+     */
     virtual void extract(const ExampleRef& ref, Example& ex);
 
+    /// return true if any cache prefetches only the structures it is given by prefetch
+    bool prefetches_referenced() const;
+
+    /// have the caches prefetch the structures of refs, if their policy is referenced
+    void prefetch(const ExampleRefStore& refs) const;
+
     /// return the number of types (channels) each example will have
     /// Note: this is only accurate if types are explicitly setup.  Must provide an ExampleRef
     // if implicit typing is being used
@@ -76,6 +86,9 @@ class ExampleExtractor {
     ///return names of types for explicitly typed examples
     ///type names are prepended by coordinate set index
     virtual std::vector<std::string> get_type_names() const;
+
+    ///return counters of the atom stores used by the caches, summed over distinct stores
+    CacheStats get_cache_stats() const;
 };
 
 } /* namespace libmolgrid */
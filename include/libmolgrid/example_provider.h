@@ -9,6 +9,11 @@
 #ifndef EXAMPLE_PROVIDER_H_
 #define EXAMPLE_PROVIDER_H_
 
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
 #include "libmolgrid/example.h"
 #include "libmolgrid/exampleref_providers.h"
 #include "libmolgrid/example_extractor.h"
@@ -19,11 +24,67 @@ namespace libmolgrid {
 /** \brief Given a file of examples, provide Example classes one at a time
  * This contains an exampleref provider, which can be configured using a
  * single settings object if so desired, and an example extractor.
+ *
+ * If num_prefetch_threads is set, upcoming examples are extracted
+ * asynchronously by a pool of background threads.  Example references are
+ * still drawn from the provider in order, so the examples returned are
+ * identical to those of a non-prefetching provider with the same seed.
+ *
+ * next, next_batch, next_batch_coordinates, skip and save_state may be
+ * called concurrently from several threads.  Each batch is a run of
+ * consecutive examples, so concurrent callers receive the same batches as
+ * sequential calls would, in the order the calls draw them.  Only reading
+ * the structures is done in parallel.  populate and load_state must not
+ * overlap any other call.
  */
 class ExampleProvider {
     std::shared_ptr<ExampleRefProvider> provider;
     ExampleExtractor extractor;
     ExampleProviderSettings init_settings; //save settings created with
+
+    /// an example being prepared by a prefetch worker
+    struct PrefetchSlot {
+      ExampleRef ref;
+      Example ex;
+      std::exception_ptr error;
+      bool ready = false;
+    };
+
+    //prefetching state, all protected by prefetch_mutex; slots are in provider order
+    //refs are also only drawn from provider while holding prefetch_mutex
+    std::deque<PrefetchSlot> prefetched;
+    size_t prefetch_capacity = 0; //maximum number of examples in flight
+    bool stop_workers = false;
+    std::vector<std::thread> workers;
+    std::mutex prefetch_mutex;
+    std::condition_variable work_cv; //signaled when there is room for more examples
+    std::condition_variable ready_cv; //signaled when an example has been prepared
+    std::mutex batch_mutex; //held while a batch is taken from prefetched, so batches are not interleaved
+
+    //examples of next_batch_coordinates not in use by a caller, kept so their memory is reused
+    std::vector<std::vector<Example> > coordinate_batches;
+    std::mutex coordinate_mutex; //protects coordinate_batches
+    std::deque<ExampleRef> resumed; //refs drawn before a saved state, returned before any from provider
+
+    /// draw the next ref, from resumed if a restored state left any; prefetch_mutex must be held
+    void nextref(ExampleRef& ref);
+    /// draw the refs of the next n examples into refs
+    void nextrefs(std::vector<ExampleRef>& refs, unsigned n);
+
+    /// start workers if necessary and make room for prefetch_depth batches of batch_size
+    void start_prefetching(unsigned batch_size);
+    /// stop workers and discard any prefetched examples
+    void stop_prefetching();
+    /// worker thread loop
+    void prefetch_worker();
+    /// retrieve the next prefetched example in order
+    void next_prefetched(Example& ex);
+    /// add the refs of example file fname to provider, using a binary index if enabled,
+    /// or append them to pending if it is not null
+    void populate_file(const std::string& fname, int num_labels, ExampleRefStore *pending = nullptr);
+    /// populate provider with the shard of every file in fnames that belongs to this rank and set it up
+    void populate_files(const std::vector<std::string>& fnames, int num_labels);
+
   public:
 
     /// return provider as specifyed by settings
@@ -44,7 +105,10 @@ class ExampleProvider {
 
     /// use provided provider
     ExampleProvider(std::shared_ptr<ExampleRefProvider> p, const ExampleExtractor& e);
-    virtual ~ExampleProvider() {}
+
+    ExampleProvider(const ExampleProvider&) = delete;
+    ExampleProvider& operator=(const ExampleProvider&) = delete;
+    virtual ~ExampleProvider();
 
     ///load example file file fname and setup provider
     virtual void populate(const std::string& fname, int num_labels=-1);
@@ -61,10 +125,30 @@ class ExampleProvider {
     ///skip over the first n examples
     virtual void skip(unsigned n);
 
+    // Docstring_ExampleProvider_save_state
+    /** \brief Write the position of the provider so that it can resume from it.
+     * The state holds the shuffled orders and cursors of the populated
+     * provider, the state of the random engine, and the examples that were
+     * already prefetched but not yet returned.  It does not hold the
+     * examples themselves, so it is small and restored without replaying
+     * the provider.
+     * @param[out] out stream to write the state to
+     */
+    void save_state(std::ostream& out);
+
+    // Docstring_ExampleProvider_load_state
+    /** \brief Resume from a state written by save_state.
+     * The provider must have been populated with the same example files and
+     * settings as the provider that saved the state.  The examples that
+     * follow are those that would have followed the save.
+     * @param[in] in stream to read the state from
+     */
+    void load_state(std::istream& in);
+
     ///return settings created with
     const ExampleProviderSettings& settings() const { return init_settings; }
 
-    ///provide a batch of examples
+    ///provide a batch of examples; the memory of ex may be reused, as by ExampleExtractor::extract
     virtual void next_batch(std::vector<Example>& ex, unsigned batch_size);
     virtual std::vector<Example> next_batch(unsigned batch_size) {
       std::vector<Example> ex;
@@ -72,6 +156,26 @@ class ExampleProvider {
       return ex;
     }
 
+    // Docstring_ExampleProvider_next_batch_coordinates
+    /** \brief Provide the next batch as padded grids of merged coordinates.
+     * The batch size is the first dimension of coords.  Examples are merged
+     * and padded as by Example::extract_coordinates, with index types if types
+     * is 2D (BxN) and vector types if it is 3D (BxNxT).
+     * @param[out] coords BxNx3 coordinates
+     * @param[out] types BxN or BxNxT types
+     * @param[out] radii BxN radii
+     * @param[out] counts B number of atoms of each example
+     * @param[out] labels BxL labels, not set if empty
+     * @param[in] start ignore coordinates sets prior to this index (default zero)
+     * @param[in] unique_indexed_types if true, different coordinate sets will have unique, non-overlapping types
+     * @param[in] stream CUDA stream of the copies of the coordinates to device grids
+     */
+    template <std::size_t TN, bool isCUDA>
+    void next_batch_coordinates(Grid<float, 3, isCUDA>& coords, Grid<float, TN, isCUDA>& types, Grid<float, 2, isCUDA>& radii,
+        Grid<float, 1, isCUDA>& counts, Grid<float, 2, isCUDA>& labels, unsigned start=0, bool unique_index_types=true,
+        cudaStream_t stream=0);
+
+    /// access to the extractor and ref provider; these are not synchronized with prefetch workers or other callers
     ExampleExtractor& get_extractor() { return extractor; }
     ExampleRefProvider& get_provider() { return *provider; }
 
@@ -81,6 +185,8 @@ class ExampleProvider {
     std::vector<std::string> get_type_names() const { return extractor.get_type_names(); }
     ///return number of examples
     size_t size() const { return provider->size(); }
+    ///counters of cached structures, which are shared with other providers using the same cache settings
+    CacheStats get_cache_stats() const { return extractor.get_cache_stats(); }
 };
 
 } /* namespace libmolgrid */
@@ -9,6 +9,7 @@
 #define EXAMPLE_PROVIDERS_H_
 
 #include <iostream>
+#include <numeric>
 #include <vector>
 #include <algorithm>
 #include <type_traits>
@@ -19,6 +20,119 @@
 
 namespace libmolgrid {
 
+/** \brief Permute 0..n-1 so that contiguous ranges stay close together.
+ * Blocks of block_size consecutive indices are shuffled, then the indices of
+ * each run of window consecutive blocks are shuffled together.  Every index
+ * can be placed anywhere, but each run of window*block_size outputs comes
+ * from only window blocks of the input.
+ */
+template <class Index, class URNG>
+void block_shuffle(std::vector<Index>& order, size_t n, size_t block_size, size_t window, URNG& g) {
+  size_t nblocks = (n + block_size - 1) / block_size;
+  std::vector<size_t> blocks(nblocks);
+  for(size_t i = 0; i < nblocks; i++) blocks[i] = i;
+  std::shuffle(blocks.begin(), blocks.end(), g);
+
+  order.clear();
+  order.reserve(n);
+  for(size_t b = 0; b < nblocks; b += window) {
+    size_t start = order.size();
+    for(size_t w = b, wend = std::min(nblocks, b + window); w < wend; w++) {
+      for(size_t i = blocks[w] * block_size, end = std::min(n, i + block_size); i < end; i++) {
+        order.push_back(i);
+      }
+    }
+    std::shuffle(order.begin() + start, order.end(), g);
+  }
+}
+
+/** \brief Parse example references from lines, in order.
+ * Lines are split into contiguous chunks that are parsed concurrently.
+ * @param[in] lines example file contents, one example per line
+ * @param[in] numlabels number of labels, negative to detect per line
+ * @param[in] hasgroup lines start with a group number
+ * @param[in] nthreads number of parsing threads, zero uses all hardware threads
+ */
+ExampleRefStore parse_example_refs(std::istream& lines, int numlabels, bool hasgroup, unsigned nthreads = 0);
+
+/** \brief Keep only the refs of shard rank of world_size, in order.
+ * Ungrouped refs are dealt round robin, so each shard has a similar mix of
+ * labels and receptors, and shorter shards are padded by repeating their
+ * own first refs so that every shard has the same size and shards stay
+ * disjoint.  There must be at least world_size refs.  Grouped refs are dealt
+ * by group, in order of first appearance, so a group is never split, and
+ * shards with fewer groups are padded with a copy of the frames of their
+ * first group under a new group id, above every id in refs.  There must be
+ * at least world_size groups.
+ * @param[in,out] refs all example references, replaced by the shard
+ * @param[in] rank shard to keep, less than world_size
+ * @param[in] world_size number of shards
+ * @param[in] hasgroup refs were parsed with a group number
+ */
+void shard_example_refs(ExampleRefStore& refs, unsigned rank, unsigned world_size, bool hasgroup);
+
+/** \brief Write example references to a binary index.
+ * File names are stored once in a table and refs store their indices.  The
+ * size, modification time and a hash of the start of source are stored so
+ * read_ref_index can tell when the index is stale.
+ * @param[in] fname index file to write
+ * @param[in] source example file refs were parsed from
+ * @param[in] refs parsed example references
+ * @param[in] numlabels number of labels requested when parsing
+ * @param[in] hasgroup refs were parsed with a group number
+ */
+void write_ref_index(const std::string& fname, const std::string& source, const ExampleRefStore& refs, int numlabels, bool hasgroup);
+
+/** \brief Read example references from a memory mapped binary index.
+ * @param[in] fname index file written by write_ref_index
+ * @param[in] source example file, its size, modification time and starting bytes must match the index
+ * @param[in] numlabels number of labels requested, must match the index
+ * @param[in] hasgroup must match the index
+ * @param[out] refs example references
+ * @return false if fname is not a valid, up to date index of source for numlabels and hasgroup
+ */
+bool read_ref_index(const std::string& fname, const std::string& source, int numlabels, bool hasgroup, ExampleRefStore& refs);
+
+/// binary reading and writing of provider state, in native byte order
+namespace provider_state {
+  template <typename T>
+  void write(std::ostream& out, const T& val) {
+    out.write((const char*)&val, sizeof(T));
+  }
+
+  template <typename T>
+  T read(std::istream& in) {
+    T val = T();
+    if(!in.read((char*)&val, sizeof(T))) throw std::invalid_argument("Truncated provider state");
+    return val;
+  }
+
+  template <typename T>
+  void write_vector(std::ostream& out, const std::vector<T>& v) {
+    write<uint64_t>(out, v.size());
+    out.write((const char*)v.data(), v.size() * sizeof(T));
+  }
+
+  template <typename T>
+  void read_vector(std::istream& in, std::vector<T>& v) {
+    uint64_t n = read<uint64_t>(in);
+    std::vector<T> ret;
+    while(ret.size() < n) { //grow as data is read, so a corrupt size does not allocate everything
+      T val = read<T>(in);
+      ret.push_back(val);
+    }
+    v.swap(ret);
+  }
+
+  /// throw if a size in a saved state is not that of the provider it is restored to
+  inline void check_size(std::istream& in, size_t expected) {
+    uint64_t n = read<uint64_t>(in);
+    if(n != expected) {
+      throw std::invalid_argument("Provider state is for "+itoa(n)+" entries, not "+itoa(expected)+"; was it populated with the same examples and settings?");
+    }
+  }
+}
+
 /// abstract class for storing training example references
 class ExampleRefProvider {
 
@@ -36,25 +150,41 @@ class ExampleRefProvider {
     ///return number of labels in *an* example
     virtual size_t num_labels() const = 0;  
     ///read in all the example refs from lines, but does not setup
-    virtual int populate(std::istream& lines, int numlabels);
+    ///lines are parsed by nthreads threads, zero uses all hardware threads
+    virtual int populate(std::istream& lines, int numlabels, unsigned nthreads = 1);
+    ///add parsed refs in order, but does not setup
+    virtual int populate(const ExampleRefStore& refs);
+
+    ///write the position of a setup provider, including any shuffled orders, but not the refs themselves
+    virtual void save_state(std::ostream& out) const {
+      throw std::logic_error("Provider does not support saving its state");
+    }
+    ///restore a position written by save_state of a provider populated with the same refs and settings
+    virtual void load_state(std::istream& in) {
+      throw std::logic_error("Provider does not support loading its state");
+    }
 };
 
 
 ///single array of examples, possibly shuffled or copied
 class UniformExampleRefProvider: public ExampleRefProvider
 {
-  std::vector<ExampleRef> all;
+  ExampleRefStore all;
+  std::vector<uint32_t> order; //permutation of all when shuffling, all is kept in its original order
   size_t current = 0;
   size_t current_copy = 0;
   size_t nlabels = 0;
 
   bool randomize = false;
   size_t ncopies = 1;
+  size_t block_size = 0;
+  size_t window = 1;
 
 public:
   UniformExampleRefProvider() {}
   UniformExampleRefProvider(const ExampleProviderSettings& settings): ExampleRefProvider(settings),
-      current(0), current_copy(0), randomize(settings.shuffle), ncopies(settings.num_copies) {
+      current(0), current_copy(0), randomize(settings.shuffle), ncopies(settings.num_copies),
+      block_size(settings.shuffle_block_size), window(std::max(settings.shuffle_window, 1U)) {
   }
 
   void addref(const ExampleRef& ex);
@@ -62,6 +192,8 @@ public:
   void setup();
   void nextref(ExampleRef& ex);
   unsigned size() const { return all.size(); }
+  void save_state(std::ostream& out) const;
+  void load_state(std::istream& in);
 };
 
 
@@ -70,7 +202,7 @@ class BalancedExampleRefProvider: public ExampleRefProvider
 {
   UniformExampleRefProvider actives;
   UniformExampleRefProvider decoys;
-  size_t current = 0;
+  size_t current = 0; //0 if the next ref is an active, 1 if a decoy
   unsigned labelpos = 0;
 
 public:
@@ -92,6 +224,9 @@ public:
 
   void next_active(ExampleRef& ex) {  actives.nextref(ex); }
   void next_decoy(ExampleRef& ex) { decoys.nextref(ex); }
+
+  void save_state(std::ostream& out) const;
+  void load_state(std::istream& in);
 };
 
 
@@ -136,6 +271,17 @@ public:
   }
 
   unsigned size() const { return p1.size()+p2.size(); }
+
+  //the distribution keeps no state of its own, draws only use random_engine
+  void save_state(std::ostream& out) const {
+    p1.save_state(out);
+    p2.save_state(out);
+  }
+
+  void load_state(std::istream& in) {
+    p1.load_state(in);
+    p2.load_state(in);
+  }
 };
 
 
@@ -146,6 +292,7 @@ template<class Provider, int K=1>
 class ReceptorStratifiedExampleRefProvider: public ExampleRefProvider
 {
   std::vector<Provider> examples;
+  std::vector<size_t> order; //permutation of examples, which is kept in its original order
   std::unordered_map<const char*, unsigned> recmap; //map to receptor indices
   ExampleProviderSettings param; //keep copy for instantiating new providers
 
@@ -173,6 +320,7 @@ public:
     }
     unsigned pos = recmap[ex.files[0]];
     examples[pos].addref(ex);
+    order.clear();
   }
   
   virtual size_t num_labels() const {
@@ -193,8 +341,10 @@ public:
     {
       examples[i].setup();
     }
+    order.resize(examples.size());
+    std::iota(order.begin(), order.end(), 0);
     //also shuffle receptors
-    if(randomize) shuffle(examples.begin(), examples.end(), random_engine);
+    if(randomize) shuffle(order.begin(), order.end(), random_engine);
   }
 
   void nextref(ExampleRef& ex)
@@ -209,11 +359,12 @@ public:
     {
       currenti = 0;
       if(currentk != 0) std::logic_error("Invalid indices");
-      if(randomize) shuffle(examples.begin(), examples.end(), random_engine);
+      if(randomize) shuffle(order.begin(), order.end(), random_engine);
     }
 
-    if(examples[currenti].size() == 0) throw std::logic_error("No valid sub-stratified examples.");
-    examples[currenti].nextref(ex);
+    Provider& p = examples[order[currenti]];
+    if(p.size() == 0) throw std::logic_error("No valid sub-stratified examples.");
+    p.nextref(ex);
     currentk++;
   }
 
@@ -227,6 +378,28 @@ public:
     }
     return ret;
   }
+
+  void save_state(std::ostream& out) const
+  {
+    provider_state::write<uint64_t>(out, examples.size());
+    provider_state::write<uint64_t>(out, currenti);
+    provider_state::write<uint64_t>(out, currentk);
+    provider_state::write_vector(out, order);
+    for(const Provider& p : examples) p.save_state(out);
+  }
+
+  void load_state(std::istream& in)
+  {
+    provider_state::check_size(in, examples.size());
+    currenti = provider_state::read<uint64_t>(in);
+    currentk = provider_state::read<uint64_t>(in);
+    provider_state::read_vector(in, order);
+    if(order.size() != examples.size() || currenti > examples.size()) throw std::invalid_argument("Invalid provider state");
+    for(size_t i : order) {
+      if(i >= examples.size()) throw std::invalid_argument("Invalid provider state");
+    }
+    for(Provider& p : examples) p.load_state(in);
+  }
 };
 
 template<>
@@ -329,6 +502,21 @@ public:
     }
     return ret;
   }
+
+  void save_state(std::ostream& out) const
+  {
+    provider_state::write<uint64_t>(out, examples.size());
+    provider_state::write<uint64_t>(out, currenti);
+    for(const Provider& p : examples) p.save_state(out);
+  }
+
+  void load_state(std::istream& in)
+  {
+    provider_state::check_size(in, examples.size());
+    currenti = provider_state::read<uint64_t>(in);
+    if(currenti >= examples.size()) throw std::invalid_argument("Invalid provider state");
+    for(Provider& p : examples) p.load_state(in);
+  }
 };
 
 /** \brief group multiple grids into a single example
@@ -349,8 +537,8 @@ class GroupedExampleRefProvider : public ExampleRefProvider {
   unsigned batch_size = 1;
   unsigned maxgroupsize = 0;
 
-  std::unordered_map<int, std::vector<ExampleRef>> frame_groups;
-
+  ExampleRefStore frames; //every frame, in the order added
+  std::unordered_map<int, std::vector<uint32_t>> frame_groups; //indices into frames of each group
   unsigned current_ts = 0;
   unsigned current_group_index = 0;
   std::vector<int> current_groups;
@@ -371,7 +559,8 @@ public:
     if(frame_groups.count(group) == 0)  //new group
       examples.addref(ex); //let provider manage, but we are really just using it to select the groups
 
-    frame_groups[group].push_back(ex);
+    frame_groups[group].push_back(frames.size());
+    frames.push_back(ex);
     if(frame_groups[group].size() > maxgroupsize)
       log(WARNING) << "Frame group " << group <<" has " << frame_groups[group].size() << " frames, which is more than max group size "<<maxgroupsize << "\n";
   }
@@ -411,9 +600,9 @@ public:
     auto& timeseries = frame_groups[group];
     //want current_ts from timeseries, but check for truncated series
     if(current_ts < timeseries.size()) {
-      ex = timeseries[current_ts];
+      frames.get(timeseries[current_ts], ex);
     } else {
-      ex = timeseries.back();
+      frames.get(timeseries.back(), ex);
       for(unsigned i = 0, n = ex.files.size(); i < n; i++)
         ex.files[i] = string_cache.get("none");
       for(unsigned i = 0, n = ex.labels.size(); i < n; i++)
@@ -429,6 +618,29 @@ public:
   {
     return examples.size();
   }
+
+  void save_state(std::ostream& out) const
+  {
+    provider_state::write<uint32_t>(out, current_ts);
+    provider_state::write<uint32_t>(out, current_group_index);
+    provider_state::write_vector(out, current_groups);
+    examples.save_state(out);
+  }
+
+  void load_state(std::istream& in)
+  {
+    current_ts = provider_state::read<uint32_t>(in);
+    current_group_index = provider_state::read<uint32_t>(in);
+    provider_state::read_vector(in, current_groups);
+    if(current_groups.size() != batch_size || current_group_index > batch_size) throw std::invalid_argument("Invalid provider state");
+    //groups of the current batch must already have been chosen
+    for(unsigned i = 0; i < batch_size; i++) {
+      if((current_ts > 0 || i < current_group_index) && frame_groups.count(current_groups[i]) == 0) {
+        throw std::invalid_argument("Provider state is for a group that was not populated");
+      }
+    }
+    examples.load_state(in);
+  }
 };
 
 } /* namespace libmolgrid */
@@ -214,6 +214,12 @@ class Grid {
       else memset(data(), 0, sizeof(Dtype)*size());
     }
 
+    ///set contents to zero, asynchronously on stream if on the GPU
+    void fill_zero(cudaStream_t stream) {
+      if(isCUDA) cudaMemsetAsync(data(), 0, sizeof(Dtype)*size(), stream);
+      else memset(data(), 0, sizeof(Dtype)*size());
+    }
+
     // constructor used by operator[], create a subgrid, assuming memory is allocated
     CUDA_CALLABLE_MEMBER
     explicit Grid(const Grid<Dtype,NumDims+1,isCUDA>& G, size_t i): buffer(G.data() ? &G.data()[i*G.offset(0)] : nullptr) {
@@ -298,6 +304,12 @@ class Grid<Dtype,1,isCUDA> {
       else memset(data(), 0, sizeof(Dtype)*size());
     }
 
+    ///set contents to zero, asynchronously on stream if on the GPU
+    void fill_zero(cudaStream_t stream) {
+      if(isCUDA) cudaMemsetAsync(data(), 0, sizeof(Dtype)*size(), stream);
+      else memset(data(), 0, sizeof(Dtype)*size());
+    }
+
     //only called from regular Grid
     CUDA_CALLABLE_MEMBER
     explicit Grid<Dtype,1,isCUDA>(const Grid<Dtype,2,isCUDA>& G, size_t i):
@@ -328,7 +340,11 @@ class Grid<Dtype,1,isCUDA> {
 typedef Grid<float, SIZE, false> Grid##SIZE##f; \
 typedef Grid<double, SIZE, false> Grid##SIZE##d; \
 typedef Grid<float, SIZE, true> Grid##SIZE##fCUDA; \
-typedef Grid<double, SIZE, true> Grid##SIZE##dCUDA;
+typedef Grid<double, SIZE, true> Grid##SIZE##dCUDA; \
+typedef Grid<__half, SIZE, false> Grid##SIZE##h; \
+typedef Grid<__nv_bfloat16, SIZE, false> Grid##SIZE##bf; \
+typedef Grid<__half, SIZE, true> Grid##SIZE##hCUDA; \
+typedef Grid<__nv_bfloat16, SIZE, true> Grid##SIZE##bfCUDA;
 
 BOOST_PP_REPEAT_FROM_TO(1,LIBMOLGRID_MAX_GRID_DIM, EXPAND_GRID_DEFINITIONS, 0);
 
@@ -9,6 +9,9 @@
 
 #include "libmolgrid/cartesian_grid.h"
 #include <iostream>
+#include <string>
+#include <vector>
+#include <boost/iostreams/device/mapped_file.hpp>
 
 namespace libmolgrid {
 
@@ -80,6 +83,106 @@ void write_bin(std::ostream& out, const G& grid) {
     out.write((char*)grid.data(), grid.size() * sizeof(typename G::type));
 }
 
+
+/// how a channel is stored in a grid file
+enum GridEncoding {
+  GRID_RAW = 0, ///uncompressed values, readable in place from the memory map
+  GRID_SPARSE = 1, ///indices and values of the non-zero voxels
+  GRID_DEFLATE = 2 ///zlib compressed values
+};
+
+// Docstring_write_grid_file
+/** \brief Write a self-describing binary grid file.
+ * The file records the dimensions, center, resolution and name of each
+ * channel of grid.  Each channel is stored with encoding, except that when
+ * sparse is set channels with few enough non-zero values to be smaller as
+ * GRID_SPARSE are stored that way.  Raw channels are aligned so that
+ * GridFile can return them without copying.
+ * @param[in] fname file to write
+ * @param[in] grid channels by x,y,z
+ * @param[in] center center of the grid
+ * @param[in] resolution grid spacing
+ * @param[in] names name of each channel, may be empty
+ * @param[in] encoding encoding of dense channels, GRID_RAW or GRID_DEFLATE
+ * @param[in] sparse store mostly empty channels as GRID_SPARSE
+ */
+template <typename Dtype>
+void write_grid_file(const std::string& fname, const Grid<Dtype, 4>& grid, const float3& center, float resolution,
+    const std::vector<std::string>& names = std::vector<std::string>(), GridEncoding encoding = GRID_RAW, bool sparse = true);
+
+// Docstring_GridFile
+/** \brief Memory mapped reader of files written by write_grid_file.
+ * Raw channels are returned as views of the mapped file without copying.
+ * Views are read only and are valid for the lifetime of the GridFile.
+ */
+class GridFile {
+  public:
+    /// location and encoding of a stored channel
+    struct Channel {
+      std::string name;
+      GridEncoding encoding = GRID_RAW;
+      size_t offset = 0; ///from the start of the file
+      size_t bytes = 0; ///stored size
+    };
+
+  private:
+    boost::iostreams::mapped_file_source map;
+    std::string fname;
+    unsigned elem_size = 0; ///bytes per value
+    size_t dims[3] = {0,};
+    float3 center_ = {0,};
+    float resolution_ = 0;
+    std::vector<Channel> channels;
+
+    //check c and the element type of the file
+    void check_channel(unsigned c, size_t elsize) const;
+
+  public:
+    /// open and map fname, throws invalid_argument if it is not a grid file
+    explicit GridFile(const std::string& fname);
+
+    /// number of channels
+    unsigned num_channels() const { return channels.size(); }
+    /// spatial dimension along axis i (0-2)
+    size_t dimension(unsigned i) const { return dims[i]; }
+    /// center of the grid
+    float3 center() const { return center_; }
+    /// grid spacing
+    float resolution() const { return resolution_; }
+    /// true if values are stored as double, otherwise float
+    bool is_double() const { return elem_size == sizeof(double); }
+
+    /// name of each channel
+    std::vector<std::string> channel_names() const;
+    /// storage of channel c
+    const Channel& channel_info(unsigned c) const;
+
+    /** \brief Return a view of raw channel c in the memory map.
+     * Throws if the channel is not GRID_RAW or Dtype is not the stored type.
+     */
+    template <typename Dtype>
+    Grid<Dtype, 3, false> channel(unsigned c) const;
+
+    /** \brief Return a view of every channel in the memory map.
+     * Throws unless every channel is GRID_RAW and they are contiguous, as
+     * written by write_grid_file.
+     */
+    template <typename Dtype>
+    Grid<Dtype, 4, false> view() const;
+
+    /// decode channel c into out, converting to Dtype
+    template <typename Dtype>
+    void read_channel(unsigned c, Grid<Dtype, 3, false>& out) const;
+
+    /// decode every channel into out, converting to Dtype
+    template <typename Dtype>
+    void read(Grid<Dtype, 4, false>& out) const;
+
+    /// decode every channel into a new grid
+    template <typename Dtype>
+    CartesianGrid<ManagedGrid<Dtype, 4> > read() const;
+};
+
 }
 
 
@@ -12,6 +12,7 @@
 #include <vector>
 #include <array>
 #include <algorithm>
+#include <cmath>
 #include <cuda_runtime.h>
 #include "libmolgrid/coordinateset.h"
 #include "libmolgrid/grid.h"
@@ -20,6 +21,82 @@
 
 namespace libmolgrid {
 
+// Docstring_SparseGrid
+/**
+ * \class SparseGrid
+ * Coordinate list form of a 4D grid as generated by GridMaker::forward_sparse.
+ * Only non-zero voxels are stored, ordered by channel and then by position.
+ * Like type indices, voxel indices are stored as floats.
+ */
+struct SparseGrid {
+  MGrid2f indices; ///Nx4 channel, x, y and z index of each non-zero voxel
+  MGrid1f values; ///N voxel values
+  unsigned channels = 0; ///number of channels of the dense grid
+  unsigned dim = 0; ///points along each spatial dimension of the dense grid
+
+  ///number of non-zero voxels
+  size_t size() const { return values.size(); }
+
+  /** \brief Scatter into a dense grid (CPU), which must be channels x dim x dim x dim.
+   * @param[out] out a 4D grid
+   */
+  void todense(Grid<float, 4, false>& out) const;
+};
+
+// Docstring_ReceptorGridCache
+/**
+ * \class ReceptorGridCache
+ * Density of the first coordinate set (the receptor) of an example, kept by
+ * GridMaker::forward so that poses gridded against the same receptor only
+ * grid their other sets.  The receptor is identified by the source of its
+ * coordinates, its number of atoms and types, a hash of its types and radii
+ * (so the same source typed by another typer is a different receptor), the
+ * transform and the gridding settings, including the resolution and the
+ * number of points along each dimension.  A receptor without a source (src), such as one constructed from
+ * grids, is not cached and is gridded by every call.  Call clear after
+ * changing a cached receptor in place.  GPU caches are filled on the stream passed to forward,
+ * so other streams must be synchronized with it before using the cache.
+ */
+template <typename Dtype = float>
+class ReceptorGridCache {
+    //identity of a gridded receptor
+    struct key_t {
+      const char *source = nullptr; //src of the coordinates
+      const float *density_table = nullptr;
+      uint64_t types_hash = 0; //of the types and radii, which depend on the typer
+      unsigned natoms = 0;
+      unsigned ntypes = 0;
+      unsigned dim = 0; //points along each dimension
+      bool gpu = false;
+      bool binary = false;
+      bool radii_type_indexed = false;
+      float values[14] = {0,}; //rotation, center, translation, resolution, dimension, radius scale and gaussian multiple
+
+      bool operator==(const key_t& k) const {
+        return source == k.source && density_table == k.density_table && types_hash == k.types_hash && natoms == k.natoms &&
+            ntypes == k.ntypes && dim == k.dim && gpu == k.gpu && binary == k.binary && radii_type_indexed == k.radii_type_indexed &&
+            std::equal(values, values+14, k.values);
+      }
+    };
+
+    ManagedGrid<Dtype, 4> grid; //receptor channels
+    key_t key;
+    bool valid = false;
+    size_t hits = 0;
+    size_t misses = 0;
+    friend class GridMaker;
+
+  public:
+    /// forget the cached receptor
+    void clear() { valid = false; }
+
+    /// number of forward calls that reused the cached receptor
+    size_t get_hits() const { return hits; }
+
+    /// number of forward calls that gridded the receptor
+    size_t get_misses() const { return misses; }
+};
+
 // Docstring_GridMaker
 /**
  * \class GridMaker
@@ -30,8 +107,17 @@ namespace libmolgrid {
  * must be passed the grid_center (which may have changed due to
  * transformations performed directly on the atom coordinates externally to
  * this class)
+ *
+ * GPU grids may also be half precision (__half or __nv_bfloat16) for forward,
+ * index type backward and backward_relevance.  Densities and gradients are
+ * computed in single precision and only stored at the reduced precision.
+ *
+ * Gridding and gradients do not modify the GridMaker, so they may be called
+ * concurrently from several threads provided each call has its own outputs
+ * and receptor cache and the settings are not changed meanwhile.
  */
 class GridMaker {
+    friend class GridPyramid;
   protected:
     float resolution = 0.5; /// grid spacing
     float dimension = 0; /// grid side length in Angstroms
@@ -46,6 +132,66 @@ class GridMaker {
     bool binary = false; /// use binary occupancy instead of real-valued atom density
     bool radii_type_indexed = false;
     unsigned dim; /// grid width in points
+    unsigned cpu_threads = 1; /// number of threads used for CPU gridding and gradients, zero uses all hardware threads
+    bool specialized_kernels = false; /// use GPU forward kernels compiled for a fixed grid geometry when one matches
+    bool autotune = false; /// time GPU forward launch configurations on first use and keep the fastest
+    ///tabulated density as a function of squared distance over squared radius,
+    ///null when density is computed exactly; tables are shared and never freed
+    ///(in copies made by device_copy this is the table in device memory)
+    const float *density_table = nullptr;
+    float density_table_scale = 0; /// table index per unit of squared distance over squared radius
+    float density_table_error = 0; /// maximum absolute error of the tabulated density
+
+    /// number of threads to actually use for CPU gridding
+    unsigned num_cpu_threads() const;
+
+    /// copy of this gridmaker to pass to kernels, with any density table in device memory
+    GridMaker device_copy() const;
+
+    /* \brief Add the density of a single atom to the grid points of a single channel. (CPU)
+     * Only grid points with first index in [istart, iend) are touched so that
+     * threads can grid disjoint slabs of the same channel.
+     * If Weighted, density is multiplied by tmult (binary density adds tmult).
+     */
+    template <typename Dtype, bool Binary, bool Weighted>
+    void set_atom_cpu(float3 grid_origin, float3 a, float radius, Dtype tmult,
+        unsigned istart, unsigned iend, Dtype *channel) const;
+
+    /* \brief Add sign times the density of atoms to out, which is not zeroed.
+     * Each atom is six values: x, y, z, radius, type and sign.  Only non-binary
+     * density is supported; on the GPU only float grids are.
+     */
+    template <typename Dtype>
+    void add_atoms(float3 grid_origin, const std::vector<float>& atoms, Grid<Dtype, 4, false>& out, cudaStream_t) const;
+    void add_atoms(float3 grid_origin, const std::vector<float>& atoms, Grid<float, 4, true>& out, cudaStream_t stream) const;
+    template <typename Dtype>
+    void add_atoms(float3, const std::vector<float>&, Grid<Dtype, 4, true>&, cudaStream_t) const {
+      throw std::logic_error("Incremental gridding on the GPU requires float grids");
+    }
+
+    ///batched gridding; on the gpu, if random is not null the rotations and translations
+    ///of transforms are replaced by those of random, which are generated on the device
+    template <typename Dtype>
+    void forward_batch(const std::vector<Example>& in, const std::vector<Transform>& transforms, const RandomTransforms *random,
+        uint64_t first_index, Grid<Dtype, 5, true>& out, cudaStream_t stream) const;
+    template <typename Dtype>
+    void forward_batch(const std::vector<Example>& in, const std::vector<Transform>& transforms, const RandomTransforms *,
+        uint64_t, Grid<Dtype, 5, false>& out, cudaStream_t stream) const {
+      forward(in, transforms, out, stream);
+    }
+
+    ///store the non-zero voxels of dense in out[i] for each i, the next channels[i].size() channels of
+    ///dense are out[i]'s channels channels[i]
+    static void compact_sparse(const Grid<float, 4, false>& dense, const std::vector<std::vector<unsigned> >& channels, SparseGrid *out);
+    ///as above on the GPU, dense must come from sparse_scratch and is released for reuse once compacted
+    static void compact_sparse(const Grid<float, 4, true>& dense, const std::vector<std::vector<unsigned> >& channels, SparseGrid *out,
+        cudaStream_t stream);
+    ///GPU grid of nchannels channels the calling thread grids into before compact_sparse,
+    ///waits for the compaction of its previous use to complete
+    Grid<float, 4, true> sparse_scratch(unsigned nchannels) const;
+    ///grid each of the n sets into out, centered on the matching center
+    void forward_sparse(const float3 *centers, const CoordinateSet *in, unsigned n, SparseGrid *out, bool gpu,
+        cudaStream_t stream) const;
 
     template<typename Dtype, bool isCUDA>
     void check_index_args(const Grid<float, 2, isCUDA>& coords,
@@ -57,6 +203,8 @@ class GridMaker {
         const Grid<float, 2, isCUDA>& type_vector, const Grid<float, 1, isCUDA>& radii,
         Grid<Dtype, 4, isCUDA>& out) const;
   public:
+    ///number of intervals in the tabulated density
+    static constexpr unsigned density_table_size = 1024;
 
     GridMaker(float res = 0, float d = 0, bool bin = false, bool rti = false, float rscale=1.0, float grm = 1.0) :
       resolution(res), dimension(d), radius_scale(rscale), gaussian_radius_multiple(grm), final_radius_multiple(0),
@@ -103,6 +251,41 @@ class GridMaker {
     ///set if radius array should be indexed by type id, not atom
     CUDA_CALLABLE_MEMBER void set_radii_type_indexed(bool b) { radii_type_indexed = b; }
 
+    ///return number of threads used for CPU gridding and gradients
+    unsigned get_cpu_threads() const { return cpu_threads; }
+    ///set number of threads used for CPU gridding and gradients, zero uses all available hardware threads; threads are kept for reuse by later calls
+    void set_cpu_threads(unsigned n) { cpu_threads = n; }
+
+    ///return if density is looked up from a precomputed table instead of being computed exactly
+    bool get_density_table() const { return density_table != nullptr; }
+    /** \brief Set if non-binary density is interpolated from a precomputed table.
+     * The table is indexed by squared distance over squared radius so it only
+     * depends on the gaussian radius multiple.  Gradients are always exact.
+     */
+    void set_density_table(bool use);
+    ///return maximum absolute error of the tabulated density (zero when not tabulated)
+    float get_density_table_error() const { return density_table ? density_table_error : 0; }
+
+    ///return if GPU forward kernels specialized for common grid geometries are used
+    bool get_specialized_kernels() const { return specialized_kernels; }
+    /** \brief Set if GPU forward kernels specialized for common grid geometries are used.
+     * The grid width and resolution of the specialized kernels are compile time
+     * constants; they cover 23.5 and 11.5 Angstrom grids at 0.5 resolution and
+     * 23.5 Angstrom grids at 0.25.  Other geometries use the generic kernels.
+     * Results are identical either way.
+     */
+    void set_specialized_kernels(bool use) { specialized_kernels = use; }
+
+    ///return if GPU forward launch configurations are tuned
+    bool get_autotune() const { return autotune; }
+    /** \brief Set if GPU forward launch configurations are tuned.
+     * The first GPU forward of each device, kernel and grid geometry then times
+     * several thread block shapes and atom chunk sizes on its own inputs,
+     * synchronizing its stream, and the fastest is used from then on by every
+     * GridMaker.  Results are identical to those of the default configuration.
+     */
+    void set_autotune(bool use) { autotune = use; }
+
     ///return multiplier of radius where density goes to zero
     CUDA_CALLABLE_MEMBER float get_radiusmultiple() const { return radius_scale*final_radius_multiple; }
 
@@ -133,26 +316,47 @@ class GridMaker {
      * @param[in] center of grid
      * @param[in] coordinate set
      * @param[out] a 4D grid
+     * @param[in] stream CUDA stream for kernels and copies
      */
     template <typename Dtype>
-    void forward(float3 grid_center, const CoordinateSet& in, Grid<Dtype, 4, true>& out) const {
+    void forward(float3 grid_center, const CoordinateSet& in, Grid<Dtype, 4, true>& out, cudaStream_t stream = 0) const {
+      in.togpu(stream);
       if(in.has_vector_types() && in.size() > 0) {
-        forward(grid_center, in.coords.gpu(), in.type_vector.gpu(), in.radii.gpu(), out);
+        forward(grid_center, in.coords.gpu(), in.type_vector.gpu(), in.radii.gpu(), out, stream);
       } else {
-        forward(grid_center, in.coords.gpu(), in.type_index.gpu(), in.radii.gpu(), out);
+        forward(grid_center, in.coords.gpu(), in.type_index.gpu(), in.radii.gpu(), out, stream);
       }
     }
 
     // Docstring_GridMaker_forward_3
     /* \brief Generate grid tensor from an example while applying a transformation.
      * The center specified in the transform will be used as the grid center.
+     * For GPU grids of index types the transformation is applied as atoms are
+     * gridded, so the example's coordinates are never copied and transformed.
+     *
+     * @param[in] ex example
+     * @param[in] transform transformation to apply
+     * @param[out] out a 4D grid
+     * @param[in] stream CUDA stream for kernels and copies, ignored for CPU grids
+     */
+    template <typename Dtype, bool isCUDA>
+    void forward(const Example& in, const Transform& transform, Grid<Dtype, 4, isCUDA>& out, cudaStream_t stream = 0) const;
+
+    // Docstring_GridMaker_forward_12
+    /* \brief Generate grid tensor from an example with a static receptor.
+     * The channels of the first coordinate set are copied from cache, and are
+     * only gridded if the cache holds a different receptor, transform or
+     * settings.  The other sets are gridded as in forward.
      *
      * @param[in] ex example
      * @param[in] transform transformation to apply
      * @param[out] out a 4D grid
+     * @param[in,out] cache receptor channels for reuse by later calls
+     * @param[in] stream CUDA stream for kernels and copies, ignored for CPU grids
      */
     template <typename Dtype, bool isCUDA>
-    void forward(const Example& in, const Transform& transform, Grid<Dtype, 4, isCUDA>& out) const;
+    void forward(const Example& in, const Transform& transform, Grid<Dtype, 4, isCUDA>& out,
+        ReceptorGridCache<Dtype>& cache, cudaStream_t stream = 0) const;
 
     // Docstring_GridMaker_forward_4
     /* \brief Generate grid tensor from an example.
@@ -165,11 +369,12 @@ class GridMaker {
      * @param[in] random_translation  maximum amount to randomly translate each coordinate (+/-)
      * @param[in] random_rotation whether or not to randomly rotate
      * @param[in] center grid center to use, if not provided will use center of the last coordinate set before transformation
+     * @param[in] stream CUDA stream for kernels and copies, ignored for CPU grids
      */
     template <typename Dtype, bool isCUDA>
     void forward(const Example& in, Grid<Dtype, 4, isCUDA>& out,
         float random_translation=0.0, bool random_rotation = false,
-        const float3& center = make_float3(INFINITY, INFINITY, INFINITY)) const;
+        const float3& center = make_float3(INFINITY, INFINITY, INFINITY), cudaStream_t stream = 0) const;
 
     // Docstring_GridMaker_forward_5
     /* \brief Generate grid tensor from a vector of examples, as provided by ExampleProvider.next_batch.
@@ -183,16 +388,160 @@ class GridMaker {
      * @param[out] out a 4D grid
      * @param[in] random_translation  maximum amount to randomly translate each coordinate (+/-)
      * @param[in] random_rotation whether or not to randomly rotate
+     * @param[in] stream CUDA stream for kernels and copies, ignored for CPU grids
      */
     template <typename Dtype, bool isCUDA>
-    void forward(const std::vector<Example>& in, Grid<Dtype, 5, isCUDA>& out, float random_translation=0.0, bool random_rotation = false) const {
-      if(in.size() != out.dimension(0)) throw std::out_of_range("output grid dimension does not match size of example vector");
-      for(unsigned i = 0, n = in.size(); i < n; i++) {
-        Grid<Dtype, 4, isCUDA> g(out[i]);
-        forward<Dtype,isCUDA>(in[i],g, random_translation, random_rotation);
-      }
-    }
+    void forward(const std::vector<Example>& in, Grid<Dtype, 5, isCUDA>& out, float random_translation=0.0, bool random_rotation = false,
+        cudaStream_t stream = 0) const;
+
+    // Docstring_GridMaker_forward_15
+    /* \brief Generate grid tensor from a vector of examples with counter based random transformations.
+     * Example i is transformed by random.get(center, first_index+i), where
+     * center is the center of its last coordinate set, which is also the grid
+     * center.  The same indices always give the same transformations, so
+     * augmentation is reproducible and independent of the global random
+     * engine.  On the GPU the transformations of index typed batches are
+     * generated by a kernel on stream rather than on the host.
+     *
+     * @param[in] in vector of examples
+     * @param[out] out a 5D grid
+     * @param[in] random source of transformations
+     * @param[in] first_index index of the transformation of the first example
+     * @param[in] stream CUDA stream for kernels and copies, ignored for CPU grids
+     */
+    template <typename Dtype, bool isCUDA>
+    void forward(const std::vector<Example>& in, Grid<Dtype, 5, isCUDA>& out, const RandomTransforms& random,
+        uint64_t first_index = 0, cudaStream_t stream = 0) const;
+
+    // Docstring_GridMaker_forward_10
+    /* \brief Generate grid tensor from a vector of examples, each with its own transformation. (CPU)
+     * The center of each transform is used as the grid center for its example.
+     *
+     * @param[in] in vector of examples
+     * @param[in] transforms transformation to apply to each example
+     * @param[out] out a 5D grid
+     * @param[in] stream ignored, present so CPU and GPU grids share a signature
+     */
+    template <typename Dtype>
+    void forward(const std::vector<Example>& in, const std::vector<Transform>& transforms, Grid<Dtype, 5, false>& out,
+        cudaStream_t stream = 0) const;
+
+    // Docstring_GridMaker_forward_11
+    /* \brief Generate grid tensor from a vector of examples, each with its own transformation. (GPU)
+     * The center of each transform is used as the grid center for its example.
+     * Index typed examples are packed into a single buffer and the whole batch
+     * is transformed and gridded with one kernel launch each.
+     *
+     * @param[in] in vector of examples
+     * @param[in] transforms transformation to apply to each example
+     * @param[out] out a 5D grid
+     * @param[in] stream CUDA stream for kernels and copies
+     */
+    template <typename Dtype>
+    void forward(const std::vector<Example>& in, const std::vector<Transform>& transforms, Grid<Dtype, 5, true>& out,
+        cudaStream_t stream = 0) const;
+
+    // Docstring_GridMaker_forward_13
+    /* \brief Generate grid tensor from a vector of examples sharded across GPUs.
+     * The batch is split into contiguous shards, one per device, that are
+     * gridded concurrently, each on its own device and stream, and gathered
+     * into out, which may be on the CPU or any device.  Returns once every
+     * shard is in out.  Examples should be on the CPU, as provided by ExampleProvider.
+     *
+     * @param[in] in vector of examples
+     * @param[in] transforms transformation to apply to each example
+     * @param[out] out a 5D grid
+     * @param[in] devices devices to grid on, each is given an equal share of the batch
+     */
+    template <typename Dtype>
+    void forward(const std::vector<Example>& in, const std::vector<Transform>& transforms, ManagedGrid<Dtype, 5>& out,
+        const std::vector<int>& devices) const;
+
+    // Docstring_GridMaker_forward_14
+    /* \brief Generate grid tensor from a vector of examples sharded across GPUs.
+     * A random transform is generated for each example, centered on its last
+     * coordinate set, and the shards are gridded as when transforms are given.
+     *
+     * @param[in] in vector of examples
+     * @param[out] out a 5D grid
+     * @param[in] devices devices to grid on, each is given an equal share of the batch
+     * @param[in] random_translation  maximum amount to randomly translate each coordinate (+/-)
+     * @param[in] random_rotation whether or not to randomly rotate
+     */
+    template <typename Dtype>
+    void forward(const std::vector<Example>& in, ManagedGrid<Dtype, 5>& out, const std::vector<int>& devices,
+        float random_translation=0.0, bool random_rotation = false) const;
+
+
+    // Docstring_GridMaker_forward_delta
+    /* \brief Update the grid of one frame to that of the next by regridding only the atoms that changed.
+     * out must hold the grid of prev at grid_center, as made by forward.  The
+     * density of each atom whose coordinates moved by more than tolerance, or
+     * whose type or radius changed, is subtracted at its old position and added
+     * at its new one, so the cost scales with the number of moved atoms.  prev
+     * is then updated to the atoms as gridded, so passing the same prev for
+     * every frame keeps atoms that move less than tolerance each frame within
+     * tolerance of where they are gridded.  The result matches forward of prev
+     * up to floating point rounding, which accumulates over many updates, so
+     * frames should be regridded from scratch periodically.  out is instead
+     * regridded from scratch, and prev set to a copy of next, if more than
+     * max_fraction of the atoms changed, the number of atoms differs, the
+     * sets do not have index types, density is binary, or out is a reduced
+     * precision or double GPU grid.
+     * @param[in] grid_center center of grid
+     * @param[in,out] prev coordinate set gridded in out, updated to the atoms gridded in out
+     * @param[in] next coordinate set to grid
+     * @param[in,out] out 4D grid of prev, updated to the grid of next
+     * @param[in] max_fraction largest fraction of changed atoms to update incrementally
+     * @param[in] tolerance largest change of a coordinate that is not a move
+     * @param[in] stream CUDA stream for kernels and copies, ignored for CPU grids
+     * @return number of atoms that were gridded
+     */
+    template <typename Dtype, bool isCUDA>
+    size_t forward_delta(float3 grid_center, CoordinateSet& prev, const CoordinateSet& next, Grid<Dtype, 4, isCUDA>& out,
+        float max_fraction = 0.25, float tolerance = 0, cudaStream_t stream = 0) const;
+
+    // Docstring_GridMaker_forward_sparse_1
+    /* \brief Generate a sparse grid from atomic data.
+     * Only channels that have atoms are gridded, into a dense scratch grid that
+     * is reused across calls, and its non-zero voxels are then compacted into out.
+     * Zero channels are neither cleared nor written, but the scratch holds every
+     * voxel of the active channels, so peak memory is that of a dense grid of them.
+     * On the GPU the host waits once, for the number of non-zero voxels, and
+     * out is complete once stream is synchronized.
+     * @param[in] center of grid
+     * @param[in] coordinate set
+     * @param[out] out sparse grid, left on the GPU if gpu is set
+     * @param[in] gpu grid and compact on the GPU
+     * @param[in] stream CUDA stream for kernels and copies, ignored on the CPU
+     */
+    void forward_sparse(float3 grid_center, const CoordinateSet& in, SparseGrid& out, bool gpu = false,
+        cudaStream_t stream = 0) const;
 
+    // Docstring_GridMaker_forward_sparse_2
+    /* \brief Generate a sparse grid from an example while applying a transformation.
+     * The center specified in the transform will be used as the grid center.
+     * @param[in] ex example
+     * @param[in] transform transformation to apply
+     * @param[out] out sparse grid, left on the GPU if gpu is set
+     * @param[in] gpu grid and compact on the GPU
+     * @param[in] stream CUDA stream for kernels and copies, ignored on the CPU
+     */
+    void forward_sparse(const Example& in, const Transform& transform, SparseGrid& out, bool gpu = false,
+        cudaStream_t stream = 0) const;
+
+    // Docstring_GridMaker_forward_sparse_3
+    /* \brief Generate a sparse grid of each example of a batch while applying its transformation.
+     * The active channels of every example are gridded into one scratch grid and
+     * compacted together, so on the GPU the host waits once per batch.
+     * @param[in] in examples
+     * @param[in] transforms transformation of each example, whose centers are the grid centers
+     * @param[out] out sparse grid of each example, resized to the number of examples
+     * @param[in] gpu grid and compact on the GPU
+     * @param[in] stream CUDA stream for kernels and copies, ignored on the CPU
+     */
+    void forward_sparse(const std::vector<Example>& in, const std::vector<Transform>& transforms, std::vector<SparseGrid>& out,
+        bool gpu = false, cudaStream_t stream = 0) const;
 
     // Docstring_GridMaker_forward_6
     /* \brief Generate grid tensor from CPU atomic data.  Grid must be properly sized.
@@ -214,11 +563,12 @@ class GridMaker {
      * @param[in] type indices (N integers stored as floats)
      * @param[in] radii (N)
      * @param[out] a 4D grid
+     * @param[in] stream CUDA stream for kernels and copies
      */
     template <typename Dtype>
     void forward(float3 grid_center, const Grid<float, 2, true>& coords,
         const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii,
-        Grid<Dtype, 4, true>& out) const;
+        Grid<Dtype, 4, true>& out, cudaStream_t stream = 0) const;
         
         
     // Docstring_GridMaker_forward_8
@@ -243,11 +593,12 @@ class GridMaker {
      * @param[in] type indices (NxT)
      * @param[in] radii (N) or (T) depending on if radii_type_indexed is set
      * @param[out] a 4D grid
+     * @param[in] stream CUDA stream for kernels and copies
      */
     template <typename Dtype>
     void forward(float3 grid_center, const Grid<float, 2, true>& coords,
         const Grid<float, 2, true>& type_vector, const Grid<float, 1, true>& radii,
-        Grid<Dtype, 4, true>& out) const;
+        Grid<Dtype, 4, true>& out, cudaStream_t stream = 0) const;
 
 
     // Docstring_GridMaker_backward_1
@@ -298,12 +649,14 @@ class GridMaker {
      * @param[in] diff a 4D grid of gradients
      * @param[out] atomic_gradients vector quantities for each atom
      * @param[out] type_gradients only set if input has type vectors
+     * @param[in] stream CUDA stream for kernels and copies
      */
     template <typename Dtype>
     void backward(float3 grid_center, const CoordinateSet& in, const Grid<Dtype, 4, true>& diff,
-        Grid<Dtype, 2, true>& atomic_gradients, Grid<Dtype, 2, true>& type_gradients) const {
+        Grid<Dtype, 2, true>& atomic_gradients, Grid<Dtype, 2, true>& type_gradients, cudaStream_t stream = 0) const {
       if(in.has_vector_types()) {
-        backward(grid_center, in.coords.gpu(), in.type_vector.gpu(), in.radii.gpu(), diff, atomic_gradients, type_gradients);
+        in.togpu(stream);
+        backward(grid_center, in.coords.gpu(), in.type_vector.gpu(), in.radii.gpu(), diff, atomic_gradients, type_gradients, stream);
       } else {
         throw std::invalid_argument("Vector types missing from coordinate set");
       }
@@ -317,12 +670,14 @@ class GridMaker {
      * @param[in] in coordinate set
      * @param[in] diff a 4D grid of gradients
      * @param[out] atomic_gradients vector quantities for each atom
+     * @param[in] stream CUDA stream for kernels and copies
      */
     template <typename Dtype>
     void backward(float3 grid_center, const CoordinateSet& in, const Grid<Dtype, 4, true>& diff,
-        Grid<Dtype, 2, true>& atomic_gradients) const {
+        Grid<Dtype, 2, true>& atomic_gradients, cudaStream_t stream = 0) const {
       if(in.has_indexed_types()) {
-        backward(grid_center, in.coords.gpu(), in.type_index.gpu(), in.radii.gpu(), diff, atomic_gradients);
+        in.togpu(stream);
+        backward(grid_center, in.coords.gpu(), in.type_index.gpu(), in.radii.gpu(), diff, atomic_gradients, stream);
       } else {
         throw std::invalid_argument("Index types missing from coordinate set");
       }
@@ -352,11 +707,12 @@ class GridMaker {
      * @param[in] radii (N)
      * @param[in] diff a 4D grid of gradients
      * @param[out] atomic_gradients vector quantities for each atom
+     * @param[in] stream CUDA stream for kernels and copies
      */
     template <typename Dtype>
     void backward(float3 grid_center, const Grid<float, 2, true>& coords,
         const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii,
-        const Grid<Dtype, 4, true>& grid, Grid<Dtype, 2, true>& atom_gradients) const;
+        const Grid<Dtype, 4, true>& grid, Grid<Dtype, 2, true>& atom_gradients, cudaStream_t stream = 0) const;
 
     // Docstring_GridMaker_backward_7
     /* \brief Generate atom and type gradients from grid gradients. (CPU)
@@ -385,13 +741,86 @@ class GridMaker {
      * @param[in] diff a 4D grid of gradients
      * @param[out] atomic_gradients vector quantities for each atom
      * @param[out] type_gradients vector quantities for each atom
+     * @param[in] stream CUDA stream for kernels and copies
      *
      */
     template <typename Dtype>
     void backward(float3 grid_center, const Grid<float, 2, true>& coords,
         const Grid<float, 2, true>& type_vectors, const Grid<float, 1, true>& radii,
         const Grid<Dtype, 4, true>& grid,
-        Grid<Dtype, 2, true>& atom_gradients,  Grid<Dtype, 2, true>& type_gradients) const;
+        Grid<Dtype, 2, true>& atom_gradients,  Grid<Dtype, 2, true>& type_gradients, cudaStream_t stream = 0) const;
+
+    // Docstring_GridMaker_backward_9
+    /* \brief Generate atom gradients of a batch from grid gradients. (CPU)
+     * Examples are padded to the same number of atoms.  Padding atoms
+     * should have a negative type and get zero gradient.
+     * @param[in] center of grid, shared by all examples
+     * @param[in] coordinates (BxNx3)
+     * @param[in] type indices (BxN integers stored as floats)
+     * @param[in] radii (BxN)
+     * @param[in] diff a 5D grid of gradients
+     * @param[out] atomic_gradients vector quantities for each atom (BxNx3)
+     */
+    template <typename Dtype>
+    void backward(float3 grid_center, const Grid<float, 3, false>& coords,
+        const Grid<float, 2, false>& type_index, const Grid<float, 2, false>& radii,
+        const Grid<Dtype, 5, false>& diff, Grid<Dtype, 3, false>& atom_gradients) const;
+
+    // Docstring_GridMaker_backward_10
+    /* \brief Generate atom gradients of a batch from grid gradients. (GPU)
+     * All examples are processed by a single kernel launch.  Examples are
+     * padded to the same number of atoms.  Padding atoms should have a
+     * negative type and get zero gradient.
+     * @param[in] center of grid, shared by all examples
+     * @param[in] coordinates (BxNx3)
+     * @param[in] type indices (BxN integers stored as floats)
+     * @param[in] radii (BxN)
+     * @param[in] diff a 5D grid of gradients
+     * @param[out] atomic_gradients vector quantities for each atom (BxNx3)
+     * @param[in] stream CUDA stream for kernels and copies
+     */
+    template <typename Dtype>
+    void backward(float3 grid_center, const Grid<float, 3, true>& coords,
+        const Grid<float, 2, true>& type_index, const Grid<float, 2, true>& radii,
+        const Grid<Dtype, 5, true>& diff, Grid<Dtype, 3, true>& atom_gradients, cudaStream_t stream = 0) const;
+
+    // Docstring_GridMaker_backward_11
+    /* \brief Generate atom and type gradients of a batch from grid gradients. (CPU)
+     * Examples are padded to the same number of atoms.  Padding atoms
+     * should have a zero type vector or a zero radius.
+     * @param[in] center of grid, shared by all examples
+     * @param[in] coordinates (BxNx3)
+     * @param[in] type vectors (BxNxT)
+     * @param[in] radii (BxN, or BxT with type indexed radii)
+     * @param[in] diff a 5D grid of gradients
+     * @param[out] atomic_gradients vector quantities for each atom (BxNx3)
+     * @param[out] type_gradients vector quantities for each atom (BxNxT)
+     */
+    template <typename Dtype>
+    void backward(float3 grid_center, const Grid<float, 3, false>& coords,
+        const Grid<float, 3, false>& type_vectors, const Grid<float, 2, false>& radii,
+        const Grid<Dtype, 5, false>& diff,
+        Grid<Dtype, 3, false>& atom_gradients, Grid<Dtype, 3, false>& type_gradients) const;
+
+    // Docstring_GridMaker_backward_12
+    /* \brief Generate atom and type gradients of a batch from grid gradients. (GPU)
+     * All examples are processed by a single kernel launch.  Examples are
+     * padded to the same number of atoms.  Padding atoms should have a zero
+     * type vector or a zero radius.
+     * @param[in] center of grid, shared by all examples
+     * @param[in] coordinates (BxNx3)
+     * @param[in] type vectors (BxNxT)
+     * @param[in] radii (BxN, or BxT with type indexed radii)
+     * @param[in] diff a 5D grid of gradients
+     * @param[out] atomic_gradients vector quantities for each atom (BxNx3)
+     * @param[out] type_gradients vector quantities for each atom (BxNxT)
+     * @param[in] stream CUDA stream for kernels and copies
+     */
+    template <typename Dtype>
+    void backward(float3 grid_center, const Grid<float, 3, true>& coords,
+        const Grid<float, 3, true>& type_vectors, const Grid<float, 2, true>& radii,
+        const Grid<Dtype, 5, true>& diff,
+        Grid<Dtype, 3, true>& atom_gradients, Grid<Dtype, 3, true>& type_gradients, cudaStream_t stream = 0) const;
 
     /* \brief Propagate relevance (in diff) onto atoms. (CPU)
      * Index types are required.
@@ -419,18 +848,21 @@ class GridMaker {
      * @param[in] density a 4D grid of densities (used in forward)
      * @param[in] diff a 4D grid of relevance
      * @param[out] relevance score for each atom
+     * @param[in] stream CUDA stream for kernels and copies
      */
     template <typename Dtype>
     void backward_relevance(float3 grid_center,  const CoordinateSet& in,
         const Grid<Dtype, 4, true>& density, const Grid<Dtype, 4, true>& diff,
-        Grid<Dtype, 1, true>& relevance) const {
+        Grid<Dtype, 1, true>& relevance, cudaStream_t stream = 0) const {
       if(in.has_indexed_types()) {
-        backward_relevance(grid_center, in.coords.gpu(), in.type_index.gpu(), in.radii.gpu(), density, diff, relevance);
+        in.togpu(stream);
+        backward_relevance(grid_center, in.coords.gpu(), in.type_index.gpu(), in.radii.gpu(), density, diff, relevance, stream);
       } else {
         throw std::invalid_argument("Index types missing from coordinate set in backward relevance"); //could setup dummy types here
       }
     }
 
+    // Docstring_GridMaker_backward_relevance_1
     /* \brief Propagate relevance (in diff) onto atoms. (CPU)
      * Index types are required.
      * @param[in] center of grid
@@ -447,6 +879,7 @@ class GridMaker {
         const Grid<Dtype, 4, false>& density, const Grid<Dtype, 4, false>& diff,
         Grid<Dtype, 1, false>& relevance) const;
 
+    // Docstring_GridMaker_backward_relevance_2
     /* \brief Propagate relevance (in diff) onto atoms. (GPU)
      * Index types are required.
      * @param[in] center of grid
@@ -456,30 +889,69 @@ class GridMaker {
      * @param[in] density a 4D grid of densities (used in forward)
      * @param[in] diff a 4D grid of relevance
      * @param[out] relevance score for each atom
+     * @param[in] stream CUDA stream for kernels and copies
      */
     template <typename Dtype>
     void backward_relevance(float3 grid_center,  const Grid<float, 2, true>& coords,
         const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii,
         const Grid<Dtype, 4, true>& density, const Grid<Dtype, 4, true>& diff,
-        Grid<Dtype, 1, true>& relevance) const;
+        Grid<Dtype, 1, true>& relevance, cudaStream_t stream = 0) const;
+
+    // Docstring_GridMaker_backward_relevance_batch_1
+    /* \brief Propagate relevance (in diff) onto the atoms of a batch. (CPU)
+     * Index types are required.  Padding atoms should have a negative type.
+     * @param[in] center of grid, shared by all examples
+     * @param[in] coords coordinates (BxNx3)
+     * @param[in] type_index (BxN)
+     * @param[in] radii (BxN)
+     * @param[in] density a 5D grid of densities (used in forward)
+     * @param[in] diff a 5D grid of relevance
+     * @param[out] relevance score for each atom (BxN)
+     */
+    template <typename Dtype>
+    void backward_relevance(float3 grid_center,  const Grid<float, 3, false>& coords,
+        const Grid<float, 2, false>& type_index, const Grid<float, 2, false>& radii,
+        const Grid<Dtype, 5, false>& density, const Grid<Dtype, 5, false>& diff,
+        Grid<Dtype, 2, false>& relevance) const;
+
+    // Docstring_GridMaker_backward_relevance_batch_2
+    /* \brief Propagate relevance (in diff) onto the atoms of a batch. (GPU)
+     * All examples are processed by a single kernel launch.
+     * Index types are required.  Padding atoms should have a negative type.
+     * @param[in] center of grid, shared by all examples
+     * @param[in] coords coordinates (BxNx3)
+     * @param[in] type_index (BxN)
+     * @param[in] radii (BxN)
+     * @param[in] density a 5D grid of densities (used in forward)
+     * @param[in] diff a 5D grid of relevance
+     * @param[out] relevance score for each atom (BxN)
+     * @param[in] stream CUDA stream for kernels and copies
+     */
+    template <typename Dtype>
+    void backward_relevance(float3 grid_center,  const Grid<float, 3, true>& coords,
+        const Grid<float, 2, true>& type_index, const Grid<float, 2, true>& radii,
+        const Grid<Dtype, 5, true>& density, const Grid<Dtype, 5, true>& diff,
+        Grid<Dtype, 2, true>& relevance, cudaStream_t stream = 0) const;
 
 
     /* \brief The function that actually updates the voxel density values.
+     * Coordinates of the relevant atoms are read from shared memory, where
+     * they have already been transformed.
      * @param[in] number of possibly relevant atoms
      * @param[in] grid origin
-     * @param[in] coordinates
      * @param[in] type indices (N integers stored as floats)
      * @param[in] radii (N)
      * @param[out] a 4D grid
+     * Geometry supplies the grid width and resolution, which may be compile time constants.
      */
-    template <typename Dtype, bool Binary>
+    template <typename Dtype, bool Binary, typename Geometry>
     CUDA_DEVICE_MEMBER void set_atoms(unsigned natoms, float3 grid_origin,
-        const float3 *coords, const float *tindex, const float *radii, Dtype* out);
+        const float *tindex, const float *radii, Dtype* out);
 
     /* \brief The function that actually updates the voxel density values.
+     * Coordinates of the relevant atoms are read from shared memory.
      * @param[in] number of possibly relevant atoms
      * @param[in] grid origin
-     * @param[in] coordinates
      * @param[in] type vector (NxT)
      * @param[in] ntypes number of types
      * @param[in] radii (N)
@@ -487,7 +959,7 @@ class GridMaker {
      */
     template <typename Dtype, bool Binary, bool RadiiFromTypes>
     CUDA_DEVICE_MEMBER void set_atoms(unsigned natoms, float3 grid_origin,
-        const float3 *coords, const float *type_vec, unsigned ntypes,
+        const float *type_vec, unsigned ntypes,
         const float *radii, Dtype* out);
 
   //protected:
@@ -525,20 +997,147 @@ class GridMaker {
     CUDA_CALLABLE_MEMBER float calc_point(float ax, float ay, float az, float ar,
         const float3& grid_coords) const;
 
+    /* \brief Calculate atom density from squared distance to a grid point.
+     * @param[in] squared distance from atom center
+     * @param[in] atomic radius
+     * @param[out] atom density
+     */
+    template <bool Binary>
+    CUDA_CALLABLE_MEMBER float calc_density(float rsq, float ar) const;
+
+    /* \brief Interpolate non-binary atom density from a density table.
+     * @param[in] squared distance from atom center
+     * @param[in] atomic radius
+     * @param[in] table of density_table_size+1 values
+     * @param[out] atom density
+     */
+    CUDA_CALLABLE_MEMBER float lookup_density(float rsq, float ar, const float *table) const {
+      ar *= radius_scale;
+      float x = rsq * density_table_scale / (ar * ar);
+      if (x >= density_table_size) return 0.0;
+      unsigned i = x;
+      float t = x - i;
+      float lo = table[i];
+      return lo + t * (table[i + 1] - lo);
+    }
+
     //accumulate gradient from grid point x,y,z for provided atom at ax,ay,az
     CUDA_CALLABLE_MEMBER void accumulate_atom_gradient(float ax, float ay, float az,
             float x, float y, float z, float radius, float gridval, float3& agrad) const;
 
+    //kernels are batched, the example is a block index
     template<typename Dtype> __global__ friend //member functions don't kernel launch
-    void set_atom_gradients(GridMaker G, float3 grid_center, Grid2fCUDA coords, Grid1fCUDA type_index,
-        Grid1fCUDA radii, Grid<Dtype, 4, true> grid, Grid<Dtype, 2, true> atom_gradients);
+    void set_atom_gradients(GridMaker G, float3 grid_center, Grid3fCUDA coords, Grid2fCUDA type_index,
+        Grid2fCUDA radii, Grid<Dtype, 5, true> grid, Grid<Dtype, 3, true> atom_gradients);
     template<typename Dtype, bool RadiiFromTypes> __global__ friend
-    void set_atom_type_gradients(GridMaker G, float3 grid_origin, Grid2fCUDA coords, Grid2fCUDA type_vector,
-        unsigned ntypes, Grid1fCUDA radii, Grid<Dtype, 4, true> grid, Grid<Dtype, 2, true> atom_gradients,
-        Grid<Dtype, 2, true> type_gradients);
+    void set_atom_type_gradients(GridMaker G, float3 grid_origin, Grid3fCUDA coords, Grid3fCUDA type_vector,
+        unsigned ntypes, Grid2fCUDA radii, Grid<Dtype, 5, true> grid, Grid<Dtype, 3, true> atom_gradients,
+        Grid<Dtype, 3, true> type_gradients);
+    __global__ friend
+    void add_atoms_kernel(GridMaker G, float3 grid_origin, unsigned natoms, const float *atoms, Grid<float, 4, true> out);
     template<typename Dtype> __global__ friend
-    void set_atom_relevance(GridMaker G, float3 grid_origin, Grid2fCUDA coords, Grid1fCUDA type_index,
-        Grid1fCUDA radii, Grid<Dtype, 4, true> densitygrid, Grid<Dtype, 4, true> diffgrid, Grid<Dtype, 1, true> relevance);
+    void set_atom_relevance(GridMaker G, float3 grid_origin, Grid3fCUDA coords, Grid2fCUDA type_index,
+        Grid2fCUDA radii, Grid<Dtype, 5, true> densitygrid, Grid<Dtype, 5, true> diffgrid, Grid<Dtype, 2, true> relevance);
+};
+
+//non-binary, gaussian case
+template<>
+CUDA_CALLABLE_MEMBER inline float GridMaker::calc_density<false>(float rsq, float ar) const {
+  ar *= radius_scale;
+  //For non-binary density we want a Gaussian where 2 std occurs at the
+  //radius, after which it becomes quadratic.
+  //The quadratic is fit to have both the same value and first derivative
+  //at the cross over point and a value and derivative of zero at fianl_radius_multiple
+  float dist = sqrtf(rsq);
+  if (dist >= ar * final_radius_multiple) {
+    return 0.0;
+  } else
+  if (dist <= ar * gaussian_radius_multiple) {
+    //return gaussian
+    float ex = -2.0 * dist * dist / (ar*ar);
+    return exp(ex);
+  } else { //return quadratic
+    float dr = dist / ar;
+    float q = (A * dr + B) * dr + C;
+    return q > 0 ? q : 0; //avoid very small negative numbers
+  }
+}
+
+template<>
+CUDA_CALLABLE_MEMBER inline float GridMaker::calc_density<true>(float rsq, float ar) const {
+  ar *= radius_scale;
+  //is point within radius?
+  if (rsq < ar * ar)
+    return 1.0;
+  else
+    return 0.0;
+}
+
+// Docstring_GridPyramid
+/**
+ * \class GridPyramid
+ * Grids the same atoms at several resolutions and dimensions.  Each level
+ * is a GridMaker with the same density settings.  On the CPU all levels are
+ * filled from a single pass over the atoms, so atoms are loaded and typed once
+ * however many levels there are.  Output grids are indexed by level.
+ */
+class GridPyramid {
+    std::vector<GridMaker> levels;
+
+    void check_outputs(size_t n) const {
+      if(n != levels.size()) throw std::invalid_argument("Expected "+itoa(levels.size())+" output grids, got "+itoa(n));
+    }
+  public:
+    /** \brief Construct a pyramid from the resolution and dimension of each level
+     * @param[in] levels (resolution, dimension) pairs in Angstroms
+     * @param[in] bin boolean indicating if binary density should be used
+     * @param[in] rscale scaling factor to be uniformly applied to all input radii
+     * @param[in] grm gaussian radius multiplier - cutoff point for switching from Gaussian density to quadratic
+     */
+    GridPyramid(const std::vector<std::pair<float, float> >& levels, bool bin = false, float rscale = 1.0, float grm = 1.0);
+
+    ///return number of levels
+    size_t num_levels() const { return levels.size(); }
+
+    ///return the gridmaker of level i
+    const GridMaker& get_level(unsigned i) const { return levels.at(i); }
+
+    ///return number of threads used for CPU gridding
+    unsigned get_cpu_threads() const { return levels.size() ? levels[0].get_cpu_threads() : 1; }
+    ///set number of threads used for CPU gridding, zero uses all available hardware threads
+    void set_cpu_threads(unsigned n) { for(GridMaker& g : levels) g.set_cpu_threads(n); }
+
+    // Docstring_GridPyramid_forward_1
+    /* \brief Generate a grid of every level from atomic data.  Grids (CPU) must be properly sized.
+     * @param[in] center of grids
+     * @param[in] coordinate set
+     * @param[out] one 4D grid per level
+     */
+    template <typename Dtype>
+    void forward(float3 grid_center, const CoordinateSet& in, std::vector<Grid<Dtype, 4, false> >& out) const;
+
+    // Docstring_GridPyramid_forward_2
+    /* \brief Generate a grid of every level from atomic data.  Grids (GPU) must be properly sized.
+     * Coordinates are copied to the device once and each level is gridded by its own kernels.
+     * @param[in] center of grids
+     * @param[in] coordinate set
+     * @param[out] one 4D grid per level
+     * @param[in] stream of the gridding kernels
+     */
+    template <typename Dtype>
+    void forward(float3 grid_center, const CoordinateSet& in, std::vector<Grid<Dtype, 4, true> >& out, cudaStream_t stream = 0) const;
+
+    // Docstring_GridPyramid_forward_3
+    /* \brief Generate a grid of every level from an example while applying a transformation.
+     * The coordinates are merged and transformed once and the center specified
+     * in the transform is used as the center of every level.
+     * @param[in] example
+     * @param[in] transform to apply
+     * @param[out] one 4D grid per level
+     * @param[in] stream of the gridding kernels (GPU only)
+     */
+    template <typename Dtype, bool isCUDA>
+    void forward(const Example& in, const Transform& transform, std::vector<Grid<Dtype, 4, isCUDA> >& out, cudaStream_t stream = 0) const;
 };
 
 } /* namespace libmolgrid */
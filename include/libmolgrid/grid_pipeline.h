@@ -0,0 +1,138 @@
+/** \file grid_pipeline.h
+ *
+ *  Pipelined extraction, transfer and gridding of batches on the GPU.
+ */
+
+#ifndef GRID_PIPELINE_H_
+#define GRID_PIPELINE_H_
+
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include "libmolgrid/example_provider.h"
+#include "libmolgrid/grid_maker.h"
+
+namespace libmolgrid {
+
+// Docstring_GridPipelineStats
+/** \brief Cumulative times of the stages of a GridPipeline.
+ * If starved_seconds is a large part of the time the consumer spends, it is
+ * waiting on data and the largest of extract_seconds, submit_seconds and
+ * grid_seconds is the bottleneck.  If stalled_seconds dominates instead, the
+ * pipeline is waiting on the consumer, which is then the bottleneck.
+ */
+struct GridPipelineStats {
+    size_t batches = 0; ///batches handed to the consumer
+    double extract_seconds = 0; ///host time drawing and extracting the examples and labels of batches
+    double submit_seconds = 0; ///host time packing atoms and queuing the transfers and gridding of batches
+    double grid_seconds = 0; ///device time of transfers and gridding, counted once a buffer is refilled
+    double starved_seconds = 0; ///time the consumer waited for a batch to be ready
+    double stalled_seconds = 0; ///time the pipeline waited for the consumer to return a buffer
+};
+
+// Docstring_GridPipeline
+/** \brief Grid batches of an ExampleProvider ahead of the consumer on the GPU.
+ * A background thread draws each batch from the provider, extracts its
+ * labels and queues the upload and gridding of its atoms on a stream of its
+ * own, into one of depth device buffers.  While the consumer computes on one
+ * batch, the next batches are extracted, copied to the device and gridded.
+ * Handing a batch to the consumer makes its stream wait on the batch with an
+ * event, so no call synchronizes the host with the device.
+ *
+ * Example i of the batches is transformed by random.get(center, i), as by
+ * GridMaker::forward with RandomTransforms, so augmentation does not depend
+ * on the global random engine.  The provider must outlive the pipeline and
+ * should not be used by others while the pipeline is, or the pipeline will
+ * skip the batches they draw.  Grids are on the device that was current when
+ * the pipeline was constructed.
+ */
+class GridPipeline {
+    /// device buffers of a batch and the events that order their reuse
+    struct Slot {
+      MGrid5f grid;
+      MGrid2f labels;
+      cudaStream_t stream = nullptr;
+      cudaEvent_t start = nullptr; //recorded before the batch's transfers and gridding
+      cudaEvent_t ready = nullptr; //recorded after them
+      cudaEvent_t consumed = nullptr; //recorded on the consumer's stream once it is done with the batch
+      bool timed = false; //start and ready bracket work whose time has not been counted
+    };
+
+    ExampleProvider& provider;
+    GridMaker gmaker;
+    RandomTransforms random;
+    unsigned batch_size;
+    int device;
+    uint64_t next_index = 0; //transformation index of the next example gridded
+
+    //all protected by mtx
+    std::vector<Slot> slots;
+    std::deque<unsigned> free_slots; //slots that may be filled
+    std::deque<unsigned> ready_slots; //filled slots in batch order
+    int held = -1; //slot given to the consumer by the last next, returned by the following one
+    bool stop = false;
+    std::exception_ptr error; //raised by the worker, rethrown by next once ready batches run out
+    GridPipelineStats stats;
+    std::mutex mtx;
+    std::condition_variable free_cv; //signaled when a slot is returned
+    std::condition_variable ready_cv; //signaled when a slot is filled or the worker fails
+    std::thread worker;
+
+    /// worker thread loop
+    void run();
+    /// return the held slot, then wait for the next ready slot and make stream wait on it
+    unsigned take_ready(cudaStream_t stream);
+    /// return slot s once the work queued on stream so far is done; mtx must be held
+    void release(unsigned s, cudaStream_t stream);
+
+  public:
+    /** \brief Start gridding batches of provider.
+     * @param[in] p provider of examples, which must outlive the pipeline
+     * @param[in] g gridding settings, which are copied
+     * @param[in] batch_size number of examples in a batch
+     * @param[in] random source of the transformation of each example, the default does not transform
+     * @param[in] depth number of batches that may be prepared or held by the consumer at once
+     */
+    GridPipeline(ExampleProvider& p, const GridMaker& g, unsigned batch_size,
+        const RandomTransforms& random = RandomTransforms(), unsigned depth = 2);
+    GridPipeline(const GridPipeline&) = delete;
+    GridPipeline& operator=(const GridPipeline&) = delete;
+    /// stop the worker and wait for queued work
+    virtual ~GridPipeline();
+
+    // Docstring_GridPipeline_next_1
+    /* \brief Provide the next batch in the pipeline's own device buffers.
+     * stream waits for the batch before any work queued on it later.  The
+     * buffers are returned to the pipeline by the next call, once the work
+     * queued on that call's stream is done, and are then overwritten.
+     * @param[out] grid BxTxDxDxD grids of the batch on the device
+     * @param[out] labels BxL labels of the batch on the device
+     * @param[in] stream CUDA stream of the consumer
+     */
+    void next(MGrid5f& grid, MGrid2f& labels, cudaStream_t stream = 0);
+
+    // Docstring_GridPipeline_next_2
+    /* \brief Copy the next batch into grid and labels on stream.
+     * The pipeline's buffers are returned as soon as the copies are done.
+     * @param[out] grid BxTxDxDxD grids of the batch
+     * @param[out] labels BxL labels of the batch
+     * @param[in] stream CUDA stream of the consumer
+     */
+    void next(Grid<float, 5, true>& grid, Grid<float, 2, true>& labels, cudaStream_t stream = 0);
+
+    /// return the cumulative times of the pipeline stages
+    GridPipelineStats get_stats();
+    /// zero the cumulative times
+    void reset_stats();
+
+    /// number of examples in a batch
+    unsigned get_batch_size() const { return batch_size; }
+    /// number of device buffers
+    unsigned get_depth() const { return slots.size(); }
+};
+
+} /* namespace libmolgrid */
+
+#endif /* GRID_PIPELINE_H_ */
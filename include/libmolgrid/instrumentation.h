@@ -0,0 +1,119 @@
+/** \file instrumentation.h
+ *  \brief Opt-in cumulative timings and counters of the data pipeline stages.
+ *
+ *  When disabled (the default) every probe costs a single relaxed atomic load.
+ *  When enabled, each probe adds to per-stage atomic counters, so results are
+ *  totals across all threads.  GPU kernels are timed with CUDA events that are
+ *  only read once they have completed, so timing never synchronizes a stream;
+ *  pending events are kept per thread so concurrent launches do not serialize.
+ */
+
+#ifndef INSTRUMENTATION_H_
+#define INSTRUMENTATION_H_
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cuda_runtime_api.h>
+
+namespace libmolgrid {
+
+/// instrumented stages of the pipeline
+enum InstrumentedStage {
+  STAGE_NEXTREF, ///choosing the next example references
+  STAGE_SET_COORDS, ///CoordCache::set_coords, including all reading and typing
+  STAGE_READ_MOLCACHE, ///copying atoms out of a memory mapped molcache2 file
+  STAGE_READ_GNINATYPES, ///reading and typing a gninatypes file
+  STAGE_PARSE_OPENBABEL, ///parsing (and protonating) a molecule with OpenBabel
+  STAGE_TYPING, ///typing the atoms of an OpenBabel molecule
+  STAGE_STORE_HIT, ///structures found in an AtomStore
+  STAGE_STORE_MISS, ///structures that had to be read
+  STAGE_MERGE, ///Example::merge_coordinates
+  STAGE_HOST_TO_DEVICE, ///ManagedGrid transfers to the GPU, asynchronous ones from CUDA events
+  STAGE_DEVICE_TO_HOST, ///ManagedGrid transfers to the CPU, asynchronous ones from CUDA events
+  STAGE_FORWARD_CPU, ///CPU gridding
+  STAGE_BACKWARD_CPU, ///CPU gradients
+  STAGE_FORWARD_GPU, ///GPU gridding kernels, from CUDA events
+  STAGE_BACKWARD_GPU, ///GPU gradient kernels, from CUDA events
+  NUM_INSTRUMENTED_STAGES
+};
+
+/// cumulative totals of a stage
+struct StageStats {
+  std::string name;
+  size_t count = 0; ///times the stage was entered
+  double seconds = 0; ///total time spent in the stage
+  size_t bytes = 0; ///total bytes handled, for stages that move memory
+};
+
+namespace instrumentation_detail {
+  extern std::atomic<bool> enabled;
+}
+
+/// return true if stages are being recorded
+inline bool get_instrumentation() { return instrumentation_detail::enabled.load(std::memory_order_relaxed); }
+
+/// enable or disable recording of stages, totals are kept when disabled
+void set_instrumentation(bool enable);
+
+/// zero the totals of all stages
+void reset_instrumentation();
+
+/** \brief Return the totals of every stage.
+ * GPU timings are included once their kernels have completed.
+ */
+std::vector<StageStats> get_instrumentation_stats();
+
+/// return the name of stage s
+const char* stage_name(InstrumentedStage s);
+
+/// add to the totals of stage s
+void record_stage(InstrumentedStage s, double seconds, size_t bytes = 0, size_t count = 1);
+
+/// count an occurrence of stage s without timing it, if recording
+inline void count_stage(InstrumentedStage s, size_t bytes = 0) {
+  if(get_instrumentation()) record_stage(s, 0, bytes);
+}
+
+/** \brief Record the host time from construction to destruction as stage. */
+class StageTimer {
+    std::chrono::steady_clock::time_point start;
+    size_t bytes;
+    InstrumentedStage stage;
+    bool active;
+  public:
+    explicit StageTimer(InstrumentedStage s, size_t b = 0): bytes(b), stage(s), active(get_instrumentation()) {
+      if(active) start = std::chrono::steady_clock::now();
+    }
+    ~StageTimer() {
+      if(active) record_stage(stage, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), bytes);
+    }
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+};
+
+/** \brief Record the device time of the work queued on stream between
+ *  construction and destruction as stage.  Must be used on the current device.
+ */
+class KernelTimer {
+    cudaStream_t stream;
+    cudaEvent_t start = nullptr;
+    size_t bytes;
+    InstrumentedStage stage;
+    void begin();
+    void end();
+  public:
+    KernelTimer(InstrumentedStage s, cudaStream_t st, size_t b = 0): stream(st), bytes(b), stage(s) {
+      if(get_instrumentation()) begin();
+    }
+    ~KernelTimer() {
+      if(start) end();
+    }
+    KernelTimer(const KernelTimer&) = delete;
+    KernelTimer& operator=(const KernelTimer&) = delete;
+};
+
+} /* namespace libmolgrid */
+
+#endif /* INSTRUMENTATION_H_ */
@@ -9,6 +9,7 @@
 
 #include <random>
 #include <iostream>
+#include <mutex>
 #include <boost/lexical_cast.hpp>
 #include <cuda_runtime.h>
 
@@ -17,6 +18,8 @@
 namespace libmolgrid {
     ///random engine used in libmolgrid
     extern std::default_random_engine random_engine;
+    ///held while drawing from random_engine, which libmolgrid may do from several threads
+    extern std::mutex random_engine_mutex;
 
     using cuda_float3 = ::float3; //in case "someone" has redefined float3
     enum LogLevel { INFO, WARNING, ERROR, DEBUG};
@@ -15,15 +15,55 @@
 #include <boost/lexical_cast.hpp>
 
 #include "libmolgrid/grid.h"
+#include "libmolgrid/instrumentation.h"
 
 
 namespace libmolgrid {
 
 
+/** \brief Enable or disable pooled memory for ManagedGrid.
+ * When pooling, host memory is page-locked so transfers can be asynchronous,
+ * and the host and device memory of freed grids is kept and reused by later
+ * grids instead of being returned with free/cudaFree. Grids that already exist
+ * keep the memory they were allocated with.
+ */
+void set_memory_pooling(bool pool);
+///return true if ManagedGrid memory is pooled
+bool get_memory_pooling();
+///free all unused memory held by the pools
+void release_memory_pools();
+
+///get a page-locked block of at least bytes, sets bytes to the block size; null if unavailable
+void *pooled_host_alloc(size_t& bytes);
+///get a device block of at least bytes on the current device, sets bytes to the block size; null if unavailable
+void *pooled_gpu_alloc(size_t& bytes, int& device);
+///events recorded on every stream that used the memory of a pooled grid
+struct StreamUses;
+/** \brief Record that work queued on stream uses pooled memory.
+ * @param[in,out] uses the streams that used the memory, allocated if null
+ * @param[in] stream stream the work was queued on
+ */
+void record_stream_use(StreamUses*& uses, cudaStream_t stream);
+/** \brief Return the blocks of a grid to the pools.
+ * The blocks are not reused until the work queued on the legacy default
+ * stream of device, and on every stream recorded in uses, is done.
+ * @param[in] host block from pooled_host_alloc, may be null
+ * @param[in] hostbytes size of host
+ * @param[in] gpu block from pooled_gpu_alloc, may be null
+ * @param[in] gpubytes size of gpu
+ * @param[in] device device of gpu, or that last used host; the current device if negative
+ * @param[in] uses streams that used the blocks, may be null, owned by the pools
+ */
+void pooled_free(void *host, size_t hostbytes, void *gpu, size_t gpubytes, int device, StreamUses *uses);
+
 template<typename Dtype>
 struct mgrid_buffer_data {
     Dtype *gpu_ptr;
     bool sent_to_gpu;
+    size_t host_pool_bytes; //size of pooled host block, zero if malloc'd
+    size_t gpu_pool_bytes; //size of pooled gpu block, zero if cudaMalloc'd
+    int gpu_device; //device of gpu memory, or to allocate it on; negative until chosen
+    StreamUses *streams; //streams that used pooled memory, null if none
 };
 
 /** \brief ManagedGrid base class */
@@ -53,25 +93,43 @@ class ManagedGridBase {
     // deallocate our special buffer memory, include gpu memory if present
     static void delete_buffer(void *ptr) {
       buffer_data *data = (buffer_data*)(ptr) - 1;
-      if(data->gpu_ptr != nullptr) {
-        //deallocate gpu
+      bool gpu_pooled = data->gpu_ptr != nullptr && data->gpu_pool_bytes;
+      bool host_pooled = data->host_pool_bytes; //data may be reused as soon as it is returned
+      if(data->gpu_ptr != nullptr && !gpu_pooled) {
+        //deallocate gpu, cudaFree waits for pending work
+        DeviceGuard guard(data->gpu_device);
         cudaFree(data->gpu_ptr);
       }
-      free(data);
+      if(gpu_pooled || host_pooled) {
+        //pooled blocks may still be used by queued work, so are only reused once it is done
+        pooled_free(host_pooled ? data : nullptr, data->host_pool_bytes,
+            gpu_pooled ? data->gpu_ptr : nullptr, data->gpu_pool_bytes, data->gpu_device, data->streams);
+      }
+      if(!host_pooled) free(data);
     }
     //allocate and set the cpu pointer (and grid) with space for sent_to_gpu bool, set the bool ptr location
     //does not initialize memory
     void alloc_and_set_cpu(size_t sz) {
       //put buffer data at start so know where it is on delete
-      void *buffer = malloc(sizeof(buffer_data)+sz*sizeof(Dtype));
-      Dtype *cpu_data = (Dtype*)((buffer_data*)buffer+1);
+      size_t bytes = sizeof(buffer_data)+sz*sizeof(Dtype);
+      size_t poolbytes = bytes;
+      void *buffer = get_memory_pooling() ? pooled_host_alloc(poolbytes) : nullptr;
+      if(!buffer) {
+        poolbytes = 0;
+        buffer = malloc(bytes);
+      }
 
       if(!buffer) throw std::runtime_error("Could not allocate "+itoa(sz*sizeof(Dtype))+" bytes of CPU memory in ManagedGrid");
+      Dtype *cpu_data = (Dtype*)((buffer_data*)buffer+1);
       cpu_ptr = std::shared_ptr<Dtype>(cpu_data, delete_buffer);
       cpu_grid.set_buffer(cpu_ptr.get());
       gpu_info = (buffer_data*)buffer;
       gpu_info->gpu_ptr = nullptr;
       gpu_info->sent_to_gpu = false;
+      gpu_info->host_pool_bytes = poolbytes;
+      gpu_info->gpu_pool_bytes = 0;
+      gpu_info->gpu_device = -1;
+      gpu_info->streams = nullptr;
     }
 
     //allocate and set gpu_ptr and grid, does not initialize memory, should not be called if memory is already allocated
@@ -81,11 +139,20 @@ class ManagedGridBase {
       if(gpu_info->gpu_ptr != nullptr) {
         throw std::runtime_error("Attempt to reallocate gpu memory in  ManagedGrid");
       }
-      //we are not actually using unified memory, but this make debugging easier?
-      cudaError_t err = cudaMalloc(&gpu_info->gpu_ptr,sz*sizeof(Dtype));
-      cudaGetLastError();
-      if(err != cudaSuccess) {
-        throw std::runtime_error("Could not allocate "+itoa(sz*sizeof(Dtype))+" bytes of GPU memory in ManagedGrid");
+      DeviceGuard guard(gpu_info->gpu_device);
+      size_t poolbytes = sz*sizeof(Dtype);
+      void *pooled = get_memory_pooling() ? pooled_gpu_alloc(poolbytes, gpu_info->gpu_device) : nullptr;
+      if(pooled) {
+        gpu_info->gpu_ptr = (Dtype*)pooled;
+        gpu_info->gpu_pool_bytes = poolbytes;
+      } else {
+        //we are not actually using unified memory, but this make debugging easier?
+        cudaError_t err = cudaMalloc(&gpu_info->gpu_ptr,sz*sizeof(Dtype));
+        cudaGetLastError();
+        if(err != cudaSuccess) {
+          throw std::runtime_error("Could not allocate "+itoa(sz*sizeof(Dtype))+" bytes of GPU memory in ManagedGrid");
+        }
+        gpu_info->gpu_device = DeviceGuard::current_device();
       }
       gpu_grid.set_buffer(gpu_info->gpu_ptr);
     }
@@ -100,7 +167,8 @@ class ManagedGridBase {
     }
 
     //helper for clone, allocate new memory and copies contents of current ptr into it
-    void clone_ptrs() {
+    //gpu memory is allocated on device, or the device of the current memory if negative
+    void clone_ptrs(int device = -1) {
       if(capacity == 0) {
         return;
       }
@@ -111,11 +179,16 @@ class ManagedGridBase {
       alloc_and_set_cpu(capacity);
       memcpy(cpu_ptr.get(), old.get(), sizeof(Dtype)*capacity);
       gpu_info->sent_to_gpu = oldgpu.sent_to_gpu;
+      gpu_info->gpu_device = device < 0 ? oldgpu.gpu_device : device;
 
       //if allocated, duplicate gpu, but only if it is active
       if(oldgpu.gpu_ptr && oldgpu.sent_to_gpu) {
         alloc_and_set_gpu(capacity);
-        LMG_CUDA_CHECK(cudaMemcpy(gpu_info->gpu_ptr, oldgpu.gpu_ptr, sizeof(Dtype)*capacity, cudaMemcpyDeviceToDevice));
+        if(gpu_info->gpu_device == oldgpu.gpu_device) {
+          LMG_CUDA_CHECK(cudaMemcpy(gpu_info->gpu_ptr, oldgpu.gpu_ptr, sizeof(Dtype)*capacity, cudaMemcpyDeviceToDevice));
+        } else {
+          LMG_CUDA_CHECK(cudaMemcpyPeer(gpu_info->gpu_ptr, gpu_info->gpu_device, oldgpu.gpu_ptr, oldgpu.gpu_device, sizeof(Dtype)*capacity));
+        }
       }
     }
   public:
@@ -262,6 +335,7 @@ class ManagedGridBase {
         return tmp;
       } else {
         ManagedGrid<Dtype, NumDims> tmp(sizes...);
+        if(gpu_info) tmp.gpu_info->gpu_device = gpu_info->gpu_device;
         if(size() > 0 && tmp.size() > 0) {
           if(ongpu()) tmp.togpu(); //allocate gpu memory
           copyTo(tmp);
@@ -282,29 +356,21 @@ class ManagedGridBase {
     cpu_grid_t& cpu() { tocpu(); return cpu_grid; }
 
     /** \brief Transfer data to GPU */
-    void togpu(bool dotransfer=true) const {
-      if(capacity == 0) return;
-      //check that memory is allocated - even if data is on gpu, may still need to set this mgrid's gpu_grid
-      if(gpu_grid.data() == nullptr) {
-        if(gpu_info->gpu_ptr == nullptr) {
-          alloc_and_set_gpu(capacity);
-        } //otherwise some other copy has already allocated memory, just need to set
-        size_t offset = cpu_grid.data() - cpu_ptr.get(); //might be subgrid
-          gpu_grid.set_buffer(gpu_info->gpu_ptr+offset);
-      }
-      if(oncpu() && dotransfer) {
-        LMG_CUDA_CHECK(cudaMemcpy(gpu_info->gpu_ptr,cpu_ptr.get(),capacity*sizeof(Dtype),cudaMemcpyHostToDevice));
-      }
-      if(gpu_info) gpu_info->sent_to_gpu = true;
-    }
+    void togpu(bool dotransfer=true) const { send_to_gpu(dotransfer, false, 0); }
+
+    /** \brief Transfer data to GPU asynchronously on stream.
+     * The host memory must not be modified until the stream is synchronized.
+     * The copy only overlaps other work if host memory is page-locked (see set_memory_pooling).
+     */
+    void togpu(cudaStream_t stream, bool dotransfer=true) const { send_to_gpu(dotransfer, true, stream); }
 
     /** \brief Transfer data to CPU.  If not dotransfer, data is not copied back. */
-    void tocpu(bool dotransfer=true) const {
-      if(ongpu() && capacity > 0 && dotransfer) {
-        LMG_CUDA_CHECK(cudaMemcpy(cpu_ptr.get(),gpu_info->gpu_ptr,capacity*sizeof(Dtype),cudaMemcpyDeviceToHost));
-      }
-      if(gpu_info) gpu_info->sent_to_gpu = false;
-    }
+    void tocpu(bool dotransfer=true) const { send_to_cpu(dotransfer, false, 0); }
+
+    /** \brief Transfer data to CPU asynchronously on stream.
+     * The host memory must not be accessed until the stream is synchronized.
+     */
+    void tocpu(cudaStream_t stream, bool dotransfer=true) const { send_to_cpu(dotransfer, true, stream); }
 
     /** \brief Return true if memory is currently on GPU */
     bool ongpu() const {
@@ -316,6 +382,26 @@ class ManagedGridBase {
     /** \brief Return true if memory is currently on CPU */
     bool oncpu() const { return gpu_info == nullptr || !gpu_info->sent_to_gpu; }
 
+    /** \brief Return true if another grid shares this grid's memory */
+    bool shared() const { return cpu_ptr.use_count() > 1; }
+
+    /** \brief Return the device GPU memory is allocated on, or will be allocated on.
+     * Negative if GPU memory will be allocated on whichever device is current.
+     */
+    int device() const { return gpu_info ? gpu_info->gpu_device : -1; }
+
+    /** \brief Allocate GPU memory on device instead of the current device.
+     * Transfers also run on this device.  Throws if GPU memory has already
+     * been allocated on a different device; use clone(device) to copy the grid instead.
+     */
+    void set_device(int device) {
+      if(gpu_info == nullptr)
+        throw std::runtime_error("Attempt to set device of empty ManagedGrid");
+      if(gpu_info->gpu_ptr != nullptr && gpu_info->gpu_device != device)
+        throw std::runtime_error("Attempt to change device of allocated gpu memory in ManagedGrid");
+      gpu_info->gpu_device = device;
+    }
+
 
     operator cpu_grid_t() const { return cpu(); }
     operator cpu_grid_t&() {return cpu(); }
@@ -331,7 +417,60 @@ class ManagedGridBase {
     bool operator==(const ManagedGridBase<Dtype, NumDims>& rhs) const {
       return cpu_ptr == rhs.cpu_ptr;
     }
+    /** \brief Record that work queued on stream uses this grid's memory.
+     * Pooled memory is not reused until the work queued on every recorded
+     * stream before the grid is freed is done. Asynchronous transfers record
+     * their stream; call this after queuing other work, such as a kernel
+     * given gpu(), on a stream that does not synchronize with the legacy
+     * default stream.
+     */
+    void record_stream(cudaStream_t stream) const {
+      if(gpu_info == nullptr || (!gpu_info->host_pool_bytes && !gpu_info->gpu_pool_bytes)) return;
+      record_stream_use(gpu_info->streams, stream);
+    }
+
   protected:
+
+    void send_to_gpu(bool dotransfer, bool async, cudaStream_t stream) const {
+      if(capacity == 0) return;
+      DeviceGuard guard(gpu_info->gpu_device);
+      //check that memory is allocated - even if data is on gpu, may still need to set this mgrid's gpu_grid
+      if(gpu_grid.data() == nullptr) {
+        if(gpu_info->gpu_ptr == nullptr) {
+          alloc_and_set_gpu(capacity);
+        } //otherwise some other copy has already allocated memory, just need to set
+        size_t offset = cpu_grid.data() - cpu_ptr.get(); //might be subgrid
+          gpu_grid.set_buffer(gpu_info->gpu_ptr+offset);
+      }
+      if(oncpu() && dotransfer) {
+        //the host time of an asynchronous copy is only its launch, so it is timed on the stream
+        if(async) {
+          KernelTimer timer(STAGE_HOST_TO_DEVICE, stream, capacity*sizeof(Dtype));
+          LMG_CUDA_CHECK(cudaMemcpyAsync(gpu_info->gpu_ptr,cpu_ptr.get(),capacity*sizeof(Dtype),cudaMemcpyHostToDevice,stream));
+          record_stream(stream);
+        } else {
+          StageTimer timer(STAGE_HOST_TO_DEVICE, capacity*sizeof(Dtype));
+          LMG_CUDA_CHECK(cudaMemcpy(gpu_info->gpu_ptr,cpu_ptr.get(),capacity*sizeof(Dtype),cudaMemcpyHostToDevice));
+        }
+      }
+      if(gpu_info) gpu_info->sent_to_gpu = true;
+    }
+
+    void send_to_cpu(bool dotransfer, bool async, cudaStream_t stream) const {
+      if(ongpu() && capacity > 0 && dotransfer) {
+        DeviceGuard guard(gpu_info->gpu_device);
+        if(async) {
+          KernelTimer timer(STAGE_DEVICE_TO_HOST, stream, capacity*sizeof(Dtype));
+          LMG_CUDA_CHECK(cudaMemcpyAsync(cpu_ptr.get(),gpu_info->gpu_ptr,capacity*sizeof(Dtype),cudaMemcpyDeviceToHost,stream));
+          record_stream(stream);
+        } else {
+          StageTimer timer(STAGE_DEVICE_TO_HOST, capacity*sizeof(Dtype));
+          LMG_CUDA_CHECK(cudaMemcpy(cpu_ptr.get(),gpu_info->gpu_ptr,capacity*sizeof(Dtype),cudaMemcpyDeviceToHost));
+        }
+      }
+      if(gpu_info) gpu_info->sent_to_gpu = false;
+    }
+
     // constructor used by operator[]
     friend ManagedGridBase<Dtype,NumDims-1>;
     explicit ManagedGridBase(const ManagedGridBase<Dtype,NumDims+1>& G, size_t i):
@@ -383,10 +522,12 @@ class ManagedGrid :  public ManagedGridBase<Dtype, NumDims> {
       return ManagedGrid<Dtype,NumDims-1>(*static_cast<const ManagedGridBase<Dtype, NumDims> *>(this), i);
     }
 
-    /** \brief Return a copy of this grid */
-    ManagedGrid<Dtype, NumDims> clone() const {
+    /** \brief Return a copy of this grid.
+     * GPU memory of the copy is on device, or the device of this grid if negative.
+     */
+    ManagedGrid<Dtype, NumDims> clone(int device = -1) const {
       ManagedGrid<Dtype, NumDims> ret(*this);
-      ret.clone_ptrs();
+      ret.clone_ptrs(device);
       return ret;
     }
   protected:
@@ -429,9 +570,9 @@ class ManagedGrid<Dtype, 1> : public ManagedGridBase<Dtype, 1> {
       return this->cpu_grid(a);
     }
 
-    ManagedGrid<Dtype, 1> clone() const {
+    ManagedGrid<Dtype, 1> clone(int device = -1) const {
       ManagedGrid<Dtype, 1> ret(*this);
-      ret.clone_ptrs();
+      ret.clone_ptrs(device);
       return ret;
     }
 
@@ -446,7 +587,9 @@ class ManagedGrid<Dtype, 1> : public ManagedGridBase<Dtype, 1> {
 
 #define EXPAND_MGRID_DEFINITIONS(Z,SIZE,_) \
 typedef ManagedGrid<float, SIZE> MGrid##SIZE##f; \
-typedef ManagedGrid<double, SIZE> MGrid##SIZE##d;
+typedef ManagedGrid<double, SIZE> MGrid##SIZE##d; \
+typedef ManagedGrid<__half, SIZE> MGrid##SIZE##h; \
+typedef ManagedGrid<__nv_bfloat16, SIZE> MGrid##SIZE##bf;
 
 
 BOOST_PP_REPEAT_FROM_TO(1,LIBMOLGRID_MAX_GRID_DIM, EXPAND_MGRID_DEFINITIONS, 0);
@@ -7,6 +7,8 @@
 
 #ifndef TRANSFORM_H_
 #define TRANSFORM_H_
+#include <cmath>
+#include <cstdint>
 #include <random>
 #include <stdexcept>
 
@@ -68,8 +70,9 @@ class Transform {
      * @param[out] output example with same dimensions
      * @param[in] dotranslate if false only a rotation around the origin is applied.
      * (This is for vector quantities such as gradients and normals).
+     * @param[in] stream CUDA stream used for coordinates that are on the GPU
      */
-    void forward(const Example& in, Example& out, bool dotranslate=true) const;
+    void forward(const Example& in, Example& out, bool dotranslate=true, cudaStream_t stream=0) const;
 
     // Docstring_Transform_forward_3
     /* \brief Apply 3D transformation to CoordinateSet.   It is safe to transform in-place
@@ -78,8 +81,9 @@ class Transform {
      * @param[out] output coords with same dimensions
      * @param[in] dotranslate if false only a rotation around the origin is applied.
      * (This is for vector quantities such as gradients and normals).
+     * @param[in] stream CUDA stream used if the coordinates are on the GPU
      */
-    void forward(const CoordinateSet& in, CoordinateSet& out, bool dotranslate=true) const;
+    void forward(const CoordinateSet& in, CoordinateSet& out, bool dotranslate=true, cudaStream_t stream=0) const;
 
     // Docstring_Transform_forward_4
     /* \brief Apply 3D transformation on GPU.  It is safe to transform a grid
@@ -89,9 +93,10 @@ class Transform {
      * @param[out] out Nx3 output grid (will be overwritten)
      * @param[in] dotranslate if false only a rotation around the origin is applied.
      * (This is for vector quantities such as gradients and normals).
+     * @param[in] stream CUDA stream to launch on
      */
     template <typename Dtype>
-    __host__ void forward(const Grid<Dtype, 2, true>& in, Grid<Dtype, 2, true>& out, bool dotranslate=true) const;
+    __host__ void forward(const Grid<Dtype, 2, true>& in, Grid<Dtype, 2, true>& out, bool dotranslate=true, cudaStream_t stream=0) const;
 
     // Docstring_Transform_backward_1
     /* \brief Apply inverse of 3D transformation on CPU.
@@ -107,9 +112,10 @@ class Transform {
      * @param[in] in Nx3 input grid
      * @param[out] out Nx3 output grid (will be overwritten)
      * @param[in] dotranslate if false only the inverse rotation is applied
+     * @param[in] stream CUDA stream to launch on
      */
     template <typename Dtype>
-    __host__ void backward(const Grid<Dtype, 2, true>& in, Grid<Dtype, 2, true>& out, bool dotranslate=true) const;
+    __host__ void backward(const Grid<Dtype, 2, true>& in, Grid<Dtype, 2, true>& out, bool dotranslate=true, cudaStream_t stream=0) const;
 
     const Quaternion& get_quaternion() const { return Q; }
     float3 get_rotation_center() const { return center; }
@@ -150,6 +156,86 @@ class Transform {
 };
 
 
+// Docstring_RandomTransforms
+/** \brief Counter based source of random transformations.
+ *
+ *  The transformation of an example is a function of only the seed and the
+ *  example's index, computed with the Philox4x32-10 generator, so it is the
+ *  same however, wherever and in whatever order it is generated, including in
+ *  GPU kernels, and generating it touches no shared state.  As with the random
+ *  Transform constructor, rotations are uniform over all orientations and
+ *  translations are uniform in +/- random_translation along each axis.
+ */
+struct RandomTransforms {
+    uint64_t seed = 0;
+    float random_translation = 0;
+    bool random_rotation = false;
+
+    RandomTransforms() {}
+    RandomTransforms(uint64_t s, float random_translate = 0.0, bool random_rotate = false)
+        : seed(s), random_translation(random_translate), random_rotation(random_rotate) {
+    }
+
+    /// Philox4x32-10 of counter (index, word) and key seed
+    CUDA_CALLABLE_MEMBER static void philox(uint64_t index, uint32_t word, uint64_t seed, uint32_t out[4]) {
+      uint32_t c0 = index, c1 = index >> 32, c2 = word, c3 = 0;
+      uint32_t k0 = seed, k1 = seed >> 32;
+      for(unsigned round = 0; round < 10; round++) {
+        uint64_t p0 = uint64_t(0xD2511F53) * c0;
+        uint64_t p1 = uint64_t(0xCD9E8D57) * c2;
+        c0 = uint32_t(p1 >> 32) ^ c1 ^ k0;
+        c1 = uint32_t(p1);
+        c2 = uint32_t(p0 >> 32) ^ c3 ^ k1;
+        c3 = uint32_t(p0);
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+      }
+      out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+    }
+
+    /// uniform in [0,1) from the top 24 bits of r
+    CUDA_CALLABLE_MEMBER static float uniform(uint32_t r) {
+      return (r >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // Docstring_RandomTransforms_sample
+    /* \brief Rotation and translation of example index.
+     * @param[in] index index of the example
+     * @param[out] Q rotation, the identity if random_rotation is false
+     * @param[out] translate translation
+     */
+    CUDA_CALLABLE_MEMBER void sample(uint64_t index, Quaternion& Q, float3& translate) const {
+      uint32_t r[4];
+      philox(index, 0, seed, r);
+      translate.x = (2 * uniform(r[0]) - 1) * random_translation;
+      translate.y = (2 * uniform(r[1]) - 1) * random_translation;
+      translate.z = (2 * uniform(r[2]) - 1) * random_translation;
+      Q = Quaternion();
+      if(random_rotation) {
+        float u1 = uniform(r[3]);
+        philox(index, 1, seed, r);
+        float u2 = uniform(r[0]);
+        float u3 = uniform(r[1]);
+        float sq1 = sqrtf(1 - u1);
+        float sqr = sqrtf(u1);
+        const float twopi = 6.283185307179586f;
+        Q = Quaternion(sq1 * sinf(twopi * u2), sq1 * cosf(twopi * u2), sqr * sinf(twopi * u3), sqr * cosf(twopi * u3));
+      }
+    }
+
+    // Docstring_RandomTransforms_get
+    /* \brief Transformation of example index about center.
+     * @param[in] center center of rotation
+     * @param[in] index index of the example
+     */
+    Transform get(float3 center, uint64_t index) const {
+      Quaternion Q;
+      float3 translate;
+      sample(index, Q, translate);
+      return Transform(Q, center, translate);
+    }
+};
+
 } /* namespace libmolgrid */
 
 #endif /* TRANSFORM_H_ */
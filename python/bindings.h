@@ -27,6 +27,8 @@
 
 extern bool python_gpu_enabled;
 bool init_numpy();
+//register python float conversions of __half and __nv_bfloat16 grid values
+void register_reduced_float_converters();
 
 //wrapper for float* since it isn't a native python type
 template <typename T>
@@ -58,10 +60,16 @@ void define_mgrid(const char* name);
 #define MAKE_GRIDS(Z, N, _) \
     MAKE_GRID(N,CUDA,f) \
     MAKE_GRID(N,CUDA,d) \
+    MAKE_GRID(N,CUDA,h) \
+    MAKE_GRID(N,CUDA,bf) \
     MAKE_GRID(N, ,f) \
     MAKE_GRID(N, ,d) \
+    MAKE_GRID(N, ,h) \
+    MAKE_GRID(N, ,bf) \
     MAKE_MGRID(N,f) \
-    MAKE_MGRID(N,d)
+    MAKE_MGRID(N,d) \
+    MAKE_MGRID(N,h) \
+    MAKE_MGRID(N,bf)
 
 #define MAKE_ALL_GRIDS() BOOST_PP_REPEAT_FROM_TO(1,LIBMOLGRID_MAX_GRID_DIM, MAKE_GRIDS, 0);
 MAKE_ALL_GRIDS()
@@ -27,6 +27,41 @@ bool init_numpy()
   return true;
 }
 
+//name of a grid element type, matches torch and numpy names (bfloat16 has no numpy type)
+template<typename T> const char* element_name() { return "unknown"; }
+template<> const char* element_name<float>() { return "float32"; }
+template<> const char* element_name<double>() { return "float64"; }
+template<> const char* element_name<__half>() { return "float16"; }
+template<> const char* element_name<__nv_bfloat16>() { return "bfloat16"; }
+
+//convert reduced precision grid values to and from python floats
+template<typename T>
+struct reduced_float_converter {
+    static PyObject* convert(const T& val) {
+      return PyFloat_FromDouble(float(val));
+    }
+
+    static void* convertible(PyObject *obj_ptr) {
+      return PyNumber_Check(obj_ptr) ? obj_ptr : nullptr;
+    }
+
+    static void construct(PyObject* obj_ptr, converter::rvalue_from_python_stage1_data* data) {
+      void* storage = ((converter::rvalue_from_python_storage<T>*)data)->storage.bytes;
+      new (storage) T(float(PyFloat_AsDouble(obj_ptr)));
+      data->convertible = storage;
+    }
+
+    reduced_float_converter() {
+      to_python_converter<T, reduced_float_converter<T> >();
+      converter::registry::push_back(&convertible, &construct, type_id<T>());
+    }
+};
+
+void register_reduced_float_converters() {
+  reduced_float_converter<__half>();
+  reduced_float_converter<__nv_bfloat16>();
+}
+
 //create a grid given the data ptr and dimensions
 template<typename GridType, std::size_t ... I>
 GridType grid_create(typename GridType::type *data, std::size_t *dims, std::index_sequence<I...>) {
@@ -82,10 +117,10 @@ struct Grid_from_python {
         void *dataptr;
         size_t shape[LIBMOLGRID_MAX_GRID_DIM];
         size_t ndim;
-        bool isdouble;
+        std::string dtype; //element_name of the element type
         bool isGPU;
 
-        tensor_info(): dataptr(nullptr), shape{0,}, ndim(0), isdouble(false), isGPU(false) {}
+        tensor_info(): dataptr(nullptr), shape{0,}, ndim(0), isGPU(false) {}
     };
     //return non-NULL pointer to data and fill out metadata if obj_ptr is torch tensor
     static bool is_torch_tensor(PyObject *obj_ptr, tensor_info& info) {
@@ -102,18 +137,17 @@ struct Grid_from_python {
           info.shape[i] = extract<size_t>(s[i]);
         }
 
-        if(typ == "torch.FloatTensor") {
-          info.isGPU = false;
-          info.isdouble = false;
-        } else if(typ == "torch.DoubleTensor") {
-          info.isGPU = false;
-          info.isdouble = true;
-        } else if(typ == "torch.cuda.FloatTensor") {
-          info.isGPU = true;
-          info.isdouble = false;
-        } else if(typ == "torch.cuda.DoubleTensor") {
-          info.isGPU = true;
-          info.isdouble = true;
+        const std::string gpuprefix = "torch.cuda.";
+        info.isGPU = typ.compare(0, gpuprefix.size(), gpuprefix) == 0;
+        std::string base = typ.substr(info.isGPU ? gpuprefix.size() : std::string("torch.").size());
+        if(base == "FloatTensor") {
+          info.dtype = "float32";
+        } else if(base == "DoubleTensor") {
+          info.dtype = "float64";
+        } else if(base == "HalfTensor") {
+          info.dtype = "float16";
+        } else if(base == "BFloat16Tensor") {
+          info.dtype = "bfloat16";
         } else {
           return false; //don't recognize
         }
@@ -143,7 +177,7 @@ struct Grid_from_python {
         else
           info.dataptr = mg.cpu().data();
         info.ndim = Grid_t::N;
-        info.isdouble = std::is_same<typename Grid_t::type,double>::value;
+        info.dtype = element_name<typename Grid_t::type>();
         info.isGPU = Grid_t::GPU;
 
         for(unsigned i = 0; i < info.ndim; i++) {
@@ -155,7 +189,7 @@ struct Grid_from_python {
         //check correct types
 
         if(Grid_t::N == info.ndim && Grid_t::GPU == info.isGPU &&
-            std::is_same<typename Grid_t::type,double>::value == info.isdouble) {
+            info.dtype == element_name<typename Grid_t::type>()) {
           return new tensor_info(info);
         }
       } else if(HasNumpy && !Grid_t::GPU && PyArray_Check(obj_ptr)) {
@@ -169,7 +203,6 @@ struct Grid_from_python {
           auto typ = PyArray_TYPE(array);
 
           info.dataptr = PyArray_DATA(array);
-          info.isdouble = (typ == NPY_DOUBLE);
           info.isGPU = false; //numpy always cpu
 
           auto npdims = PyArray_DIMS(array);
@@ -181,6 +214,8 @@ struct Grid_from_python {
             return new tensor_info(info); //should be fine
           } else if(typ == NPY_DOUBLE && std::is_same<typename Grid_t::type,double>::value) {
             return new tensor_info(info);
+          } else if(typ == NPY_HALF && std::is_same<typename Grid_t::type,__half>::value) {
+            return new tensor_info(info);
           }
         }
       }
@@ -231,9 +266,8 @@ void add_grid_members(class_<GridType>& C) {
       .def("copyTo", +[](const GridType& self, typename GridType::gpu_grid_t dest) { return self.copyTo(dest);})
       .def("copyFrom", static_cast<size_t (GridType::*)(const typename GridType::cpu_grid_t&)>(&GridType::copyFrom))
       .def("copyFrom", static_cast<size_t (GridType::*)(const typename GridType::gpu_grid_t&)>(&GridType::copyFrom))
-      .def("fill_zero", &GridType::fill_zero)
-      .def("type", +[](const GridType& g){
-              return std::is_same<typename GridType::type,float>::value ? "float32" : std::is_same<typename GridType::type,double>::value  ? "float64" : "unknown";});
+      .def("fill_zero", static_cast<void (GridType::*)()>(&GridType::fill_zero))
+      .def("type", +[](const GridType& g){ return element_name<typename GridType::type>();});
 
 }
 
@@ -260,9 +294,12 @@ void define_mgrid(const char* name) {
   add_grid_members(C);
   C.def("cpu",static_cast<const typename GridType::cpu_grid_t& (GridType::*)() const>(&GridType::cpu), return_value_policy<copy_const_reference>())
       .def("gpu",static_cast<const typename GridType::gpu_grid_t& (GridType::*)() const>(&GridType::gpu), return_value_policy<copy_const_reference>())
-      .def("clone", &GridType::clone)
+      .def("clone", +[](const GridType& self, int device) { return self.clone(device); }, (arg("device")=-1),
+          "Return a copy of the grid, with gpu memory on device (default the device of this grid).")
       .def("ongpu", &GridType::ongpu)
       .def("oncpu", &GridType::oncpu)
+      .def("device", &GridType::device, "Device gpu memory is allocated on, negative if not yet chosen.")
+      .def("set_device", &GridType::set_device, "Allocate gpu memory on the given device instead of the current device.")
       .def("copyTo", +[](const GridType& self, GridType dest) {return self.copyTo(dest);})
       .def("copyFrom", static_cast<size_t (GridType::*)(const typename GridType::base_t&)>(&GridType::copyFrom))
       ;
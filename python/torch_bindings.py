@@ -18,19 +18,32 @@ def tensor_as_grid(t):
     elif isinstance(t,torch.cuda.DoubleTensor):
         gname += 'dCUDA'
         return getattr(mg,gname)(mg.todoubleptr(t.data_ptr()),*t.shape)    
+    elif isinstance(t,torch.cuda.HalfTensor):
+        gname += 'hCUDA'
+        return getattr(mg,gname)(mg.tohalfptr(t.data_ptr()),*t.shape)
+    elif isinstance(t,torch.cuda.BFloat16Tensor):
+        gname += 'bfCUDA'
+        return getattr(mg,gname)(mg.tobfloat16ptr(t.data_ptr()),*t.shape)
+    elif isinstance(t,torch.HalfTensor):
+        gname += 'h'
+        return getattr(mg,gname)(mg.tohalfptr(t.data_ptr()),*t.shape)
+    elif isinstance(t,torch.BFloat16Tensor):
+        gname += 'bf'
+        return getattr(mg,gname)(mg.tobfloat16ptr(t.data_ptr()),*t.shape)
     else:
         raise ValueError('Tensor base type %s not supported as grid type.'%str(t.dtype))
     
     return t
 
 #extend grid maker to create pytorch Tensor
-def make_grid_tensor(gridmaker, center, c):
-    '''Create appropriately sized pytorch tensor of grid densities.  set_gpu_enabled can be used to control if result is located on the cpu or gpu'''
+def make_grid_tensor(gridmaker, center, c, dtype=torch.float32):
+    '''Create appropriately sized pytorch tensor of grid densities.  set_gpu_enabled can be used to control if result is located on the cpu or gpu.
+    torch.float16 and torch.bfloat16 are only supported on the gpu.'''
     dims = gridmaker.grid_dimensions(c.max_type) # this should be grid_dims or get_grid_dims
     if mg.get_gpu_enabled():
-        t = torch.zeros(dims, dtype=torch.float32, device='cuda:0')
+        t = torch.zeros(dims, dtype=dtype, device='cuda:0')
     else:
-        t = torch.zeros(dims, dtype=torch.float32)
+        t = torch.zeros(dims, dtype=dtype)
     gridmaker.forward(center, c, t)
     return t 
 
@@ -40,13 +53,13 @@ class Coords2GridFunction(torch.autograd.Function):
     '''Layer for converting from coordinate and type tensors to a molecular grid'''
     
     @staticmethod
-    def forward(ctx, gmaker, center, coords, types, radii):
-        '''coords are Nx3, types are NxT, radii are N'''
+    def forward(ctx, gmaker, center, coords, types, radii, dtype=None):
+        '''coords are Nx3, types are NxT, radii are N, the grid has type dtype (default coords.dtype)'''
         ctx.save_for_backward(coords, types, radii)
         ctx.gmaker = gmaker
         ctx.center = center
         shape = gmaker.grid_dimensions(types.shape[1]) #ntypes == nchannels
-        output = torch.empty(*shape,dtype=coords.dtype,device=coords.device)
+        output = torch.empty(*shape,dtype=dtype or coords.dtype,device=coords.device)
         gmaker.forward(center, coords, types, radii, output)
         return output
         
@@ -58,16 +71,17 @@ class Coords2GridFunction(torch.autograd.Function):
         center = ctx.center
         grad_coords = torch.empty(*coords.shape,dtype=coords.dtype,device=coords.device)
         grad_types = torch.empty(*types.shape,dtype=types.dtype,device=types.device)
-        #radii are fixed
+        #radii are fixed, the gradient is always computed at the precision of the coordinates
+        grid_gradient = grid_gradient.to(coords.dtype).contiguous()
         gmaker.backward(center, coords, types, radii, grid_gradient, grad_coords, grad_types)
-        return None, None, grad_coords, grad_types, None
+        return None, None, grad_coords, grad_types, None, None
         
 class BatchedCoords2GridFunction(torch.autograd.Function):
     '''Layer for converting from coordinate and type tensors to a molecular grid using batched input'''
     
     @staticmethod
-    def forward(ctx, gmaker, center, coords, types, radii):
-        '''coords are Nx3, types are NxT, radii are N'''
+    def forward(ctx, gmaker, center, coords, types, radii, dtype=None):
+        '''coords are BxNx3, types are BxNxT, radii are BxN, the grid has type dtype (default coords.dtype)'''
         ctx.save_for_backward(coords, types, radii)
         ctx.gmaker = gmaker
         ctx.center = center
@@ -75,7 +89,7 @@ class BatchedCoords2GridFunction(torch.autograd.Function):
         if batch_size != types.shape[0] or batch_size != radii.shape[0]:
             raise RuntimeError("Inconsistent batch sizes in Coords2Grid inputs")
         shape = gmaker.grid_dimensions(types.shape[2]) #ntypes == nchannels
-        output = torch.empty(batch_size,*shape,dtype=coords.dtype,device=coords.device)
+        output = torch.empty(batch_size,*shape,dtype=dtype or coords.dtype,device=coords.device)
         for i in range(batch_size):
             gmaker.forward(center, coords[i], types[i], radii[i], output[i])
         return output
@@ -88,19 +102,20 @@ class BatchedCoords2GridFunction(torch.autograd.Function):
         center = ctx.center
         grad_coords = torch.empty(*coords.shape,dtype=coords.dtype,device=coords.device)
         grad_types = torch.empty(*types.shape,dtype=types.dtype,device=types.device)
-        #radii are fixed
-        batch_size = coords.shape[0]
-        for i in range(batch_size):
-            gmaker.backward(center, coords[i], types[i], radii[i], grid_gradient[i], grad_coords[i], grad_types[i])
-        return None, None, grad_coords, grad_types, None
+        #radii are fixed, all examples are handled by a single batched call at the precision of the coordinates
+        gmaker.backward(center, coords, types, radii, grid_gradient.to(coords.dtype).contiguous(), grad_coords, grad_types)
+        return None, None, grad_coords, grad_types, None, None
             
 class Coords2Grid(torch.nn.Module):
-    def __init__(self, gmaker, center=(0,0,0)):
+    def __init__(self, gmaker, center=(0,0,0), dtype=None):
         '''Convert coordinates/types/radii to a grid using the provided
-        GridMaker and grid center'''
+        GridMaker and grid center.  The grid has type dtype, which defaults
+        to the type of the coordinates.  torch.float16 or torch.bfloat16 grids
+        are written directly on the gpu for mixed precision training.'''
         super(Coords2Grid, self).__init__()
         self.gmaker = gmaker
         self.center = center
+        self.dtype = dtype
         
     def forward(self, coords, types, radii):
         if not coords.is_contiguous():
@@ -110,9 +125,9 @@ class Coords2Grid(torch.nn.Module):
         if not radii.is_contiguous():
             radii == radii.clone()
         if len(coords.shape) == 3 and len(types.shape) == 3 and len(radii.shape) == 2: #batched
-            return BatchedCoords2GridFunction.apply(self.gmaker, self.center, coords, types, radii)
+            return BatchedCoords2GridFunction.apply(self.gmaker, self.center, coords, types, radii, self.dtype)
         elif len(coords.shape) == 2 and len(types.shape) == 2 and len(radii.shape) == 1:
-            return Coords2GridFunction.apply(self.gmaker, self.center, coords, types, radii)
+            return Coords2GridFunction.apply(self.gmaker, self.center, coords, types, radii, self.dtype)
         else:
             raise RuntimeError("Invalid input dimensions in forward of Coords2Grid")
     
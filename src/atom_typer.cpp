@@ -11,6 +11,7 @@
 #include <openbabel/obiter.h>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
+#include <algorithm>
 
 #if (OB_VERSION >= OB_VERSION_CHECK(2,4,90))
 # include <openbabel/elements.h>
@@ -28,6 +29,31 @@ using namespace std;
 
 namespace libmolgrid {
 
+/**************  AtomTyper  ********************/
+
+void AtomTyper::type_molecule(OpenBabel::OBMol& mol, std::vector<int>& types, std::vector<float>& radii) const {
+  types.resize(mol.NumAtoms());
+  radii.resize(mol.NumAtoms());
+  FOR_ATOMS_OF_MOL(a, mol) {
+    unsigned i = a->GetIdx() - 1;
+    auto type_rad = get_atom_type_index(&*a);
+    types[i] = type_rad.first;
+    radii[i] = type_rad.second;
+  }
+}
+
+void AtomTyper::type_molecule(OpenBabel::OBMol& mol, std::vector<float>& type_vectors, std::vector<float>& radii) const {
+  unsigned nt = num_types();
+  type_vectors.assign(mol.NumAtoms() * nt, 0);
+  radii.resize(mol.NumAtoms());
+  vector<float> vec;
+  FOR_ATOMS_OF_MOL(a, mol) {
+    unsigned i = a->GetIdx() - 1;
+    radii[i] = get_atom_type_vector(&*a, vec);
+    std::copy(vec.begin(), vec.begin() + std::min<size_t>(vec.size(), nt), type_vectors.begin() + i * nt);
+  }
+}
+
 /**************  GninaIndexTyper  ********************/
 
 const GninaIndexTyper::info GninaIndexTyper::default_data[GninaIndexTyper::NumTypes] = { //el, ad, xs
@@ -76,41 +102,52 @@ std::string GninaIndexTyper::gnina_type_name(int t) {
 }
 
 
-///return type index and radius of a
-std::pair<int,float> GninaIndexTyper::get_atom_type_index(OpenBabel::OBAtom* a) const {
+GninaIndexTyper::GninaIndexTyper(bool usec, const info *d): use_covalent(usec), data(d) {
+  //every combination of element, alternate name and bonding
+  type_table.resize(table_elements * 2 * 4);
+  for(unsigned anum = 0; anum < table_elements; anum++) {
+    for(unsigned alt = 0; alt < 2; alt++) {
+      for(unsigned bonding = 0; bonding < 4; bonding++) {
+        type_table[(anum * 2 + alt) * 4 + bonding] = resolve_type(anum, alt, bonding);
+      }
+    }
+  }
+}
+
+//bonding flags contributed by a neighbor of element anum
+static inline unsigned neighbor_bonding(unsigned anum) {
+  if (anum == 1)
+    return 1; //bonded to hydrogen
+  else if (anum != 6)
+    return 2; //hetero anything that is not hydrogen and not carbon
+  return 0;
+}
 
+int GninaIndexTyper::resolve_type(unsigned anum, bool alternate, unsigned bonding) const {
   //this function is more convoluted than it needs to be for historical reasons
   //and a general fear of breaking backwards compatibility
-  bool Hbonded = false;
-  bool heteroBonded = false;
-
-
-  FOR_NBORS_OF_ATOM(neigh, a){
-    if (neigh->GetAtomicNum() == 1)
-      Hbonded = true;
-    else if (neigh->GetAtomicNum() != 6)
-      heteroBonded = true; //hetero anything that is not hydrogen and not carbon
-  }
+  bool Hbonded = bonding & 1;
+  bool heteroBonded = bonding & 2;
 
-  const char *element_name = GET_SYMBOL(a->GetAtomicNum());
+  const char *element_name = GET_SYMBOL(anum);
   std::string ename(element_name);
 
   //massage the element name in some cases
-  switch(a->GetAtomicNum()) {
+  switch(anum) {
   case 1:
-    ename =  a->IsPolarHydrogen() ? "HD" : "H";
+    ename = alternate ? "HD" : "H";
     break;
   case 6:
-    if(a->IsAromatic()) ename = "A";
+    if(alternate) ename = "A";
     break;
   case 7:
-    if(a->IsHbondAcceptor()) ename = "NA";
+    if(alternate) ename = "NA";
     break;
   case 8:
     ename = "OA";
     break;
   case 16:
-    if(a->IsHbondAcceptor()) ename = "SA";
+    if(alternate) ename = "SA";
     break;
   case 34:
     ename = "S"; //historically selenium is treated as sulfur  ¯\_(ツ)_/¯
@@ -154,13 +191,65 @@ std::pair<int,float> GninaIndexTyper::get_atom_type_index(OpenBabel::OBAtom* a)
     ret = Hbonded ? OxygenXSDonorAcceptor : OxygenXSAcceptor;
     break;
   }
+  return ret;
+}
+
+int GninaIndexTyper::atom_type(OpenBabel::OBAtom* a, unsigned bonding) const {
+  unsigned anum = a->GetAtomicNum();
+  //only query perception for the elements whose name depends on it
+  bool alternate = false;
+  switch(anum) {
+  case 1:
+    alternate = a->IsPolarHydrogen();
+    break;
+  case 6:
+    alternate = a->IsAromatic();
+    break;
+  case 7:
+  case 16:
+    alternate = a->IsHbondAcceptor();
+    break;
+  }
+  if(anum < table_elements) {
+    return type_table[(anum * 2 + alternate) * 4 + bonding];
+  }
+  return resolve_type(anum, alternate, bonding);
+}
+
+///return type index and radius of a
+std::pair<int,float> GninaIndexTyper::get_atom_type_index(OpenBabel::OBAtom* a) const {
+  unsigned bonding = 0;
+  FOR_NBORS_OF_ATOM(neigh, a){
+    bonding |= neighbor_bonding(neigh->GetAtomicNum());
+  }
 
+  int ret = atom_type(a, bonding);
   if(use_covalent) {
     return make_pair(ret, data[ret].covalent_radius);
   } else {
     return make_pair(ret, data[ret].xs_radius);
   }
+}
+
+void GninaIndexTyper::type_molecule(OpenBabel::OBMol& mol, std::vector<int>& types, std::vector<float>& radii) const {
+  unsigned n = mol.NumAtoms();
+  //classify the neighbors of every atom in a single pass over the bonds
+  vector<unsigned char> bonding(n, 0);
+  FOR_BONDS_OF_MOL(b, mol) {
+    OBAtom *begin = b->GetBeginAtom();
+    OBAtom *end = b->GetEndAtom();
+    bonding[begin->GetIdx() - 1] |= neighbor_bonding(end->GetAtomicNum());
+    bonding[end->GetIdx() - 1] |= neighbor_bonding(begin->GetAtomicNum());
+  }
 
+  types.resize(n);
+  radii.resize(n);
+  FOR_ATOMS_OF_MOL(a, mol) {
+    unsigned i = a->GetIdx() - 1;
+    int t = atom_type(&*a, bonding[i]);
+    types[i] = t;
+    radii[i] = use_covalent ? data[t].covalent_radius : data[t].xs_radius;
+  }
 }
 
 //look up radius for passed type
@@ -299,83 +388,30 @@ unsigned GninaVectorTyper::num_types() const {
   return NumTypes;
 }
 
-///return type index of a
-float GninaVectorTyper::get_atom_type_vector(OpenBabel::OBAtom* a, std::vector<float>& typ) const {
-  typ.assign(NumTypes, 0);
-  auto t_r = ityper.get_atom_type_index(a);
-  int t = t_r.first;
-  float radius = t_r.second;
-
-  int elemtyp = 0;
-  switch (t) { //convert to element index
-  case GninaIndexTyper::Hydrogen:
-  case GninaIndexTyper::PolarHydrogen:
-    elemtyp = Hydrogen;
-    break;
-  case GninaIndexTyper::AliphaticCarbonXSHydrophobe:
-  case GninaIndexTyper::AliphaticCarbonXSNonHydrophobe:
-  case GninaIndexTyper::AromaticCarbonXSHydrophobe:
-  case GninaIndexTyper::AromaticCarbonXSNonHydrophobe:
-    elemtyp = Carbon;
-    break;
-
-  case GninaIndexTyper::Nitrogen:
-  case GninaIndexTyper::NitrogenXSDonor:
-  case GninaIndexTyper::NitrogenXSDonorAcceptor:
-  case GninaIndexTyper::NitrogenXSAcceptor:
-    elemtyp = Nitrogen;
-    break;
-  case GninaIndexTyper::Oxygen:
-  case GninaIndexTyper::OxygenXSDonor:
-  case GninaIndexTyper::OxygenXSDonorAcceptor:
-  case GninaIndexTyper::OxygenXSAcceptor:
-    elemtyp = Oxygen;
-    break;
-  case GninaIndexTyper::Sulfur:
-  case GninaIndexTyper::SulfurAcceptor:
-    elemtyp = Sulfur;
-    break;
-  case GninaIndexTyper::Phosphorus:
-    elemtyp = Phosphorus;
-    break;
-  case GninaIndexTyper::Fluorine:
-    elemtyp = Fluorine;
-    break;
-  case GninaIndexTyper::Chlorine:
-    elemtyp = Chlorine;
-    break;
-  case GninaIndexTyper::Bromine:
-    elemtyp = Bromine;
-    break;
-  case GninaIndexTyper::Iodine:
-    elemtyp = Iodine;
-    break;
-  case GninaIndexTyper::Magnesium:
-    elemtyp = Magnesium;
-    break;
-  case GninaIndexTyper::Manganese:
-    elemtyp = Manganese;
-    break;
-  case GninaIndexTyper::Zinc:
-    elemtyp = Zinc;
-    break;
-  case GninaIndexTyper::Calcium:
-    elemtyp = Calcium;
-    break;
-  case GninaIndexTyper::Iron:
-    elemtyp = Iron;
-    break;
-  case GninaIndexTyper::GenericMetal:
-    elemtyp = GenericAtom;
-    break;
-  case GninaIndexTyper::Boron:
-    elemtyp = Boron;
-    break;
-  default:
-    elemtyp = GenericAtom;
-  }
+//element of each gnina type, indexed by GninaIndexTyper::type
+static const int gnina_type_element[GninaIndexTyper::NumTypes] = {
+    GninaVectorTyper::Hydrogen, GninaVectorTyper::Hydrogen, //Hydrogen, PolarHydrogen
+    GninaVectorTyper::Carbon, GninaVectorTyper::Carbon, GninaVectorTyper::Carbon, GninaVectorTyper::Carbon,
+    GninaVectorTyper::Nitrogen, GninaVectorTyper::Nitrogen, GninaVectorTyper::Nitrogen, GninaVectorTyper::Nitrogen,
+    GninaVectorTyper::Oxygen, GninaVectorTyper::Oxygen, GninaVectorTyper::Oxygen, GninaVectorTyper::Oxygen,
+    GninaVectorTyper::Sulfur, GninaVectorTyper::Sulfur, //Sulfur, SulfurAcceptor
+    GninaVectorTyper::Phosphorus,
+    GninaVectorTyper::Fluorine,
+    GninaVectorTyper::Chlorine,
+    GninaVectorTyper::Bromine,
+    GninaVectorTyper::Iodine,
+    GninaVectorTyper::Magnesium,
+    GninaVectorTyper::Manganese,
+    GninaVectorTyper::Zinc,
+    GninaVectorTyper::Calcium,
+    GninaVectorTyper::Iron,
+    GninaVectorTyper::GenericAtom, //GenericMetal
+    GninaVectorTyper::Boron
+};
 
+void GninaVectorTyper::set_type_vector(int t, OpenBabel::OBAtom* a, float *typ) const {
   //set one-hot element
+  int elemtyp = (t >= 0 && t < GninaIndexTyper::NumTypes) ? gnina_type_element[t] : GenericAtom;
   typ[elemtyp] = 1.0;
   //set properties
   const GninaIndexTyper::info& info = ityper.get_info(t);
@@ -388,7 +424,24 @@ float GninaVectorTyper::get_atom_type_vector(OpenBabel::OBAtom* a, std::vector<f
   typ[AD_heteroatom] = info.ad_heteroatom;
   typ[OB_partialcharge] = a->GetPartialCharge();
   typ[Aromatic] = a->IsAromatic();
-  return radius;
+}
+
+///return type index of a
+float GninaVectorTyper::get_atom_type_vector(OpenBabel::OBAtom* a, std::vector<float>& typ) const {
+  typ.assign(NumTypes, 0);
+  auto t_r = ityper.get_atom_type_index(a);
+  set_type_vector(t_r.first, a, typ.data());
+  return t_r.second;
+}
+
+void GninaVectorTyper::type_molecule(OpenBabel::OBMol& mol, std::vector<float>& type_vectors, std::vector<float>& radii) const {
+  vector<int> types;
+  ityper.type_molecule(mol, types, radii);
+  type_vectors.assign(types.size() * NumTypes, 0);
+  FOR_ATOMS_OF_MOL(a, mol) {
+    unsigned i = a->GetIdx() - 1;
+    set_type_vector(types[i], &*a, &type_vectors[i * NumTypes]);
+  }
 }
 
 ///return radii of types
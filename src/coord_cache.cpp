@@ -6,12 +6,22 @@
  */
 
 #include "libmolgrid/coord_cache.h"
+#include "libmolgrid/exampleref_providers.h"
+#include "libmolgrid/instrumentation.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem/path.hpp>
 #include <boost/filesystem.hpp>
 #include <openbabel/obconversion.h>
+#include <openbabel/obiter.h>
 #include <cuda_runtime.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <atomic>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
 
 
 namespace libmolgrid {
@@ -21,10 +31,68 @@ using namespace OpenBabel;
 
 unsigned do_not_optimize_away;
 
+//openbabel keeps global state during parsing and perception (e.g. aromaticity),
+//so molecules are read and typed one at a time
+static mutex openbabel_mutex;
+
+//regions of a molcache that have been read ahead, one per block of a shuffle window
+struct CoordCache::Readahead {
+  size_t bytes;
+  mutex mtx;
+  vector<size_t> recent; //page aligned region starts, least recent at next
+  unsigned next = 0;
+
+  Readahead(size_t b, unsigned window): bytes(b), recent(max(window, 1U), SIZE_MAX) {}
+
+  //ask the kernel to read the region after offset unless it was recently requested
+  void advise(const boost::iostreams::mapped_file_source& map, size_t offset) {
+    lock_guard<mutex> lock(mtx);
+    for(size_t r : recent) {
+      if(r != SIZE_MAX && offset >= r && offset - r < bytes) return;
+    }
+    static const size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = offset / page * page;
+    size_t len = min(bytes + offset - start, map.size() - start);
+    madvise(const_cast<char*>(map.data()) + start, len, MADV_WILLNEED);
+    recent[next] = start;
+    next = (next + 1) % recent.size();
+  }
+};
+
+//background threads having the kernel read ranges of a molcache, joined before the map is closed
+struct CoordCache::Prefetcher {
+  boost::iostreams::mapped_file_source map;
+  atomic<bool> stop;
+  mutex mtx;
+  vector<thread> threads;
+
+  explicit Prefetcher(const boost::iostreams::mapped_file_source& m): map(m), stop(false) {}
+  ~Prefetcher() {
+    stop = true;
+    for(thread& t : threads) t.join();
+  }
+
+  void start(const vector<pair<size_t, size_t> >& ranges) {
+    lock_guard<mutex> lock(mtx);
+    threads.emplace_back([this, ranges]() {
+      static const size_t page = sysconf(_SC_PAGESIZE);
+      const size_t chunk = 64 << 20; //so the first structures are available quickly
+      char *data = const_cast<char*>(map.data());
+      for(const auto& r : ranges) {
+        for(size_t pos = r.first / page * page; pos < r.second; pos += chunk) {
+          if(stop) return;
+          madvise(data + pos, min(chunk, r.second - pos), MADV_WILLNEED);
+        }
+      }
+    });
+  }
+};
+
 //read in molcache if present
 CoordCache::CoordCache(std::shared_ptr<AtomTyper> t, const ExampleProviderSettings& settings,
     const std::string& mc): typer(t), data_root(settings.data_root), molcache(mc),
-        use_cache(settings.cache_structs), addh(settings.add_hydrogens), make_vector_types(settings.make_vector_types) {
+        addh(settings.add_hydrogens), make_vector_types(settings.make_vector_types) {
+  if(settings.cache_structs) store = AtomStore::shared(addh, settings.cache_bytes);
   if(molcache.length() > 0) {
     static_assert(sizeof(size_t) == 8, "size_t must be 8 bytes");
 
@@ -62,113 +130,604 @@ CoordCache::CoordCache(std::shared_ptr<AtomTyper> t, const ExampleProviderSettin
       offsets[string_cache.get(mname)] = offset;
     }
 
-    //prefetch into file cache
-    unsigned sum = 0;
-    for(unsigned i = 0, n = cache_map.size(); i < n; i += 1024) {
-      sum += cache_map.data()[i];
+    char *map_start = const_cast<char*>(cache_map.data());
+    if(settings.molcache_huge_pages) {
+#ifdef MADV_HUGEPAGE
+      madvise(map_start, cache_map.size(), MADV_HUGEPAGE); //advisory, unsupported kernels or filesystems ignore it
+#endif
+    }
+    if(settings.molcache_readahead > 0) {
+      //structures are read ahead as they are used, so the kernel shouldn't guess
+      readahead = std::make_shared<Readahead>(settings.molcache_readahead, settings.shuffle_window);
+      madvise(map_start, cache_map.size(), MADV_RANDOM);
+    }
+
+    const string& policy = settings.molcache_prefetch;
+    if(policy == "all") {
+      //prefetch into file cache
+      unsigned sum = 0;
+      for(size_t i = 0, n = cache_map.size(); i < n; i += 1024) {
+        sum += cache_map.data()[i];
+      }
+      do_not_optimize_away = sum;
+    } else if(policy == "background") {
+      prefetcher = std::make_shared<Prefetcher>(cache_map);
+      prefetch_ranges({make_pair(size_t(0), cache_map.size())});
+    } else if(policy == "referenced") {
+      prefetcher = std::make_shared<Prefetcher>(cache_map);
+      prefetch_referenced = true;
+    } else if(policy != "none") {
+      throw invalid_argument("Invalid molcache_prefetch "+policy+", must be all, background, referenced or none");
+    }
+
+    //molcache types are gnina types, so the typer can be applied once per type up front
+    if(!typer->is_vector_typer()) {
+      try {
+        for(int t = 0; t < GninaIndexTyper::NumTypes; t++) {
+          molcache_types.push_back(typer->get_int_type(t));
+        }
+      } catch(std::exception& e) {
+        molcache_types.clear(); //leave any error to be reported when the molcache is used
+      }
     }
-    do_not_optimize_away = sum;
   }
 
 }
 
-//set coords using the cache
-void CoordCache::set_coords(const char *fname, CoordinateSet& coord) {
+namespace {
+//atom record of molcache2 and gninatypes files
+struct info {
+  float x,y,z;
+  int type;
+};
+}
 
-  struct info {
-    float x,y,z;
-    int type;
-  };
+void CoordCache::set_molcache_coords(const char *data, CoordinateSet& coord) const {
+  unsigned natoms = *(unsigned*)data;
+  const info *atoms = (const info*)(data+sizeof(unsigned));
 
+  if(typer->is_vector_typer())
+    throw invalid_argument("Vector typer used with molcache files");
 
-  if(offsets.count(fname)) {
-    size_t off = offsets[fname];
-    const char *data = cache_map.data()+off;
-    unsigned natoms = *(unsigned*)data;
-    info *atoms = (info*)(data+sizeof(unsigned));
+  //size for every atom, then trim to the typed atoms; resized only allocates if capacity is exceeded
+  coord.drop_shared(); //don't overwrite another set's memory
+  coord.coords = coord.coords.resized(natoms, 3);
+  coord.type_index = coord.type_index.resized(natoms);
+  coord.radii = coord.radii.resized(natoms);
+  coord.type_vector = MGrid2f();
+  //contents are about to be overwritten, so don't copy back from the gpu
+  coord.coords.tocpu(false); coord.type_index.tocpu(false); coord.radii.tocpu(false);
+  float *c = coord.coords.cpu().data();
+  float *t = coord.type_index.cpu().data();
+  float *r = coord.radii.cpu().data();
 
-    if(typer->is_vector_typer())
-      throw invalid_argument("Vector typer used with molcache files");
+  unsigned ntypes = molcache_types.size();
+  unsigned n = 0;
+  for(unsigned i = 0; i < natoms; i++)
+  {
+    const info& atom = atoms[i];
+    auto t_r = (atom.type >= 0 && unsigned(atom.type) < ntypes) ? molcache_types[atom.type] : typer->get_int_type(atom.type);
+    if(t_r.first >= 0) { //ignore neg
+      t[n] = t_r.first;
+      r[n] = t_r.second;
+      c[3*n] = atom.x;
+      c[3*n+1] = atom.y;
+      c[3*n+2] = atom.z;
+      n++;
+    }
+  }
 
-    vector<float3> c; c.reserve(natoms);
-    vector<float> r; r.reserve(natoms);
-    vector<int> t; t.reserve(natoms);
-    for(unsigned i = 0; i < natoms; i++)
-    {
-      info& atom = atoms[i];
-      auto t_r = typer->get_int_type(atom.type);
-      if(t_r.first >= 0) { //ignore neg
-        t.push_back(t_r.first);
-        r.push_back(t_r.second);
-        c.push_back(make_float3(atom.x,atom.y,atom.z));
-      }
+  if(n != natoms) {
+    coord.coords = coord.coords.resized(n, 3);
+    coord.type_index = coord.type_index.resized(n);
+    coord.radii = coord.radii.resized(n);
+  }
+  coord.max_type = typer->num_types();
+}
+
+void CoordCache::prefetch_ranges(std::vector<std::pair<size_t, size_t> > ranges) const {
+  if(ranges.empty() || !prefetcher) return;
+  prefetcher->start(ranges);
+}
+
+void CoordCache::prefetch(const std::vector<const char*>& names) const {
+  if(!prefetches_referenced()) return;
+
+  //an entry extends to the next entry, entries are not necessarily in name order
+  vector<size_t> starts;
+  starts.reserve(offsets.size());
+  for(const auto& o : offsets) starts.push_back(o.second);
+  sort(starts.begin(), starts.end());
+
+  vector<pair<size_t, size_t> > entries;
+  for(const char *name : names) {
+    auto pos = offsets.find(name);
+    if(pos == offsets.end()) continue;
+    auto next = upper_bound(starts.begin(), starts.end(), pos->second);
+    entries.push_back(make_pair(pos->second, next == starts.end() ? cache_map.size() : *next));
+  }
+  sort(entries.begin(), entries.end());
+
+  //merge entries that are nearly adjacent, as a whole page is read anyway
+  static const size_t page = sysconf(_SC_PAGESIZE);
+  vector<pair<size_t, size_t> > ranges;
+  for(const auto& e : entries) {
+    if(ranges.size() && e.first <= ranges.back().second + page) {
+      ranges.back().second = max(ranges.back().second, e.second);
+    } else {
+      ranges.push_back(e);
     }
+  }
+  prefetch_ranges(ranges);
+}
+
+//set coords using the cache
+void CoordCache::set_coords(const char *fname, CoordinateSet& coord) {
+  StageTimer timer(STAGE_SET_COORDS);
 
-    coord = CoordinateSet(c, t, r, typer->num_types());
+  auto cached_offset = offsets.find(fname);
+  if(cached_offset != offsets.end()) {
+    StageTimer mtimer(STAGE_READ_MOLCACHE);
+    if(readahead) readahead->advise(cache_map, cached_offset->second);
+    set_molcache_coords(cache_map.data()+cached_offset->second, coord);
     coord.src = fname;
   }
-  else if(memcache.count(fname)) {
-    coord = memcache[fname].clone(); //always copy out of cache
-  } else {
+  else if(boost::algorithm::ends_with(fname,"none")) { //reserved word
+    coord = CoordinateSet();
+    coord.max_type = typer->num_types(); //empty, but include type size
+  }
+  else {
     std::string fullname = fname;
     if(data_root.length()) {
       boost::filesystem::path p = boost::filesystem::path(data_root) / boost::filesystem::path(fname);
       fullname = p.string();
     }
-    //check for custom gninatypes file
-    if(boost::algorithm::ends_with(fname,".gninatypes"))
+
+    if(store) {
+      store->set_coords(fullname, typer, make_vector_types, coord);
+    } else {
+      MGrid2f c;
+      vector<AtomStore::Projection> projs(1);
+      projs[0].typer = typer;
+      projs[0].vector_types = make_vector_types;
+      AtomStore::read(fullname, addh, c, projs);
+      AtomStore::set_coords(c, projs[0], coord);
+    }
+    coord.src = fname;
+  }
+}
+
+std::shared_ptr<AtomStore> AtomStore::shared(bool addh, size_t budget) {
+  static mutex stores_mutex;
+  static map<pair<bool, size_t>, std::weak_ptr<AtomStore> > stores; //released when no cache uses them
+
+  lock_guard<mutex> lock(stores_mutex);
+  std::weak_ptr<AtomStore>& store = stores[make_pair(addh, budget)];
+  std::shared_ptr<AtomStore> ret = store.lock();
+  if(!ret) {
+    ret = std::make_shared<AtomStore>(addh, budget);
+    store = ret;
+  }
+  return ret;
+}
+
+//set the typed atoms of proj from the types (or type vectors) and radii of every atom of a file
+static void set_projection(AtomStore::Projection& proj, const vector<int>& atom_types,
+    const vector<float>& atom_vectors, const vector<float>& atom_radii) {
+  const AtomTyper& typer = *proj.typer;
+  unsigned ntypes = typer.num_types();
+  vector<float> t, r, tv;
+  proj.atoms.clear();
+  for(unsigned i = 0, na = atom_radii.size(); i < na; i++) {
+    if(typer.is_vector_typer()) {
+      if(atom_radii[i] > 0) { //don't ignore
+        proj.atoms.push_back(i);
+        tv.insert(tv.end(), atom_vectors.begin() + i * ntypes, atom_vectors.begin() + (i + 1) * ntypes);
+        r.push_back(atom_radii[i]);
+      }
+    } else {
+      if(atom_types[i] >= (int)ntypes) throw invalid_argument("Invalid type");
+      if(atom_types[i] >= 0) { //don't ignore atom
+        proj.atoms.push_back(i);
+        t.push_back(atom_types[i]);
+        r.push_back(atom_radii[i]);
+      }
+    }
+  }
+
+  unsigned n = proj.atoms.size();
+  CoordinateSet& types = proj.types;
+  types = CoordinateSet();
+  types.max_type = ntypes;
+  types.radii = MGrid1f(n);
+  if(n) memcpy(types.radii.cpu().data(), &r[0], sizeof(float)*n);
+  if(typer.is_vector_typer()) {
+    types.type_vector = MGrid2f(n, ntypes);
+    if(n) memcpy(types.type_vector.cpu().data(), &tv[0], sizeof(float)*n*ntypes);
+  } else {
+    types.type_index = MGrid1f(n);
+    if(n) memcpy(types.type_index.cpu().data(), &t[0], sizeof(float)*n);
+    const AtomIndexTyper *ityper = dynamic_cast<const AtomIndexTyper*>(&typer);
+    if(proj.vector_types && ityper) {
+      types.make_vector_types(false, ityper->get_type_radii());
+    }
+  }
+}
+
+void AtomStore::read(const std::string& fname, bool addh, MGrid2f& coords, std::vector<Projection>& projs) {
+  vector<float3> c;
+  vector<exception_ptr> errors(projs.size());
+  vector<int> atom_types;
+  vector<float> atom_vectors, atom_radii;
+
+  //check for custom gninatypes file
+  if(boost::algorithm::ends_with(fname,".gninatypes"))
+  {
+    StageTimer timer(STAGE_READ_GNINATYPES);
+    ifstream in(fname.c_str());
+    if(!in) throw invalid_argument("Could not read "+fname);
+
+    vector<int> gnina_types;
+    info atom;
+    while(in.read((char*)&atom, sizeof(atom)))
     {
-      if(typer->is_vector_typer())
-        throw invalid_argument("Vector typer used with gninatypes files");
-
-      ifstream in(fullname.c_str());
-      if(!in) throw invalid_argument("Could not read "+fullname);
-
-      vector<float3> c;
-      vector<float> r;
-      vector<int> t;
-      info atom;
-
-      while(in.read((char*)&atom, sizeof(atom)))
-      {
-        auto t_r = typer->get_int_type(atom.type);
-        if(t_r.first >= 0) { //ignore neg
-          t.push_back(t_r.first);
-          r.push_back(t_r.second);
-          c.push_back(make_float3(atom.x,atom.y,atom.z));
+      c.push_back(make_float3(atom.x,atom.y,atom.z));
+      gnina_types.push_back(atom.type);
+    }
+
+    for(unsigned p = 0, np = projs.size(); p < np; p++) {
+      try {
+        const AtomTyper& typer = *projs[p].typer;
+        if(typer.is_vector_typer())
+          throw invalid_argument("Vector typer used with gninatypes files");
+        atom_types.resize(gnina_types.size());
+        atom_radii.resize(gnina_types.size());
+        for(unsigned i = 0, na = gnina_types.size(); i < na; i++) {
+          auto t_r = typer.get_int_type(gnina_types[i]);
+          atom_types[i] = t_r.first;
+          atom_radii[i] = t_r.second;
         }
+        set_projection(projs[p], atom_types, atom_vectors, atom_radii);
+      } catch(...) {
+        errors[p] = current_exception();
       }
-
-      coord = CoordinateSet(c, t, r, typer->num_types());
-      coord.src = fname;
     }
-    else if(!boost::algorithm::ends_with(fname,"none")) //reserved word
+  }
+  else
+  {
+    //read mol from file and set mol info (atom coords and grid positions)
+    lock_guard<mutex> lock(openbabel_mutex);
+    OBConversion conv;
+    OBMol mol;
     {
-      //read mol from file and set mol info (atom coords and grid positions)
-      OBConversion conv;
-      OBMol mol;
-      if(!conv.ReadFile(&mol, fullname.c_str()))
-        throw invalid_argument("Could not read " + fullname);
+      StageTimer timer(STAGE_PARSE_OPENBABEL);
+      if(!conv.ReadFile(&mol, fname.c_str()))
+        throw invalid_argument("Could not read " + fname);
 
       if(addh) {
         mol.AddHydrogens();
       }
+    }
+
+    FOR_ATOMS_OF_MOL(a, mol) {
+      c.push_back(make_float3(a->GetX(), a->GetY(), a->GetZ()));
+    }
+
+    //the molecule is parsed once and typed by every typer
+    StageTimer timer(STAGE_TYPING);
+    for(unsigned p = 0, np = projs.size(); p < np; p++) {
+      try {
+        const AtomTyper& typer = *projs[p].typer;
+        if(typer.is_vector_typer()) {
+          typer.type_molecule(mol, atom_vectors, atom_radii);
+        } else {
+          typer.type_molecule(mol, atom_types, atom_radii);
+        }
+        set_projection(projs[p], atom_types, atom_vectors, atom_radii);
+      } catch(...) {
+        errors[p] = current_exception();
+      }
+    }
+  }
+
+  //only the first typer must succeed, the others are dropped and report their errors when requested
+  if(errors.size() && errors[0]) rethrow_exception(errors[0]);
+  for(unsigned p = projs.size(); p > 1; p--) {
+    if(errors[p-1]) projs.erase(projs.begin() + p - 1);
+  }
+
+  coords = MGrid2f(c.size(), 3);
+  if(c.size()) memcpy(coords.cpu().data(), &c[0], sizeof(float3)*c.size());
+}
+
+void AtomStore::set_coords(const MGrid2f& coords, const Projection& proj, CoordinateSet& coord) {
+  const CoordinateSet& types = proj.types;
+  unsigned n = proj.atoms.size();
+
+  //grids shared with another set are replaced, the rest are only reallocated if too small
+  coord.drop_shared();
+  //contents are about to be overwritten, so don't copy back from the gpu
+  coord.coords = coord.coords.resized(n, 3);
+  coord.coords.tocpu(false);
+  const float3 *src = (const float3*)coords.cpu().data();
+  float3 *dst = (float3*)coord.coords.cpu().data();
+  for(unsigned i = 0; i < n; i++) {
+    dst[i] = src[proj.atoms[i]];
+  }
+
+  coord.type_index = coord.type_index.resized(types.type_index.size());
+  coord.type_index.tocpu(false);
+  coord.type_index.copyFrom(types.type_index.cpu());
+  if(types.type_vector.size()) {
+    coord.type_vector = coord.type_vector.resized(types.type_vector.dimension(0), types.type_vector.dimension(1));
+    coord.type_vector.tocpu(false);
+    coord.type_vector.copyFrom(types.type_vector.cpu());
+  } else {
+    coord.type_vector = MGrid2f();
+  }
+  coord.radii = coord.radii.resized(types.radii.size());
+  coord.radii.tocpu(false);
+  coord.radii.copyFrom(types.radii.cpu());
+  coord.max_type = types.max_type;
+}
+
+//bytes of memory used by the grids of a projection
+static size_t projection_bytes(const AtomStore::Projection& proj) {
+  const CoordinateSet& t = proj.types;
+  return proj.atoms.size()*sizeof(unsigned) +
+      (t.type_index.size() + t.type_vector.size() + t.radii.size())*sizeof(float);
+}
+
+void AtomStore::evict(const Record& keep) {
+  if(max_bytes == 0) return;
+  while(stats.bytes > max_bytes && lru.size() > 1) {
+    auto victim = records.find(*lru.back());
+    if(&victim->second == &keep) break; //only the most recent is left
+    stats.bytes -= victim->second.bytes;
+    stats.evictions++;
+    lru.pop_back();
+    records.erase(victim);
+  }
+  stats.entries = records.size();
+}
+
+//return true if proj was typed by typer
+static bool typed_by(const AtomStore::Projection& proj, const std::shared_ptr<AtomTyper>& typer, bool vector_types) {
+  return proj.typer == typer && proj.vector_types == vector_types;
+}
+
+void AtomStore::pair_typers(const Typing& a, const Typing& b) {
+  vector<Typing>& ac = companions[make_pair(a.first.get(), a.second)];
+  if(find(ac.begin(), ac.end(), b) == ac.end()) ac.push_back(b);
+  vector<Typing>& bc = companions[make_pair(b.first.get(), b.second)];
+  if(find(bc.begin(), bc.end(), a) == bc.end()) bc.push_back(a);
+}
+
+void AtomStore::set_coords(const std::string& fname, const std::shared_ptr<AtomTyper>& typer, bool vector_types,
+    CoordinateSet& coord) {
+  vector<Projection> projs(1);
+  projs[0].typer = typer;
+  projs[0].vector_types = vector_types;
+  {
+    lock_guard<mutex> lock(records_mutex);
+    auto rec = records.find(fname);
+    if(rec != records.end()) {
+      for(const Projection& proj : rec->second.projections) {
+        if(typed_by(proj, typer, vector_types)) {
+          lru.splice(lru.begin(), lru, rec->second.lru_pos);
+          stats.hits++;
+          count_stage(STAGE_STORE_HIT);
+          set_coords(rec->second.coords, proj, coord);
+          return;
+        }
+      }
+      //the typers of this file will likely be asked for the same files, so type later reads for all of them
+      for(const Projection& proj : rec->second.projections) {
+        pair_typers(Typing(proj.typer, proj.vector_types), Typing(typer, vector_types));
+      }
+    }
+    for(const Typing& other : companions[make_pair(typer.get(), vector_types)]) {
+      bool stored = false;
+      if(rec != records.end()) {
+        for(const Projection& proj : rec->second.projections) {
+          stored = stored || typed_by(proj, other.first, other.second);
+        }
+      }
+      if(!stored) {
+        projs.push_back(Projection());
+        projs.back().typer = other.first;
+        projs.back().vector_types = other.second;
+      }
+    }
+    stats.misses++;
+  }
+  count_stage(STAGE_STORE_MISS);
 
-      coord = CoordinateSet(&mol, *typer);
-      coord.src = fname;
+  //read without holding the lock, a concurrent read of the same file is discarded
+  MGrid2f c;
+  read(fname, addh, c, projs);
+
+  lock_guard<mutex> lock(records_mutex);
+  auto inserted = records.emplace(fname, Record());
+  Record& rec = inserted.first->second;
+  if(inserted.second) {
+    rec.coords = c; //coordinates don't depend on the typer
+    rec.bytes = c.size()*sizeof(float) + fname.size();
+    stats.bytes += rec.bytes;
+    lru.push_front(&inserted.first->first);
+    rec.lru_pos = lru.begin();
+  } else {
+    lru.splice(lru.begin(), lru, rec.lru_pos);
+  }
+  for(const Projection& proj : projs) {
+    bool stored = false;
+    for(const Projection& p : rec.projections) {
+      stored = stored || typed_by(p, proj.typer, proj.vector_types);
+    }
+    if(!stored) {
+      rec.projections.push_back(proj);
+      rec.bytes += projection_bytes(proj);
+      stats.bytes += projection_bytes(proj);
+    }
+  }
+  for(const Projection& p : rec.projections) {
+    if(typed_by(p, typer, vector_types)) set_coords(rec.coords, p, coord);
+  }
+  evict(rec);
+}
+
+size_t AtomStore::size() {
+  lock_guard<mutex> lock(records_mutex);
+  return records.size();
+}
+
+CacheStats AtomStore::get_stats() {
+  lock_guard<mutex> lock(records_mutex);
+  stats.entries = records.size();
+  return stats;
+}
+
+
+//read the atoms of fname with the gnina types stored in molcache2 files
+static void read_gnina_atoms(const std::string& fname, bool addh, vector<info>& atoms) {
+  atoms.clear();
+  if(boost::algorithm::ends_with(fname,".gninatypes")) {
+    StageTimer timer(STAGE_READ_GNINATYPES);
+    ifstream in(fname.c_str(), ios::binary);
+    if(!in) throw invalid_argument("Could not read "+fname);
+    info atom;
+    while(in.read((char*)&atom, sizeof(atom))) {
+      atoms.push_back(atom);
+    }
+    return;
+  }
+
+  //read uncompressed files before locking so only parsing is serialized
+  bool compressed = boost::algorithm::ends_with(fname,".gz");
+  string contents;
+  if(!compressed) {
+    ifstream in(fname.c_str(), ios::binary);
+    if(!in) throw invalid_argument("Could not read "+fname);
+    stringstream buffer;
+    buffer << in.rdbuf();
+    contents = buffer.str();
+  }
+
+  static const GninaIndexTyper typer;
+  lock_guard<mutex> lock(openbabel_mutex);
+  OBConversion conv;
+  OBMol mol;
+  {
+    StageTimer timer(STAGE_PARSE_OPENBABEL);
+    bool ok = false;
+    if(compressed) {
+      ok = conv.ReadFile(&mol, fname.c_str());
     } else {
-      coord = CoordinateSet();
-      coord.max_type = typer->num_types(); //empty, but include type size
+      OBFormat *format = conv.FormatFromExt(fname.c_str());
+      ok = format && conv.SetInFormat(format) && conv.ReadString(&mol, contents);
     }
+    if(!ok) throw invalid_argument("Could not read " + fname);
+    if(addh) {
+      mol.AddHydrogens();
+    }
+  }
+
+  StageTimer timer(STAGE_TYPING);
+  vector<int> types;
+  vector<float> radii;
+  typer.type_molecule(mol, types, radii);
+  atoms.reserve(types.size());
+  FOR_ATOMS_OF_MOL(a, mol) {
+    OBAtom *atom = &*a;
+    int t = types[atom->GetIdx() - 1];
+    if(t >= 0) {
+      info rec = {float(atom->GetX()), float(atom->GetY()), float(atom->GetZ()), t};
+      atoms.push_back(rec);
+    }
+  }
+}
+
+size_t write_molcache(const std::string& molcache, const std::string& types, const ExampleProviderSettings& settings,
+    int column, int numlabels, unsigned nthreads) {
+  ifstream typesin(types.c_str());
+  if(!typesin) throw invalid_argument("Could not open file: "+types);
+  ExampleRefStore refs = parse_example_refs(typesin, numlabels, settings.max_group_size > 0, settings.num_parse_threads);
+
+  //each structure once, in the order it is first used
+  vector<const char*> names;
+  unordered_set<const char*> seen;
+  for(size_t r = 0, nr = refs.size(); r < nr; r++) {
+    const char* const* files = refs.file_data(r);
+    for(unsigned i = 0, n = refs.num_files(r); i < n; i++) {
+      const char *name = files[i];
+      if(column >= 0 && i != unsigned(column)) continue;
+      if(boost::algorithm::ends_with(name,"none")) continue; //reserved word
+      if(strlen(name) > 255) throw invalid_argument(string("Name too long for molcache2: ")+name);
+      if(seen.insert(name).second) names.push_back(name);
+    }
+  }
+
+  ofstream out(molcache.c_str(), ios::binary);
+  if(!out) throw invalid_argument("Could not open file: "+molcache);
+  int version = -1;
+  size_t start = 0; //of the names, filled in once the atoms are written
+  out.write((char*)&version, sizeof(int));
+  out.write((char*)&start, sizeof(size_t));
+
+  if(nthreads == 0) nthreads = max(thread::hardware_concurrency(), 1U);
+  //structures are read a batch at a time so memory is bounded by the batch, not the data set
+  const size_t batch = 1024;
+  vector<vector<info> > atoms(min(batch, names.size()));
+  vector<size_t> offsets(names.size());
+  for(size_t b = 0, N = names.size(); b < N; b += batch) {
+    size_t n = min(batch, N - b);
+    atomic<size_t> next(0);
+    vector<exception_ptr> errors(nthreads);
+    auto read = [&](unsigned t) {
+      try {
+        for(size_t i = next++; i < n; i = next++) {
+          string fname = names[b+i];
+          if(settings.data_root.length()) {
+            fname = (boost::filesystem::path(settings.data_root) / boost::filesystem::path(fname)).string();
+          }
+          read_gnina_atoms(fname, settings.add_hydrogens, atoms[i]);
+        }
+      } catch(...) {
+        errors[t] = current_exception();
+        next = n; //stop the other threads
+      }
+    };
 
-    AtomIndexTyper *ityper = dynamic_cast<AtomIndexTyper*>(typer.get());
-    if(make_vector_types && ityper) {
-      coord.make_vector_types(false, ityper->get_type_radii());
+    vector<thread> threads;
+    for(unsigned t = 1, nt = min<size_t>(nthreads, n); t < nt; t++) {
+      threads.push_back(thread(read, t));
     }
-    if(use_cache) { //save coord
-      memcache[fname] = coord.clone(); //save a copy in case the returned set is modified
+    read(0);
+    for(thread& th : threads) th.join();
+    for(exception_ptr& e : errors) {
+      if(e) rethrow_exception(e);
     }
+
+    for(size_t i = 0; i < n; i++) {
+      offsets[b+i] = out.tellp();
+      unsigned natoms = atoms[i].size();
+      out.write((char*)&natoms, sizeof(unsigned));
+      if(natoms) out.write((char*)&atoms[i][0], sizeof(info)*natoms);
+    }
+  }
+
+  //names and offsets follow the atoms
+  start = out.tellp();
+  for(size_t i = 0, n = names.size(); i < n; i++) {
+    unsigned char len = strlen(names[i]);
+    out.write((char*)&len, 1);
+    out.write(names[i], len);
+    out.write((char*)&offsets[i], sizeof(size_t));
   }
+  out.seekp(sizeof(int));
+  out.write((char*)&start, sizeof(size_t));
+  if(!out) throw invalid_argument("Could not write "+molcache);
+  return names.size();
 }
 
 
@@ -21,27 +21,37 @@ CoordinateSet::CoordinateSet(OBMol *mol): CoordinateSet(mol, defaultGninaLigandT
 CoordinateSet::CoordinateSet(OBMol *mol, const AtomTyper& typer)
     : max_type(typer.num_types()) {
 
+  //type the whole molecule at once, then gather the atoms that are not ignored
   vector<float3> c; c.reserve(mol->NumAtoms());
   vector<float> types;  types.reserve(mol->NumAtoms());
-  vector<vector<float> > vector_types;  vector_types.reserve(mol->NumAtoms());
+  vector<float> vector_types;
   vector<float> rads; rads.reserve(mol->NumAtoms());
-  vector<float> vec;
+  vector<int> atom_types;
+  vector<float> atom_vectors;
+  vector<float> atom_radii;
+
+  bool vector_typer = typer.is_vector_typer();
+  if(vector_typer) {
+    typer.type_molecule(*mol, atom_vectors, atom_radii);
+    vector_types.reserve(atom_vectors.size());
+  } else {
+    typer.type_molecule(*mol, atom_types, atom_radii);
+  }
 
   FOR_ATOMS_OF_MOL(a, mol){
     OBAtom *atom = &*a; //convert from iterator
+    unsigned i = atom->GetIdx() - 1;
 
-    if(typer.is_vector_typer()) {
-
-      float radius = typer.get_atom_type_vector(atom, vec);
+    if(vector_typer) {
+      float radius = atom_radii[i];
       if(radius > 0) { //don't ignore
         c.push_back(make_float3(atom->GetX(), atom->GetY(), atom->GetZ()));
-        vector_types.push_back(vec);
+        vector_types.insert(vector_types.end(), atom_vectors.begin() + i * max_type, atom_vectors.begin() + (i + 1) * max_type);
         rads.push_back(radius);
       }
     } else {
-      auto type_rad = typer.get_atom_type_index(atom);
-      int type = type_rad.first;
-      float r = type_rad.second;
+      int type = atom_types[i];
+      float r = atom_radii[i];
       if(type >= (int)max_type) throw invalid_argument("Invalid type");
       if(type >= 0) { //don't ignore atom
         c.push_back(make_float3(atom->GetX(), atom->GetY(), atom->GetZ()));
@@ -60,7 +70,7 @@ CoordinateSet::CoordinateSet(OBMol *mol, const AtomTyper& typer)
   radii = MGrid1f(N);
   memcpy(radii.cpu().data(), &rads[0], sizeof(float)*N);
 
-  if(typer.is_vector_typer()) {
+  if(vector_typer) {
     type_vector = MGrid2f(N,max_type);
     memcpy(type_vector.cpu().data(), &vector_types[0], sizeof(float)*N*max_type);
   } else {
@@ -202,7 +212,7 @@ void CoordinateSet::make_vector_types(bool include_dummy_type, const std::vector
 
   if(type_radii.size()>  0) {
     //change radii from being indexed by atom to being indexed by type
-    radii = radii.resized(max_type);
+    radii = radii.shared() ? MGrid1f(max_type) : radii.resized(max_type);
     radii.tocpu();
     if(include_dummy_type) radii[max_type-1] = 0.0;
     memcpy(radii.data(), &type_radii[0], sizeof(float)*type_radii.size());
@@ -240,7 +250,15 @@ void CoordinateSet::dump(std::ostream& out) const {
   }
 }
 
+void CoordinateSet::drop_shared() {
+  if(coords.shared()) coords = MGrid2f();
+  if(type_index.shared()) type_index = MGrid1f();
+  if(type_vector.shared()) type_vector = MGrid2f();
+  if(radii.shared()) radii = MGrid1f();
+}
+
 void CoordinateSet::size_like(const CoordinateSet& s) {
+  drop_shared();
   coords = coords.resized(s.coords.dimension(0), 3);
   type_index = type_index.resized(s.type_index.dimension(0));
   type_vector = type_vector.resized(s.type_vector.dimension(0), s.type_vector.dimension(1));
@@ -259,6 +277,7 @@ void CoordinateSet::copyInto(const CoordinateSet& s) {
 }
 
 void CoordinateSet::mergeInto(const CoordinateSet& rec, const CoordinateSet& lig, bool unique_index_types) {
+  drop_shared();
 
   coords = coords.resized(rec.coords.dimension(0)+lig.coords.dimension(0), 3);
   type_index = type_index.resized(rec.type_index.dimension(0)+lig.type_index.dimension(0));
@@ -40,15 +40,17 @@ __global__ void sum_index_types_gpu(Grid<float, 1, true> types, Grid<float, 1, t
   sum[t] = tsum;
 }
 
-void CoordinateSet::sum_types(Grid<float, 1, true>& sum, bool zerofirst) const {
-  if(zerofirst) sum.fill_zero();
+void CoordinateSet::sum_types(Grid<float, 1, true>& sum, bool zerofirst, cudaStream_t stream) const {
+  if(zerofirst) sum.fill_zero(stream);
   int NT = num_types();
   int blocks = LMG_GET_BLOCKS(NT);
   int threads = LMG_GET_THREADS(NT);
   if(!has_vector_types()) {
-    sum_index_types_gpu<<<blocks,threads>>>(type_index.gpu(), sum);
+    type_index.togpu(stream);
+    sum_index_types_gpu<<<blocks,threads,0,stream>>>(type_index.gpu(), sum);
   } else { //vector types
-    sum_vector_types_gpu<<<blocks,threads>>>(type_vector.gpu(), sum);
+    type_vector.togpu(stream);
+    sum_vector_types_gpu<<<blocks,threads,0,stream>>>(type_vector.gpu(), sum);
   }
   LMG_CUDA_CHECK(cudaPeekAtLastError());
 
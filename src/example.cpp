@@ -12,6 +12,7 @@
 #include <cuda_runtime.h>
 
 #include "libmolgrid/example.h"
+#include "libmolgrid/instrumentation.h"
 
 namespace libmolgrid {
 
@@ -38,37 +39,122 @@ size_t Example::num_types(bool unique_index_types) const {
   return maxt;
 }
 
-//grid version
-void Example::merge_coordinates(Grid2f& c, Grid1f& t, Grid1f& r, unsigned start, bool unique_index_types) const {
+namespace {
+//the current data of g, which is in gpu memory if gpu is set on return
+template <std::size_t N>
+const float* current_data(const ManagedGrid<float, N>& g, bool& gpu) {
+  gpu = g.ongpu();
+  return gpu ? g.gpu().data() : g.cpu().data();
+}
 
-  vector<float3> coords;
-  vector<float> types;
-  vector<float> radii;
+//copy rows of width floats from src into rows of pitch floats of dst, either of which may be gpu memory
+void copy_rows(float *dst, size_t pitch, bool dst_gpu, const float *src, size_t width, bool src_gpu, size_t rows) {
+  if(rows == 0 || width == 0) return;
+  if(!dst_gpu && !src_gpu) {
+    if(pitch == width) {
+      memcpy(dst, src, sizeof(float)*width*rows);
+    } else {
+      for(size_t i = 0; i < rows; i++) memcpy(dst+i*pitch, src+i*width, sizeof(float)*width);
+    }
+    return;
+  }
+  cudaMemcpyKind kind = src_gpu ? (dst_gpu ? cudaMemcpyDeviceToDevice : cudaMemcpyDeviceToHost) : cudaMemcpyHostToDevice;
+  if(pitch == width) {
+    LMG_CUDA_CHECK(cudaMemcpy(dst, src, sizeof(float)*width*rows, kind));
+  } else {
+    LMG_CUDA_CHECK(cudaMemcpy2D(dst, sizeof(float)*pitch, src, sizeof(float)*width, sizeof(float)*width, rows, kind));
+  }
+}
 
-  merge_coordinates(coords, types, radii, start, unique_index_types);
+//number of atoms N and vector types T of the sets from start when merged
+void merged_size(const vector<CoordinateSet>& sets, unsigned start, bool unique_index_types, size_t& N, unsigned& T) {
+  N = 0;
+  T = 0;
+  for(unsigned i = start, n = sets.size(); i < n; i++) {
+    N += sets[i].coords.dimension(0);
+    if(unique_index_types)
+      T += sets[i].max_type;
+    else
+      T = max(T, sets[i].max_type);
+  }
+}
+
+/* merge the sets from start into coords (Nx3), types (N, or NxT if vector_types) and radii (N),
+ * which are in gpu memory if gpu is set; the sets may be on either device
+ */
+void merge_sets(const vector<CoordinateSet>& sets, unsigned start, bool unique_index_types, size_t N,
+    bool vector_types, unsigned T, float *coords, float *types, float *radii, bool gpu) {
+  StageTimer timer(STAGE_MERGE);
+  if(vector_types && N*T > 0) {
+    if(gpu) LMG_CUDA_CHECK(cudaMemset(types, 0, sizeof(float)*N*T));
+    else memset(types, 0, sizeof(float)*N*T);
+  }
+  static thread_local vector<float> staging; //index types offset on the host
+  size_t pos = 0;
+  unsigned offset = 0; //amount to offset types
+  for(unsigned s = start, ns = sets.size(); s < ns; s++) {
+    const CoordinateSet& CS = sets[s];
+    unsigned n = CS.coords.dimension(0);
+    if(n == 0 && !vector_types) continue; //empty index typed sets do not offset later types
+    if(n > 0) {
+      bool src_gpu = false;
+      if(vector_types) {
+        if(!CS.has_vector_types()) throw logic_error("Coordinate sets do not have compatible vector types for merge.");
+        if(CS.max_type != CS.type_vector.dimension(1))
+          throw logic_error("Coordinate set "+itoa(s)+" does not have consistent max_type/vector type sizes");
+        if(offset + CS.max_type > T) throw logic_error("Incompatible vector sizes in merge_coordinates");
+        const float *t = current_data(CS.type_vector, src_gpu);
+        copy_rows(types+pos*T+offset, T, gpu, t, CS.max_type, src_gpu, n);
+      } else {
+        if(!CS.has_indexed_types()) throw logic_error("Coordinate sets do not have compatible index types for merge.");
+        const float *t = current_data(CS.type_index, src_gpu);
+        if(!gpu && !src_gpu) {
+          for(unsigned i = 0; i < n; i++) types[pos+i] = t[i]+offset;
+        } else if(offset == 0) {
+          copy_rows(types+pos, 1, gpu, t, 1, src_gpu, n);
+        } else {
+          staging.resize(n);
+          copy_rows(staging.data(), 1, false, t, 1, src_gpu, n);
+          for(float& v : staging) v += offset;
+          copy_rows(types+pos, 1, gpu, staging.data(), 1, false, n);
+        }
+      }
+      const float *c = current_data(CS.coords, src_gpu);
+      copy_rows(coords+3*pos, 3, gpu, c, 3, src_gpu, n);
+      const float *r = current_data(CS.radii, src_gpu);
+      copy_rows(radii+pos, 1, gpu, r, 1, src_gpu, n);
+      pos += n;
+    }
+    if(unique_index_types) offset += CS.max_type;
+  }
+}
+}
+
+//grid version
+void Example::merge_coordinates(Grid2f& c, Grid1f& t, Grid1f& r, unsigned start, bool unique_index_types) const {
+  size_t N = 0;
+  unsigned T = 0;
+  merged_size(sets, start, unique_index_types, N, T);
 
   //validate sizes
-  if(c.dimension(0) != coords.size()) {
-    throw invalid_argument("Coordinates do not have correct dimension: "+itoa(c.dimension(0)) + " != " + itoa(coords.size()));
+  if(c.dimension(0) != N) {
+    throw invalid_argument("Coordinates do not have correct dimension: "+itoa(c.dimension(0)) + " != " + itoa(N));
   }
   if(c.dimension(1) != 3) {
     throw invalid_argument("Coordinates do not have correct second dimension (3): "+itoa(c.dimension(1)));
   }
-  if(t.size() != types.size()) {
-    throw invalid_argument("Types do not have correct dimension: "+itoa(t.size())+ " != " +itoa(types.size()));
+  if(t.size() != N) {
+    throw invalid_argument("Types do not have correct dimension: "+itoa(t.size())+ " != " +itoa(N));
   }
-  if(r.size() != radii.size()) {
-    throw invalid_argument("Radii do not have correct dimension: "+itoa(r.size())+ " != " +itoa(radii.size()));
+  if(r.size() != N) {
+    throw invalid_argument("Radii do not have correct dimension: "+itoa(r.size())+ " != " +itoa(N));
   }
 
-  //copy data
-  memcpy(c.data(), &coords[0], sizeof(float3)*coords.size());
-  memcpy(t.data(), &types[0], sizeof(float)*types.size());
-  memcpy(r.data(), &radii[0], sizeof(float)*radii.size());
-
+  merge_sets(sets, start, unique_index_types, N, false, T, c.data(), t.data(), r.data(), false);
 }
 
 void Example::merge_coordinates(std::vector<float3>& coords, std::vector<float>& types, std::vector<float>& radii, unsigned start, bool unique_index_types) const {
+  StageTimer timer(STAGE_MERGE);
   unsigned N = num_coordinates();
 
   coords.clear();
@@ -103,42 +189,36 @@ void Example::merge_coordinates(std::vector<float3>& coords, std::vector<float>&
 
 //grid version of vector
 void Example::merge_coordinates(Grid2f& c, Grid2f& t, Grid1f& r, unsigned start, bool unique_index_types) const {
+  size_t N = 0;
+  unsigned T = 0;
+  merged_size(sets, start, unique_index_types, N, T);
 
-  vector<float3> coords;
-  vector< vector<float> > types;
-  vector<float> radii;
-
-  merge_coordinates(coords, types, radii, start, unique_index_types);
-
-  if(types.size() == 0)
+  if(N == 0)
     return;
 
   //validate sizes
-  if(c.dimension(0) != coords.size()) {
-    throw invalid_argument("Coordinates do not have correct dimension: "+itoa(c.dimension(0)) + " != " + itoa(coords.size()));
+  if(c.dimension(0) != N) {
+    throw invalid_argument("Coordinates do not have correct dimension: "+itoa(c.dimension(0)) + " != " + itoa(N));
   }
   if(c.dimension(1) != 3) {
     throw invalid_argument("Coordinates do not have correct second dimension (3): "+itoa(c.dimension(1)));
   }
-  if(t.dimension(0) != types.size()) {
-    throw invalid_argument("Types do not have correct dimension: "+itoa(t.dimension(0))+ " != " +itoa(types.size()));
+  if(t.dimension(0) != N) {
+    throw invalid_argument("Types do not have correct dimension: "+itoa(t.dimension(0))+ " != " +itoa(N));
   }
-  if(t.dimension(1) != types[0].size()) {
-    throw invalid_argument("Types do not have correct dimension: "+itoa(t.dimension(1))+ " != " +itoa(types[0].size()));
+  if(t.dimension(1) != T) {
+    throw invalid_argument("Types do not have correct dimension: "+itoa(t.dimension(1))+ " != " +itoa(T));
   }
-  if(r.size() != radii.size()) {
-     throw invalid_argument("Radii do not have correct dimension: "+itoa(r.size())+ " != " +itoa(radii.size()));
+  if(r.size() != N) {
+     throw invalid_argument("Radii do not have correct dimension: "+itoa(r.size())+ " != " +itoa(N));
   }
 
-  //copy data
-  memcpy(c.data(), &coords[0], sizeof(float3)*coords.size());
-  memcpy(t.data(), &types[0], sizeof(float)*types.size());
-  memcpy(r.data(), &radii[0], sizeof(float)*radii.size());
-
+  merge_sets(sets, start, unique_index_types, N, true, T, c.data(), t.data(), r.data(), false);
 }
 
 void Example::merge_coordinates(std::vector<float3>& coords, std::vector<std::vector<float> >& types,
     std::vector<float>& radii, unsigned start, bool unique_index_types) const {
+  StageTimer timer(STAGE_MERGE);
 
   coords.clear();
   types.clear();
@@ -210,23 +290,65 @@ CoordinateSet Example::merge_coordinates(unsigned start, bool unique_index_types
   } else if(sets.size() == start+1) {
     //copy data for consistency with multiple sets
     return sets[start].clone();
-  } else if(!has_vec) {
+  } else {
+    CoordinateSet ret;
+    merge_coordinates(ret, start, unique_index_types);
+    return ret;
+  }
+}
 
-    vector<float3> coords;
-    vector<float> types;
-    vector<float> radii;
-    merge_coordinates(coords, types, radii, start, unique_index_types);
+void Example::merge_coordinates(CoordinateSet& out, unsigned start, bool unique_index_types, bool gpu) const {
+
+  bool has_vec = has_vector_types();
+  bool has_ind = has_index_types();
+  if(!has_ind && !has_vec) {
+    throw invalid_argument("Inconsistent typing schemes in merge_coordinates");
+  }
 
-    return CoordinateSet(coords, types, radii, num_types(unique_index_types));
+  out.src = nullptr;
+  if(sets.size() <= start) {
+    out = CoordinateSet();
+    return;
+  }
 
-  } else { //vector types
+  size_t N = 0;
+  unsigned T = 0;
+  merged_size(sets, start, unique_index_types, N, T);
+
+  //resized only allocates if capacity is exceeded, shared grids are replaced rather than overwritten
+  out.drop_shared();
+  out.coords = out.coords.resized(N, 3);
+  out.radii = out.radii.resized(N);
+  if(has_vec) {
+    out.type_vector = out.type_vector.resized(N, T);
+    out.type_index = MGrid1f();
+    out.max_type = T;
+  } else {
+    out.type_index = out.type_index.resized(N);
+    out.type_vector = MGrid2f();
+    out.max_type = num_types(unique_index_types);
+  }
+  if(sets.size() == start+1) {
+    //as if copied
+    out.max_type = sets[start].max_type;
+    out.src = sets[start].src;
+  }
 
-    vector<float3> coords;
-    vector<vector<float> > types;
-    vector<float> radii;
-    merge_coordinates(coords, types, radii, start, unique_index_types);
-    return CoordinateSet(coords, types, radii);
+  //contents are about to be overwritten, so don't copy them between devices
+  MGrid1f& types1 = out.type_index;
+  MGrid2f& types2 = out.type_vector;
+  if(gpu) {
+    out.coords.togpu(false); out.radii.togpu(false); types1.togpu(false); types2.togpu(false);
+  } else {
+    out.coords.tocpu(false); out.radii.tocpu(false); types1.tocpu(false); types2.tocpu(false);
   }
+  float *c = gpu ? out.coords.gpu().data() : out.coords.cpu().data();
+  float *r = gpu ? out.radii.gpu().data() : out.radii.cpu().data();
+  float *t = nullptr;
+  if(has_vec) t = gpu ? types2.gpu().data() : types2.cpu().data();
+  else t = gpu ? types1.gpu().data() : types1.cpu().data();
+
+  merge_sets(sets, start, unique_index_types, N, has_vec, T, c, t, r, gpu);
 }
 
 bool Example::has_vector_types(unsigned start) const {
@@ -298,6 +420,192 @@ template void Example::extract_label(const vector<Example>&, unsigned, Grid<floa
 template void Example::extract_label(const vector<Example>&, unsigned, Grid<float, 1, true>& );
 
 
+//check the batch dimensions shared by both kinds of typing
+template <bool isCUDA>
+static void check_padded_batch(size_t nexamples, const Grid<float, 3, isCUDA>& coords, size_t typesN,
+    const Grid<float, 2, isCUDA>& radii, const Grid<float, 1, isCUDA>& counts) {
+  size_t N = coords.dimension(1);
+  if(coords.dimension(0) != nexamples || radii.dimension(0) != nexamples || counts.dimension(0) != nexamples)
+    throw std::out_of_range("Grid dimension does not match number of examples: "+itoa(nexamples));
+  if(coords.dimension(2) != 3)
+    throw invalid_argument("Coordinates do not have correct third dimension (3): "+itoa(coords.dimension(2)));
+  if(typesN != N || radii.dimension(1) != N)
+    throw invalid_argument("Padded atom dimensions do not match: "+itoa(N)+", "+itoa(typesN)+", "+itoa(radii.dimension(1)));
+}
+
+/* page-locked memory a thread packs batches into before copying them to the
+ * device, so the copies are asynchronous; reused once the previous copies are done
+ */
+struct pinned_staging {
+  float *data = nullptr;
+  size_t bytes = 0; //size of the pooled block
+  cudaEvent_t copied = nullptr; //recorded after the copies out of data
+  int device = -1; //of copied
+
+  ~pinned_staging() {
+    //the copies may be on a non-blocking stream, which the pool does not wait for
+    if(copied) cudaEventSynchronize(copied);
+    try {
+      if(data) pooled_free(data, bytes, nullptr, 0, device, nullptr);
+    } catch(...) {} //thread exit may follow context teardown
+    cudaGetLastError();
+  }
+
+  //wait for the previous copies, then return room for n floats
+  float* get(size_t n) {
+    if(copied) LMG_CUDA_CHECK(cudaEventSynchronize(copied));
+    if(n*sizeof(float) > bytes) {
+      if(data) pooled_free(data, bytes, nullptr, 0, device, nullptr);
+      data = nullptr;
+      bytes = n*sizeof(float);
+      data = (float*)pooled_host_alloc(bytes);
+      if(!data) {
+        bytes = 0;
+        throw std::runtime_error("Could not allocate "+itoa(n*sizeof(float))+" bytes of page-locked memory");
+      }
+    }
+    return data;
+  }
+
+  //mark data as in use by the work queued on stream so far
+  void copied_on(cudaStream_t stream) {
+    int current = DeviceGuard::current_device();
+    if(copied && device != current) {
+      cudaEventDestroy(copied); //already waited on
+      copied = nullptr;
+    }
+    if(!copied) LMG_CUDA_CHECK(cudaEventCreateWithFlags(&copied, cudaEventDisableTiming));
+    device = current;
+    LMG_CUDA_CHECK(cudaEventRecord(copied, stream));
+  }
+};
+
+//copy n floats of staged host memory to the device on stream
+static void stage_to_device(float *dest, const float *src, size_t n, cudaStream_t stream) {
+  if(n) LMG_CUDA_CHECK(cudaMemcpyAsync(dest, src, sizeof(float)*n, cudaMemcpyHostToDevice, stream));
+}
+
+template <bool isCUDA>
+void Example::extract_coordinates(const std::vector<Example>& examples, Grid<float, 3, isCUDA>& coords,
+    Grid<float, 2, isCUDA>& type_index, Grid<float, 2, isCUDA>& radii, Grid<float, 1, isCUDA>& counts,
+    unsigned start, bool unique_index_types, cudaStream_t stream) {
+  StageTimer timer(STAGE_MERGE);
+  size_t B = examples.size(), N = coords.dimension(1);
+  check_padded_batch(B, coords, type_index.dimension(1), radii, counts);
+  if(type_index.dimension(0) != B) throw std::out_of_range("Grid dimension does not match number of examples: "+itoa(B));
+
+  //device grids are packed on the host and copied at once
+  static thread_local pinned_staging staging;
+  float *stage = isCUDA ? staging.get(B*N*5+B) : nullptr;
+  float *c = isCUDA ? stage : coords.data();
+  float *t = isCUDA ? c+B*N*3 : type_index.data();
+  float *r = isCUDA ? t+B*N : radii.data();
+  float *cnt = isCUDA ? r+B*N : counts.data();
+
+  for(size_t e = 0; e < B; e++) {
+    const vector<CoordinateSet>& sets = examples[e].sets;
+    size_t pos = 0;
+    unsigned toffset = 0; //amount to offset types
+    for(unsigned s = start, ns = sets.size(); s < ns; s++) {
+      const CoordinateSet& CS = sets[s];
+      unsigned n = CS.coords.dimension(0);
+      if(n == 0) continue; //ignore empties, as in merge_coordinates
+      if(!CS.has_indexed_types()) throw logic_error("Coordinate sets do not have compatible index types for merge.");
+      if(pos + n > N) throw std::out_of_range("Example "+itoa(e)+" has more than "+itoa(N)+" atoms");
+
+      memcpy(c+3*(e*N+pos), CS.coords.cpu().data(), sizeof(float)*3*n);
+      const float *ct = CS.type_index.cpu().data();
+      const float *cr = CS.radii.cpu().data();
+      for(unsigned i = 0; i < n; i++) {
+        t[e*N+pos+i] = ct[i]+toffset;
+      }
+      memcpy(r+e*N+pos, cr, sizeof(float)*n);
+      pos += n;
+      if(unique_index_types) toffset += CS.max_type;
+    }
+    cnt[e] = pos;
+    memset(c+3*(e*N+pos), 0, sizeof(float)*3*(N-pos));
+    fill(t+e*N+pos, t+(e+1)*N, -1.0f);
+    memset(r+e*N+pos, 0, sizeof(float)*(N-pos));
+  }
+
+  if(isCUDA) {
+    stage_to_device(coords.data(), c, B*N*3, stream);
+    stage_to_device(type_index.data(), t, B*N, stream);
+    stage_to_device(radii.data(), r, B*N, stream);
+    stage_to_device(counts.data(), cnt, B, stream);
+    staging.copied_on(stream);
+  }
+}
+
+template <bool isCUDA>
+void Example::extract_coordinates(const std::vector<Example>& examples, Grid<float, 3, isCUDA>& coords,
+    Grid<float, 3, isCUDA>& type_vector, Grid<float, 2, isCUDA>& radii, Grid<float, 1, isCUDA>& counts,
+    unsigned start, bool unique_index_types, cudaStream_t stream) {
+  StageTimer timer(STAGE_MERGE);
+  size_t B = examples.size(), N = coords.dimension(1), T = type_vector.dimension(2);
+  check_padded_batch(B, coords, type_vector.dimension(1), radii, counts);
+  if(type_vector.dimension(0) != B) throw std::out_of_range("Grid dimension does not match number of examples: "+itoa(B));
+
+  static thread_local pinned_staging staging;
+  float *stage = isCUDA ? staging.get(B*N*(4+T)+B) : nullptr;
+  float *c = isCUDA ? stage : coords.data();
+  float *t = isCUDA ? c+B*N*3 : type_vector.data();
+  float *r = isCUDA ? t+B*N*T : radii.data();
+  float *cnt = isCUDA ? r+B*N : counts.data();
+
+  for(size_t e = 0; e < B; e++) {
+    const vector<CoordinateSet>& sets = examples[e].sets;
+    size_t pos = 0;
+    unsigned offset = 0;
+    float *et = t+e*N*T;
+    for(unsigned s = start, ns = sets.size(); s < ns; s++) {
+      const CoordinateSet& CS = sets[s];
+      unsigned n = CS.coords.dimension(0);
+      if(n > 0) {
+        if(!CS.has_vector_types()) throw logic_error("Coordinate sets do not have compatible vector types for merge.");
+        if(CS.max_type != CS.type_vector.dimension(1))
+          throw logic_error("Coordinate set "+itoa(s)+" does not have consistent max_type/vector type sizes");
+        if(offset + CS.max_type > T) throw invalid_argument("Types do not have correct dimension: "+itoa(T));
+        if(pos + n > N) throw std::out_of_range("Example "+itoa(e)+" has more than "+itoa(N)+" atoms");
+
+        memcpy(c+3*(e*N+pos), CS.coords.cpu().data(), sizeof(float)*3*n);
+        memcpy(r+e*N+pos, CS.radii.cpu().data(), sizeof(float)*n);
+        const float *ct = CS.type_vector.cpu().data();
+        for(unsigned i = 0; i < n; i++) {
+          float *row = et+(pos+i)*T;
+          memset(row, 0, sizeof(float)*T);
+          memcpy(row+offset, ct+i*CS.max_type, sizeof(float)*CS.max_type);
+        }
+        pos += n;
+      }
+      if(unique_index_types) offset += CS.max_type;
+    }
+    cnt[e] = pos;
+    memset(c+3*(e*N+pos), 0, sizeof(float)*3*(N-pos));
+    memset(et+pos*T, 0, sizeof(float)*T*(N-pos));
+    memset(r+e*N+pos, 0, sizeof(float)*(N-pos));
+  }
+
+  if(isCUDA) {
+    stage_to_device(coords.data(), c, B*N*3, stream);
+    stage_to_device(type_vector.data(), t, B*N*T, stream);
+    stage_to_device(radii.data(), r, B*N, stream);
+    stage_to_device(counts.data(), cnt, B, stream);
+    staging.copied_on(stream);
+  }
+}
+
+template void Example::extract_coordinates(const std::vector<Example>&, Grid<float, 3, false>&, Grid<float, 2, false>&,
+    Grid<float, 2, false>&, Grid<float, 1, false>&, unsigned, bool, cudaStream_t);
+template void Example::extract_coordinates(const std::vector<Example>&, Grid<float, 3, true>&, Grid<float, 2, true>&,
+    Grid<float, 2, true>&, Grid<float, 1, true>&, unsigned, bool, cudaStream_t);
+template void Example::extract_coordinates(const std::vector<Example>&, Grid<float, 3, false>&, Grid<float, 3, false>&,
+    Grid<float, 2, false>&, Grid<float, 1, false>&, unsigned, bool, cudaStream_t);
+template void Example::extract_coordinates(const std::vector<Example>&, Grid<float, 3, true>&, Grid<float, 3, true>&,
+    Grid<float, 2, true>&, Grid<float, 1, true>&, unsigned, bool, cudaStream_t);
+
+
 bool is_numeric(const string& number)
 {
     char* end = nullptr;
@@ -353,6 +661,97 @@ ExampleRef::ExampleRef(const std::string& line, int numlabels, bool hasgroup) {
 
 }
 
+void ExampleRefStore::reserve(size_t nrefs, size_t nfiles, size_t nlabels) {
+  file_end.reserve(nrefs);
+  label_end.reserve(nrefs);
+  groups.reserve(nrefs);
+  seqconts.reserve(nrefs);
+  files.reserve(nfiles);
+  labels.reserve(nlabels);
+}
+
+void ExampleRefStore::clear() {
+  ExampleRefStore empty;
+  swap(empty); //release the memory
+}
+
+void ExampleRefStore::swap(ExampleRefStore& other) {
+  files.swap(other.files);
+  labels.swap(other.labels);
+  file_end.swap(other.file_end);
+  label_end.swap(other.label_end);
+  groups.swap(other.groups);
+  seqconts.swap(other.seqconts);
+}
+
+void ExampleRefStore::push_back(const ExampleRef& ref) {
+  if(groups.size() >= UINT32_MAX || files.size() + ref.files.size() > UINT32_MAX || labels.size() + ref.labels.size() > UINT32_MAX)
+    throw length_error("Too many example references");
+  files.insert(files.end(), ref.files.begin(), ref.files.end());
+  labels.insert(labels.end(), ref.labels.begin(), ref.labels.end());
+  file_end.push_back(files.size());
+  label_end.push_back(labels.size());
+  groups.push_back(ref.group);
+  seqconts.push_back(ref.seqcont);
+}
+
+void ExampleRefStore::push_back(const ExampleRefStore& other, size_t i) {
+  unsigned nf = other.num_files(i), nl = other.num_labels(i);
+  if(groups.size() >= UINT32_MAX || files.size() + nf > UINT32_MAX || labels.size() + nl > UINT32_MAX)
+    throw length_error("Too many example references");
+  files.insert(files.end(), other.file_data(i), other.file_data(i) + nf);
+  labels.insert(labels.end(), other.label_data(i), other.label_data(i) + nl);
+  file_end.push_back(files.size());
+  label_end.push_back(labels.size());
+  groups.push_back(other.groups[i]);
+  seqconts.push_back(other.seqconts[i]);
+}
+
+void ExampleRefStore::append(const ExampleRefStore& other) {
+  reserve(size() + other.size(), files.size() + other.files.size(), labels.size() + other.labels.size());
+  for(size_t i = 0, n = other.size(); i < n; i++) {
+    push_back(other, i);
+  }
+}
+
+void ExampleRefStore::get(size_t i, ExampleRef& ex) const {
+  ex.files.assign(file_data(i), file_data(i) + num_files(i));
+  ex.labels.assign(label_data(i), label_data(i) + num_labels(i));
+  ex.group = groups[i];
+  ex.seqcont = seqconts[i];
+}
+
+size_t StringCache::cstring_hash::operator()(const char *s) const {
+  //FNV-1a
+  size_t h = 14695981039346656037ULL;
+  for(; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+const char* StringCache::get(const std::string& s) {
+  const char *key = s.c_str();
+  Shard& shard = shards[cstring_hash()(key) % num_shards];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto pos = shard.strings.find(key);
+  if(pos != shard.strings.end()) return *pos;
+
+  size_t len = s.size() + 1;
+  if(shard.used + len > block_size) {
+    //strings longer than a block get their own block
+    shard.blocks.push_back(std::unique_ptr<char[]>(new char[max(len, block_size)]));
+    shard.used = 0;
+  }
+  char *str = shard.blocks.back().get() + shard.used;
+  memcpy(str, key, len);
+  //an oversized string fills its block so the next string starts a new one
+  shard.used = len > block_size ? block_size : shard.used + len;
+  shard.strings.insert(str);
+  return str;
+}
+
 template<bool isCUDA>
 void Example::sum_types(Grid<float, 1, isCUDA>& sum, bool unique_types) const {
   unsigned NT = num_types(unique_types);
@@ -8,6 +8,7 @@
 #include "libmolgrid/example_extractor.h"
 #include "libmolgrid/atom_typer.h"
 
+#include <algorithm>
 #include <boost/algorithm/string.hpp>
 #include <boost/filesystem/path.hpp>
 #include <openbabel/obconversion.h>
@@ -24,7 +25,7 @@ void ExampleExtractor::extract(const ExampleRef& ref, Example& ex) {
   ex.seqcont = ref.seqcont;
 
   //for each file in ref, get a coordinate set using the matching typer
-  ex.sets.clear();
+  //existing sets are kept so their memory can be reused
 
   if(!duplicate_poses || ref.files.size() < 3) {
     ex.sets.resize(ref.files.size());
@@ -44,7 +45,7 @@ void ExampleExtractor::extract(const ExampleRef& ref, Example& ex) {
       if(t >= coord_caches.size()) t = coord_caches.size()-1; //repeat last typer if necessary
       coord_caches[t].set_coords(fname, ex.sets[2*(i-1)+1]);
 
-      //duplicate receptor by copying
+      //duplicate receptor without copying, memory is shared until a transform modifies a copy
       if(i > 1) ex.sets[2*(i-1)] = ex.sets[0];
     }
   }
@@ -85,4 +86,45 @@ std::vector<std::string> ExampleExtractor::get_type_names() const {
   return ret;
 }
 
+bool ExampleExtractor::prefetches_referenced() const {
+  for(const CoordCache& c : coord_caches) {
+    if(c.prefetches_referenced()) return true;
+  }
+  return false;
+}
+
+void ExampleExtractor::prefetch(const ExampleRefStore& refs) const {
+  if(!prefetches_referenced()) return;
+  //files are read by the same caches as in extract
+  vector<vector<const char*> > names(coord_caches.size());
+  for(size_t r = 0, nr = refs.size(); r < nr; r++) {
+    const char* const* files = refs.file_data(r);
+    for(unsigned i = 0, n = refs.num_files(r); i < n; i++) {
+      unsigned t = i;
+      if(t >= coord_caches.size()) t = coord_caches.size()-1;
+      names[t].push_back(files[i]);
+    }
+  }
+  for(unsigned t = 0, n = coord_caches.size(); t < n; t++) {
+    coord_caches[t].prefetch(names[t]);
+  }
+}
+
+CacheStats ExampleExtractor::get_cache_stats() const {
+  CacheStats ret;
+  vector<AtomStore*> seen;
+  for(unsigned i = 0, n = coord_caches.size(); i < n; i++) {
+    std::shared_ptr<AtomStore> store = coord_caches[i].get_store();
+    if(!store || find(seen.begin(), seen.end(), store.get()) != seen.end()) continue;
+    seen.push_back(store.get());
+    CacheStats s = store->get_stats();
+    ret.hits += s.hits;
+    ret.misses += s.misses;
+    ret.evictions += s.evictions;
+    ret.bytes += s.bytes;
+    ret.entries += s.entries;
+  }
+  return ret;
+}
+
 } /* namespace libmolgrid */
@@ -7,6 +7,9 @@
 
 #include "libmolgrid/example_provider.h"
 #include "libmolgrid/atom_typer.h"
+#include "libmolgrid/instrumentation.h"
+#include <cstring>
+#include <sstream>
 
 namespace libmolgrid {
 
@@ -16,27 +19,28 @@ ExampleProvider::ExampleProvider(const ExampleProviderSettings& settings) :
     provider(createProvider(settings)),
         extractor(settings,
             make_shared < FileMappedGninaTyper > (defaultGninaReceptorTyper),
-            make_shared < FileMappedGninaTyper > (defaultGninaLigandTyper)) {
+            make_shared < FileMappedGninaTyper > (defaultGninaLigandTyper)),
+        init_settings(settings) {
 
 }
 
 /// Create provider/extractor according to settings with single typer
 ExampleProvider::ExampleProvider(const ExampleProviderSettings& settings,
     std::shared_ptr<AtomTyper> t) :
-    provider(createProvider(settings)), extractor(settings, t) {
+    provider(createProvider(settings)), extractor(settings, t), init_settings(settings) {
 
 }
 
 ExampleProvider::ExampleProvider(const ExampleProviderSettings& settings,
     std::shared_ptr<AtomTyper> t1, std::shared_ptr<AtomTyper> t2) :
-    provider(createProvider(settings)), extractor(settings, t1, t2) {
+    provider(createProvider(settings)), extractor(settings, t1, t2), init_settings(settings) {
 
 }
 
 ExampleProvider::ExampleProvider(const ExampleProviderSettings& settings,
     const std::vector<std::shared_ptr<AtomTyper> >& typrs, const std::vector<std::string>& molcaches)
 :
-    provider(createProvider(settings)), extractor(settings, typrs, molcaches) {
+    provider(createProvider(settings)), extractor(settings, typrs, molcaches), init_settings(settings) {
 
 }
 
@@ -47,54 +51,346 @@ ExampleProvider::ExampleProvider(std::shared_ptr<ExampleRefProvider> p,
 
 }
 
-///load example file file fname and setup provider
-void ExampleProvider::populate(const std::string& fname, int num_labels) {
+ExampleProvider::~ExampleProvider() {
+  stop_prefetching();
+}
+
+void ExampleProvider::populate_file(const std::string& fname, int num_labels, ExampleRefStore *pending) {
   ifstream f(fname.c_str());
   if (!f) throw invalid_argument("Could not open file " + fname);
-  provider->populate(f, num_labels);
+  ExampleRefStore refs;
+  if(!init_settings.index_example_files) {
+    if(!pending && !extractor.prefetches_referenced()) {
+      provider->populate(f, num_labels, init_settings.num_parse_threads);
+      return;
+    }
+    refs = parse_example_refs(f, num_labels, provider->has_group(), init_settings.num_parse_threads);
+  } else {
+    //use the index if it was made from the example file as it is now
+    string index = fname + ".refidx";
+    if(!read_ref_index(index, fname, num_labels, provider->has_group(), refs)) {
+      refs = parse_example_refs(f, num_labels, provider->has_group(), init_settings.num_parse_threads);
+      try {
+        write_ref_index(index, fname, refs, num_labels, provider->has_group());
+      } catch(std::exception& e) {
+        log(WARNING) << "Could not save example index: " << e.what() << "\n";
+      }
+    }
+  }
+  if(pending) {
+    if(pending->empty()) pending->swap(refs);
+    else pending->append(refs);
+    return;
+  }
+  extractor.prefetch(refs);
+  provider->populate(refs);
+}
+
+void ExampleProvider::populate_files(const std::vector<std::string>& fnames, int num_labels) {
+  stop_prefetching(); //provider is about to be reset
+  resumed.clear();
+  if(init_settings.world_size <= 1) {
+    for (unsigned i = 0, n = fnames.size(); i < n; i++) {
+      populate_file(fnames[i], num_labels);
+    }
+  } else {
+    //the files are sharded together so that shards stay the same size,
+    //and only the shard is prefetched and later read
+    ExampleRefStore refs;
+    for (unsigned i = 0, n = fnames.size(); i < n; i++) {
+      populate_file(fnames[i], num_labels, &refs);
+    }
+    shard_example_refs(refs, init_settings.rank, init_settings.world_size, provider->has_group());
+    extractor.prefetch(refs);
+    provider->populate(refs);
+  }
+  lock_guard<mutex> lock(random_engine_mutex); //setup shuffles
   provider->setup();
 }
 
+///load example file file fname and setup provider
+void ExampleProvider::populate(const std::string& fname, int num_labels) {
+  populate_files(vector<string>(1, fname), num_labels);
+}
+
 ///load multiple example files
 void ExampleProvider::populate(const std::vector<std::string>& fnames, int num_labels) {
-  for (unsigned i = 0, n = fnames.size(); i < n; i++) {
-    ifstream f(fnames[i].c_str());
-    if (!f) throw invalid_argument("Could not open file " + fnames[i]);
-    provider->populate(f, num_labels);
-  }
-  provider->setup();
+  populate_files(fnames, num_labels);
 }
 
 ///provide next example
 void ExampleProvider::next(Example& ex) {
-  static thread_local ExampleRef ref;
-  provider->nextref(ref);
+  if(init_settings.num_prefetch_threads > 0) {
+    start_prefetching(1);
+    lock_guard<mutex> lock(batch_mutex);
+    next_prefetched(ex);
+    return;
+  }
+  ExampleRef ref;
+  {
+    lock_guard<mutex> lock(prefetch_mutex);
+    nextref(ref);
+  }
   extractor.extract(ref, ex);
 }
 
 ///provide a batch of examples
 void ExampleProvider::next_batch(std::vector<Example>& ex, unsigned batch_size) {
-  static vector<ExampleRef> refs;
-  ex.resize(batch_size);
-  refs.resize(batch_size);
   provider->check_batch_size(batch_size);
+  ex.resize(batch_size);
+  if(init_settings.num_prefetch_threads > 0) {
+    start_prefetching(batch_size);
+    lock_guard<mutex> lock(batch_mutex);
+    for (unsigned i = 0; i < batch_size; i++) {
+      next_prefetched(ex[i]);
+    }
+    return;
+  }
+  //refs are drawn together, then extracted concurrently with other callers
+  vector<ExampleRef> refs;
+  nextrefs(refs, batch_size);
   for (unsigned i = 0; i < batch_size; i++) {
-    provider->nextref(refs[i]);
     extractor.extract(refs[i], ex[i]);
   }
+}
 
+template <std::size_t TN, bool isCUDA>
+void ExampleProvider::next_batch_coordinates(Grid<float, 3, isCUDA>& coords, Grid<float, TN, isCUDA>& types,
+    Grid<float, 2, isCUDA>& radii, Grid<float, 1, isCUDA>& counts, Grid<float, 2, isCUDA>& labels,
+    unsigned start, bool unique_index_types, cudaStream_t stream) {
+  vector<Example> batch;
+  {
+    lock_guard<mutex> lock(coordinate_mutex);
+    if(coordinate_batches.size()) {
+      swap(batch, coordinate_batches.back());
+      coordinate_batches.pop_back();
+    }
+  }
+  next_batch(batch, coords.dimension(0));
+  Example::extract_coordinates(batch, coords, types, radii, counts, start, unique_index_types, stream);
+  if(labels.size()) Example::extract_labels(batch, labels);
+  lock_guard<mutex> lock(coordinate_mutex);
+  coordinate_batches.push_back(std::move(batch));
 }
 
+template void ExampleProvider::next_batch_coordinates(Grid<float, 3, false>&, Grid<float, 2, false>&, Grid<float, 2, false>&,
+    Grid<float, 1, false>&, Grid<float, 2, false>&, unsigned, bool, cudaStream_t);
+template void ExampleProvider::next_batch_coordinates(Grid<float, 3, true>&, Grid<float, 2, true>&, Grid<float, 2, true>&,
+    Grid<float, 1, true>&, Grid<float, 2, true>&, unsigned, bool, cudaStream_t);
+template void ExampleProvider::next_batch_coordinates(Grid<float, 3, false>&, Grid<float, 3, false>&, Grid<float, 2, false>&,
+    Grid<float, 1, false>&, Grid<float, 2, false>&, unsigned, bool, cudaStream_t);
+template void ExampleProvider::next_batch_coordinates(Grid<float, 3, true>&, Grid<float, 3, true>&, Grid<float, 2, true>&,
+    Grid<float, 1, true>&, Grid<float, 2, true>&, unsigned, bool, cudaStream_t);
+
 void ExampleProvider::skip(unsigned n) {
+  if(init_settings.num_prefetch_threads > 0) {
+    //examples already drawn from the provider come first
+    lock_guard<mutex> lock(batch_mutex);
+    bool prefetching;
+    {
+      lock_guard<mutex> plock(prefetch_mutex);
+      prefetching = workers.size() > 0;
+    }
+    if(prefetching) {
+      Example ex;
+      for(unsigned i = 0; i < n; i++) {
+        next_prefetched(ex);
+      }
+      return;
+    }
+  }
+  lock_guard<mutex> lock(prefetch_mutex);
   ExampleRef ref;
   for(unsigned i = 0; i < n; i++) {
-    provider->nextref(ref);
+    nextref(ref);
   }
 }
 
+void ExampleProvider::nextref(ExampleRef& ref) {
+  if(resumed.size()) {
+    ref = std::move(resumed.front());
+    resumed.pop_front();
+    return;
+  }
+  StageTimer timer(STAGE_NEXTREF);
+  lock_guard<mutex> lock(random_engine_mutex);
+  provider->nextref(ref);
+}
+
+void ExampleProvider::nextrefs(std::vector<ExampleRef>& refs, unsigned n) {
+  lock_guard<mutex> lock(prefetch_mutex);
+  refs.resize(n);
+  for(unsigned i = 0; i < n; i++) {
+    nextref(refs[i]);
+  }
+}
+
+namespace {
+const char provider_state_magic[8] = {'L','M','G','S','T','A','T','E'};
+const uint32_t provider_state_version = 2; //2: uniform orders are 32-bit indices
+
+void write_ref(ostream& out, const ExampleRef& ref) {
+  provider_state::write<int32_t>(out, ref.group);
+  provider_state::write<uint8_t>(out, ref.seqcont);
+  provider_state::write_vector(out, ref.labels);
+  provider_state::write<uint32_t>(out, ref.files.size());
+  for(const char *f : ref.files) {
+    uint32_t len = strlen(f);
+    provider_state::write<uint32_t>(out, len);
+    out.write(f, len);
+  }
+}
+
+ExampleRef read_ref(istream& in) {
+  ExampleRef ref;
+  ref.group = provider_state::read<int32_t>(in);
+  ref.seqcont = provider_state::read<uint8_t>(in);
+  provider_state::read_vector(in, ref.labels);
+  uint32_t nfiles = provider_state::read<uint32_t>(in);
+  string name;
+  for(uint32_t i = 0; i < nfiles; i++) {
+    uint32_t len = provider_state::read<uint32_t>(in);
+    name.resize(len);
+    if(!in.read(&name[0], len)) throw invalid_argument("Truncated provider state");
+    ref.files.push_back(string_cache.get(name));
+  }
+  return ref;
+}
+}
+
+void ExampleProvider::save_state(std::ostream& out) {
+  //workers can not draw more refs while the lock is held
+  unique_lock<mutex> lock(prefetch_mutex);
+  out.write(provider_state_magic, sizeof(provider_state_magic));
+  provider_state::write<uint32_t>(out, provider_state_version);
+  provider->save_state(out);
+
+  stringstream engine;
+  {
+    lock_guard<mutex> elock(random_engine_mutex);
+    engine << random_engine;
+  }
+  string e = engine.str();
+  provider_state::write<uint32_t>(out, e.size());
+  out.write(e.data(), e.size());
+
+  //refs already drawn from the provider, in the order they will be returned
+  provider_state::write<uint64_t>(out, prefetched.size() + resumed.size());
+  for(const PrefetchSlot& slot : prefetched) write_ref(out, slot.ref);
+  for(const ExampleRef& ref : resumed) write_ref(out, ref);
+  if(!out) throw invalid_argument("Could not write provider state");
+}
+
+void ExampleProvider::load_state(std::istream& in) {
+  stop_prefetching(); //prefetched examples are either in the state or follow it
+  char magic[sizeof(provider_state_magic)];
+  if(!in.read(magic, sizeof(magic)) || memcmp(magic, provider_state_magic, sizeof(magic)) != 0) {
+    throw invalid_argument("Not a provider state");
+  }
+  uint32_t version = provider_state::read<uint32_t>(in);
+  if(version != provider_state_version) throw invalid_argument("Unsupported provider state version "+itoa(version));
+
+  //a bad state leaves the provider where it was
+  stringstream backup;
+  provider->save_state(backup);
+  default_random_engine engine;
+  deque<ExampleRef> pending;
+  try {
+    provider->load_state(in);
+    uint32_t len = provider_state::read<uint32_t>(in);
+    string e(len, '\0');
+    if(!in.read(&e[0], len)) throw invalid_argument("Truncated provider state");
+    stringstream estr(e);
+    if(!(estr >> engine)) throw invalid_argument("Invalid random engine state");
+
+    uint64_t npending = provider_state::read<uint64_t>(in);
+    for(uint64_t i = 0; i < npending; i++) {
+      pending.push_back(read_ref(in));
+    }
+  } catch(...) {
+    provider->load_state(backup);
+    throw;
+  }
+  {
+    lock_guard<mutex> elock(random_engine_mutex);
+    random_engine = engine;
+  }
+  swap(resumed, pending);
+}
+
+void ExampleProvider::start_prefetching(unsigned batch_size) {
+  unique_lock<mutex> lock(prefetch_mutex);
+  size_t capacity = max(init_settings.prefetch_depth, 1U) * (size_t)batch_size;
+  if(capacity > prefetch_capacity) {
+    prefetch_capacity = capacity;
+    work_cv.notify_all();
+  }
+  if(workers.size() == 0) {
+    stop_workers = false;
+    for(unsigned i = 0; i < init_settings.num_prefetch_threads; i++) {
+      workers.push_back(thread(&ExampleProvider::prefetch_worker, this));
+    }
+  }
+}
+
+void ExampleProvider::stop_prefetching() {
+  {
+    unique_lock<mutex> lock(prefetch_mutex);
+    if(workers.size() == 0) return;
+    stop_workers = true;
+  }
+  work_cv.notify_all();
+  for(auto& w : workers) {
+    w.join();
+  }
+  workers.clear();
+  prefetched.clear();
+  prefetch_capacity = 0;
+  stop_workers = false;
+}
+
+void ExampleProvider::prefetch_worker() {
+  unique_lock<mutex> lock(prefetch_mutex);
+  while(true) {
+    work_cv.wait(lock, [this] { return stop_workers || prefetched.size() < prefetch_capacity; });
+    if(stop_workers) return;
+
+    //refs are drawn while holding the lock so they are produced in provider order;
+    //deque references remain valid as slots are added and removed at the ends
+    prefetched.emplace_back();
+    PrefetchSlot& slot = prefetched.back();
+    try {
+      nextref(slot.ref);
+      lock.unlock();
+      extractor.extract(slot.ref, slot.ex);
+      lock.lock();
+    } catch(...) {
+      if(!lock.owns_lock()) lock.lock();
+      slot.error = current_exception();
+    }
+    slot.ready = true;
+    ready_cv.notify_all();
+  }
+}
+
+void ExampleProvider::next_prefetched(Example& ex) {
+  unique_lock<mutex> lock(prefetch_mutex);
+  ready_cv.wait(lock, [this] { return prefetched.size() > 0 && prefetched.front().ready; });
+  PrefetchSlot& slot = prefetched.front();
+  exception_ptr error = slot.error;
+  swap(ex, slot.ex);
+  prefetched.pop_front();
+  lock.unlock();
+  work_cv.notify_one();
+
+  if(error) rethrow_exception(error);
+}
 
 std::shared_ptr<ExampleRefProvider> ExampleProvider::createProvider(
     const ExampleProviderSettings& settings) {
+  if(settings.rank >= settings.world_size) {
+    throw invalid_argument("rank "+itoa(settings.rank)+" is not less than world_size "+itoa(settings.world_size));
+  }
   bool balanced = settings.balanced;
   bool strat_receptor = settings.stratify_receptor;
   bool strat_aff = settings.stratify_max != settings.stratify_min;
@@ -7,6 +7,14 @@
 
 #include "libmolgrid/exampleref_providers.h"
 #include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <thread>
 
 namespace libmolgrid {
 
@@ -41,43 +49,343 @@ void ReceptorStratifiedExampleRefProvider<BalancedExampleRefProvider, 2>::setup(
   }
 
   swap(examples,tmp);
-  if(randomize) shuffle(examples.begin(), examples.end(), random_engine);
+  order.resize(examples.size());
+  iota(order.begin(), order.end(), 0);
+  if(randomize) shuffle(order.begin(), order.end(), random_engine);
 
 }
 
-int ExampleRefProvider::populate(std::istream& lines, int numlabels) {
+ExampleRefStore parse_example_refs(std::istream& lines, int numlabels, bool hasgroup, unsigned nthreads) {
   if(!lines) throw invalid_argument("Could not read lines");
 
-  string line;
-  while (getline(lines, line))
+  stringstream buffer;
+  buffer << lines.rdbuf();
+  const string data = buffer.str();
+
+  if(nthreads == 0) nthreads = max(thread::hardware_concurrency(), 1U);
+  //chunks must be big enough to be worth a thread
+  const size_t min_chunk = 1 << 16;
+  nthreads = max<size_t>(1, min<size_t>(nthreads, data.size() / min_chunk));
+
+  //chunk boundaries are moved forward to the start of a line
+  vector<size_t> bounds(nthreads + 1, data.size());
+  bounds[0] = 0;
+  for(unsigned t = 1; t < nthreads; t++) {
+    size_t pos = max(bounds[t-1], data.size() * t / nthreads);
+    if(pos > 0 && pos < data.size()) {
+      pos = data.find('\n', pos - 1);
+      pos = pos == string::npos ? data.size() : pos + 1;
+    }
+    bounds[t] = pos;
+  }
+
+  vector<ExampleRefStore> chunks(nthreads);
+  vector<exception_ptr> errors(nthreads);
+  auto parse = [&](unsigned t) {
+    try {
+      string line;
+      size_t pos = bounds[t], end = bounds[t+1];
+      while(pos < end) {
+        size_t eol = data.find('\n', pos);
+        if(eol == string::npos || eol > end) eol = end;
+        line.assign(data, pos, eol - pos);
+        pos = eol + 1;
+        trim(line);
+        if(line.length() > 0) { //ignore blank lines
+          chunks[t].push_back(ExampleRef(line, numlabels, hasgroup));
+        }
+      }
+    } catch(...) {
+      errors[t] = current_exception();
+    }
+  };
+
+  vector<thread> threads;
+  for(unsigned t = 1; t < nthreads; t++) {
+    threads.push_back(thread(parse, t));
+  }
+  parse(0);
+  for(thread& th : threads) th.join();
+  for(exception_ptr& e : errors) { //report the first bad line
+    if(e) rethrow_exception(e);
+  }
+
+  ExampleRefStore refs;
+  refs.swap(chunks[0]);
+  for(unsigned t = 1; t < nthreads; t++) {
+    refs.append(chunks[t]);
+    chunks[t].clear();
+  }
+  return refs;
+}
+
+void shard_example_refs(ExampleRefStore& refs, unsigned rank, unsigned world_size, bool hasgroup) {
+  if(rank >= world_size) throw invalid_argument("rank "+itoa(rank)+" is not less than world_size "+itoa(world_size));
+  if(world_size == 1) return;
+  ExampleRefStore shard;
+  if(hasgroup && refs.size() > 0) {
+    unordered_map<int, size_t> group_order;
+    vector<size_t> own; //refs of this shard
+    int maxgroup = refs.group(0);
+    for(size_t i = 0, n = refs.size(); i < n; i++) {
+      size_t g = group_order.emplace(refs.group(i), group_order.size()).first->second;
+      if(g % world_size == rank) own.push_back(i);
+      maxgroup = max(maxgroup, refs.group(i));
+    }
+    size_t ngroups = group_order.size();
+    if(ngroups < world_size) throw invalid_argument("Only "+itoa(ngroups)+" groups to shard across "+itoa(world_size)+" ranks");
+    for(size_t i : own) shard.push_back(refs, i);
+
+    //pad with copies of this shard's own groups, under new group ids, so every shard has as many groups
+    size_t per_rank = (ngroups + world_size - 1) / world_size;
+    size_t mine = (ngroups - rank + world_size - 1) / world_size;
+    ExampleRef ref;
+    for(size_t p = 0; mine + p < per_rank; p++) {
+      int copied = refs.group(own[0]);
+      for(size_t i : own) {
+        refs.get(i, ref);
+        if(ref.group != copied) continue;
+        ref.group = maxgroup + 1 + p;
+        shard.push_back(ref);
+      }
+    }
+  } else if(refs.size() > 0) {
+    size_t n = refs.size();
+    if(n < world_size) throw invalid_argument("Only "+itoa(n)+" examples to shard across "+itoa(world_size)+" ranks");
+    size_t per_rank = (n + world_size - 1) / world_size;
+    shard.reserve(per_rank);
+    for(size_t i = rank; i < n; i += world_size) {
+      shard.push_back(refs, i);
+    }
+    //pad with this shard's own refs so no example is in two shards
+    for(size_t i = 0, own = shard.size(); shard.size() < per_rank; i++) {
+      shard.push_back(refs, rank + (i % own) * world_size);
+    }
+  }
+  refs.swap(shard);
+}
+
+namespace {
+//binary ref index layout, all in native byte order:
+//  magic, int32 numlabels, int32 hasgroup
+//  uint64 number of names, then each name as uint32 length and characters
+//  uint64 number of refs, then each ref as int32 group, uint32 number of labels,
+//  uint32 number of files, float labels, uint32 name indices
+const char ref_index_magic[8] = {'L','M','G','R','E','F','2','\0'};
+
+//identity of the example file an index was parsed from
+struct source_stamp {
+  uint64_t size = 0;
+  int64_t mtime = 0;
+  uint64_t hash = 0; //of the start of the file, catches edits that keep size and time
+};
+
+//stamp source, false if it can't be read
+bool stamp_source(const std::string& source, source_stamp& stamp) {
+  boost::system::error_code ec;
+  stamp.size = boost::filesystem::file_size(source, ec);
+  if(ec) return false;
+  stamp.mtime = boost::filesystem::last_write_time(source, ec);
+  if(ec) return false;
+  ifstream f(source.c_str(), ios::binary);
+  if(!f) return false;
+  char head[65536];
+  f.read(head, sizeof(head));
+  size_t n = f.gcount();
+  uint64_t h = 14695981039346656037ULL; //FNV-1a
+  for(size_t i = 0; i < n; i++) {
+    h ^= (unsigned char)head[i];
+    h *= 1099511628211ULL;
+  }
+  stamp.hash = h;
+  return true;
+}
+
+//bounds checked reads from a mapped index
+struct index_reader {
+  const char *pos;
+  const char *end;
+  bool ok = true;
+
+  template <typename T>
+  T get() {
+    T ret = T();
+    if(size_t(end - pos) < sizeof(T)) {
+      ok = false;
+      return ret;
+    }
+    memcpy(&ret, pos, sizeof(T));
+    pos += sizeof(T);
+    return ret;
+  }
+
+  const char* skip(size_t n) {
+    const char *ret = pos;
+    if(size_t(end - pos) < n) {
+      ok = false;
+      return nullptr;
+    }
+    pos += n;
+    return ret;
+  }
+};
+
+template <typename T>
+void put(ostream& out, T val) {
+  out.write((const char*)&val, sizeof(T));
+}
+}
+
+void write_ref_index(const std::string& fname, const std::string& source, const ExampleRefStore& refs, int numlabels, bool hasgroup) {
+  source_stamp stamp;
+  if(!stamp_source(source, stamp)) throw invalid_argument("Could not read "+source);
+  unordered_map<const char*, uint32_t> ids;
+  vector<const char*> names;
+  for(size_t i = 0, n = refs.size(); i < n; i++) {
+    const char* const* files = refs.file_data(i);
+    for(unsigned f = 0, nf = refs.num_files(i); f < nf; f++) {
+      if(ids.emplace(files[f], names.size()).second) names.push_back(files[f]);
+    }
+  }
+
+  //write to a temporary so a partial index is never read
+  string tmp = fname + ".tmp";
   {
-    trim(line);
-    if(line.length() > 0) { //ignore blank lines
-      ExampleRef ref(line, numlabels, has_group());
-      addref(ref);
+    ofstream out(tmp.c_str(), ios::binary);
+    if(!out) throw invalid_argument("Could not write "+tmp);
+    out.write(ref_index_magic, sizeof(ref_index_magic));
+    put<uint64_t>(out, stamp.size);
+    put<int64_t>(out, stamp.mtime);
+    put<uint64_t>(out, stamp.hash);
+    put<int32_t>(out, numlabels);
+    put<int32_t>(out, hasgroup);
+    put<uint64_t>(out, names.size());
+    for(const char *n : names) {
+      uint32_t len = strlen(n);
+      put<uint32_t>(out, len);
+      out.write(n, len);
+    }
+    put<uint64_t>(out, refs.size());
+    for(size_t i = 0, n = refs.size(); i < n; i++) {
+      unsigned nlabels = refs.num_labels(i), nfiles = refs.num_files(i);
+      put<int32_t>(out, refs.group(i));
+      put<uint32_t>(out, nlabels);
+      put<uint32_t>(out, nfiles);
+      out.write((const char*)refs.label_data(i), nlabels*sizeof(float));
+      const char* const* files = refs.file_data(i);
+      for(unsigned f = 0; f < nfiles; f++) {
+        put<uint32_t>(out, ids[files[f]]);
+      }
+    }
+    if(!out) throw invalid_argument("Could not write "+tmp);
+  }
+  if(rename(tmp.c_str(), fname.c_str()) != 0) {
+    remove(tmp.c_str());
+    throw invalid_argument("Could not write "+fname);
+  }
+}
+
+bool read_ref_index(const std::string& fname, const std::string& source, int numlabels, bool hasgroup, ExampleRefStore& refs) {
+  source_stamp stamp;
+  if(!stamp_source(source, stamp)) return false;
+  boost::iostreams::mapped_file_source map;
+  try {
+    map.open(fname.c_str());
+  } catch(std::exception& e) {
+    return false;
+  }
+  if(!map.is_open()) return false;
+
+  index_reader in{map.data(), map.data() + map.size()};
+  const char *magic = in.skip(sizeof(ref_index_magic));
+  if(!in.ok || memcmp(magic, ref_index_magic, sizeof(ref_index_magic)) != 0) return false;
+  if(in.get<uint64_t>() != stamp.size || in.get<int64_t>() != stamp.mtime || in.get<uint64_t>() != stamp.hash || !in.ok)
+    return false; //stale
+  if(in.get<int32_t>() != numlabels || in.get<int32_t>() != int32_t(hasgroup) || !in.ok) return false;
+
+  uint64_t nnames = in.get<uint64_t>();
+  vector<const char*> names;
+  names.reserve(in.ok ? min<uint64_t>(nnames, map.size()) : 0);
+  string name;
+  for(uint64_t i = 0; i < nnames && in.ok; i++) {
+    uint32_t len = in.get<uint32_t>();
+    const char *chars = in.skip(len);
+    if(!in.ok) break;
+    name.assign(chars, len);
+    names.push_back(string_cache.get(name));
+  }
+
+  uint64_t nrefs = in.get<uint64_t>();
+  if(!in.ok) return false;
+  ExampleRefStore ret;
+  ret.reserve(min<uint64_t>(nrefs, map.size()));
+  ExampleRef ref; //reused for every ref
+  for(uint64_t i = 0; i < nrefs; i++) {
+    ref.group = in.get<int32_t>();
+    uint32_t nlabels = in.get<uint32_t>();
+    uint32_t nfiles = in.get<uint32_t>();
+    const char *labels = in.skip(size_t(nlabels)*sizeof(float));
+    const char *files = in.skip(size_t(nfiles)*sizeof(uint32_t));
+    if(!in.ok) return false;
+    ref.labels.resize(nlabels);
+    memcpy(ref.labels.data(), labels, nlabels*sizeof(float));
+    ref.files.resize(nfiles);
+    for(uint32_t f = 0; f < nfiles; f++) {
+      uint32_t id;
+      memcpy(&id, files + f*sizeof(uint32_t), sizeof(uint32_t));
+      if(id >= names.size()) return false;
+      ref.files[f] = names[id];
     }
+    ret.push_back(ref);
   }
+  if(in.pos != in.end) return false;
+  refs.swap(ret);
+  return true;
+}
+
+int ExampleRefProvider::populate(std::istream& lines, int numlabels, unsigned nthreads) {
+  return populate(parse_example_refs(lines, numlabels, has_group(), nthreads));
+}
 
+int ExampleRefProvider::populate(const ExampleRefStore& refs) {
+  ExampleRef ref; //reused for every ref
+  for(size_t i = 0, n = refs.size(); i < n; i++) {
+    refs.get(i, ref);
+    addref(ref);
+  }
   return size();
 }
 
 void UniformExampleRefProvider::addref(const ExampleRef& ex)
 {
   all.push_back(ex);
+  order.clear(); //no longer a permutation of all, until the next setup
   nlabels = ex.labels.size();
 }
 
 void UniformExampleRefProvider::setup()
 {
   current = 0;
-  if(randomize) shuffle(all.begin(), all.end(), random_engine);
+  if(randomize) {
+    //blocks are drawn from all in its original order, otherwise the order of the
+    //previous epoch is shuffled again, so all is never shuffled itself
+    if(block_size > 0) {
+      block_shuffle(order, all.size(), block_size, window, random_engine);
+    } else {
+      if(order.size() != all.size()) {
+        order.resize(all.size());
+        iota(order.begin(), order.end(), 0);
+      }
+      shuffle(order.begin(), order.end(), random_engine);
+    }
+  }
   if(all.size() == 0) throw std::invalid_argument("No valid examples found in training set.");
 }
 
 void UniformExampleRefProvider::nextref(ExampleRef& ex)
 {
   assert(current < all.size());
-  ex = all[current];
+  all.get(order.size() ? order[current] : current, ex);
 
   if(ncopies > 1) {
     current_copy++;
@@ -94,6 +402,24 @@ void UniformExampleRefProvider::nextref(ExampleRef& ex)
   }
 }
 
+void UniformExampleRefProvider::save_state(std::ostream& out) const {
+  provider_state::write<uint64_t>(out, all.size());
+  provider_state::write<uint64_t>(out, current);
+  provider_state::write<uint64_t>(out, current_copy);
+  provider_state::write_vector(out, order);
+}
+
+void UniformExampleRefProvider::load_state(std::istream& in) {
+  provider_state::check_size(in, all.size());
+  current = provider_state::read<uint64_t>(in);
+  current_copy = provider_state::read<uint64_t>(in);
+  provider_state::read_vector(in, order);
+  if(current >= all.size() || (order.size() && order.size() != all.size())) throw invalid_argument("Invalid provider state");
+  for(uint32_t i : order) {
+    if(i >= all.size()) throw invalid_argument("Invalid provider state");
+  }
+}
+
 void BalancedExampleRefProvider::addref(const ExampleRef& ex)
 {
   if(labelpos < ex.labels.size()) {
@@ -116,12 +442,26 @@ void BalancedExampleRefProvider::setup()
 void BalancedExampleRefProvider::nextref(ExampleRef& ex)
 {
   //alternate between actives and decoys
-  if(current % 2 == 0)
+  if(current == 0)
     actives.nextref(ex);
   else
     decoys.nextref(ex);
 
-  current++;
+  current = (current+1) % 2;
+}
+
+void BalancedExampleRefProvider::save_state(std::ostream& out) const {
+  provider_state::write<uint64_t>(out, current);
+  actives.save_state(out);
+  decoys.save_state(out);
+}
+
+void BalancedExampleRefProvider::load_state(std::istream& in) {
+  current = provider_state::read<uint64_t>(in);
+  if(current > 1) throw invalid_argument("Invalid provider state");
+  //the actives and decoys check their own sizes and positions
+  actives.load_state(in);
+  decoys.load_state(in);
 }
 
 
@@ -9,6 +9,12 @@
 
 #include "libmolgrid/grid_io.h"
 #include <boost/algorithm/string.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iomanip>
 
@@ -230,6 +236,295 @@ void write_map(const std::string& fname, const Grid<DType, 3>& grid, const float
 
 
 
+/* Grid file layout, all values native endian:
+ *   header: magic, version, bytes per value, channels, x, y, z, center, resolution
+ *   channel table: encoding, name length, offset, stored bytes, name
+ *   raw channels, contiguous and starting on a GRID_FILE_ALIGN boundary
+ *   sparse channels: count, uint32 indices, values
+ *   deflate channels: zlib stream of the values
+ */
+static const char GRID_FILE_MAGIC[8] = {'L','M','G','G','R','I','D','\0'};
+static const uint32_t GRID_FILE_VERSION = 1;
+static const size_t GRID_FILE_ALIGN = 64;
+static const size_t GRID_FILE_HEADER = sizeof(GRID_FILE_MAGIC) + 6*sizeof(uint32_t) + 4*sizeof(float);
+static const size_t GRID_FILE_CHANNEL = 2*sizeof(uint32_t) + 2*sizeof(uint64_t);
+
+template <typename T>
+static void put(std::ostream& out, T val) {
+  out.write((const char*)&val, sizeof(T));
+}
+
+//copy a T out of unaligned memory, advancing ptr
+template <typename T>
+static T take(const char *& ptr) {
+  T val;
+  memcpy(&val, ptr, sizeof(T));
+  ptr += sizeof(T);
+  return val;
+}
+
+template <typename Dtype>
+void write_grid_file(const std::string& fname, const Grid<Dtype, 4>& grid, const float3& center, float resolution,
+    const std::vector<std::string>& names, GridEncoding encoding, bool sparse) {
+  unsigned nchannels = grid.dimension(0);
+  size_t n = grid.dimension(1)*grid.dimension(2)*grid.dimension(3);
+  size_t raw_bytes = n*sizeof(Dtype);
+  if(names.size() && names.size() != nchannels)
+    throw invalid_argument("Number of channel names ("+itoa(names.size())+") does not match number of channels ("+itoa(nchannels)+")");
+  if(encoding != GRID_RAW && encoding != GRID_DEFLATE)
+    throw invalid_argument("Grid file channels must be encoded as GRID_RAW or GRID_DEFLATE");
+  if(n > UINT32_MAX) throw invalid_argument("Grid too large to write as a grid file");
+
+  //encode compressed channels up front to learn their sizes
+  vector<GridEncoding> encodings(nchannels, GRID_RAW);
+  vector<vector<char> > encoded(nchannels);
+  for(unsigned c = 0; c < nchannels; c++) {
+    const Dtype *data = grid[c].data();
+    if(encoding == GRID_DEFLATE) {
+      iostreams::filtering_ostream zout;
+      zout.push(iostreams::zlib_compressor());
+      zout.push(iostreams::back_inserter(encoded[c]));
+      zout.write((const char*)data, raw_bytes);
+      zout.reset(); //flush
+      encodings[c] = GRID_DEFLATE;
+    }
+    if(sparse) {
+      size_t nnz = 0;
+      for(size_t i = 0; i < n; i++) {
+        if(data[i] != 0) nnz++;
+      }
+      size_t sparse_bytes = sizeof(uint64_t) + nnz*(sizeof(uint32_t)+sizeof(Dtype));
+      size_t dense_bytes = encodings[c] == GRID_DEFLATE ? encoded[c].size() : raw_bytes;
+      if(sparse_bytes < dense_bytes) {
+        vector<char>& buf = encoded[c];
+        buf.resize(sparse_bytes);
+        char *ptr = buf.data();
+        uint64_t count = nnz;
+        memcpy(ptr, &count, sizeof(count));
+        char *idx = ptr+sizeof(count);
+        char *vals = idx+nnz*sizeof(uint32_t);
+        for(size_t i = 0; i < n; i++) {
+          if(data[i] != 0) {
+            uint32_t index = i;
+            memcpy(idx, &index, sizeof(index));
+            memcpy(vals, data+i, sizeof(Dtype));
+            idx += sizeof(index);
+            vals += sizeof(Dtype);
+          }
+        }
+        encodings[c] = GRID_SPARSE;
+      }
+    }
+  }
+
+  //raw channels are laid out first so that together they form one view
+  size_t table = GRID_FILE_HEADER;
+  for(unsigned c = 0; c < nchannels; c++) {
+    table += GRID_FILE_CHANNEL + (names.size() ? names[c].size() : 0);
+  }
+  size_t offset = (table + GRID_FILE_ALIGN - 1) / GRID_FILE_ALIGN * GRID_FILE_ALIGN;
+  vector<size_t> offsets(nchannels), sizes(nchannels);
+  for(unsigned c = 0; c < nchannels; c++) {
+    if(encodings[c] == GRID_RAW) {
+      offsets[c] = offset;
+      sizes[c] = raw_bytes;
+      offset += raw_bytes;
+    }
+  }
+  for(unsigned c = 0; c < nchannels; c++) {
+    if(encodings[c] != GRID_RAW) {
+      offsets[c] = offset;
+      sizes[c] = encoded[c].size();
+      offset += encoded[c].size();
+    }
+  }
+
+  std::ofstream out(fname.c_str(), std::ios::binary);
+  if(!out) throw invalid_argument("Could not open file "+fname);
+  out.write(GRID_FILE_MAGIC, sizeof(GRID_FILE_MAGIC));
+  put<uint32_t>(out, GRID_FILE_VERSION);
+  put<uint32_t>(out, sizeof(Dtype));
+  put<uint32_t>(out, nchannels);
+  for(unsigned i = 1; i < 4; i++) put<uint32_t>(out, grid.dimension(i));
+  put<float>(out, center.x);
+  put<float>(out, center.y);
+  put<float>(out, center.z);
+  put<float>(out, resolution);
+  for(unsigned c = 0; c < nchannels; c++) {
+    string name = names.size() ? names[c] : string();
+    put<uint32_t>(out, encodings[c]);
+    put<uint32_t>(out, name.size());
+    put<uint64_t>(out, offsets[c]);
+    put<uint64_t>(out, sizes[c]);
+    out.write(name.data(), name.size());
+  }
+  for(size_t i = table; i < (table + GRID_FILE_ALIGN - 1) / GRID_FILE_ALIGN * GRID_FILE_ALIGN; i++) out.put(0);
+  for(unsigned c = 0; c < nchannels; c++) {
+    if(encodings[c] == GRID_RAW) out.write((const char*)grid[c].data(), raw_bytes);
+  }
+  for(unsigned c = 0; c < nchannels; c++) {
+    if(encodings[c] != GRID_RAW) out.write(encoded[c].data(), encoded[c].size());
+  }
+  if(!out) throw invalid_argument("Could not write grid file "+fname);
+}
+
+GridFile::GridFile(const std::string& fn): fname(fn) {
+  try {
+    map.open(fname);
+  } catch(std::exception& e) {
+    throw invalid_argument("Could not open grid file "+fname+": "+e.what());
+  }
+  size_t fsize = map.size();
+  const char *ptr = map.data();
+  if(fsize < GRID_FILE_HEADER || memcmp(ptr, GRID_FILE_MAGIC, sizeof(GRID_FILE_MAGIC)) != 0)
+    throw invalid_argument(fname+" is not a grid file");
+  ptr += sizeof(GRID_FILE_MAGIC);
+  uint32_t version = take<uint32_t>(ptr);
+  if(version != GRID_FILE_VERSION) throw invalid_argument("Unsupported grid file version "+itoa(version)+" in "+fname);
+  elem_size = take<uint32_t>(ptr);
+  if(elem_size != sizeof(float) && elem_size != sizeof(double))
+    throw invalid_argument("Invalid value size "+itoa(elem_size)+" in grid file "+fname);
+  uint32_t nchannels = take<uint32_t>(ptr);
+  for(unsigned i = 0; i < 3; i++) dims[i] = take<uint32_t>(ptr);
+  center_.x = take<float>(ptr);
+  center_.y = take<float>(ptr);
+  center_.z = take<float>(ptr);
+  resolution_ = take<float>(ptr);
+
+  //dimensions are 32 bit, so the size of a channel is computed checking that it can't wrap around
+  size_t n = 1;
+  for(unsigned i = 0; i < 3; i++) {
+    if(dims[i] && n > SIZE_MAX / elem_size / dims[i]) throw invalid_argument("Invalid grid dimensions in grid file "+fname);
+    n *= dims[i];
+  }
+  const char *end = map.data()+fsize;
+  channels.resize(nchannels);
+  for(unsigned c = 0; c < nchannels; c++) {
+    Channel& ch = channels[c];
+    if(size_t(end-ptr) < GRID_FILE_CHANNEL) throw invalid_argument("Truncated grid file "+fname);
+    uint32_t encoding = take<uint32_t>(ptr);
+    uint32_t len = take<uint32_t>(ptr);
+    ch.offset = take<uint64_t>(ptr);
+    ch.bytes = take<uint64_t>(ptr);
+    if(size_t(end-ptr) < len) throw invalid_argument("Truncated grid file "+fname);
+    ch.name.assign(ptr, len);
+    ptr += len;
+    if(encoding > GRID_DEFLATE) throw invalid_argument("Invalid channel encoding "+itoa(encoding)+" in grid file "+fname);
+    ch.encoding = (GridEncoding)encoding;
+    if(ch.offset > fsize || ch.bytes > fsize - ch.offset) throw invalid_argument("Truncated grid file "+fname);
+    if(ch.encoding == GRID_RAW && (ch.bytes != n*elem_size || ch.offset % elem_size))
+      throw invalid_argument("Invalid raw channel "+itoa(c)+" in grid file "+fname);
+    //deflate expands data at most 1032 fold, so larger channels can't be stored in the file
+    if(ch.encoding == GRID_DEFLATE && n*elem_size / 1032 > ch.bytes)
+      throw invalid_argument("Invalid compressed channel "+itoa(c)+" in grid file "+fname);
+    if(ch.encoding == GRID_SPARSE) {
+      const char *sp = map.data()+ch.offset;
+      uint64_t count = ch.bytes < sizeof(uint64_t) ? 0 : take<uint64_t>(sp);
+      if(ch.bytes < sizeof(uint64_t) || count > n || ch.bytes != sizeof(uint64_t) + count*(sizeof(uint32_t)+elem_size))
+        throw invalid_argument("Invalid sparse channel "+itoa(c)+" in grid file "+fname);
+    }
+  }
+}
+
+std::vector<std::string> GridFile::channel_names() const {
+  vector<string> ret;
+  ret.reserve(channels.size());
+  for(const Channel& ch : channels) ret.push_back(ch.name);
+  return ret;
+}
+
+const GridFile::Channel& GridFile::channel_info(unsigned c) const {
+  if(c >= channels.size()) throw out_of_range("Channel "+itoa(c)+" out of range in grid file "+fname);
+  return channels[c];
+}
+
+void GridFile::check_channel(unsigned c, size_t elsize) const {
+  if(c >= channels.size()) throw out_of_range("Channel "+itoa(c)+" out of range in grid file "+fname);
+  if(elsize != elem_size) throw invalid_argument("Requested value type does not match grid file "+fname);
+}
+
+template <typename Dtype>
+Grid<Dtype, 3, false> GridFile::channel(unsigned c) const {
+  check_channel(c, sizeof(Dtype));
+  if(channels[c].encoding != GRID_RAW) throw invalid_argument("Channel "+itoa(c)+" of "+fname+" is compressed and cannot be viewed");
+  Dtype *data = (Dtype*)const_cast<char*>(map.data()+channels[c].offset);
+  return Grid<Dtype, 3, false>(data, dims[0], dims[1], dims[2]);
+}
+
+template <typename Dtype>
+Grid<Dtype, 4, false> GridFile::view() const {
+  if(elem_size != sizeof(Dtype)) throw invalid_argument("Requested value type does not match grid file "+fname);
+  size_t chbytes = size_t(dims[0])*dims[1]*dims[2]*sizeof(Dtype);
+  for(unsigned c = 0, n = channels.size(); c < n; c++) {
+    if(channels[c].encoding != GRID_RAW || channels[c].offset != channels[0].offset + c*chbytes)
+      throw invalid_argument("Channels of "+fname+" are not all raw and contiguous");
+  }
+  Dtype *data = channels.size() ? (Dtype*)const_cast<char*>(map.data()+channels[0].offset) : nullptr;
+  return Grid<Dtype, 4, false>(data, channels.size(), dims[0], dims[1], dims[2]);
+}
+
+//convert n stored values of type T to Dtype
+template <typename T, typename Dtype>
+static void convert_values(const char *src, size_t n, Dtype *dst) {
+  if(sizeof(T) == sizeof(Dtype)) {
+    memcpy(dst, src, n*sizeof(T));
+  } else {
+    for(size_t i = 0; i < n; i++) dst[i] = take<T>(src);
+  }
+}
+
+template <typename Dtype>
+void GridFile::read_channel(unsigned c, Grid<Dtype, 3, false>& out) const {
+  const Channel& ch = channel_info(c);
+  if(out.dimension(0) != dims[0] || out.dimension(1) != dims[1] || out.dimension(2) != dims[2])
+    throw invalid_argument("Grid dimensions do not match grid file "+fname);
+  const char *src = map.data()+ch.offset;
+  size_t n = out.size();
+  Dtype *dst = out.data();
+  bool dbl = is_double();
+
+  if(ch.encoding == GRID_RAW) {
+    if(dbl) convert_values<double>(src, n, dst);
+    else convert_values<float>(src, n, dst);
+  } else if(ch.encoding == GRID_SPARSE) {
+    uint64_t count = take<uint64_t>(src);
+    const char *vals = src+count*sizeof(uint32_t);
+    memset(dst, 0, n*sizeof(Dtype));
+    for(uint64_t i = 0; i < count; i++) {
+      uint32_t index = take<uint32_t>(src);
+      if(index >= n) throw invalid_argument("Invalid sparse channel "+itoa(c)+" in grid file "+fname);
+      dst[index] = dbl ? take<double>(vals) : take<float>(vals);
+    }
+  } else {
+    vector<char> buf(n*elem_size);
+    iostreams::filtering_istream zin;
+    zin.push(iostreams::zlib_decompressor());
+    zin.push(iostreams::array_source(src, ch.bytes));
+    zin.read(buf.data(), buf.size());
+    if(size_t(zin.gcount()) != buf.size()) throw invalid_argument("Invalid compressed channel "+itoa(c)+" in grid file "+fname);
+    if(dbl) convert_values<double>(buf.data(), n, dst);
+    else convert_values<float>(buf.data(), n, dst);
+  }
+}
+
+template <typename Dtype>
+void GridFile::read(Grid<Dtype, 4, false>& out) const {
+  if(out.dimension(0) != channels.size()) throw invalid_argument("Number of channels does not match grid file "+fname);
+  for(unsigned c = 0, n = channels.size(); c < n; c++) {
+    Grid<Dtype, 3, false> g = out[c];
+    read_channel(c, g);
+  }
+}
+
+template <typename Dtype>
+CartesianGrid<ManagedGrid<Dtype, 4> > GridFile::read() const {
+  ManagedGrid<Dtype, 4> grid(channels.size(), dims[0], dims[1], dims[2]);
+  Grid<Dtype, 4, false> g = grid.cpu();
+  read(g);
+  return CartesianGrid<ManagedGrid<Dtype, 4> >(grid, center_, resolution_);
+}
+
+
 template CartesianGrid<ManagedGrid<float, 3> > read_dx(std::istream& in);
 template CartesianGrid<ManagedGrid<double, 3> > read_dx(std::istream& in);
 template CartesianGrid<ManagedGrid<float, 3> > read_dx(const std::string& fname);
@@ -251,5 +546,19 @@ template void write_map(const std::string&, const Grid<float, 3>&, const float3&
 template void write_map(std::ostream&, const Grid<double, 3>&, const float3&, float, float);
 template void write_map(const std::string&, const Grid<double, 3>&, const float3&, float, float);
 
+template void write_grid_file(const std::string&, const Grid<float, 4>&, const float3&, float, const std::vector<std::string>&, GridEncoding, bool);
+template void write_grid_file(const std::string&, const Grid<double, 4>&, const float3&, float, const std::vector<std::string>&, GridEncoding, bool);
+
+template Grid<float, 3, false> GridFile::channel(unsigned) const;
+template Grid<double, 3, false> GridFile::channel(unsigned) const;
+template Grid<float, 4, false> GridFile::view() const;
+template Grid<double, 4, false> GridFile::view() const;
+template void GridFile::read_channel(unsigned, Grid<float, 3, false>&) const;
+template void GridFile::read_channel(unsigned, Grid<double, 3, false>&) const;
+template void GridFile::read(Grid<float, 4, false>&) const;
+template void GridFile::read(Grid<double, 4, false>&) const;
+template CartesianGrid<ManagedGrid<float, 4> > GridFile::read() const;
+template CartesianGrid<ManagedGrid<double, 4> > GridFile::read() const;
+
 
 }
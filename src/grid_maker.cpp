@@ -5,9 +5,19 @@
  *      Author: dkoes
  */
 #include "libmolgrid/grid_maker.h"
+#include "libmolgrid/instrumentation.h"
 #include <cmath>
 #include <vector>
 #include <iomanip>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <type_traits>
 
 namespace libmolgrid {
 
@@ -27,6 +37,53 @@ void GridMaker::initialize(float res, float d, bool bin, float rscale, float grm
 
   D = 8*grm*grm*exp(-2.0*grm*grm); // * d/r^2
   E = - ( 4*grm + 8*grm*grm*grm) * exp(-2*grm*grm); // * 1/r
+
+  if(density_table) set_density_table(true); //coefficients may have changed
+}
+
+namespace {
+struct DensityTable {
+  std::vector<float> values;
+  float max_error = 0;
+};
+}
+
+void GridMaker::set_density_table(bool use) {
+  if(!use) {
+    density_table = nullptr;
+    return;
+  }
+  //tables only depend on the gaussian radius multiple, so are shared by all grid makers
+  static std::mutex table_mutex;
+  static std::map<float, std::unique_ptr<DensityTable> > tables;
+
+  float umax = final_radius_multiple * final_radius_multiple;
+  density_table_scale = density_table_size / umax;
+
+  std::lock_guard<std::mutex> lock(table_mutex);
+  std::unique_ptr<DensityTable>& table = tables[gaussian_radius_multiple];
+  if(!table) {
+    //tabulate with unit radius; rsq is then the squared distance over squared radius
+    GridMaker exact(*this);
+    exact.radius_scale = 1.0;
+    exact.density_table = nullptr;
+    table.reset(new DensityTable);
+    table->values.resize(density_table_size + 1);
+    for(unsigned i = 0; i < density_table_size; i++) {
+      table->values[i] = exact.calc_density<false>(i / density_table_scale, 1.0);
+    }
+    table->values[density_table_size] = 0; //density is zero at the final radius
+
+    //measure interpolation error between table entries
+    const unsigned samples = 16;
+    for(unsigned i = 0; i < density_table_size * samples; i++) {
+      float u = (i + 0.5f) / (samples * density_table_scale);
+      float err = fabs(exact.lookup_density(u, 1.0, table->values.data()) - exact.calc_density<false>(u, 1.0));
+      table->max_error = std::max(table->max_error, err);
+    }
+  }
+  density_table = table->values.data();
+  density_table_error = table->max_error;
 }
 
 //validate argument ranges
@@ -55,6 +112,10 @@ template void GridMaker::check_index_args(const Grid<float, 2, false>& coords,
     const Grid<float, 1, false>& type_index, const Grid<float, 1, false>& radii, Grid<double, 4, false>& out) const;
 template void GridMaker::check_index_args(const Grid<float, 2, true>& coords,
     const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii, Grid<double, 4, true>& out) const;
+template void GridMaker::check_index_args(const Grid<float, 2, true>& coords,
+    const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii, Grid<__half, 4, true>& out) const;
+template void GridMaker::check_index_args(const Grid<float, 2, true>& coords,
+    const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii, Grid<__nv_bfloat16, 4, true>& out) const;
 
 
 //validate argument ranges
@@ -90,6 +151,10 @@ template void GridMaker::check_vector_args(const Grid<float, 2, false>& coords,
     const Grid<float, 2, false>& type_vec, const Grid<float, 1, false>& radii, Grid<double, 4, false>& out) const;
 template void GridMaker::check_vector_args(const Grid<float, 2, true>& coords,
     const Grid<float, 2, true>& type_vec, const Grid<float, 1, true>& radii, Grid<double, 4, true>& out) const;
+template void GridMaker::check_vector_args(const Grid<float, 2, true>& coords,
+    const Grid<float, 2, true>& type_vec, const Grid<float, 1, true>& radii, Grid<__half, 4, true>& out) const;
+template void GridMaker::check_vector_args(const Grid<float, 2, true>& coords,
+    const Grid<float, 2, true>& type_vec, const Grid<float, 1, true>& radii, Grid<__nv_bfloat16, 4, true>& out) const;
 
 float3 GridMaker::get_grid_origin(const float3& grid_center) const {
   float half = dimension / 2.0;
@@ -100,47 +165,394 @@ float3 GridMaker::get_grid_origin(const float3& grid_center) const {
   return grid_origin;
 }
 
+//select the CoordinateSet overload, only GPU grids take a stream
+template <typename Dtype>
+static void forward_coords(const GridMaker& gmaker, float3 center, const CoordinateSet& c, Grid<Dtype, 4, false>& out, cudaStream_t) {
+  gmaker.forward(center, c, out);
+}
+
+template <typename Dtype>
+static void forward_coords(const GridMaker& gmaker, float3 center, const CoordinateSet& c, Grid<Dtype, 4, true>& out, cudaStream_t stream) {
+  gmaker.forward(center, c, out, stream);
+}
+
+//on the gpu, index typed examples are gridded by the batch kernels, which transform atoms
+//as they are loaded instead of transforming a merged copy of the coordinates
+template <typename Dtype>
+static bool forward_fused(const GridMaker&, const Example&, const Transform&, Grid<Dtype, 4, false>&, cudaStream_t) {
+  return false;
+}
+
+template <typename Dtype>
+static bool forward_fused(const GridMaker& gmaker, const Example& in, const Transform& transform, Grid<Dtype, 4, true>& out, cudaStream_t stream) {
+  if(gmaker.get_radii_type_indexed() || !in.has_index_types()) return false;
+  Grid<Dtype, 5, true> g(out.data(), 1, out.dimension(0), out.dimension(1), out.dimension(2), out.dimension(3));
+  //batches of one are reused, copying an example only shares its grids
+  static thread_local std::vector<Example> examples(1);
+  static thread_local std::vector<Transform> transforms(1);
+  examples[0] = in;
+  transforms[0] = transform;
+  gmaker.forward(examples, transforms, g, stream);
+  examples[0].sets.clear(); //don't keep the example's grids alive
+  return true;
+}
+
+/* \brief Merge the coordinates of in into memory kept for the calling thread.
+ * The merged set is transformed in place and is overwritten by the next
+ * merge on the thread, so GPU work reading it must complete first.
+ */
+static CoordinateSet& merge_scratch(const Example& in, bool gpu) {
+  static thread_local CoordinateSet merged;
+  if(gpu && merged.coords.device() >= 0 && merged.coords.device() != DeviceGuard::current_device()) merged = CoordinateSet();
+  in.merge_coordinates(merged, 0, true, gpu);
+  return merged;
+}
+
 template <typename Dtype, bool isCUDA>
-void GridMaker::forward(const Example& in, const Transform& transform, Grid<Dtype, 4, isCUDA>& out) const {
-  CoordinateSet c = in.merge_coordinates(); // !important - this copies the underlying coordinates so we can safely mogrify them
+void GridMaker::forward(const Example& in, const Transform& transform, Grid<Dtype, 4, isCUDA>& out, cudaStream_t stream) const {
+  if(forward_fused(*this, in, transform, out, stream)) return;
+  CoordinateSet& c = merge_scratch(in, isCUDA); // !important - this copies the underlying coordinates so we can safely mogrify them
   if(c.max_type != out.dimension(0)) throw std::out_of_range("Incorrect number of channels in output grid: "+itoa(c.max_type) +" vs "+itoa(out.dimension(0)));
-  if(isCUDA) c.togpu(); //this will enable tranformation on the gpu
-  transform.forward(c,c);
-  forward(transform.get_rotation_center(), c, out);
+  transform.forward(c,c,true,stream); //on the gpu if merged there
+  forward_coords(*this, transform.get_rotation_center(), c, out, stream);
+  //the merged coordinates are overwritten by the next call, which is only ordered with the default stream
+  if(isCUDA && stream) LMG_CUDA_CHECK(cudaStreamSynchronize(stream));
 }
 
 //not sure why these have to be instantiated given the next function must implicitly instantiate them
-template void GridMaker::forward(const Example& in, const Transform& transform, Grid<float, 4, false>& out) const;
-template void GridMaker::forward(const Example& in, const Transform& transform, Grid<float, 4, true>& out) const;
-template void GridMaker::forward(const Example& in, const Transform& transform, Grid<double, 4, false>& out) const;
-template void GridMaker::forward(const Example& in, const Transform& transform, Grid<double, 4, true>& out) const;
+template void GridMaker::forward(const Example& in, const Transform& transform, Grid<float, 4, false>& out, cudaStream_t) const;
+template void GridMaker::forward(const Example& in, const Transform& transform, Grid<float, 4, true>& out, cudaStream_t) const;
+template void GridMaker::forward(const Example& in, const Transform& transform, Grid<double, 4, false>& out, cudaStream_t) const;
+template void GridMaker::forward(const Example& in, const Transform& transform, Grid<double, 4, true>& out, cudaStream_t) const;
+template void GridMaker::forward(const Example& in, const Transform& transform, Grid<__half, 4, true>& out, cudaStream_t) const;
+template void GridMaker::forward(const Example& in, const Transform& transform, Grid<__nv_bfloat16, 4, true>& out, cudaStream_t) const;
+
+
+//receptor channels of a cache, resident where the output grid is
+template <typename Dtype>
+static Grid<Dtype, 4, false> cached_channels(ManagedGrid<Dtype, 4>& g, const Grid<Dtype, 4, false>&) {
+  g.tocpu(false);
+  return g.cpu();
+}
 
+template <typename Dtype>
+static Grid<Dtype, 4, true> cached_channels(ManagedGrid<Dtype, 4>& g, const Grid<Dtype, 4, true>&) {
+  g.togpu(false);
+  return g.gpu();
+}
+
+template <typename Dtype>
+static void copy_channels(const Grid<Dtype, 4, false>& src, Dtype *dest, cudaStream_t) {
+  memcpy(dest, src.data(), src.size()*sizeof(Dtype));
+}
+
+template <typename Dtype>
+static void copy_channels(const Grid<Dtype, 4, true>& src, Dtype *dest, cudaStream_t stream) {
+  LMG_CUDA_CHECK(cudaMemcpyAsync(dest, src.data(), src.size()*sizeof(Dtype), cudaMemcpyDeviceToDevice, stream));
+}
+
+//FNV-1a of the bytes of n floats
+static uint64_t hash_floats(uint64_t h, const float *data, size_t n) {
+  const unsigned char *bytes = (const unsigned char*)data;
+  for(size_t i = 0, nb = n*sizeof(float); i < nb; i++) {
+    h ^= bytes[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+//identifies the typing of c, which the source of its coordinates does not
+static uint64_t hash_types(const CoordinateSet& c) {
+  uint64_t h = 14695981039346656037ULL;
+  if(c.has_vector_types()) h = hash_floats(h, c.type_vector.cpu().data(), c.type_vector.size());
+  else h = hash_floats(h, c.type_index.cpu().data(), c.type_index.size());
+  return hash_floats(h, c.radii.cpu().data(), c.radii.size());
+}
+
+template <typename Dtype, bool isCUDA>
+void GridMaker::forward(const Example& in, const Transform& transform, Grid<Dtype, 4, isCUDA>& out,
+    ReceptorGridCache<Dtype>& cache, cudaStream_t stream) const {
+  if(in.sets.size() < 2) { //nothing to keep static
+    forward(in, transform, out, stream);
+    return;
+  }
+  const CoordinateSet& rec = in.sets[0];
+  if(!rec.src) { //coordinates that may change in place can't be identified
+    cache.misses++;
+    forward(in, transform, out, stream);
+    return;
+  }
+  unsigned ntypes = in.num_types();
+  unsigned rtypes = rec.num_types();
+  if(ntypes != out.dimension(0)) throw std::out_of_range("Incorrect number of channels in output grid: "+itoa(ntypes) +" vs "+itoa(out.dimension(0)));
+  for(unsigned i = 1; i <= 3; i++) {
+    if(dim != out.dimension(i)) throw std::out_of_range("Output grid dimension incorrect: "+itoa(dim) +" vs " +itoa(out.dimension(i)));
+  }
+
+  typename ReceptorGridCache<Dtype>::key_t key;
+  key.source = rec.src;
+  key.density_table = density_table;
+  key.types_hash = hash_types(rec);
+  key.natoms = rec.size();
+  key.ntypes = rtypes;
+  key.dim = dim;
+  key.gpu = isCUDA;
+  key.binary = binary;
+  key.radii_type_indexed = radii_type_indexed;
+  const Quaternion& Q = transform.get_quaternion();
+  float3 center = transform.get_rotation_center();
+  float3 translate = transform.get_translation();
+  float values[14] = {Q.R_component_1(), Q.R_component_2(), Q.R_component_3(), Q.R_component_4(),
+      center.x, center.y, center.z, translate.x, translate.y, translate.z,
+      resolution, dimension, radius_scale, gaussian_radius_multiple};
+  std::copy(values, values+14, key.values);
+
+  Grid<Dtype, 4, isCUDA> recgrid = cached_channels(cache.grid, out);
+  if(cache.valid && key == cache.key) {
+    cache.hits++;
+  } else {
+    cache.misses++;
+    cache.valid = false;
+    cache.grid = cache.grid.resized(rtypes, dim, dim, dim);
+    recgrid = cached_channels(cache.grid, out);
+    Example r;
+    r.sets.push_back(rec);
+    if(rtypes) forward(r, transform, recgrid, stream);
+    cache.key = key;
+    cache.valid = true;
+  }
+  if(rtypes) copy_channels(recgrid, out.data(), stream);
+
+  if(ntypes > rtypes) {
+    Example lig;
+    lig.sets.assign(in.sets.begin()+1, in.sets.end());
+    Grid<Dtype, 4, isCUDA> ligout(out.data()+(size_t)rtypes*dim*dim*dim, ntypes-rtypes, dim, dim, dim);
+    forward(lig, transform, ligout, stream);
+  }
+}
+
+template void GridMaker::forward(const Example&, const Transform&, Grid<float, 4, false>&, ReceptorGridCache<float>&, cudaStream_t) const;
+template void GridMaker::forward(const Example&, const Transform&, Grid<float, 4, true>&, ReceptorGridCache<float>&, cudaStream_t) const;
+template void GridMaker::forward(const Example&, const Transform&, Grid<double, 4, false>&, ReceptorGridCache<double>&, cudaStream_t) const;
+template void GridMaker::forward(const Example&, const Transform&, Grid<double, 4, true>&, ReceptorGridCache<double>&, cudaStream_t) const;
+template void GridMaker::forward(const Example&, const Transform&, Grid<__half, 4, true>&, ReceptorGridCache<__half>&, cudaStream_t) const;
+template void GridMaker::forward(const Example&, const Transform&, Grid<__nv_bfloat16, 4, true>&, ReceptorGridCache<__nv_bfloat16>&, cudaStream_t) const;
 
 template<typename Dtype, bool isCUDA>
 void GridMaker::forward(const Example& in, Grid<Dtype, 4, isCUDA>& out,
-    float random_translation, bool random_rotation, const float3& center) const {
+    float random_translation, bool random_rotation, const float3& center, cudaStream_t stream) const {
   float3 c = center;
   if(std::isinf(c.x)) {
     c = in.sets.back().center();
   }
   Transform t(c, random_translation, random_rotation);
-  forward(in, t, out);
+  forward(in, t, out, stream);
 }
 
 template void GridMaker::forward(const Example& in, Grid<float, 4, false>& out,
-    float random_translation, bool random_rotation, const float3& center) const;
+    float random_translation, bool random_rotation, const float3& center, cudaStream_t) const;
 template void GridMaker::forward(const Example& in, Grid<float, 4, true>& out,
-    float random_translation, bool random_rotation, const float3& center) const;
+    float random_translation, bool random_rotation, const float3& center, cudaStream_t) const;
 template void GridMaker::forward(const Example& in, Grid<double, 4, false>& out,
-    float random_translation, bool random_rotation, const float3& center) const;
+    float random_translation, bool random_rotation, const float3& center, cudaStream_t) const;
 template void GridMaker::forward(const Example& in, Grid<double, 4, true>& out,
-    float random_translation, bool random_rotation, const float3& center) const;
+    float random_translation, bool random_rotation, const float3& center, cudaStream_t) const;
+template void GridMaker::forward(const Example& in, Grid<__half, 4, true>& out,
+    float random_translation, bool random_rotation, const float3& center, cudaStream_t) const;
+template void GridMaker::forward(const Example& in, Grid<__nv_bfloat16, 4, true>& out,
+    float random_translation, bool random_rotation, const float3& center, cudaStream_t) const;
+
+
+unsigned GridMaker::num_cpu_threads() const {
+  unsigned n = cpu_threads;
+  if(n == 0) n = std::thread::hardware_concurrency();
+  if(n == 0) n = 1;
+  return std::min(n, dim); //work is divided into slabs along the first grid axis
+}
 
+namespace {
+/* Threads kept for the life of the process that run the slabs of
+ * parallel_slabs, so CPU gridding doesn't start threads on every call.  The
+ * pool grows to the largest number of threads requested.  A caller waiting
+ * for its slabs runs queued slabs itself, so concurrent and nested calls
+ * make progress even when every worker is busy.
+ */
+class SlabPool {
+    struct Task {
+      std::function<void()> run;
+      unsigned *remaining; //slabs of the task's call that are not done, protected by mtx
+    };
+    std::mutex mtx;
+    std::condition_variable work_cv; //signaled when tasks are queued or on stop
+    std::condition_variable done_cv; //signaled when the last slab of a call is done
+    std::deque<Task> tasks;
+    std::vector<std::thread> workers;
+    bool stop = false;
+
+    //run a task, mtx must be held and is released while it runs
+    void execute(Task task, std::unique_lock<std::mutex>& lock) {
+      lock.unlock();
+      task.run();
+      lock.lock();
+      if(--*task.remaining == 0) done_cv.notify_all();
+    }
+
+    void work() {
+      std::unique_lock<std::mutex> lock(mtx);
+      while(true) {
+        work_cv.wait(lock, [this] { return stop || tasks.size(); });
+        if(stop) return;
+        Task task = std::move(tasks.front());
+        tasks.pop_front();
+        execute(std::move(task), lock);
+      }
+    }
+
+  public:
+    ~SlabPool() {
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+      }
+      work_cv.notify_all();
+      for(std::thread& t : workers) t.join();
+    }
+
+    //run every slab, the first on the calling thread, and return once all are done; slabs must not throw
+    void run(std::vector<std::function<void()> >& slabs) {
+      unsigned remaining = slabs.size() - 1;
+      std::unique_lock<std::mutex> lock(mtx);
+      while(workers.size() < remaining) workers.emplace_back(&SlabPool::work, this);
+      for(unsigned i = 1, n = slabs.size(); i < n; i++) tasks.push_back(Task{std::move(slabs[i]), &remaining});
+      work_cv.notify_all();
+      lock.unlock();
+      slabs[0]();
+      lock.lock();
+      while(remaining) {
+        if(tasks.size()) {
+          Task task = std::move(tasks.front());
+          tasks.pop_front();
+          execute(std::move(task), lock);
+        } else {
+          done_cv.wait(lock);
+        }
+      }
+    }
+};
+
+SlabPool& slab_pool() {
+  static SlabPool pool;
+  return pool;
+}
+}
+
+//run f(start, end) over n slabs of [0,len), rethrowing the first exception
+template <typename F>
+static void parallel_slabs(unsigned nthreads, unsigned len, const F& f) {
+  if(nthreads <= 1) {
+    f(0, len);
+    return;
+  }
+  std::vector<std::exception_ptr> errors(nthreads);
+  std::vector<std::function<void()> > slabs;
+  slabs.reserve(nthreads);
+  for(unsigned t = 0; t < nthreads; t++) {
+    unsigned start = len * t / nthreads;
+    unsigned end = len * (t + 1) / nthreads;
+    slabs.push_back([&f, &errors, t, start, end]() {
+      try {
+        f(start, end);
+      } catch(...) {
+        errors[t] = std::current_exception();
+      }
+    });
+  }
+  slab_pool().run(slabs);
+  for(auto& e : errors) {
+    if(e) std::rethrow_exception(e);
+  }
+}
+
+template <typename Dtype, bool Binary, bool Weighted>
+void GridMaker::set_atom_cpu(float3 grid_origin, float3 a, float radius, Dtype tmult,
+    unsigned istart, unsigned iend, Dtype *channel) const {
+  float densityrad = radius * radius_scale * final_radius_multiple;
+
+  uint2 bounds[3];
+  bounds[0] = get_bounds_1d(grid_origin.x, a.x, densityrad);
+  bounds[1] = get_bounds_1d(grid_origin.y, a.y, densityrad);
+  bounds[2] = get_bounds_1d(grid_origin.z, a.z, densityrad);
+  bounds[0].x = std::max(bounds[0].x, istart);
+  bounds[0].y = std::min(bounds[0].y, iend);
+  if(bounds[2].x >= bounds[2].y) return;
+
+  //rows that are entirely outside the atom's sphere contribute nothing
+  float ar = radius * radius_scale;
+  float cutoff = Binary ? ar : ar * final_radius_multiple;
+  float cutoffsq = cutoff * cutoff;
+  const float *table = Binary ? nullptr : density_table;
+
+  for (unsigned i = bounds[0].x, iend = bounds[0].y; i < iend; i++) {
+    float dx = grid_origin.x + i * resolution - a.x;
+    float dxsq = dx * dx;
+    for (unsigned j = bounds[1].x, jend = bounds[1].y; j < jend; j++) {
+      float dy = grid_origin.y + j * resolution - a.y;
+      float dxysq = dxsq + dy * dy;
+      if (dxysq >= cutoffsq) continue;
+
+      //the row is contiguous in memory so the inner loops have no index math, and they
+      //are branch free so they vectorize: points past the cutoff are masked to zero density
+      Dtype *row = channel + (size_t(i) * dim + j) * dim;
+      unsigned kstart = bounds[2].x, kend = bounds[2].y;
+      if (Binary) {
+        #pragma omp simd
+        for (unsigned k = kstart; k < kend; k++) {
+          float dz = grid_origin.z + k * resolution - a.z;
+          bool inside = dxysq + dz * dz < cutoffsq;
+          if (Weighted) row[k] += inside ? tmult : Dtype(0); //not quite binary
+          else row[k] = inside ? Dtype(1.0) : row[k];
+        }
+      } else if (table) {
+        float scale = density_table_scale / (ar * ar);
+        #pragma omp simd
+        for (unsigned k = kstart; k < kend; k++) {
+          float dz = grid_origin.z + k * resolution - a.z;
+          float x = (dxysq + dz * dz) * scale;
+          bool inside = x < density_table_size;
+          float xc = inside ? x : 0.0f; //points past the table read its first entry, then are masked
+          int t = xc;
+          float lo = table[t];
+          float val = lo + (xc - t) * (table[t + 1] - lo);
+          val = inside ? val : 0.0f;
+          if (Weighted) row[k] += val * tmult;
+          else row[k] += val;
+        }
+      } else {
+        float gaussian_cutoff = ar * gaussian_radius_multiple;
+        #pragma omp simd
+        for (unsigned k = kstart; k < kend; k++) {
+          //calc_density, with both pieces evaluated and the one that applies selected
+          float dz = grid_origin.z + k * resolution - a.z;
+          float dist = sqrtf(dxysq + dz * dz);
+          float ex = -2.0 * dist * dist / (ar * ar);
+          float gauss = exp(ex);
+          float dr = dist / ar;
+          float q = (A * dr + B) * dr + C;
+          float val = dist <= gaussian_cutoff ? gauss : (q > 0 ? q : 0.0f);
+          val = dist < cutoff ? val : 0.0f;
+          if (Weighted) row[k] += val * tmult;
+          else row[k] += val;
+        }
+      }
+    }
+  }
+}
 
 template<typename Dtype>
 void GridMaker::forward(float3 grid_center, const Grid<float, 2, false>& coords,
     const Grid<float, 1, false>& type_index, const Grid<float, 1, false>& radii,
     Grid<Dtype, 4, false>& out) const {
+  StageTimer timer(STAGE_FORWARD_CPU);
   //zero grid first
   std::fill(out.data(), out.data() + out.size(), 0.0);
   check_index_args(coords, type_index, radii, out);
@@ -151,55 +563,40 @@ void GridMaker::forward(float3 grid_center, const Grid<float, 2, false>& coords,
   float3 grid_origin = get_grid_origin(grid_center);
   size_t natoms = coords.dimension(0);
   size_t ntypes = out.dimension(0);
-  //iterate over all atoms
+  size_t chsize = size_t(dim) * dim * dim;
+  //validate types up front so worker threads never throw part way through
   for (size_t aidx = 0; aidx < natoms; ++aidx) {
     float atype = type_index(aidx);
     if(atype >= ntypes) throw std::out_of_range("Type index "+itoa(atype)+" larger than allowed "+itoa(ntypes));
-    if (atype >= 0 && atype < ntypes) {
-      float3 acoords;
-      acoords.x = coords(aidx, 0);
-      acoords.y = coords(aidx, 1);
-      acoords.z = coords(aidx, 2);
-      float radius = radii(aidx);
-      float densityrad = radius * radius_scale * final_radius_multiple;
-
-      uint2 bounds[3];
-      bounds[0] = get_bounds_1d(grid_origin.x, acoords.x, densityrad);
-      bounds[1] = get_bounds_1d(grid_origin.y, acoords.y, densityrad);
-      bounds[2] = get_bounds_1d(grid_origin.z, acoords.z, densityrad);
-
-      //for every grid point possibly overlapped by this atom
-      for (size_t i = bounds[0].x, iend = bounds[0].y; i < iend; i++) {
-        for (size_t j = bounds[1].x, jend = bounds[1].y; j < jend; j++) {
-          for (size_t k = bounds[2].x, kend = bounds[2].y; k < kend; k++) {
-            float3 grid_coords;
-            grid_coords.x = grid_origin.x + i * resolution;
-            grid_coords.y = grid_origin.y + j * resolution;
-            grid_coords.z = grid_origin.z + k * resolution;
-
-            size_t offset = ((((atype * dim) + i) * dim) + j) * dim + k;
-            if (binary) {
-              float val = calc_point<true>(acoords.x, acoords.y, acoords.z, radius, grid_coords);
-
-              if (val != 0)
-                *(out.data() + offset) = 1.0;
-            }
-            else {
-              float val = calc_point<false>(acoords.x, acoords.y, acoords.z, radius, grid_coords);
-              *(out.data() + offset) += val;
-            }
+  }
 
-          }
-        }
+  //each thread owns a slab of the grid along x, so there are no write conflicts
+  //and every grid point sees its atoms in the same order as a serial pass
+  parallel_slabs(num_cpu_threads(), dim, [&](unsigned istart, unsigned iend) {
+    //iterate over all atoms
+    for (size_t aidx = 0; aidx < natoms; ++aidx) {
+      float atype = type_index(aidx);
+      if (atype >= 0 && atype < ntypes) {
+        float3 acoords;
+        acoords.x = coords(aidx, 0);
+        acoords.y = coords(aidx, 1);
+        acoords.z = coords(aidx, 2);
+        float radius = radii(aidx);
+        Dtype *channel = out.data() + size_t(atype) * chsize;
+        if (binary)
+          set_atom_cpu<Dtype, true, false>(grid_origin, acoords, radius, 1.0, istart, iend, channel);
+        else
+          set_atom_cpu<Dtype, false, false>(grid_origin, acoords, radius, 1.0, istart, iend, channel);
       }
     }
-  }
+  });
 }
 
 template<typename Dtype, bool TypesFromRadii>
 void GridMaker::forward(float3 grid_center, const Grid<float, 2, false>& coords,
     const Grid<float, 2, false>& type_vector, const Grid<float, 1, false>& radii,
     Grid<Dtype, 4, false>& out) const {
+  StageTimer timer(STAGE_FORWARD_CPU);
   //zero grid first
   std::fill(out.data(), out.data() + out.size(), 0.0);
   check_vector_args(coords, type_vector, radii, out);
@@ -207,64 +604,383 @@ void GridMaker::forward(float3 grid_center, const Grid<float, 2, false>& coords,
   float3 grid_origin = get_grid_origin(grid_center);
   size_t natoms = coords.dimension(0);
   size_t ntypes = type_vector.dimension(1);
-  //iterate over all atoms
-  for (size_t aidx = 0; aidx < natoms; ++aidx) {
-    for (size_t tidx = 0; tidx < ntypes; tidx++) {
-      Dtype tmult = type_vector(aidx, tidx); //amount of type for this atom
-      if (tmult != 0) {
-        float3 acoords;
-        acoords.x = coords(aidx, 0);
-        acoords.y = coords(aidx, 1);
-        acoords.z = coords(aidx, 2);
-        float radius = 0;
-        if(radii_type_indexed) radius = radii(tidx);
-        else radius = radii(aidx);
-
-        float densityrad = radius * radius_scale * final_radius_multiple;
-
-        uint2 bounds[3];
-        bounds[0] = get_bounds_1d(grid_origin.x, acoords.x, densityrad);
-        bounds[1] = get_bounds_1d(grid_origin.y, acoords.y, densityrad);
-        bounds[2] = get_bounds_1d(grid_origin.z, acoords.z, densityrad);
-
-        //for every grid point possibly overlapped by this atom
-        for (size_t i = bounds[0].x, iend = bounds[0].y; i < iend; i++) {
-          for (size_t j = bounds[1].x, jend = bounds[1].y; j < jend; j++) {
-            for (size_t k = bounds[2].x, kend = bounds[2].y; k < kend; k++) {
-              float3 grid_coords;
-              grid_coords.x = grid_origin.x + i * resolution;
-              grid_coords.y = grid_origin.y + j * resolution;
-              grid_coords.z = grid_origin.z + k * resolution;
-
-              size_t offset = ((((tidx * dim) + i) * dim) + j) * dim + k;
-              if (binary) {
-                float val = calc_point<true>(acoords.x, acoords.y, acoords.z, radius, grid_coords);
-
-                if (val != 0)
-                  *(out.data() + offset) += tmult; //not quite binary
-              }
-              else {
-                float val = calc_point<false>(acoords.x, acoords.y, acoords.z, radius, grid_coords);
-                *(out.data() + offset) += val*tmult;
-              }
-            }
+  size_t chsize = size_t(dim) * dim * dim;
+
+  parallel_slabs(num_cpu_threads(), dim, [&](unsigned istart, unsigned iend) {
+    //iterate over all atoms
+    for (size_t aidx = 0; aidx < natoms; ++aidx) {
+      float3 acoords;
+      acoords.x = coords(aidx, 0);
+      acoords.y = coords(aidx, 1);
+      acoords.z = coords(aidx, 2);
+      for (size_t tidx = 0; tidx < ntypes; tidx++) {
+        Dtype tmult = type_vector(aidx, tidx); //amount of type for this atom
+        if (tmult != 0) {
+          float radius = 0;
+          if(radii_type_indexed) radius = radii(tidx);
+          else radius = radii(aidx);
+
+          Dtype *channel = out.data() + tidx * chsize;
+          if (binary)
+            set_atom_cpu<Dtype, true, true>(grid_origin, acoords, radius, tmult, istart, iend, channel);
+          else
+            set_atom_cpu<Dtype, false, true>(grid_origin, acoords, radius, tmult, istart, iend, channel);
+        } //tmult != 0
+      } //tidx
+    } //aidx
+  });
+}
+
+
+template <typename Dtype, bool isCUDA>
+void GridMaker::forward(const std::vector<Example>& in, Grid<Dtype, 5, isCUDA>& out, float random_translation, bool random_rotation,
+    cudaStream_t stream) const {
+  if(in.size() != out.dimension(0)) throw std::out_of_range("output grid dimension does not match size of example vector");
+  //transforms are generated in example order so the random draws match gridding each example separately
+  std::vector<Transform> transforms;
+  transforms.reserve(in.size());
+  for(unsigned i = 0, n = in.size(); i < n; i++) {
+    transforms.push_back(Transform(in[i].sets.back().center(), random_translation, random_rotation));
+  }
+  forward(in, transforms, out, stream);
+}
+
+template <typename Dtype>
+void GridMaker::forward(const std::vector<Example>& in, const std::vector<Transform>& transforms, Grid<Dtype, 5, false>& out,
+    cudaStream_t) const {
+  if(in.size() != out.dimension(0)) throw std::out_of_range("output grid dimension does not match size of example vector");
+  if(in.size() != transforms.size()) throw std::out_of_range("number of transforms does not match size of example vector");
+  for(unsigned i = 0, n = in.size(); i < n; i++) {
+    Grid<Dtype, 4, false> g(out[i]);
+    forward(in[i], transforms[i], g);
+  }
+}
+
+template void GridMaker::forward(const std::vector<Example>& in, const std::vector<Transform>& transforms, Grid<float, 5, false>& out, cudaStream_t) const;
+template void GridMaker::forward(const std::vector<Example>& in, const std::vector<Transform>& transforms, Grid<double, 5, false>& out, cudaStream_t) const;
+
+template <typename Dtype, bool isCUDA>
+void GridMaker::forward(const std::vector<Example>& in, Grid<Dtype, 5, isCUDA>& out, const RandomTransforms& random,
+    uint64_t first_index, cudaStream_t stream) const {
+  if(in.size() != out.dimension(0)) throw std::out_of_range("output grid dimension does not match size of example vector");
+  std::vector<Transform> transforms;
+  transforms.reserve(in.size());
+  for(unsigned i = 0, n = in.size(); i < n; i++) {
+    float3 center = in[i].sets.back().center();
+    //gpu batches generate their rotations and translations on the device
+    transforms.push_back(isCUDA ? Transform(Quaternion(), center) : random.get(center, first_index + i));
+  }
+  forward_batch(in, transforms, &random, first_index, out, stream);
+}
+
+template void GridMaker::forward(const std::vector<Example>&, Grid<float, 5, false>&, const RandomTransforms&, uint64_t, cudaStream_t) const;
+template void GridMaker::forward(const std::vector<Example>&, Grid<float, 5, true>&, const RandomTransforms&, uint64_t, cudaStream_t) const;
+template void GridMaker::forward(const std::vector<Example>&, Grid<double, 5, false>&, const RandomTransforms&, uint64_t, cudaStream_t) const;
+template void GridMaker::forward(const std::vector<Example>&, Grid<double, 5, true>&, const RandomTransforms&, uint64_t, cudaStream_t) const;
+template void GridMaker::forward(const std::vector<Example>&, Grid<__half, 5, true>&, const RandomTransforms&, uint64_t, cudaStream_t) const;
+template void GridMaker::forward(const std::vector<Example>&, Grid<__nv_bfloat16, 5, true>&, const RandomTransforms&, uint64_t, cudaStream_t) const;
+
+//non-blocking stream of the calling thread on device, kept for later batches
+//and never destroyed, thread exit may follow context teardown
+static cudaStream_t shard_stream(int device) {
+  static thread_local std::vector<cudaStream_t> streams;
+  if(device >= int(streams.size())) streams.resize(device+1, nullptr);
+  if(!streams[device]) {
+    DeviceGuard guard(device);
+    LMG_CUDA_CHECK(cudaStreamCreateWithFlags(&streams[device], cudaStreamNonBlocking));
+  }
+  return streams[device];
+}
+
+//page-locked block a shard is copied back into, so the copy does not block queuing the next shard
+struct shard_staging {
+  void *data = nullptr;
+  size_t bytes = 0; //of the pooled block
+  int device = -1;
+  ~shard_staging() {
+    //only released once the copy into it has been waited for
+    if(data) pooled_free(data, bytes, nullptr, 0, device, nullptr);
+  }
+};
+
+template <typename Dtype>
+void GridMaker::forward(const std::vector<Example>& in, const std::vector<Transform>& transforms, ManagedGrid<Dtype, 5>& out,
+    const std::vector<int>& devices) const {
+  unsigned batch_size = in.size();
+  if(batch_size != out.dimension(0)) throw std::out_of_range("output grid dimension does not match size of example vector");
+  if(batch_size != transforms.size()) throw std::out_of_range("number of transforms does not match size of example vector");
+  if(devices.empty()) throw std::invalid_argument("No devices to shard batch across");
+  if(batch_size == 0) return;
+
+  //views of out are cached by the grid, so resolve them before queuing any work
+  bool outgpu = out.ongpu();
+  int outdevice = outgpu ? out.device() : -1;
+  Dtype *outdata = outgpu ? out.gpu().data() : out.cpu().data();
+  size_t example_size = out.offset(0);
+
+  //every shard is queued on its own device before waiting on any of them
+  unsigned nshards = std::min<size_t>(devices.size(), batch_size);
+  std::vector<cudaStream_t> streams(nshards, nullptr);
+  std::vector<ManagedGrid<Dtype, 5> > shard_grids(nshards);
+  std::vector<shard_staging> staging(nshards);
+  std::exception_ptr error;
+  try {
+    for(unsigned s = 0; s < nshards; s++) {
+      unsigned start = batch_size * s / nshards;
+      unsigned end = batch_size * (s + 1) / nshards;
+      unsigned n = end - start;
+      if(n == 0) continue;
+      int device = devices[s];
+      DeviceGuard guard(device);
+      streams[s] = shard_stream(device);
+
+      std::vector<Example> examples(in.begin() + start, in.begin() + end);
+      std::vector<Transform> xforms(transforms.begin() + start, transforms.begin() + end);
+      Dtype *dest = outdata + start * example_size;
+      if(outgpu && outdevice == device) { //grid directly into the output
+        Grid<Dtype, 5, true> g(dest, n, out.dimension(1), out.dimension(2), out.dimension(3), out.dimension(4));
+        forward(examples, xforms, g, streams[s]);
+      } else {
+        ManagedGrid<Dtype, 5>& local = shard_grids[s];
+        local = ManagedGrid<Dtype, 5>(n, out.dimension(1), out.dimension(2), out.dimension(3), out.dimension(4));
+        local.set_device(device);
+        local.togpu(false);
+        Grid<Dtype, 5, true> g = local.gpu();
+        forward(examples, xforms, g, streams[s]);
+        size_t bytes = n * example_size * sizeof(Dtype);
+        if(outgpu) {
+          LMG_CUDA_CHECK(cudaMemcpyPeerAsync(dest, outdevice, g.data(), device, bytes, streams[s]));
+        } else {
+          shard_staging& stage = staging[s];
+          stage.bytes = bytes;
+          stage.data = pooled_host_alloc(stage.bytes);
+          if(!stage.data) {
+            stage.bytes = 0;
+            throw std::runtime_error("Could not allocate "+itoa(bytes)+" bytes of page-locked memory");
           }
+          stage.device = device;
+          LMG_CUDA_CHECK(cudaMemcpyAsync(stage.data, g.data(), bytes, cudaMemcpyDeviceToHost, streams[s]));
         }
-      } //tmult != 0
-    } //tidx
-  } //aidx
+      }
+    }
+  } catch(...) {
+    error = std::current_exception();
+  }
+
+  //wait for every queued shard, even after an error, before releasing memory
+  for(unsigned s = 0; s < nshards; s++) {
+    if(!streams[s]) continue;
+    DeviceGuard guard(devices[s]);
+    cudaError_t err = cudaStreamSynchronize(streams[s]);
+    if(err != cudaSuccess && !error) error = std::make_exception_ptr(std::runtime_error(std::string("CUDA Error: ")+cudaGetErrorString(err)));
+  }
+  if(error) std::rethrow_exception(error);
+
+  //gather the shards copied back to the host
+  for(unsigned s = 0; s < nshards; s++) {
+    if(!staging[s].data) continue;
+    unsigned start = batch_size * s / nshards;
+    unsigned end = batch_size * (s + 1) / nshards;
+    memcpy(outdata + start * example_size, staging[s].data, (end - start) * example_size * sizeof(Dtype));
+  }
+}
+
+template <typename Dtype>
+void GridMaker::forward(const std::vector<Example>& in, ManagedGrid<Dtype, 5>& out, const std::vector<int>& devices,
+    float random_translation, bool random_rotation) const {
+  if(in.size() != out.dimension(0)) throw std::out_of_range("output grid dimension does not match size of example vector");
+  std::vector<Transform> transforms;
+  transforms.reserve(in.size());
+  for(unsigned i = 0, n = in.size(); i < n; i++) {
+    transforms.push_back(Transform(in[i].sets.back().center(), random_translation, random_rotation));
+  }
+  forward(in, transforms, out, devices);
+}
+
+template void GridMaker::forward(const std::vector<Example>&, const std::vector<Transform>&, ManagedGrid<float, 5>&, const std::vector<int>&) const;
+template void GridMaker::forward(const std::vector<Example>&, const std::vector<Transform>&, ManagedGrid<double, 5>&, const std::vector<int>&) const;
+template void GridMaker::forward(const std::vector<Example>&, const std::vector<Transform>&, ManagedGrid<__half, 5>&, const std::vector<int>&) const;
+template void GridMaker::forward(const std::vector<Example>&, const std::vector<Transform>&, ManagedGrid<__nv_bfloat16, 5>&, const std::vector<int>&) const;
+template void GridMaker::forward(const std::vector<Example>&, ManagedGrid<float, 5>&, const std::vector<int>&, float, bool) const;
+template void GridMaker::forward(const std::vector<Example>&, ManagedGrid<double, 5>&, const std::vector<int>&, float, bool) const;
+template void GridMaker::forward(const std::vector<Example>&, ManagedGrid<__half, 5>&, const std::vector<int>&, float, bool) const;
+template void GridMaker::forward(const std::vector<Example>&, ManagedGrid<__nv_bfloat16, 5>&, const std::vector<int>&, float, bool) const;
+
+void SparseGrid::todense(Grid<float, 4, false>& out) const {
+  if(out.dimension(0) != channels || out.dimension(1) != dim || out.dimension(2) != dim || out.dimension(3) != dim)
+    throw std::out_of_range("Dense grid dimensions do not match sparse grid");
+  out.fill_zero();
+  const Grid<float, 2, false>& idx = indices.cpu();
+  const Grid<float, 1, false>& v = values.cpu();
+  for(unsigned i = 0, n = size(); i < n; i++) {
+    out[int(idx[i][0])][int(idx[i][1])][int(idx[i][2])][int(idx[i][3])] = v[i];
+  }
+}
+
+void GridMaker::compact_sparse(const Grid<float, 4, false>& dense, const std::vector<std::vector<unsigned> >& channels, SparseGrid *out) {
+  unsigned nx = dense.dimension(1), ny = dense.dimension(2), nz = dense.dimension(3);
+  size_t chsize = size_t(nx)*ny*nz;
+  const float *d = dense.data();
+  for(unsigned g = 0, ng = channels.size(); g < ng; g++) {
+    size_t total = channels[g].size() * chsize;
+    size_t n = 0;
+    for(size_t i = 0; i < total; i++) {
+      if(d[i] != 0) n++;
+    }
+    SparseGrid& sg = out[g];
+    sg.indices = sg.indices.resized(n, 4);
+    sg.values = sg.values.resized(n);
+    sg.indices.tocpu(false);
+    sg.values.tocpu(false);
+    float *idx = sg.indices.cpu().data();
+    float *v = sg.values.cpu().data();
+
+    size_t k = 0;
+    for(size_t i = 0; i < total; i++) {
+      if(d[i] != 0) {
+        idx[4*k] = channels[g][i / chsize];
+        idx[4*k+1] = (i / (ny*nz)) % nx;
+        idx[4*k+2] = (i / nz) % ny;
+        idx[4*k+3] = i % nz;
+        v[k] = d[i];
+        k++;
+      }
+    }
+    d += total;
+  }
+}
+
+//set active to in restricted to the channels that have atoms, renumbered consecutively in channel order
+static void active_channels(const CoordinateSet& in, bool radii_type_indexed, CoordinateSet& active, std::vector<unsigned>& channels) {
+  unsigned ntypes = in.num_types();
+  channels.clear();
+  active.coords = in.coords;
+  active.radii = in.radii;
+  unsigned n = in.size();
+  if(in.has_vector_types() && n > 0) {
+    const Grid<float, 2, false>& tv = in.type_vector.cpu();
+    for(unsigned t = 0; t < ntypes; t++) {
+      for(unsigned i = 0; i < n; i++) {
+        if(tv[i][t] != 0) {
+          channels.push_back(t);
+          break;
+        }
+      }
+    }
+    active.type_vector = MGrid2f(n, channels.size());
+    for(unsigned i = 0; i < n; i++) {
+      for(unsigned c = 0, nc = channels.size(); c < nc; c++) {
+        active.type_vector[i][c] = tv[i][channels[c]];
+      }
+    }
+    if(radii_type_indexed) {
+      const Grid<float, 1, false>& r = in.radii.cpu();
+      active.radii = MGrid1f(channels.size());
+      for(unsigned c = 0, nc = channels.size(); c < nc; c++) {
+        active.radii[c] = r[channels[c]];
+      }
+    }
+  } else {
+    const Grid<float, 1, false>& t = in.type_index.cpu();
+    std::vector<int> remap(ntypes, -1);
+    for(unsigned i = 0; i < n; i++) {
+      int ti = t[i];
+      if(ti >= int(ntypes)) throw std::out_of_range("Type index "+itoa(ti)+" is not less than the number of types "+itoa(ntypes));
+      if(ti >= 0) remap[ti] = 0;
+    }
+    for(unsigned c = 0; c < ntypes; c++) {
+      if(remap[c] == 0) {
+        remap[c] = channels.size();
+        channels.push_back(c);
+      }
+    }
+    active.type_index = MGrid1f(n);
+    for(unsigned i = 0; i < n; i++) {
+      int ti = t[i];
+      active.type_index[i] = ti < 0 ? -1 : remap[ti];
+    }
+  }
+  active.max_type = channels.size();
+}
+
+void GridMaker::forward_sparse(const float3 *centers, const CoordinateSet *in, unsigned n, SparseGrid *out, bool gpu,
+    cudaStream_t stream) const {
+  std::vector<CoordinateSet> active(n);
+  std::vector<std::vector<unsigned> > channels(n);
+  unsigned nchannels = 0;
+  for(unsigned i = 0; i < n; i++) {
+    active_channels(in[i], radii_type_indexed, active[i], channels[i]);
+    out[i].channels = in[i].num_types();
+    out[i].dim = dim;
+    nchannels += channels[i].size();
+  }
+
+  //the active channels of every set one after another, only needed until they are compacted
+  size_t chsize = size_t(dim)*dim*dim;
+  if(gpu) {
+    Grid<float, 4, true> g = sparse_scratch(nchannels);
+    float *d = g.data();
+    for(unsigned i = 0; i < n; i++) {
+      unsigned nc = channels[i].size();
+      Grid<float, 4, true> sub(d, nc, dim, dim, dim);
+      if(nc) forward(centers[i], active[i], sub, stream);
+      d += nc * chsize;
+    }
+    compact_sparse(g, channels, out, stream);
+  } else {
+    static thread_local MGrid4f scratch;
+    scratch = scratch.resized(nchannels, dim, dim, dim);
+    scratch.tocpu(false);
+    Grid<float, 4, false> g = scratch.cpu();
+    float *d = g.data();
+    for(unsigned i = 0; i < n; i++) {
+      unsigned nc = channels[i].size();
+      Grid<float, 4, false> sub(d, nc, dim, dim, dim);
+      if(nc) forward(centers[i], active[i], sub);
+      d += nc * chsize;
+    }
+    compact_sparse(g, channels, out);
+  }
+}
+
+void GridMaker::forward_sparse(float3 grid_center, const CoordinateSet& in, SparseGrid& out, bool gpu, cudaStream_t stream) const {
+  forward_sparse(&grid_center, &in, 1, &out, gpu, stream);
+}
+
+void GridMaker::forward_sparse(const Example& in, const Transform& transform, SparseGrid& out, bool gpu, cudaStream_t stream) const {
+  CoordinateSet& c = merge_scratch(in, gpu); //copy so the coordinates can be transformed
+  transform.forward(c, c, true, stream);
+  forward_sparse(transform.get_rotation_center(), c, out, gpu, stream); //waits for the gridding before returning
+}
+
+void GridMaker::forward_sparse(const std::vector<Example>& in, const std::vector<Transform>& transforms, std::vector<SparseGrid>& out,
+    bool gpu, cudaStream_t stream) const {
+  if(in.size() != transforms.size()) throw std::out_of_range("number of transforms does not match size of example vector");
+  unsigned n = in.size();
+  out.resize(n);
+  //each example needs its own copy, they are all gridded before the host waits
+  std::vector<CoordinateSet> merged(n);
+  std::vector<float3> centers(n);
+  for(unsigned i = 0; i < n; i++) {
+    in[i].merge_coordinates(merged[i], 0, true, gpu);
+    transforms[i].forward(merged[i], merged[i], true, stream);
+    centers[i] = transforms[i].get_rotation_center();
+  }
+  if(n) forward_sparse(centers.data(), merged.data(), n, out.data(), gpu, stream);
 }
 
-        
-        
 template void GridMaker::forward(const std::vector<Example>& in, Grid<float, 5, false>& out,
-  float random_translation, bool random_rotation) const;
+  float random_translation, bool random_rotation, cudaStream_t) const;
 template void GridMaker::forward(const std::vector<Example>& in, Grid<float, 5, true>& out,
-    float random_translation, bool random_rotation) const;
+    float random_translation, bool random_rotation, cudaStream_t) const;
 template void GridMaker::forward(const std::vector<Example>& in, Grid<double, 5, false>& out,
-  float random_translation, bool random_rotation) const;
+  float random_translation, bool random_rotation, cudaStream_t) const;
 template void GridMaker::forward(const std::vector<Example>& in, Grid<double, 5, true>& out,
-    float random_translation, bool random_rotation) const;
+    float random_translation, bool random_rotation, cudaStream_t) const;
+template void GridMaker::forward(const std::vector<Example>& in, Grid<__half, 5, true>& out,
+    float random_translation, bool random_rotation, cudaStream_t) const;
+template void GridMaker::forward(const std::vector<Example>& in, Grid<__nv_bfloat16, 5, true>& out,
+    float random_translation, bool random_rotation, cudaStream_t) const;
 
 template void GridMaker::forward(float3 grid_center,
     const Grid<float, 2, false>& coords,
@@ -284,6 +1000,230 @@ template void GridMaker::forward(float3 grid_center, const Grid<float, 2, false>
         const Grid<float, 2, false>& type_vector, const Grid<float, 1, false>& radii,
         Grid<double, 4, false>& out) const;
         
+template <typename Dtype>
+void GridMaker::add_atoms(float3 grid_origin, const std::vector<float>& atoms, Grid<Dtype, 4, false>& out, cudaStream_t) const {
+  StageTimer timer(STAGE_FORWARD_CPU);
+  size_t natoms = atoms.size() / 6;
+  size_t chsize = size_t(dim) * dim * dim;
+  //few atoms are not worth starting threads for
+  parallel_slabs(natoms > 64 ? num_cpu_threads() : 1, dim, [&](unsigned istart, unsigned iend) {
+    for (size_t aidx = 0; aidx < natoms; ++aidx) {
+      const float *a = &atoms[aidx * 6];
+      Dtype *channel = out.data() + size_t(a[4]) * chsize;
+      set_atom_cpu<Dtype, false, true>(grid_origin, float3{a[0], a[1], a[2]}, a[3], Dtype(a[5]), istart, iend, channel);
+    }
+  });
+}
+
+template <typename Dtype, bool isCUDA>
+size_t GridMaker::forward_delta(float3 grid_center, CoordinateSet& prev, const CoordinateSet& next,
+    Grid<Dtype, 4, isCUDA>& out, float max_fraction, float tolerance, cudaStream_t stream) const {
+  size_t n = next.size();
+  //binary density is not additive and only float grids have atomic adds on every device
+  bool additive = !binary && !radii_type_indexed && (!isCUDA || std::is_same<Dtype, float>::value);
+  if(!additive || n == 0 || prev.size() != n || !prev.has_indexed_types() || !next.has_indexed_types()) {
+    forward_coords(*this, grid_center, next, out, stream);
+    prev.copyInto(next);
+    return n;
+  }
+  if(next.max_type != out.dimension(0)) throw std::out_of_range("Incorrect number of channels in output grid: "+itoa(next.max_type) +" vs "+itoa(out.dimension(0)));
+  for(unsigned i = 1; i <= 3; i++) {
+    if(dim != out.dimension(i)) throw std::out_of_range("Output grid dimension incorrect: "+itoa(dim) +" vs " +itoa(out.dimension(i)));
+  }
+
+  //prev is updated to the moved atoms, so must not share them with other sets
+  prev.own_coords();
+  Grid<float, 2, false> pc = prev.coords.cpu(), nc = next.coords.cpu();
+  Grid<float, 1, false> pt = prev.type_index.cpu(), nt = next.type_index.cpu();
+  Grid<float, 1, false> pr = prev.radii.cpu(), nr = next.radii.cpu();
+  size_t ntypes = out.dimension(0);
+  size_t limit = max_fraction * n;
+  //each changed atom is removed at its old position and added at its new one
+  std::vector<float> atoms;
+  atoms.reserve(std::min(limit, n) * 12);
+  auto push = [&](const Grid<float, 2, false>& c, const Grid<float, 1, false>& t, const Grid<float, 1, false>& r, size_t i, float sign) {
+    if(t(i) < 0) return; //untyped atoms are not gridded
+    if(t(i) >= ntypes) throw std::out_of_range("Type index "+itoa(t(i))+" larger than allowed "+itoa(ntypes));
+    float a[6] = {c(i, 0), c(i, 1), c(i, 2), r(i), t(i), sign};
+    atoms.insert(atoms.end(), a, a + 6);
+  };
+  std::vector<size_t> changed;
+  bool retyped = false;
+  for(size_t i = 0; i < n; i++) {
+    if(pt(i) == nt(i) && pr(i) == nr(i) && std::fabs(pc(i, 0) - nc(i, 0)) <= tolerance &&
+        std::fabs(pc(i, 1) - nc(i, 1)) <= tolerance && std::fabs(pc(i, 2) - nc(i, 2)) <= tolerance) continue;
+    if(changed.size() >= limit) { //cheaper to start over
+      forward_coords(*this, grid_center, next, out, stream);
+      prev.copyInto(next);
+      return n;
+    }
+    push(pc, pt, pr, i, -1);
+    push(nc, nt, nr, i, 1);
+    changed.push_back(i);
+    retyped = retyped || pt(i) != nt(i) || pr(i) != nr(i);
+  }
+  if(atoms.size()) add_atoms(get_grid_origin(grid_center), atoms, out, stream);
+
+  //prev now holds the atoms as gridded, so atoms that move less than tolerance each frame
+  //are still moved once they drift further than tolerance from where they were gridded
+  if(retyped) {
+    if(prev.type_index.shared()) prev.type_index = prev.type_index.clone();
+    if(prev.radii.shared()) prev.radii = prev.radii.clone();
+    pt = prev.type_index.cpu();
+    pr = prev.radii.cpu();
+  }
+  for(size_t i : changed) {
+    for(unsigned j = 0; j < 3; j++) pc(i, j) = nc(i, j);
+    if(retyped) {
+      pt(i) = nt(i);
+      pr(i) = nr(i);
+    }
+  }
+  return changed.size();
+}
+
+template void GridMaker::add_atoms(float3, const std::vector<float>&, Grid<float, 4, false>&, cudaStream_t) const;
+template void GridMaker::add_atoms(float3, const std::vector<float>&, Grid<double, 4, false>&, cudaStream_t) const;
+
+template size_t GridMaker::forward_delta(float3, CoordinateSet&, const CoordinateSet&, Grid<float, 4, false>&, float, float, cudaStream_t) const;
+template size_t GridMaker::forward_delta(float3, CoordinateSet&, const CoordinateSet&, Grid<float, 4, true>&, float, float, cudaStream_t) const;
+template size_t GridMaker::forward_delta(float3, CoordinateSet&, const CoordinateSet&, Grid<double, 4, false>&, float, float, cudaStream_t) const;
+template size_t GridMaker::forward_delta(float3, CoordinateSet&, const CoordinateSet&, Grid<double, 4, true>&, float, float, cudaStream_t) const;
+template size_t GridMaker::forward_delta(float3, CoordinateSet&, const CoordinateSet&, Grid<__half, 4, true>&, float, float, cudaStream_t) const;
+template size_t GridMaker::forward_delta(float3, CoordinateSet&, const CoordinateSet&, Grid<__nv_bfloat16, 4, true>&, float, float, cudaStream_t) const;
+
+GridPyramid::GridPyramid(const std::vector<std::pair<float, float> >& lvls, bool bin, float rscale, float grm) {
+  if(lvls.empty()) throw std::invalid_argument("A grid pyramid needs at least one level");
+  levels.reserve(lvls.size());
+  for(const std::pair<float, float>& l : lvls) {
+    if(l.first <= 0) throw std::invalid_argument("Grid pyramid resolution must be positive: "+std::to_string(l.first));
+    levels.push_back(GridMaker(l.first, l.second, bin, false, rscale, grm));
+  }
+}
+
+template <typename Dtype>
+void GridPyramid::forward(float3 grid_center, const CoordinateSet& in, std::vector<Grid<Dtype, 4, false> >& out) const {
+  StageTimer timer(STAGE_FORWARD_CPU);
+  check_outputs(out.size());
+  bool vector_types = in.has_vector_types() && in.size() > 0;
+  Grid<float, 2, false> coords = in.coords.cpu();
+  Grid<float, 1, false> radii = in.radii.cpu();
+  Grid<float, 1, false> type_index = in.type_index.cpu();
+  Grid<float, 2, false> type_vector = in.type_vector.cpu();
+  size_t natoms = coords.dimension(0);
+  size_t ntypes = out[0].dimension(0);
+
+  unsigned nlevels = levels.size();
+  std::vector<float3> origins(nlevels);
+  std::vector<size_t> chsizes(nlevels);
+  unsigned nthreads = 1;
+  for(unsigned l = 0; l < nlevels; l++) {
+    const GridMaker& g = levels[l];
+    Grid<Dtype, 4, false>& o = out[l];
+    std::fill(o.data(), o.data() + o.size(), 0.0);
+    if(o.dimension(0) != ntypes) throw std::out_of_range("Grid pyramid levels have different numbers of channels: "+itoa(o.dimension(0))+" vs "+itoa(ntypes));
+    if(vector_types) g.check_vector_args(coords, type_vector, radii, o);
+    else g.check_index_args(coords, type_index, radii, o);
+    origins[l] = g.get_grid_origin(grid_center);
+    chsizes[l] = size_t(g.dim) * g.dim * g.dim;
+    nthreads = std::max(nthreads, g.num_cpu_threads());
+  }
+  if(vector_types) {
+    if(type_vector.dimension(1) != ntypes) throw std::out_of_range("Incorrect number of channels in output grid: "+itoa(type_vector.dimension(1))+" vs "+itoa(ntypes));
+  } else {
+    //validate types up front so worker threads never throw part way through
+    for (size_t aidx = 0; aidx < natoms; ++aidx) {
+      float atype = type_index(aidx);
+      if(atype >= ntypes) throw std::out_of_range("Type index "+itoa(atype)+" larger than allowed "+itoa(ntypes));
+    }
+  }
+  bool binary = levels[0].binary;
+
+  //thread t owns the same fraction of every level along x, so each atom is
+  //loaded once per thread and added to all levels while it is in registers
+  parallel_slabs(nthreads, nthreads, [&](unsigned tstart, unsigned tend) {
+    std::vector<uint2> slabs(nlevels);
+    for(unsigned l = 0; l < nlevels; l++) {
+      unsigned d = levels[l].dim;
+      slabs[l] = make_uint2(d * tstart / nthreads, d * tend / nthreads);
+    }
+    for (size_t aidx = 0; aidx < natoms; ++aidx) {
+      float3 acoords = make_float3(coords(aidx, 0), coords(aidx, 1), coords(aidx, 2));
+      float radius = radii(aidx);
+      if(vector_types) {
+        for (size_t tidx = 0; tidx < ntypes; tidx++) {
+          Dtype tmult = type_vector(aidx, tidx);
+          if (tmult == 0) continue;
+          for(unsigned l = 0; l < nlevels; l++) {
+            Dtype *channel = out[l].data() + tidx * chsizes[l];
+            if (binary)
+              levels[l].set_atom_cpu<Dtype, true, true>(origins[l], acoords, radius, tmult, slabs[l].x, slabs[l].y, channel);
+            else
+              levels[l].set_atom_cpu<Dtype, false, true>(origins[l], acoords, radius, tmult, slabs[l].x, slabs[l].y, channel);
+          }
+        }
+      } else {
+        float atype = type_index(aidx);
+        if (atype < 0) continue;
+        for(unsigned l = 0; l < nlevels; l++) {
+          Dtype *channel = out[l].data() + size_t(atype) * chsizes[l];
+          if (binary)
+            levels[l].set_atom_cpu<Dtype, true, false>(origins[l], acoords, radius, 1.0, slabs[l].x, slabs[l].y, channel);
+          else
+            levels[l].set_atom_cpu<Dtype, false, false>(origins[l], acoords, radius, 1.0, slabs[l].x, slabs[l].y, channel);
+        }
+      }
+    }
+  });
+}
+
+template <typename Dtype>
+void GridPyramid::forward(float3 grid_center, const CoordinateSet& in, std::vector<Grid<Dtype, 4, true> >& out, cudaStream_t stream) const {
+  check_outputs(out.size());
+  in.togpu(stream); //staged once for all levels
+  for(unsigned l = 0, n = levels.size(); l < n; l++) {
+    levels[l].forward(grid_center, in, out[l], stream);
+  }
+}
+
+//select the CoordinateSet overload, only GPU grids take a stream
+template <typename Dtype>
+static void forward_levels(const GridPyramid& pyramid, float3 center, const CoordinateSet& c, std::vector<Grid<Dtype, 4, false> >& out, cudaStream_t) {
+  pyramid.forward(center, c, out);
+}
+
+template <typename Dtype>
+static void forward_levels(const GridPyramid& pyramid, float3 center, const CoordinateSet& c, std::vector<Grid<Dtype, 4, true> >& out, cudaStream_t stream) {
+  pyramid.forward(center, c, out, stream);
+}
+
+template <typename Dtype, bool isCUDA>
+void GridPyramid::forward(const Example& in, const Transform& transform, std::vector<Grid<Dtype, 4, isCUDA> >& out, cudaStream_t stream) const {
+  check_outputs(out.size());
+  CoordinateSet& c = merge_scratch(in, isCUDA); //copy so the coordinates can be transformed
+  for(const Grid<Dtype, 4, isCUDA>& o : out) {
+    if(c.max_type != o.dimension(0)) throw std::out_of_range("Incorrect number of channels in output grid: "+itoa(c.max_type) +" vs "+itoa(o.dimension(0)));
+  }
+  transform.forward(c, c, true, stream);
+  forward_levels(*this, transform.get_rotation_center(), c, out, stream);
+  //the merged coordinates are overwritten by the next call, which is only ordered with the default stream
+  if(isCUDA && stream) LMG_CUDA_CHECK(cudaStreamSynchronize(stream));
+}
+
+template void GridPyramid::forward(float3, const CoordinateSet&, std::vector<Grid<float, 4, false> >&) const;
+template void GridPyramid::forward(float3, const CoordinateSet&, std::vector<Grid<double, 4, false> >&) const;
+template void GridPyramid::forward(float3, const CoordinateSet&, std::vector<Grid<float, 4, true> >&, cudaStream_t) const;
+template void GridPyramid::forward(float3, const CoordinateSet&, std::vector<Grid<double, 4, true> >&, cudaStream_t) const;
+template void GridPyramid::forward(float3, const CoordinateSet&, std::vector<Grid<__half, 4, true> >&, cudaStream_t) const;
+template void GridPyramid::forward(float3, const CoordinateSet&, std::vector<Grid<__nv_bfloat16, 4, true> >&, cudaStream_t) const;
+template void GridPyramid::forward(const Example&, const Transform&, std::vector<Grid<float, 4, false> >&, cudaStream_t) const;
+template void GridPyramid::forward(const Example&, const Transform&, std::vector<Grid<double, 4, false> >&, cudaStream_t) const;
+template void GridPyramid::forward(const Example&, const Transform&, std::vector<Grid<float, 4, true> >&, cudaStream_t) const;
+template void GridPyramid::forward(const Example&, const Transform&, std::vector<Grid<double, 4, true> >&, cudaStream_t) const;
+template void GridPyramid::forward(const Example&, const Transform&, std::vector<Grid<__half, 4, true> >&, cudaStream_t) const;
+template void GridPyramid::forward(const Example&, const Transform&, std::vector<Grid<__nv_bfloat16, 4, true> >&, cudaStream_t) const;
+
+
 //set a single atom gradient - note can't pass a slice by reference
 template <typename Dtype>
 float3 GridMaker::calc_atom_gradient_cpu(const float3& grid_origin, const Grid1f& coordr, const Grid<Dtype, 3, false>& diff, float radius) const {
@@ -299,16 +1239,16 @@ float3 GridMaker::calc_atom_gradient_cpu(const float3& grid_origin, const Grid1f
 
 
   //for every grid point possibly overlapped by this atom
-  for (unsigned i = ranges[0].x, iend = ranges[0].y; i < iend;
-      ++i) {
+  for (unsigned i = ranges[0].x, iend = ranges[0].y; i < iend; ++i) {
+    //convert grid point coordinates to angstroms
+    float x = grid_origin.x + i * resolution;
     for (unsigned j = ranges[1].x, jend = ranges[1].y; j < jend; ++j) {
+      float y = grid_origin.y + j * resolution;
+      //the row is contiguous in memory so the inner loop has no index math
+      const Dtype *row = diff.data() + i * diff.offset(0) + j * diff.offset(1);
       for (unsigned k = ranges[2].x, kend = ranges[2].y; k < kend; ++k) {
-        //convert grid point coordinates to angstroms
-        float x = grid_origin.x + i * resolution;
-        float y = grid_origin.y + j * resolution;
         float z = grid_origin.z + k * resolution;
-
-        accumulate_atom_gradient(a.x,a.y,a.z, x,y,z, radius, diff(i,j,k), agrad);
+        accumulate_atom_gradient(a.x,a.y,a.z, x,y,z, radius, row[k], agrad);
       }
     }
   }
@@ -331,11 +1271,12 @@ float GridMaker::calc_type_gradient_cpu(const float3& grid_origin, const Grid1f&
   float ret = 0;
   //for every grid point possibly overlapped by this atom
   for (unsigned i = ranges[0].x, iend = ranges[0].y; i < iend; ++i) {
+    //convert grid point coordinates to angstroms
+    float x = grid_origin.x + i * resolution;
     for (unsigned j = ranges[1].x, jend = ranges[1].y; j < jend; ++j) {
+      float y = grid_origin.y + j * resolution;
+      const Dtype *row = diff.data() + i * diff.offset(0) + j * diff.offset(1);
       for (unsigned k = ranges[2].x, kend = ranges[2].y; k < kend; ++k) {
-        //convert grid point coordinates to angstroms
-        float x = grid_origin.x + i * resolution;
-        float y = grid_origin.y + j * resolution;
         float z = grid_origin.z + k * resolution;
         float val;
         if(binary)
@@ -343,7 +1284,7 @@ float GridMaker::calc_type_gradient_cpu(const float3& grid_origin, const Grid1f&
         else
           val = calc_point<false>(a.x, a.y, a.z, radius, float3{x,y,z});
 
-        ret += val * diff(i,j,k);
+        ret += val * row[k];
       }
     }
   }
@@ -366,13 +1307,14 @@ float GridMaker::calc_atom_relevance_cpu(const float3& grid_origin, const Grid1f
 
 
   //for every grid point possibly overlapped by this atom
-  for (unsigned i = ranges[0].x, iend = ranges[0].y; i < iend;
-      ++i) {
+  for (unsigned i = ranges[0].x, iend = ranges[0].y; i < iend; ++i) {
+    //convert grid point coordinates to angstroms
+    float x = grid_origin.x + i * resolution;
     for (unsigned j = ranges[1].x, jend = ranges[1].y; j < jend; ++j) {
+      float y = grid_origin.y + j * resolution;
+      const Dtype *denserow = density.data() + i * density.offset(0) + j * density.offset(1);
+      const Dtype *diffrow = diff.data() + i * diff.offset(0) + j * diff.offset(1);
       for (unsigned k = ranges[2].x, kend = ranges[2].y; k < kend; ++k) {
-        //convert grid point coordinates to angstroms
-        float x = grid_origin.x + i * resolution;
-        float y = grid_origin.y + j * resolution;
         float z = grid_origin.z + k * resolution;
         float val = 0;
         if(binary)
@@ -381,8 +1323,8 @@ float GridMaker::calc_atom_relevance_cpu(const float3& grid_origin, const Grid1f
           val = calc_point<false>(a.x, a.y, a.z, radius, float3{x,y,z});
 
         if (val > 0) {
-          float denseval = density(i,j,k);
-          float gridval = diff(i,j,k);
+          float denseval = denserow[k];
+          float gridval = diffrow[k];
           if(denseval > 0) {
             //weight by contribution to density grid
             ret += gridval*val/denseval;
@@ -400,6 +1342,7 @@ template <typename Dtype>
 void GridMaker::backward(float3 grid_center, const Grid<float, 2, false>& coords,
     const Grid<float, 1, false>& type_index, const Grid<float, 1, false>& radii,
     const Grid<Dtype, 4, false>& diff, Grid<Dtype, 2, false>& atom_gradients) const {
+  StageTimer timer(STAGE_BACKWARD_CPU);
 
   atom_gradients.fill_zero();
   unsigned n = coords.dimension(0);
@@ -415,19 +1358,26 @@ void GridMaker::backward(float3 grid_center, const Grid<float, 2, false>& coords
       throw std::invalid_argument("diff does not have correct dimension "+itoa(i)+": "+itoa(diff.dimension(i))+" vs "+itoa(dim));
   }
   float3 grid_origin = get_grid_origin(grid_center);
-
+  //validate types up front so worker threads never throw part way through
   for (unsigned i = 0; i < n; ++i) {
-    int whichgrid = round(type_index[i]); // this is which atom-type channel of the grid to look at
-    if (whichgrid >= 0) {
-      if((unsigned)whichgrid >= diff.dimension(0)) {
-        throw std::invalid_argument("Incorrect channel size for diff: "+itoa(whichgrid)+" vs "+itoa(diff.dimension(0)));
-      }
-      float3 agrad = calc_atom_gradient_cpu(grid_origin, coords[i], diff[whichgrid], radii[i]);
-      atom_gradients(i,0) = agrad.x;
-      atom_gradients(i,1) = agrad.y;
-      atom_gradients(i,2) = agrad.z;
+    int whichgrid = round(type_index[i]);
+    if(whichgrid >= 0 && (unsigned)whichgrid >= diff.dimension(0)) {
+      throw std::invalid_argument("Incorrect channel size for diff: "+itoa(whichgrid)+" vs "+itoa(diff.dimension(0)));
     }
   }
+
+  //atom gradients are independent, so each thread takes a range of atoms
+  parallel_slabs(std::min(num_cpu_threads(), n), n, [&](unsigned start, unsigned end) {
+    for (unsigned i = start; i < end; ++i) {
+      int whichgrid = round(type_index[i]); // this is which atom-type channel of the grid to look at
+      if (whichgrid >= 0) {
+        float3 agrad = calc_atom_gradient_cpu(grid_origin, coords[i], diff[whichgrid], radii[i]);
+        atom_gradients(i,0) = agrad.x;
+        atom_gradients(i,1) = agrad.y;
+        atom_gradients(i,2) = agrad.z;
+      }
+    }
+  });
 }
 
 template void GridMaker::backward(float3 grid_center, const Grid<float, 2, false>& coordrs,
@@ -442,6 +1392,7 @@ template <typename Dtype>
 void GridMaker::backward(float3 grid_center, const Grid<float, 2, false>& coords,
     const Grid<float, 2, false>& type_vector, const Grid<float, 1, false>& radii,
     const Grid<Dtype, 4, false>& diff, Grid<Dtype, 2, false>& atom_gradients, Grid<Dtype, 2, false>& type_gradients) const {
+  StageTimer timer(STAGE_BACKWARD_CPU);
 
   atom_gradients.fill_zero();
   type_gradients.fill_zero();
@@ -463,23 +1414,25 @@ void GridMaker::backward(float3 grid_center, const Grid<float, 2, false>& coords
 
   float3 grid_origin = get_grid_origin(grid_center);
 
-  for (unsigned i = 0; i < n; ++i) {
-    float radius = 0;
-    if(!radii_type_indexed)
-      radius = radii(i);
-    for(unsigned whichgrid = 0; whichgrid < ntypes; whichgrid++) {
-      float tmult = type_vector(i,whichgrid);
-      if(radii_type_indexed)
-        radius = radii(whichgrid);
-      if(tmult != 0) {
-        float3 agrad = calc_atom_gradient_cpu(grid_origin, coords[i], diff[whichgrid], radius);
-        atom_gradients(i,0) += agrad.x*tmult;
-        atom_gradients(i,1) += agrad.y*tmult;
-        atom_gradients(i,2) += agrad.z*tmult;
+  parallel_slabs(std::min(num_cpu_threads(), n), n, [&](unsigned start, unsigned end) {
+    for (unsigned i = start; i < end; ++i) {
+      float radius = 0;
+      if(!radii_type_indexed)
+        radius = radii(i);
+      for(unsigned whichgrid = 0; whichgrid < ntypes; whichgrid++) {
+        float tmult = type_vector(i,whichgrid);
+        if(radii_type_indexed)
+          radius = radii(whichgrid);
+        if(tmult != 0) {
+          float3 agrad = calc_atom_gradient_cpu(grid_origin, coords[i], diff[whichgrid], radius);
+          atom_gradients(i,0) += agrad.x*tmult;
+          atom_gradients(i,1) += agrad.y*tmult;
+          atom_gradients(i,2) += agrad.z*tmult;
+        }
+        type_gradients(i,whichgrid) = calc_type_gradient_cpu(grid_origin, coords[i], diff[whichgrid], radius);
       }
-      type_gradients(i,whichgrid) = calc_type_gradient_cpu(grid_origin, coords[i], diff[whichgrid], radius);
     }
-  }
+  });
 }
 
 template void GridMaker::backward(float3 grid_center, const Grid<float, 2, false>& coords,
@@ -489,12 +1442,56 @@ template void GridMaker::backward(float3 grid_center, const Grid<float, 2, false
     const Grid<float, 2, false>& type_vector, const Grid<float, 1, false>& radii,
     const Grid<double, 4, false>& diff, Grid<double, 2, false>& atom_gradients, Grid<double, 2, false>& type_gradients) const;
 
+//cpu batched backwards, one example at a time
+template <typename Dtype>
+void GridMaker::backward(float3 grid_center, const Grid<float, 3, false>& coords,
+    const Grid<float, 2, false>& type_index, const Grid<float, 2, false>& radii,
+    const Grid<Dtype, 5, false>& diff, Grid<Dtype, 3, false>& atom_gradients) const {
+  unsigned batch = coords.dimension(0);
+  if(batch != type_index.dimension(0) || batch != radii.dimension(0) || batch != diff.dimension(0) || batch != atom_gradients.dimension(0))
+    throw std::invalid_argument("Inconsistent batch sizes in backward");
+  for(unsigned b = 0; b < batch; b++) {
+    Grid<Dtype, 2, false> agrad = atom_gradients[b];
+    backward(grid_center, coords[b], type_index[b], radii[b], diff[b], agrad);
+  }
+}
+
+template void GridMaker::backward(float3, const Grid<float, 3, false>&,
+    const Grid<float, 2, false>&, const Grid<float, 2, false>&,
+    const Grid<float, 5, false>&, Grid<float, 3, false>&) const;
+template void GridMaker::backward(float3, const Grid<float, 3, false>&,
+    const Grid<float, 2, false>&, const Grid<float, 2, false>&,
+    const Grid<double, 5, false>&, Grid<double, 3, false>&) const;
+
+template <typename Dtype>
+void GridMaker::backward(float3 grid_center, const Grid<float, 3, false>& coords,
+    const Grid<float, 3, false>& type_vector, const Grid<float, 2, false>& radii,
+    const Grid<Dtype, 5, false>& diff, Grid<Dtype, 3, false>& atom_gradients, Grid<Dtype, 3, false>& type_gradients) const {
+  unsigned batch = coords.dimension(0);
+  if(batch != type_vector.dimension(0) || batch != radii.dimension(0) || batch != diff.dimension(0) ||
+      batch != atom_gradients.dimension(0) || batch != type_gradients.dimension(0))
+    throw std::invalid_argument("Inconsistent batch sizes in backward");
+  for(unsigned b = 0; b < batch; b++) {
+    Grid<Dtype, 2, false> agrad = atom_gradients[b];
+    Grid<Dtype, 2, false> tgrad = type_gradients[b];
+    backward(grid_center, coords[b], type_vector[b], radii[b], diff[b], agrad, tgrad);
+  }
+}
+
+template void GridMaker::backward(float3, const Grid<float, 3, false>&,
+    const Grid<float, 3, false>&, const Grid<float, 2, false>&,
+    const Grid<float, 5, false>&, Grid<float, 3, false>&, Grid<float, 3, false>&) const;
+template void GridMaker::backward(float3, const Grid<float, 3, false>&,
+    const Grid<float, 3, false>&, const Grid<float, 2, false>&,
+    const Grid<double, 5, false>&, Grid<double, 3, false>&, Grid<double, 3, false>&) const;
+
 
 template <typename Dtype>
 void GridMaker::backward_relevance(float3 grid_center,  const Grid<float, 2, false>& coords,
     const Grid<float, 1, false>& type_index, const Grid<float, 1, false>& radii,
     const Grid<Dtype, 4, false>& density, const Grid<Dtype, 4, false>& diff,
     Grid<Dtype, 1, false>& relevance) const {
+  StageTimer timer(STAGE_BACKWARD_CPU);
 
   relevance.fill_zero();
   unsigned n = coords.dimension(0);
@@ -503,13 +1500,21 @@ void GridMaker::backward_relevance(float3 grid_center,  const Grid<float, 2, fal
   if(n != radii.size()) throw std::invalid_argument("Radii dimension doesn't equal number of coordinates");
 
   float3 grid_origin = get_grid_origin(grid_center);
-
   for (unsigned i = 0; i < n; ++i) {
-    int whichgrid = round(type_index[i]); // this is which atom-type channel of the grid to look at
-    if (whichgrid >= 0) {
-      relevance(i) = calc_atom_relevance_cpu(grid_origin, coords[i], density[whichgrid], diff[whichgrid], radii[i]);
+    int whichgrid = round(type_index[i]);
+    if(whichgrid >= 0 && ((unsigned)whichgrid >= density.dimension(0) || (unsigned)whichgrid >= diff.dimension(0))) {
+      throw std::out_of_range("Incorrect channel size for relevance: "+itoa(whichgrid)+" vs "+itoa(diff.dimension(0)));
     }
   }
+
+  parallel_slabs(std::min(num_cpu_threads(), n), n, [&](unsigned start, unsigned end) {
+    for (unsigned i = start; i < end; ++i) {
+      int whichgrid = round(type_index[i]); // this is which atom-type channel of the grid to look at
+      if (whichgrid >= 0) {
+        relevance(i) = calc_atom_relevance_cpu(grid_origin, coords[i], density[whichgrid], diff[whichgrid], radii[i]);
+      }
+    }
+  });
 }
 
 template void GridMaker::backward_relevance(float3,  const Grid<float, 2, false>&,
@@ -518,4 +1523,26 @@ template void GridMaker::backward_relevance(float3,  const Grid<float, 2, false>
 template void GridMaker::backward_relevance(float3,  const Grid<float, 2, false>&,
     const Grid<float, 1, false>&, const Grid<float, 1, false>&, const Grid<double, 4, false>&,
     const Grid<double, 4, false>& , Grid<double, 1, false>& ) const;
+
+template <typename Dtype>
+void GridMaker::backward_relevance(float3 grid_center,  const Grid<float, 3, false>& coords,
+    const Grid<float, 2, false>& type_index, const Grid<float, 2, false>& radii,
+    const Grid<Dtype, 5, false>& density, const Grid<Dtype, 5, false>& diff,
+    Grid<Dtype, 2, false>& relevance) const {
+  unsigned batch = coords.dimension(0);
+  if(batch != type_index.dimension(0) || batch != radii.dimension(0) || batch != density.dimension(0) ||
+      batch != diff.dimension(0) || batch != relevance.dimension(0))
+    throw std::invalid_argument("Inconsistent batch sizes in backward_relevance");
+  for(unsigned b = 0; b < batch; b++) {
+    Grid<Dtype, 1, false> rel = relevance[b];
+    backward_relevance(grid_center, coords[b], type_index[b], radii[b], density[b], diff[b], rel);
+  }
+}
+
+template void GridMaker::backward_relevance(float3,  const Grid<float, 3, false>&,
+    const Grid<float, 2, false>&, const Grid<float, 2, false>&, const Grid<float, 5, false>&,
+    const Grid<float, 5, false>&, Grid<float, 2, false>&) const;
+template void GridMaker::backward_relevance(float3,  const Grid<float, 3, false>&,
+    const Grid<float, 2, false>&, const Grid<float, 2, false>&, const Grid<double, 5, false>&,
+    const Grid<double, 5, false>& , Grid<double, 2, false>& ) const;
 }
@@ -1,67 +1,82 @@
 #include "libmolgrid/grid_maker.h"
-#include <thrust/extrema.h>
-#include <thrust/device_ptr.h>
+#include "libmolgrid/instrumentation.h"
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <type_traits>
 
 namespace libmolgrid {
-    __shared__ uint scanScratch[LMG_CUDA_NUM_THREADS * 2];
-    __shared__ uint scanBuffer[2][LMG_CUDA_NUM_THREADS];
-    __shared__ uint scanOutput[LMG_CUDA_NUM_THREADS];
-    __shared__ uint atomIndices[LMG_CUDA_NUM_THREADS];
-    __shared__ uint atomMask[LMG_CUDA_NUM_THREADS];
-
-    //TODO: warp shuffle version
-    inline __device__ uint warpScanInclusive(int threadIndex, uint idata,
-        volatile uint *s_Data, uint size) {
-      uint pos = 2 * threadIndex - (threadIndex & (size - 1));
-      s_Data[pos] = 0;
-      pos += size;
-      s_Data[pos] = idata;
-    
-      for (uint offset = 1; offset < size; offset <<= 1)
-        s_Data[pos] += s_Data[pos - offset];
-    
-      return s_Data[pos];
-    }
-    
-    inline __device__ uint warpScanExclusive(int threadIndex, uint idata,
-        volatile uint *sScratch, uint size) {
-      return warpScanInclusive(threadIndex, idata, sScratch, size) - idata;
-    }
-    
-    __inline__ __device__ void sharedMemExclusiveScan(int threadIndex, uint* sInput,
-        uint* sOutput) {
-      uint idata = sInput[threadIndex];
-      //Bottom-level inclusive warp scan
-      uint warpResult = warpScanInclusive(threadIndex, idata, scanScratch,
-          WARP_SIZE);
-
-      // Save top elements of each warp for exclusive warp scan sync
-      // to wait for warp scans to complete (because s_Data is being
-      // overwritten)
-      __syncthreads();
-    
-      if ((threadIndex & (WARP_SIZE - 1)) == (WARP_SIZE - 1)) {
-        scanScratch[threadIndex >> LOG2_WARP_SIZE] = warpResult;
+
+    /// an atom compacted into shared memory by the forward kernels
+    struct shared_atom {
+      float3 coord; //with any transformation applied
+      unsigned index;
+    };
+    //sized at launch to the atom chunk of the forward kernel's launch configuration
+    extern __shared__ shared_atom chunkAtoms[];
+
+//largest number of cells in each direction a block will search when atoms are binned,
+//beyond this (very large radii or fine resolution) blocks scan all atoms
+#define LMG_MAX_BIN_REACH 3
+#define LMG_MAX_BIN_RANGES ((2*LMG_MAX_BIN_REACH+1)*(2*LMG_MAX_BIN_REACH+1))
+    __shared__ uint binRangeStart[LMG_MAX_BIN_RANGES + 1];
+    __shared__ uint binRangeAtom[LMG_MAX_BIN_RANGES];
+
+    //inclusive scan of value across the lanes of a warp, all lanes must participate
+    __device__ inline uint warp_inclusive_scan(unsigned lane, uint value) {
+      for(unsigned offset = 1; offset < WARP_SIZE; offset <<= 1) {
+        uint n = __shfl_up_sync(0xffffffff, value, offset);
+        if(lane >= offset) value += n;
       }
-    
-      // wait for warp scans to complete
+      return value;
+    }
+
+    /* \brief Exclusive scan of per warp totals across a block.
+     * Every thread of the block must call this, and the block size must be a
+     * multiple of WARP_SIZE and at most WARP_SIZE*WARP_SIZE.
+     * @param[in] thread index within the block
+     * @param[in] number of threads in the block
+     * @param[in] warp_total total of the calling warp, only read from its last lane
+     * @param[out] total of the whole block
+     * @return sum of the totals of the preceding warps
+     */
+    __device__ inline uint block_warp_offset(unsigned tidx, unsigned nthreads, uint warp_total, uint& total) {
+      __shared__ uint warpOffsets[WARP_SIZE + 1];
+      unsigned lane = tidx & (WARP_SIZE - 1);
+      unsigned warp = tidx >> LOG2_WARP_SIZE;
+      __syncthreads(); //readers of a previous scan are done
+      if(lane == WARP_SIZE - 1) warpOffsets[warp] = warp_total;
       __syncthreads();
-    
-      if (threadIndex < (LMG_CUDA_NUM_THREADS / WARP_SIZE)) {
-        // grab top warp elements
-        uint val = scanScratch[threadIndex];
-        // calculate exclusive scan and write back to shared memory
-        scanScratch[threadIndex] = warpScanExclusive(threadIndex, val, scanScratch,
-            LMG_CUDA_NUM_THREADS >> LOG2_WARP_SIZE);
+      if(warp == 0) {
+        unsigned nwarps = nthreads >> LOG2_WARP_SIZE;
+        uint t = lane < nwarps ? warpOffsets[lane] : 0;
+        uint inclusive = warp_inclusive_scan(lane, t); //every lane has read before any writes
+        if(lane < nwarps) warpOffsets[lane] = inclusive - t;
+        if(lane == WARP_SIZE - 1) warpOffsets[WARP_SIZE] = inclusive;
       }
-    
-      //return updated warp scans with exclusive scan results
       __syncthreads();
-    
-      sOutput[threadIndex] = warpResult + scanScratch[threadIndex >> LOG2_WARP_SIZE]
-          - idata;
+      total = warpOffsets[WARP_SIZE];
+      return warpOffsets[warp];
     }
-    
+
+    //exclusive scan of value across the block, total is set to the sum of every thread's value
+    __device__ inline uint block_exclusive_scan(unsigned tidx, unsigned nthreads, uint value, uint& total) {
+      uint inclusive = warp_inclusive_scan(tidx & (WARP_SIZE - 1), value);
+      return block_warp_offset(tidx, nthreads, inclusive, total) + inclusive - value;
+    }
+
+    /* \brief Stream compaction position of this thread: the number of threads
+     * before it in the block for which keep is true.  Counts within a warp come
+     * from a ballot, so only the per warp counts go through shared memory.
+     * @param[out] total number of threads for which keep is true
+     */
+    __device__ inline uint block_compact_index(unsigned tidx, unsigned nthreads, bool keep, uint& total) {
+      unsigned lane = tidx & (WARP_SIZE - 1);
+      unsigned ballot = __ballot_sync(0xffffffff, keep);
+      uint before = __popc(ballot & ((1u << lane) - 1));
+      return block_warp_offset(tidx, nthreads, __popc(ballot), total) + before;
+    }
+
 
     uint2 GridMaker::get_bounds_1d(const float grid_origin,
         float coord, float densityrad) const {
@@ -91,42 +106,57 @@ namespace libmolgrid {
       return ret;
     }
 
+    //device copy of a host density table on the current device, uploaded on first use
+    //each table has its own copy so kernels in flight on other streams are never affected
+    static const float* device_density_table(const float *table) {
+      static std::mutex mtx;
+      static std::map<std::pair<const float*, int>, const float*> tables; //never freed, like the host tables
+      int device = 0;
+      LMG_CUDA_CHECK(cudaGetDevice(&device));
+      std::lock_guard<std::mutex> lock(mtx);
+      const float *&dtable = tables[std::make_pair(table, device)];
+      if(!dtable) {
+        size_t bytes = (GridMaker::density_table_size + 1) * sizeof(float);
+        float *d = nullptr;
+        LMG_CUDA_CHECK(cudaMalloc(&d, bytes));
+        LMG_CUDA_CHECK(cudaMemcpy(d, table, bytes, cudaMemcpyHostToDevice));
+        dtable = d;
+      }
+      return dtable;
+    }
+
+    GridMaker GridMaker::device_copy() const {
+      GridMaker g(*this);
+      if(density_table) g.density_table = device_density_table(density_table);
+      return g;
+    }
+
     //non-binary, gaussian case
     template<>
     float GridMaker::calc_point<false>(float ax, float ay, float az, float ar,
         const float3& grid_coords) const {
       float rsq = sqDistance(grid_coords, ax, ay, az);
-      ar *= radius_scale;
-      //For non-binary density we want a Gaussian where 2 std occurs at the
-      //radius, after which it becomes quadratic.
-      //The quadratic is fit to have both the same value and first derivative
-      //at the cross over point and a value and derivative of zero at fianl_radius_multiple
-      float dist = sqrtf(rsq);
-      if (dist >= ar * final_radius_multiple) {
-        return 0.0;
-      } else
-      if (dist <= ar * gaussian_radius_multiple) {
-        //return gaussian
-        float ex = -2.0 * dist * dist / (ar*ar);
-        return exp(ex);
-      } else { //return quadratic
-        float dr = dist / ar;
-        float q = (A * dr + B) * dr + C;
-        return q > 0 ? q : 0; //avoid very small negative numbers
+      if(density_table) { //device table when called from a kernel launched with device_copy
+        return lookup_density(rsq, ar, density_table);
       }
-
+      return calc_density<false>(rsq, ar);
     }
 
     template<>
     float GridMaker::calc_point<true>(float ax, float ay, float az, float ar,
         const float3& grid_coords) const {
       float rsq = sqDistance(grid_coords, ax, ay, az);
-      ar *= radius_scale;
-      //is point within radius?
-      if (rsq < ar * ar)
-        return 1.0;
-      else
-        return 0.0;
+      return calc_density<true>(rsq, ar);
+    }
+
+    /* \brief Index of this block along the z axis of the voxel grid.
+     * When gridding a batch, the blocks of each example are stacked along
+     * the z dimension of the launch grid, so blockIdx.z / blocksperside is
+     * the example.
+     */
+    __device__ inline unsigned spatial_block_z(unsigned dim) {
+      unsigned blocksperside = (dim + blockDim.z - 1) / blockDim.z;
+      return blockIdx.z % blocksperside;
     }
 
     /* \brief The GPU forward code path launches a kernel (forward_gpu) that
@@ -136,20 +166,21 @@ namespace libmolgrid {
      * they actually check whether they are overlapped by an atom and update
      * their density accordingly. atomOverlapsBlock is a helper for generating
      * the reduced array of possibly relevant atoms.
-     * @param[in] atom index to check
+     * @param[in] atom coordinate
      * @param[in] grid origin
-     * @param[in] coordinates (Nx3)
-     * @param[in] type indices (N integers stored as floats)
-     * @param[in] radii (N)
+     * @param[in] resolution
+     * @param[in] grid width in points
+     * @param[in] atom radius
+     * @param[in] radius multiple
      * @param[out] 1 if atom could overlap block, 0 if not
      */
     __device__
-    static unsigned atom_overlaps_block(unsigned aidx, float3& grid_origin,
-        float resolution, const float3 *coords, float radius, float rmult) {
+    static unsigned atom_overlaps_block(float3 a, float3& grid_origin,
+        float resolution, unsigned dim, float radius, float rmult) {
 
       unsigned xi = blockIdx.x * blockDim.x;
       unsigned yi = blockIdx.y * blockDim.y;
-      unsigned zi = blockIdx.z * blockDim.z;
+      unsigned zi = spatial_block_z(dim) * blockDim.z;
     
       //compute corners of block
       float startx = xi * resolution + grid_origin.x;
@@ -160,7 +191,6 @@ namespace libmolgrid {
       float endy = starty + resolution * blockDim.y;
       float endz = startz + resolution * blockDim.z;
 
-      float3 a = coords[aidx];
       float centerx = a.x;
       float centery = a.y;
       float centerz = a.z;
@@ -173,13 +203,52 @@ namespace libmolgrid {
     }
 
 
-    template <typename Dtype, bool Binary>
+    //add val to a grid value; reduced precision grids are summed in registers
+    //instead (see forward_gpu_block), so there are only overloads for float and double
+    __device__ inline void accumulate(float *d, float val) { *d += val; }
+    __device__ inline void accumulate(double *d, float val) { *d += val; }
+
+    /* \brief Grid width and resolution of the index type forward kernels.
+     * The runtime geometry reads both from the GridMaker.  A fixed geometry
+     * makes them compile time constants, so block counts and voxel offsets
+     * fold into immediates and divisions by the width become multiplies.
+     * Its resolution is 1/InvRes, exact for the powers of two used, and it is
+     * only selected when the GridMaker matches it exactly, so the arithmetic
+     * and therefore the densities are the same as with the runtime geometry.
+     */
+    struct runtime_geometry {
+      __host__ __device__ static unsigned dim(const GridMaker& g) { return g.get_first_dim(); }
+      __host__ __device__ static float resolution(const GridMaker& g) { return g.get_resolution(); }
+    };
+
+    template <unsigned Dim, unsigned InvRes>
+    struct fixed_geometry {
+      __host__ __device__ static constexpr unsigned dim(const GridMaker&) { return Dim; }
+      __host__ __device__ static constexpr float resolution(const GridMaker&) { return 1.0f / InvRes; }
+    };
+
+    //call f with the geometry to compile the forward kernels for
+    template <typename F>
+    static void with_geometry(const GridMaker& gmaker, const F& f) {
+      if(gmaker.get_specialized_kernels()) {
+        unsigned dim = gmaker.get_first_dim();
+        float res = gmaker.get_resolution();
+        if(dim == 48 && res == 0.5f) return f(fixed_geometry<48, 2>()); //23.5A
+        if(dim == 24 && res == 0.5f) return f(fixed_geometry<24, 2>()); //11.5A
+        if(dim == 95 && res == 0.25f) return f(fixed_geometry<95, 4>()); //23.5A
+      }
+      f(runtime_geometry());
+    }
+
+    template <typename Dtype, bool Binary, typename Geometry>
     __device__ void GridMaker::set_atoms(unsigned rel_atoms, float3 grid_origin,
-        const float3 *coord_data, const float *tdata, const float *radii, Dtype *data) {
+        const float *tdata, const float *radii, Dtype *data) {
+      const unsigned dim = Geometry::dim(*this);
+      const float resolution = Geometry::resolution(*this);
       //figure out what grid point we are 
       unsigned xi = threadIdx.x + blockIdx.x * blockDim.x;
       unsigned yi = threadIdx.y + blockIdx.y * blockDim.y;
-      unsigned zi = threadIdx.z + blockIdx.z * blockDim.z;
+      unsigned zi = threadIdx.z + spatial_block_z(dim) * blockDim.z;
 
       if(xi >= dim || yi >= dim || zi >= dim)
         return;//bail if we're off-grid, this should not be common
@@ -194,78 +263,572 @@ namespace libmolgrid {
 
       //iterate over all possibly relevant atoms
       for(unsigned ai = 0; ai < rel_atoms; ai++) {
-        unsigned i = atomIndices[ai];
-        float3 c = coord_data[i];
+        unsigned i = chunkAtoms[ai].index;
+        float3 c = chunkAtoms[ai].coord;
         float val = calc_point<Binary>(c.x, c.y, c.z, radii[i], grid_coords);
         int atype = int(tdata[i]); //type is assumed correct because atom_overlaps at least gets rid of neg
 
         if(Binary) {
             if(val != 0)
-              data[atype*chmult+goffset] = 1.0;
+              data[atype*chmult+goffset] = Dtype(1.0f);
         } else if(val > 0) {
-          data[atype*chmult+goffset] += val;
+          accumulate(data+atype*chmult+goffset, val);
         }
 
       }
     }
 
-    template <typename Dtype, bool Binary>
-    __global__ void
-  //  __launch_bounds__(LMG_CUDA_NUM_THREADS)
-    forward_gpu(GridMaker gmaker, float3 grid_origin,
-        const Grid<float, 2, true> coords, const Grid<float, 1, true> type_index,
-        const Grid<float, 1, true> radii, Grid<Dtype, 4, true> out) {
+    /// per-example information for batched gridding
+    struct gpu_batch_info {
+      Quaternion Q; //transformation
+      float3 center;
+      float3 translate;
+      float3 grid_origin;
+      unsigned offset; //index of first atom in packed atom arrays
+      unsigned natoms;
+    };
+
+    //coordinate of atom i, with the example's transformation applied if xform is provided
+    __device__ inline float3 load_atom(const float3 *coords, unsigned i, const gpu_batch_info *xform) {
+      float3 c = coords[i];
+      if(xform) c = xform->Q.transform(c.x, c.y, c.z, xform->center, xform->translate);
+      return c;
+    }
+
+    /* \brief Per-thread scratch memory for work queued on a stream.
+     * Before the memory is reused by a later call from the same thread, only
+     * the work that last used it is waited on, so calls on different streams
+     * are not serialized.  Each device has its own memory, as kernels can not
+     * use the memory of another device.  Each device alternates between two
+     * buffers, so the host can fill one for the next call while the work of
+     * the previous call is still using the other.
+     */
+    template <typename T>
+    struct stream_scratch {
+      struct device_scratch {
+        ManagedGrid<T, 1> buffer;
+        cudaEvent_t last_use = nullptr; //never destroyed, thread exit may follow context teardown
+      };
+      std::vector<device_scratch> buffers; //indexed by 2*device + buffer
+      std::vector<unsigned char> next_buffer; //indexed by device
+      unsigned current = 0; //buffer of the last acquire
+
+      //wait for the previous user of the next of the current device's buffers, then size it for n elements
+      ManagedGrid<T, 1>& acquire(size_t n) {
+        unsigned device = DeviceGuard::current_device();
+        if(device >= next_buffer.size()) {
+          next_buffer.resize(device+1, 0);
+          buffers.resize(2*(device+1));
+        }
+        current = 2*device + next_buffer[device];
+        next_buffer[device] ^= 1;
+        device_scratch& d = buffers[current];
+        if(d.last_use) LMG_CUDA_CHECK(cudaEventSynchronize(d.last_use));
+        d.buffer = d.buffer.resized(n);
+        return d.buffer;
+      }
+
+      //mark the memory of the last acquire as in use by everything queued on stream so far
+      void release(cudaStream_t stream) {
+        device_scratch& d = buffers[current];
+        if(!d.last_use) LMG_CUDA_CHECK(cudaEventCreateWithFlags(&d.last_use, cudaEventDisableTiming));
+        LMG_CUDA_CHECK(cudaEventRecord(d.last_use, stream));
+      }
+    };
+
+    /// grids stored at less than single precision
+    template <typename Dtype> struct reduced_precision { static const bool value = false; };
+    template <> struct reduced_precision<__half> { static const bool value = true; };
+    template <> struct reduced_precision<__nv_bfloat16> { static const bool value = true; };
+
+    //selects the forward code of grids stored at reduced precision
+    template <typename Dtype> using reduced_tag = std::integral_constant<bool, reduced_precision<Dtype>::value>;
+
+    /// channels of a reduced precision grid that each thread sums in registers in one pass over the atoms
+    #define LMG_REDUCED_CHANNELS 16
+
+    //add val to sum[c], c is only known at run time so every register is tested to keep sum out of local memory
+    __device__ inline void add_channel(float (&sum)[LMG_REDUCED_CHANNELS], unsigned c, float val) {
+      #pragma unroll
+      for(unsigned g = 0; g < LMG_REDUCED_CHANNELS; g++) {
+        if(g == c) sum[g] += val;
+      }
+    }
+
+    //set sum[c] to val
+    __device__ inline void set_channel(float (&sum)[LMG_REDUCED_CHANNELS], unsigned c, float val) {
+      #pragma unroll
+      for(unsigned g = 0; g < LMG_REDUCED_CHANNELS; g++) {
+        if(g == c) sum[g] = val;
+      }
+    }
+
+    //store the channels [first, first+LMG_REDUCED_CHANNELS) of a voxel, of which there are ntypes in all
+    template <typename Dtype>
+    __device__ inline void store_channels(const float (&sum)[LMG_REDUCED_CHANNELS], unsigned first, unsigned ntypes,
+        size_t chmult, Dtype *out) {
+      #pragma unroll
+      for(unsigned g = 0; g < LMG_REDUCED_CHANNELS; g++) {
+        if(first + g < ntypes) out[(first + g) * chmult] = Dtype(sum[g]);
+      }
+    }
+
+    /* \brief Atoms sorted by the cell that contains their center.  Cells are
+     * LMG_CUDA_BLOCKDIM voxels on a side, the default thread block, so a block
+     * only needs to check the atoms of the cells within reach of its own.
+     */
+    struct atom_bins {
+      const unsigned *atoms; //atom indices sorted by cell
+      const unsigned *cell_start; //index into atoms of the first atom of each cell, ncells+1 entries
+      const unsigned *reach; //cells in each direction that an atom can overlap
+      const float *maxradius; //largest radius, only set when radii are indexed by type
+    };
+
+    //cell index of an atom, atoms outside the grid are placed in the nearest cell
+    __device__ inline int atom_cell(float coord, float origin, float cellwidth, int nb) {
+      int c = floorf((coord - origin) / cellwidth);
+      return min(max(c, 0), nb - 1);
+    }
+
+    //largest of n radii, radii are non-negative so their bit patterns order like unsigned integers
+    __global__ void max_radius_kernel(unsigned n, const float *radii, unsigned *maxradius) {
+      LMG_CUDA_KERNEL_LOOP(i, n) {
+        atomicMax(maxradius, __float_as_uint(fmaxf(radii[i], 0.0f)));
+      }
+    }
+
+    //compute the cell of each atom, the number of atoms in each cell, and the largest cell reach
+    //if radii is null every atom has maxradius; atoms that cannot reach the grid are not binned
+    __global__ void bin_atoms_kernel(unsigned n, const float3 *coords, const gpu_batch_info *xform, const float *types,
+        const float *radii, const float *maxradius, float rmult, float3 grid_origin, float gridwidth,
+        float cellwidth, unsigned nb, unsigned *keys, unsigned *counts, unsigned *reach) {
+      unsigned ncells = nb * nb * nb;
+      LMG_CUDA_KERNEL_LOOP(i, n) {
+        keys[i] = ncells; //after every cell, so never gridded
+        if(types && types[i] < 0) continue;
+        float3 a = load_atom(coords, i, xform);
+        float r = (radii ? radii[i] : *maxradius) * rmult;
+        if(a.x + r < grid_origin.x || a.x - r > grid_origin.x + gridwidth ||
+           a.y + r < grid_origin.y || a.y - r > grid_origin.y + gridwidth ||
+           a.z + r < grid_origin.z || a.z - r > grid_origin.z + gridwidth)
+          continue;
+        int cx = atom_cell(a.x, grid_origin.x, cellwidth, nb);
+        int cy = atom_cell(a.y, grid_origin.y, cellwidth, nb);
+        int cz = atom_cell(a.z, grid_origin.z, cellwidth, nb);
+        unsigned key = (cx * nb + cy) * nb + cz;
+        keys[i] = key;
+        atomicAdd(counts + key, 1);
+        atomicMax(reach, unsigned(r / cellwidth) + 1);
+      }
+    }
+
+    //exclusive scan of the cell counts into cell_start with a single block of LMG_CUDA_NUM_THREADS,
+    //counts is overwritten with the same offsets to use as scatter cursors
+    __global__ void scan_cells_kernel(unsigned ncells, unsigned *counts, unsigned *cell_start) {
+      unsigned tidx = threadIdx.x;
+      unsigned chunk = (ncells + LMG_CUDA_NUM_THREADS - 1) / LMG_CUDA_NUM_THREADS;
+      unsigned begin = min(tidx * chunk, ncells);
+      unsigned end = min(begin + chunk, ncells);
+      unsigned total = 0;
+      for(unsigned c = begin; c < end; c++) total += counts[c];
+      unsigned sum = 0;
+      unsigned start = block_exclusive_scan(tidx, LMG_CUDA_NUM_THREADS, total, sum);
+      for(unsigned c = begin; c < end; c++) {
+        unsigned cnt = counts[c];
+        cell_start[c] = counts[c] = start;
+        start += cnt;
+      }
+      if(tidx == LMG_CUDA_NUM_THREADS - 1) cell_start[ncells] = start;
+    }
+
+    //place each binned atom in its cell
+    __global__ void scatter_atoms_kernel(unsigned n, const unsigned *keys, unsigned ncells,
+        unsigned *cursor, unsigned *atoms) {
+      LMG_CUDA_KERNEL_LOOP(i, n) {
+        unsigned key = keys[i];
+        if(key < ncells) atoms[atomicAdd(cursor + key, 1)] = i;
+      }
+    }
+
+    //scattering leaves the atoms of a cell in arbitrary order, restore input order so
+    //results are deterministic; cells hold few atoms so an insertion sort suffices
+    __global__ void sort_cells_kernel(unsigned ncells, const unsigned *cell_start, unsigned *atoms) {
+      LMG_CUDA_KERNEL_LOOP(c, ncells) {
+        unsigned first = cell_start[c];
+        for(unsigned i = first + 1, end = cell_start[c + 1]; i < end; i++) {
+          unsigned a = atoms[i];
+          unsigned j = i;
+          for(; j > first && atoms[j - 1] > a; j--) atoms[j] = atoms[j - 1];
+          atoms[j] = a;
+        }
+      }
+    }
+
+    /* \brief Sort atoms into cells so that forward kernels can skip distant atoms.
+     * Everything is queued on stream without synchronizing the host.
+     * @param[in] number of atoms
+     * @param[in] coordinates, types (may be null) and radii of atoms
+     * @param[in] xform transformation applied to coordinates as they are read, may be null
+     * @param[in] ntyperadii if nonzero, radii holds this many per type radii and
+     * every atom is binned with the largest
+     * @param[in] scratch memory the bins are stored in, the caller must release
+     * it once the kernels using the bins are queued
+     */
+    static atom_bins bin_atoms(const GridMaker& gmaker, float3 grid_origin, unsigned natoms,
+        const float3 *coords, const gpu_batch_info *xform, const float *types, const float *radii, unsigned ntyperadii,
+        stream_scratch<unsigned>& scratch, cudaStream_t stream) {
+      unsigned nb = (gmaker.get_first_dim() + LMG_CUDA_BLOCKDIM - 1) / LMG_CUDA_BLOCKDIM;
+      unsigned ncells = nb * nb * nb;
+      float cellwidth = LMG_CUDA_BLOCKDIM * gmaker.get_resolution();
+      float gridwidth = (gmaker.get_first_dim() - 1) * gmaker.get_resolution();
+
+      ManagedGrid<unsigned, 1>& buffer = scratch.acquire(2 * natoms + 2 * ncells + 3);
+      buffer.togpu(false);
+      unsigned *keys = buffer.gpu().data();
+      unsigned *atoms = keys + natoms;
+      unsigned *cell_start = atoms + natoms;
+      unsigned *counts = cell_start + ncells + 1;
+      unsigned *reach = counts + ncells;
+      unsigned *maxradius = reach + 1;
+
+      //counts, reach and maxradius are contiguous
+      LMG_CUDA_CHECK(cudaMemsetAsync(counts, 0, (ncells + 2) * sizeof(unsigned), stream));
+      if(ntyperadii) {
+        max_radius_kernel<<<LMG_GET_BLOCKS(ntyperadii), LMG_GET_THREADS(ntyperadii), 0, stream>>>(ntyperadii, radii, maxradius);
+        LMG_CUDA_CHECK(cudaPeekAtLastError());
+      }
+      bin_atoms_kernel<<<LMG_GET_BLOCKS(natoms), LMG_GET_THREADS(natoms), 0, stream>>>(natoms, coords, xform, types,
+          ntyperadii ? nullptr : radii, (float*)maxradius, gmaker.get_radiusmultiple(), grid_origin, gridwidth,
+          cellwidth, nb, keys, counts, reach);
+      LMG_CUDA_CHECK(cudaPeekAtLastError());
+      scan_cells_kernel<<<1, LMG_CUDA_NUM_THREADS, 0, stream>>>(ncells, counts, cell_start);
+      LMG_CUDA_CHECK(cudaPeekAtLastError());
+      scatter_atoms_kernel<<<LMG_GET_BLOCKS(natoms), LMG_GET_THREADS(natoms), 0, stream>>>(natoms, keys, ncells, counts, atoms);
+      LMG_CUDA_CHECK(cudaPeekAtLastError());
+      sort_cells_kernel<<<LMG_GET_BLOCKS(ncells), LMG_GET_THREADS(ncells), 0, stream>>>(ncells, cell_start, atoms);
+      LMG_CUDA_CHECK(cudaPeekAtLastError());
+
+      return atom_bins{atoms, cell_start, reach, (const float*)maxradius};
+    }
+
+    //cells within reach of the voxels [first, first+width) along one axis, clamped to the nb cells
+    __device__ inline void reach_cells(unsigned first, unsigned width, unsigned dim, unsigned reach, int nb, int& lo, int& hi) {
+      unsigned last = min(first + width, dim) - 1;
+      lo = max(int(first / LMG_CUDA_BLOCKDIM) - int(reach), 0);
+      hi = min(int(last / LMG_CUDA_BLOCKDIM) + int(reach), nb - 1);
+    }
+
+    /* \brief Load the ranges of binned atoms that may overlap this block into
+     * shared memory.  For each x,y column of neighbouring cells the cells along z
+     * are contiguous in the sorted atoms, so there is one range per column.
+     * Blocks may be smaller or, along z, larger than a cell.
+     * @param[in] atom bins
+     * @param[in] grid width in points
+     * @param[in] thread index within block, the block must have at least LMG_MAX_BIN_RANGES threads
+     * @param[out] number of ranges, zero if reach is too large to use bins
+     * @return number of candidate atoms in the ranges
+     */
+    __device__ static unsigned gather_bins(const atom_bins& bins, unsigned dim, unsigned tidx, unsigned& nranges) {
+      unsigned reach = *bins.reach;
+      int nb = (dim + LMG_CUDA_BLOCKDIM - 1) / LMG_CUDA_BLOCKDIM;
+      int x0, x1, y0, y1, z0, z1;
+      reach_cells(blockIdx.x * blockDim.x, blockDim.x, dim, reach, nb, x0, x1);
+      reach_cells(blockIdx.y * blockDim.y, blockDim.y, dim, reach, nb, y0, y1);
+      reach_cells(spatial_block_z(dim) * blockDim.z, blockDim.z, dim, reach, nb, z0, z1);
+      unsigned width = y1 - y0 + 1;
+      nranges = (x1 - x0 + 1) * width;
+      if(reach > LMG_MAX_BIN_REACH || nranges > LMG_MAX_BIN_RANGES) {
+        nranges = 0;
+        return 0;
+      }
+      if(tidx < nranges) {
+        int cx = x0 + int(tidx / width);
+        int cy = y0 + int(tidx % width);
+        unsigned column = (cx * nb + cy) * nb;
+        binRangeAtom[tidx] = bins.cell_start[column + z0];
+        binRangeStart[tidx] = bins.cell_start[column + z1 + 1] - bins.cell_start[column + z0];
+      }
+      __syncthreads();
+      if(tidx == 0) { //exclusive scan of range sizes, there are few ranges
+        unsigned total = 0;
+        for(unsigned r = 0; r < nranges; r++) {
+          unsigned cnt = binRangeStart[r];
+          binRangeStart[r] = total;
+          total += cnt;
+        }
+        binRangeStart[nranges] = total;
+      }
+      __syncthreads();
+      return binRangeStart[nranges];
+    }
+
+    //atom index of the v'th candidate atom gathered by gather_bins
+    __device__ inline unsigned binned_atom(const atom_bins& bins, unsigned nranges, unsigned v) {
+      unsigned lo = 0, hi = nranges; //binRangeStart[lo] <= v < binRangeStart[hi]
+      while(hi - lo > 1) {
+        unsigned mid = (lo + hi) / 2;
+        if(binRangeStart[mid] <= v) lo = mid;
+        else hi = mid;
+      }
+      return bins.atoms[binRangeAtom[lo] + v - binRangeStart[lo]];
+    }
+
+    //grid the atoms that overlap this thread block, shared by the single and batched kernels
+    //if bins is provided only atoms in nearby cells are considered, otherwise all atoms are scanned
+    //if xform is provided it is applied to each coordinate as it is loaded
+    //up to chunk atoms, a multiple of the block size, are compacted into shared memory between passes over the voxels
+    //outgrid has ntypes channels
+    template <typename Dtype, bool Binary, typename Geometry>
+    __device__ void forward_gpu_block(GridMaker& gmaker, float3 grid_origin, unsigned total_atoms,
+        const atom_bins *bins, const gpu_batch_info *xform, const float3 *coord_data, const float *types,
+        const float *radii_data, unsigned chunk, unsigned ntypes, Dtype *outgrid, std::false_type) {
       //this is the thread's index within its block, used to parallelize over atoms
-      unsigned total_atoms = coords.dimension(0);
       unsigned tidx = ((threadIdx.z * blockDim.y) + threadIdx.y) * blockDim.x + threadIdx.x;
-      float3 *coord_data = (float3*)coords.data();
-      float *types = type_index.data();
-      float *radii_data = radii.data();
-      Dtype *outgrid = out.data();
+      unsigned nthreads = blockDim.x * blockDim.y * blockDim.z;
+
+      unsigned nranges = 0;
+      unsigned ncandidates = 0;
+      if(bins) ncandidates = gather_bins(*bins, Geometry::dim(gmaker), tidx, nranges);
+      if(nranges == 0) ncandidates = total_atoms;
+
+      //if there are more then chunk atoms, chunk them
+      for(unsigned atomoffset = 0; atomoffset < ncandidates; atomoffset += chunk) {
+        unsigned rel_atoms = 0;
+        for(unsigned pass = 0; pass < chunk && atomoffset + pass < ncandidates; pass += nthreads) {
+          //first parallelize over atoms to figure out if they might overlap this block
+          unsigned cidx = atomoffset + pass + tidx;
+          unsigned aidx = cidx;
+          if(cidx < ncandidates && nranges) aidx = binned_atom(*bins, nranges, cidx);
+
+          float3 a;
+          bool overlaps = false;
+          if(cidx < ncandidates && types[aidx] >= 0) {
+            a = load_atom(coord_data, aidx, xform);
+            overlaps = atom_overlaps_block(a, grid_origin, Geometry::resolution(gmaker), Geometry::dim(gmaker),
+                radii_data[aidx], gmaker.get_radiusmultiple());
+          }
 
-      //if there are more then LMG_CUDA_NUM_THREADS atoms, chunk them
-      for(unsigned atomoffset = 0; atomoffset < total_atoms; atomoffset += LMG_CUDA_NUM_THREADS) {
-        //first parallelize over atoms to figure out if they might overlap this block
-        unsigned aidx = atomoffset + tidx;
-        
-        if(aidx < total_atoms && types[aidx] >= 0) {
-          atomMask[tidx] = atom_overlaps_block(aidx, grid_origin, gmaker.get_resolution(), coord_data, radii_data[aidx], gmaker.get_radiusmultiple());
+          //do scatter (stream compaction), which keeps the atoms in order
+          unsigned found = 0;
+          unsigned pos = rel_atoms + block_compact_index(tidx, nthreads, overlaps, found);
+          if(overlaps) chunkAtoms[pos] = shared_atom{a, aidx};
+          rel_atoms += found;
         }
-        else {
-          atomMask[tidx] = 0;
+        __syncthreads();
+
+        //chunkAtoms is now a list of rel_atoms possibly relevant atoms
+        gmaker.set_atoms<Dtype, Binary, Geometry>(rel_atoms, grid_origin, types, radii_data, outgrid);
+
+        __syncthreads();//everyone needs to finish before we muck with chunkAtoms again
+      }
+    }
+
+    /* \brief forward_gpu_block for grids stored at reduced precision.
+     * Summing into the output would round after every atom, and summing into a
+     * single precision copy of the grid would double its memory and traffic.
+     * Instead each thread sums LMG_REDUCED_CHANNELS channels of its voxel in
+     * registers over every chunk of atoms and then stores them once.  Atoms are
+     * compacted again for each group of channels, keeping only those with a
+     * type in the group, so each atom's density is still computed once.
+     */
+    template <typename Dtype, bool Binary, typename Geometry>
+    __device__ void forward_gpu_block(GridMaker& gmaker, float3 grid_origin, unsigned total_atoms,
+        const atom_bins *bins, const gpu_batch_info *xform, const float3 *coord_data, const float *types,
+        const float *radii_data, unsigned chunk, unsigned ntypes, Dtype *outgrid, std::true_type) {
+      const unsigned dim = Geometry::dim(gmaker);
+      const float resolution = Geometry::resolution(gmaker);
+      unsigned tidx = ((threadIdx.z * blockDim.y) + threadIdx.y) * blockDim.x + threadIdx.x;
+      unsigned nthreads = blockDim.x * blockDim.y * blockDim.z;
+
+      //threads off the grid still help compact atoms
+      unsigned xi = threadIdx.x + blockIdx.x * blockDim.x;
+      unsigned yi = threadIdx.y + blockIdx.y * blockDim.y;
+      unsigned zi = threadIdx.z + spatial_block_z(dim) * blockDim.z;
+      bool ongrid = xi < dim && yi < dim && zi < dim;
+      float3 grid_coords = make_float3(xi * resolution + grid_origin.x, yi * resolution + grid_origin.y,
+          zi * resolution + grid_origin.z);
+      size_t chmult = size_t(dim) * dim * dim;
+      size_t goffset = ((size_t(xi) * dim) + yi) * dim + zi;
+
+      unsigned nranges = 0;
+      unsigned ncandidates = 0;
+      if(bins) ncandidates = gather_bins(*bins, dim, tidx, nranges);
+      if(nranges == 0) ncandidates = total_atoms;
+
+      for(unsigned first = 0; first < ntypes; first += LMG_REDUCED_CHANNELS) {
+        float sum[LMG_REDUCED_CHANNELS];
+        #pragma unroll
+        for(unsigned g = 0; g < LMG_REDUCED_CHANNELS; g++) sum[g] = 0;
+
+        for(unsigned atomoffset = 0; atomoffset < ncandidates; atomoffset += chunk) {
+          unsigned rel_atoms = 0;
+          for(unsigned pass = 0; pass < chunk && atomoffset + pass < ncandidates; pass += nthreads) {
+            unsigned cidx = atomoffset + pass + tidx;
+            unsigned aidx = cidx;
+            if(cidx < ncandidates && nranges) aidx = binned_atom(*bins, nranges, cidx);
+
+            float3 a;
+            bool overlaps = false;
+            if(cidx < ncandidates && types[aidx] >= first && types[aidx] < first + LMG_REDUCED_CHANNELS) {
+              a = load_atom(coord_data, aidx, xform);
+              overlaps = atom_overlaps_block(a, grid_origin, resolution, dim, radii_data[aidx], gmaker.get_radiusmultiple());
+            }
+
+            unsigned found = 0;
+            unsigned pos = rel_atoms + block_compact_index(tidx, nthreads, overlaps, found);
+            if(overlaps) chunkAtoms[pos] = shared_atom{a, aidx};
+            rel_atoms += found;
+          }
+          __syncthreads();
+
+          if(ongrid) {
+            for(unsigned ai = 0; ai < rel_atoms; ai++) {
+              unsigned i = chunkAtoms[ai].index;
+              float3 c = chunkAtoms[ai].coord;
+              float val = gmaker.calc_point<Binary>(c.x, c.y, c.z, radii_data[i], grid_coords);
+              unsigned t = unsigned(types[i]) - first;
+              if(Binary) {
+                if(val != 0) set_channel(sum, t, 1.0f);
+              } else if(val > 0) {
+                add_channel(sum, t, val);
+              }
+            }
+          }
+          __syncthreads(); //everyone needs to finish before we muck with chunkAtoms again
         }
+        if(ongrid) store_channels(sum, first, ntypes, chmult, outgrid + goffset);
+      }
+    }
 
-        __syncthreads();
-        
-        //scan the mask to get just relevant indices
-        sharedMemExclusiveScan(tidx, atomMask, scanOutput);
-        
-        __syncthreads();
-        
-        //do scatter (stream compaction)
-        if(atomMask[tidx])
-        {
-          atomIndices[scanOutput[tidx]] = tidx + atomoffset;
+    /* \brief Thread block shape and atom chunk of a forward kernel launch.
+     * Blocks have a multiple of WARP_SIZE threads, at least LMG_MAX_BIN_RANGES
+     * and at most LMG_CUDA_NUM_THREADS.  Their x and y extents divide
+     * LMG_CUDA_BLOCKDIM, so a block lies within one bin cell in x and y.  The
+     * chunk is a multiple of the block size; larger chunks take fewer passes over
+     * the voxels but more shared memory, which can lower occupancy.
+     */
+    struct forward_launch {
+      dim3 threads;
+      unsigned chunk;
+
+      size_t shared_bytes() const { return chunk * sizeof(shared_atom); }
+
+      //blocks covering a grid of width dim, stacked nz times along z for batches
+      dim3 blocks(unsigned dim, unsigned nz = 1) const {
+        return dim3((dim + threads.x - 1) / threads.x, (dim + threads.y - 1) / threads.y,
+            nz * ((dim + threads.z - 1) / threads.z));
+      }
+    };
+
+    //8x8x8=512 threads per block, each examining one atom per chunk
+    static const forward_launch default_forward_launch =
+        {dim3(LMG_CUDA_BLOCKDIM, LMG_CUDA_BLOCKDIM, LMG_CUDA_BLOCKDIM), LMG_CUDA_NUM_THREADS};
+
+    //configurations compared by the autotuner
+    static const std::vector<forward_launch>& forward_launch_candidates() {
+      static const std::vector<forward_launch> candidates = []() {
+        std::vector<forward_launch> ret;
+        for(dim3 t : {dim3(8,8,8), dim3(8,8,4), dim3(8,4,4), dim3(4,4,4)}) {
+          for(unsigned mult : {1, 2, 4}) ret.push_back(forward_launch{t, t.x * t.y * t.z * mult});
         }
-        __syncthreads();
+        return ret;
+      }();
+      return candidates;
+    }
 
-        unsigned rel_atoms = scanOutput[LMG_CUDA_NUM_THREADS - 1] + atomMask[LMG_CUDA_NUM_THREADS - 1];
-        //atomIndex is now a list of rel_atoms possibly relevant atom indices
-        gmaker.set_atoms<Dtype, Binary>(rel_atoms, grid_origin, coord_data, types, radii_data, outgrid);
+    /// forward kernels with separately tuned configurations
+    enum forward_kernel { FORWARD_INDEX, FORWARD_INDEX_BATCH, FORWARD_VECTOR };
+
+    //device, kernel, grid width, resolution, radius multiple, binary, output element size and number of types;
+    //not the batch size, which varies from call to call (e.g. a last partial batch) and would retune each time
+    typedef std::tuple<int, int, unsigned, float, float, bool, size_t, unsigned> forward_tuning_key;
+
+    /* \brief Launch configuration for a forward kernel.
+     * Unless the GridMaker autotunes this is the default.  Otherwise the first
+     * call for a device, kernel, geometry and number of types times launch with every candidate
+     * on the caller's inputs, synchronizing the stream, and keeps the fastest.
+     * Results do not depend on the configuration, and out is zeroed again
+     * afterwards.  Streams being captured into a graph can not be synchronized,
+     * so they get the default untuned.
+     * @param[in] launch queues the kernel on stream with a configuration
+     */
+    template <typename Launch>
+    static forward_launch tuned_forward_launch(const GridMaker& gmaker, forward_kernel kernel, size_t dtype_size,
+        unsigned ntypes, void *out, size_t outbytes, cudaStream_t stream, const Launch& launch) {
+      if(!gmaker.get_autotune()) return default_forward_launch;
+      cudaStreamCaptureStatus capture = cudaStreamCaptureStatusNone;
+      LMG_CUDA_CHECK(cudaStreamIsCapturing(stream, &capture));
+      if(capture != cudaStreamCaptureStatusNone) return default_forward_launch;
+
+      static std::mutex mtx;
+      static std::map<forward_tuning_key, forward_launch> tuned; //never cleared, there are few geometries
+      forward_tuning_key key(DeviceGuard::current_device(), kernel, gmaker.get_first_dim(), gmaker.get_resolution(),
+          gmaker.get_radiusmultiple(), gmaker.get_binary(), dtype_size, ntypes);
+      {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto found = tuned.find(key);
+        if(found != tuned.end()) return found->second;
+      }
 
-        __syncthreads();//everyone needs to finish before we muck with atomIndices again
+      //tune without the lock, concurrent first calls may both tune the same key
+      cudaEvent_t start, stop;
+      LMG_CUDA_CHECK(cudaEventCreate(&start));
+      LMG_CUDA_CHECK(cudaEventCreate(&stop));
+      forward_launch best = default_forward_launch;
+      float best_ms = -1;
+      for(const forward_launch& candidate : forward_launch_candidates()) {
+        launch(candidate); //warm up
+        LMG_CUDA_CHECK(cudaPeekAtLastError());
+        LMG_CUDA_CHECK(cudaEventRecord(start, stream));
+        launch(candidate);
+        LMG_CUDA_CHECK(cudaEventRecord(stop, stream));
+        LMG_CUDA_CHECK(cudaEventSynchronize(stop));
+        float ms = 0;
+        LMG_CUDA_CHECK(cudaEventElapsedTime(&ms, start, stop));
+        if(best_ms < 0 || ms < best_ms) {
+          best = candidate;
+          best_ms = ms;
+        }
       }
+      LMG_CUDA_CHECK(cudaEventDestroy(start));
+      LMG_CUDA_CHECK(cudaEventDestroy(stop));
+      LMG_CUDA_CHECK(cudaMemsetAsync(out, 0, outbytes, stream));
+
+      std::lock_guard<std::mutex> lock(mtx);
+      tuned[key] = best;
+      return best;
+    }
+
+    template <typename Dtype, bool Binary, typename Geometry>
+    __global__ void
+    __launch_bounds__(LMG_CUDA_NUM_THREADS)
+    forward_gpu(GridMaker gmaker, float3 grid_origin,
+        const Grid<float, 2, true> coords, const Grid<float, 1, true> type_index,
+        const Grid<float, 1, true> radii, atom_bins bins, const gpu_batch_info *xform, unsigned chunk, Grid<Dtype, 4, true> out) {
+      forward_gpu_block<Dtype, Binary, Geometry>(gmaker, grid_origin, coords.dimension(0), &bins, xform, (float3*)coords.data(),
+          type_index.data(), radii.data(), chunk, out.dimension(0), out.data(), reduced_tag<Dtype>());
+    }
+
+    //queue forward_gpu on stream with launch configuration l
+    template <typename Dtype>
+    static void launch_forward_gpu(const GridMaker& gmaker, const forward_launch& l, float3 grid_origin,
+        const Grid<float, 2, true>& coords, const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii,
+        const atom_bins& bins, const gpu_batch_info *xform, const Grid<Dtype, 4, true>& out, cudaStream_t stream) {
+      dim3 blocks = l.blocks(gmaker.get_first_dim());
+      with_geometry(gmaker, [&](auto geometry) {
+        using Geometry = decltype(geometry);
+        if(gmaker.get_binary())
+          forward_gpu<Dtype, true, Geometry><<<blocks, l.threads, l.shared_bytes(), stream>>>(gmaker, grid_origin, coords, type_index, radii, bins, xform, l.chunk, out);
+        else
+          forward_gpu<Dtype, false, Geometry><<<blocks, l.threads, l.shared_bytes(), stream>>>(gmaker, grid_origin, coords, type_index, radii, bins, xform, l.chunk, out);
+      });
     }
 
     template <typename Dtype>
     void GridMaker::forward(float3 grid_center, const Grid<float, 2, true>& coords,
         const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii,
-        Grid<Dtype, 4, true>& out) const {
-      //threads are laid out in three dimensions to match the voxel grid, 
-      //8x8x8=512 threads per block
-      dim3 threads(LMG_CUDA_BLOCKDIM, LMG_CUDA_BLOCKDIM, LMG_CUDA_BLOCKDIM);
-      unsigned blocksperside = ceil(dim / float(LMG_CUDA_BLOCKDIM));
-      dim3 blocks(blocksperside, blocksperside, blocksperside);
+        Grid<Dtype, 4, true>& out, cudaStream_t stream) const {
+      //threads are laid out in three dimensions to match the voxel grid
       float3 grid_origin = get_grid_origin(grid_center);
 
       check_index_args(coords, type_index, radii, out);
@@ -274,32 +837,349 @@ namespace libmolgrid {
       }
 
       //zero out grid to start
-      LMG_CUDA_CHECK(cudaMemset(out.data(), 0, out.size() * sizeof(float)));
+      LMG_CUDA_CHECK(cudaMemsetAsync(out.data(), 0, out.size() * sizeof(Dtype), stream));
 
       if(coords.dimension(0) == 0) return; //no atoms
 
-      if(binary)
-        forward_gpu<Dtype, true><<<blocks, threads>>>(*this, grid_origin, coords, type_index, radii, out);
-      else
-        forward_gpu<Dtype, false><<<blocks, threads>>>(*this, grid_origin, coords, type_index, radii, out);
+      KernelTimer timer(STAGE_FORWARD_GPU, stream);
+      static thread_local stream_scratch<unsigned> bin_scratch;
+      atom_bins bins = bin_atoms(*this, grid_origin, coords.dimension(0), (float3*)coords.data(), nullptr,
+          type_index.data(), radii.data(), 0, bin_scratch, stream);
+      GridMaker gmaker = device_copy();
+      auto launch = [&](const forward_launch& l) {
+        launch_forward_gpu(gmaker, l, grid_origin, coords, type_index, radii, bins, nullptr, out, stream);
+      };
+      launch(tuned_forward_launch(gmaker, FORWARD_INDEX, sizeof(Dtype), out.dimension(0), out.data(), out.size() * sizeof(Dtype), stream, launch));
 
       LMG_CUDA_CHECK(cudaPeekAtLastError());
+      bin_scratch.release(stream);
     }
 
     template void GridMaker::forward(float3 grid_center, const Grid<float, 2, true>& coords,
-        const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii, Grid<float, 4, true>& out) const;
+        const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii, Grid<float, 4, true>& out, cudaStream_t) const;
+    template void GridMaker::forward(float3 grid_center, const Grid<float, 2, true>& coords,
+        const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii, Grid<double, 4, true>& out, cudaStream_t) const;
+    template void GridMaker::forward(float3 grid_center, const Grid<float, 2, true>& coords,
+        const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii, Grid<__half, 4, true>& out, cudaStream_t) const;
     template void GridMaker::forward(float3 grid_center, const Grid<float, 2, true>& coords,
-        const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii, Grid<double, 4, true>& out) const;
+        const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii, Grid<__nv_bfloat16, 4, true>& out, cudaStream_t) const;
+
+    //grid a whole batch, the example is selected by the z block index
+    //and each example's transformation is applied as its atoms are loaded
+    template <typename Dtype, bool Binary, typename Geometry>
+    __global__ void
+    __launch_bounds__(LMG_CUDA_NUM_THREADS)
+    forward_gpu_batch(GridMaker gmaker, const gpu_batch_info *info, const float3 *coords,
+        const float *types, const float *radii, unsigned chunk, Grid<Dtype, 5, true> out) {
+      unsigned blocksperside = (Geometry::dim(gmaker) + blockDim.z - 1) / blockDim.z;
+      unsigned ex = blockIdx.z / blocksperside;
+      const gpu_batch_info& b = info[ex];
+      forward_gpu_block<Dtype, Binary, Geometry>(gmaker, b.grid_origin, b.natoms, nullptr, &b, coords+b.offset,
+          types+b.offset, radii+b.offset, chunk, out.dimension(1), out.data()+ex*out.offset(0), reduced_tag<Dtype>());
+    }
+
+    //add offset to n index types
+    __global__ void offset_types_kernel(unsigned n, const float *types, float offset, float *out) {
+      LMG_CUDA_KERNEL_LOOP(i, n) {
+        out[i] = types[i] + offset;
+      }
+    }
+
+    template <typename Dtype>
+    void GridMaker::forward(const std::vector<Example>& in, const std::vector<Transform>& transforms, Grid<Dtype, 5, true>& out,
+        cudaStream_t stream) const {
+      forward_batch(in, transforms, nullptr, 0, out, stream);
+    }
+
+    //replace the rotation and translation of each example with those of random
+    __global__ void random_transforms_kernel(RandomTransforms random, uint64_t first_index, unsigned n, gpu_batch_info *info) {
+      unsigned i = blockIdx.x * blockDim.x + threadIdx.x;
+      if(i >= n) return;
+      random.sample(first_index + i, info[i].Q, info[i].translate);
+    }
+
+    template <typename Dtype>
+    void GridMaker::forward_batch(const std::vector<Example>& in, const std::vector<Transform>& transforms, const RandomTransforms *random,
+        uint64_t first_index, Grid<Dtype, 5, true>& out, cudaStream_t stream) const {
+      unsigned batch_size = in.size();
+      if(batch_size != out.dimension(0)) throw std::out_of_range("output grid dimension does not match size of example vector");
+      if(batch_size != transforms.size()) throw std::out_of_range("number of transforms does not match size of example vector");
+
+      //only index types can be packed, otherwise grid each example separately
+      bool packable = !radii_type_indexed;
+      for(unsigned i = 0; i < batch_size && packable; i++) {
+        packable = in[i].has_index_types();
+      }
+      if(!packable) {
+        for(unsigned i = 0; i < batch_size; i++) {
+          Grid<Dtype, 4, true> g(out[i]);
+          if(random) forward(in[i], random->get(transforms[i].get_rotation_center(), first_index + i), g, stream);
+          else forward(in[i], transforms[i], g, stream);
+        }
+        return;
+      }
+
+      for(unsigned i = 1; i <= 3; i++) {
+        if(dim != out.dimension(i+1)) throw std::out_of_range("Output grid dimension incorrect: "+itoa(dim) +" vs " +itoa(out.dimension(i+1)));
+      }
+      unsigned natoms = 0;
+      for(unsigned i = 0; i < batch_size; i++) {
+        size_t ntypes = in[i].num_types();
+        if(ntypes != out.dimension(1)) throw std::out_of_range("Incorrect number of channels in output grid: "+itoa(ntypes) +" vs "+itoa(out.dimension(1)));
+        natoms += in[i].num_coordinates();
+      }
+
+      //zero out grid to start
+      LMG_CUDA_CHECK(cudaMemsetAsync(out.data(), 0, out.size() * sizeof(Dtype), stream));
+      if(natoms == 0 || batch_size == 0) return;
+
+      //pack coordinates (3N), types (N) and radii (N) of all examples into one buffer,
+      //which is reused across calls to avoid reallocating device memory
+      static thread_local stream_scratch<float> atom_scratch;
+      static thread_local stream_scratch<gpu_batch_info> info_scratch;
+      ManagedGrid<float, 1>& atom_buffer = atom_scratch.acquire(5*natoms);
+      ManagedGrid<gpu_batch_info, 1>& info_buffer = info_scratch.acquire(batch_size);
+      atom_buffer.tocpu(false);
+      info_buffer.tocpu(false);
+      float *coords = atom_buffer.cpu().data();
+      float *types = coords + 3*natoms;
+      float *radii = types + natoms;
+      gpu_batch_info *info = info_buffer.cpu().data();
+
+      //sets already on the gpu are copied device to device after the upload
+      struct device_set {
+        const CoordinateSet *set;
+        unsigned offset;
+        unsigned toffset;
+      };
+      std::vector<device_set> device_sets;
+
+      unsigned offset = 0;
+      for(unsigned i = 0; i < batch_size; i++) {
+        const Example& ex = in[i];
+        info[i].Q = transforms[i].get_quaternion();
+        info[i].center = transforms[i].get_rotation_center();
+        info[i].translate = transforms[i].get_translation();
+        info[i].grid_origin = get_grid_origin(info[i].center);
+        info[i].offset = offset;
+
+        unsigned toffset = 0; //amount to offset types
+        for(unsigned s = 0, ns = ex.sets.size(); s < ns; s++) {
+          const CoordinateSet& CS = ex.sets[s];
+          unsigned n = CS.size();
+          if(n == 0) continue; //empty sets do not offset later types, as in merge_coordinates
+          if(CS.coords.ongpu() && CS.type_index.ongpu() && CS.radii.ongpu()) {
+            device_sets.push_back(device_set{&CS, offset, toffset});
+          } else {
+            memcpy(coords+3*offset, CS.coords.cpu().data(), 3*n*sizeof(float));
+            const float *t = CS.type_index.cpu().data();
+            for(unsigned a = 0; a < n; a++) {
+              types[offset+a] = t[a] + toffset;
+            }
+            memcpy(radii+offset, CS.radii.cpu().data(), n*sizeof(float));
+          }
+          offset += n;
+          toffset += CS.max_type;
+        }
+        info[i].natoms = offset - info[i].offset;
+      }
+
+      atom_buffer.togpu(stream); //single host to device copy
+      info_buffer.togpu(stream);
+      if(random) {
+        random_transforms_kernel<<<LMG_GET_BLOCKS(batch_size), LMG_GET_THREADS(batch_size), 0, stream>>>(*random, first_index,
+            batch_size, info_buffer.gpu().data());
+        LMG_CUDA_CHECK(cudaPeekAtLastError());
+      }
+      float3 *gcoords = (float3*)atom_buffer.gpu().data();
+      const gpu_batch_info *ginfo = info_buffer.gpu().data();
+      float *gtypes = (float*)(gcoords+natoms);
+      float *gradii = gtypes + natoms;
+
+      for(const device_set& d : device_sets) {
+        const CoordinateSet& CS = *d.set;
+        unsigned n = CS.size();
+        LMG_CUDA_CHECK(cudaMemcpyAsync(gcoords+d.offset, CS.coords.gpu().data(), 3*n*sizeof(float), cudaMemcpyDeviceToDevice, stream));
+        LMG_CUDA_CHECK(cudaMemcpyAsync(gradii+d.offset, CS.radii.gpu().data(), n*sizeof(float), cudaMemcpyDeviceToDevice, stream));
+        if(d.toffset == 0) {
+          LMG_CUDA_CHECK(cudaMemcpyAsync(gtypes+d.offset, CS.type_index.gpu().data(), n*sizeof(float), cudaMemcpyDeviceToDevice, stream));
+        } else {
+          offset_types_kernel<<<LMG_GET_BLOCKS(n), LMG_GET_THREADS(n), 0, stream>>>(n, CS.type_index.gpu().data(), d.toffset, gtypes+d.offset);
+          LMG_CUDA_CHECK(cudaPeekAtLastError());
+        }
+      }
+
+      //the host packing and uploads above are not part of the kernel time
+      KernelTimer timer(STAGE_FORWARD_GPU, stream);
+      GridMaker gmaker = device_copy();
+      if(batch_size == 1) {
+        //a single example has enough atoms to be worth binning, the transformation
+        //is applied as atoms are binned and gridded
+        static thread_local stream_scratch<unsigned> bin_scratch;
+        atom_bins bins = bin_atoms(*this, info[0].grid_origin, natoms, gcoords, ginfo, gtypes, gradii, 0, bin_scratch, stream);
+        Grid<float, 2, true> c((float*)gcoords, natoms, 3);
+        Grid<float, 1, true> t(gtypes, natoms);
+        Grid<float, 1, true> r(gradii, natoms);
+        Grid<Dtype, 4, true> g(out[0]);
+        auto launch = [&](const forward_launch& l) {
+          launch_forward_gpu(gmaker, l, info[0].grid_origin, c, t, r, bins, ginfo, g, stream);
+        };
+        launch(tuned_forward_launch(gmaker, FORWARD_INDEX, sizeof(Dtype), g.dimension(0), g.data(), g.size() * sizeof(Dtype), stream, launch));
+        LMG_CUDA_CHECK(cudaPeekAtLastError());
+        bin_scratch.release(stream);
+      } else {
+        auto launch = [&](const forward_launch& l) {
+          dim3 blocks = l.blocks(dim, batch_size);
+          with_geometry(gmaker, [&](auto geometry) {
+            using Geometry = decltype(geometry);
+            if(binary)
+              forward_gpu_batch<Dtype, true, Geometry><<<blocks, l.threads, l.shared_bytes(), stream>>>(gmaker, ginfo, gcoords, gtypes, gradii, l.chunk, out);
+            else
+              forward_gpu_batch<Dtype, false, Geometry><<<blocks, l.threads, l.shared_bytes(), stream>>>(gmaker, ginfo, gcoords, gtypes, gradii, l.chunk, out);
+          });
+        };
+        launch(tuned_forward_launch(gmaker, FORWARD_INDEX_BATCH, sizeof(Dtype), out.dimension(1), out.data(), out.size() * sizeof(Dtype),
+            stream, launch));
+        LMG_CUDA_CHECK(cudaPeekAtLastError());
+      }
+      atom_scratch.release(stream);
+      info_scratch.release(stream);
+    }
+
+    template void GridMaker::forward_batch(const std::vector<Example>&, const std::vector<Transform>&, const RandomTransforms*, uint64_t,
+        Grid<float, 5, true>&, cudaStream_t) const;
+    template void GridMaker::forward_batch(const std::vector<Example>&, const std::vector<Transform>&, const RandomTransforms*, uint64_t,
+        Grid<double, 5, true>&, cudaStream_t) const;
+    template void GridMaker::forward_batch(const std::vector<Example>&, const std::vector<Transform>&, const RandomTransforms*, uint64_t,
+        Grid<__half, 5, true>&, cudaStream_t) const;
+    template void GridMaker::forward_batch(const std::vector<Example>&, const std::vector<Transform>&, const RandomTransforms*, uint64_t,
+        Grid<__nv_bfloat16, 5, true>&, cudaStream_t) const;
+    template void GridMaker::forward(const std::vector<Example>& in, const std::vector<Transform>& transforms, Grid<float, 5, true>& out, cudaStream_t) const;
+    template void GridMaker::forward(const std::vector<Example>& in, const std::vector<Transform>& transforms, Grid<double, 5, true>& out, cudaStream_t) const;
+    template void GridMaker::forward(const std::vector<Example>& in, const std::vector<Transform>& transforms, Grid<__half, 5, true>& out, cudaStream_t) const;
+    template void GridMaker::forward(const std::vector<Example>& in, const std::vector<Transform>& transforms, Grid<__nv_bfloat16, 5, true>& out, cudaStream_t) const;
+
+    //position of this thread's voxel among the non-zero voxels of this block's
+    //LMG_CUDA_NUM_THREADS voxels, total is set to how many are non-zero
+    __device__ unsigned scan_nonzero(unsigned n, const float *dense, bool& nonzero, unsigned& total) {
+      unsigned tidx = threadIdx.x;
+      unsigned i = blockIdx.x * LMG_CUDA_NUM_THREADS + tidx;
+      nonzero = i < n && dense[i] != 0;
+      return block_compact_index(tidx, LMG_CUDA_NUM_THREADS, nonzero, total);
+    }
+
+    __global__ void count_nonzero_kernel(unsigned n, const float *dense, unsigned *counts) {
+      bool nonzero = false;
+      unsigned total = 0;
+      scan_nonzero(n, dense, nonzero, total);
+      if(threadIdx.x == 0) counts[blockIdx.x] = total;
+    }
+
+    //write the non-zero voxels of each block starting at its offset, dense channel c is channels[c]
+    __global__ void compact_nonzero_kernel(unsigned n, const float *dense, const unsigned *offsets,
+        const unsigned *channels, unsigned dim, float *indices, float *values) {
+      bool nonzero = false;
+      unsigned total = 0;
+      unsigned pos = scan_nonzero(n, dense, nonzero, total);
+      if(nonzero) {
+        unsigned i = blockIdx.x * LMG_CUDA_NUM_THREADS + threadIdx.x;
+        unsigned k = offsets[blockIdx.x] + pos;
+        indices[4*k] = channels[i / (dim*dim*dim)];
+        indices[4*k+1] = (i / (dim*dim)) % dim;
+        indices[4*k+2] = (i / dim) % dim;
+        indices[4*k+3] = i % dim;
+        values[k] = dense[i];
+      }
+    }
+
+    //dense grid of the active channels of forward_sparse, released once compacted
+    static thread_local stream_scratch<float> sparse_dense_scratch;
+
+    Grid<float, 4, true> GridMaker::sparse_scratch(unsigned nchannels) const {
+      ManagedGrid<float, 1>& buffer = sparse_dense_scratch.acquire(size_t(nchannels)*dim*dim*dim);
+      buffer.togpu(false);
+      return Grid<float, 4, true>(buffer.gpu().data(), nchannels, dim, dim, dim);
+    }
+
+    void GridMaker::compact_sparse(const Grid<float, 4, true>& dense, const std::vector<std::vector<unsigned> >& channels, SparseGrid *out,
+        cudaStream_t stream) {
+      unsigned ngroups = channels.size();
+      unsigned chsize = dense.dimension(1)*dense.dimension(2)*dense.dimension(3);
+      //first block and voxel count of each group, which counts are all
+      //copied back together so the host only waits once
+      std::vector<unsigned> first_block(ngroups+1, 0), nvoxels(ngroups);
+      unsigned nchannels = 0;
+      for(unsigned g = 0; g < ngroups; g++) {
+        nvoxels[g] = channels[g].size() * chsize;
+        first_block[g+1] = first_block[g] + LMG_GET_BLOCKS(nvoxels[g]);
+        nchannels += channels[g].size();
+      }
+      unsigned nblocks = first_block[ngroups];
+
+      //block counts, which become block offsets, followed by the channel maps
+      static thread_local stream_scratch<unsigned> scratch;
+      ManagedGrid<unsigned, 1>& buffer = scratch.acquire(nblocks + nchannels);
+      buffer.togpu(false);
+      unsigned *counts = buffer.gpu().data();
+
+      std::vector<unsigned> offsets(nblocks);
+      if(nblocks) {
+        const float *d = dense.data();
+        for(unsigned g = 0; g < ngroups; g++) {
+          unsigned nb = first_block[g+1] - first_block[g];
+          if(nb) {
+            count_nonzero_kernel<<<nb, LMG_CUDA_NUM_THREADS, 0, stream>>>(nvoxels[g], d, counts + first_block[g]);
+            LMG_CUDA_CHECK(cudaPeekAtLastError());
+          }
+          d += nvoxels[g];
+        }
+        LMG_CUDA_CHECK(cudaMemcpyAsync(offsets.data(), counts, nblocks * sizeof(unsigned), cudaMemcpyDeviceToHost, stream));
+        LMG_CUDA_CHECK(cudaStreamSynchronize(stream));
+      }
+      std::vector<unsigned> totals(ngroups, 0);
+      for(unsigned g = 0; g < ngroups; g++) {
+        unsigned total = 0;
+        for(unsigned b = first_block[g]; b < first_block[g+1]; b++) {
+          unsigned cnt = offsets[b];
+          offsets[b] = total;
+          total += cnt;
+        }
+        totals[g] = total;
+        offsets.insert(offsets.end(), channels[g].begin(), channels[g].end());
+      }
+
+      if(nblocks) LMG_CUDA_CHECK(cudaMemcpyAsync(counts, offsets.data(), offsets.size() * sizeof(unsigned), cudaMemcpyHostToDevice, stream));
+      const float *d = dense.data();
+      const unsigned *chmap = counts + nblocks;
+      for(unsigned g = 0; g < ngroups; g++) {
+        SparseGrid& sg = out[g];
+        sg.indices = sg.indices.resized(totals[g], 4);
+        sg.values = sg.values.resized(totals[g]);
+        sg.indices.togpu(false);
+        sg.values.togpu(false);
+        if(totals[g]) {
+          compact_nonzero_kernel<<<first_block[g+1] - first_block[g], LMG_CUDA_NUM_THREADS, 0, stream>>>(nvoxels[g], d,
+              counts + first_block[g], chmap, dense.dimension(1), sg.indices.gpu().data(), sg.values.gpu().data());
+          LMG_CUDA_CHECK(cudaPeekAtLastError());
+          sg.indices.record_stream(stream);
+          sg.values.record_stream(stream);
+        }
+        d += nvoxels[g];
+        chmap += channels[g].size();
+      }
+      //the next call waits for these kernels before reusing the dense grid and offsets
+      scratch.release(stream);
+      sparse_dense_scratch.release(stream);
+    }
 
 
     template <typename Dtype, bool Binary, bool RadiiFromTypes>
     __device__ void GridMaker::set_atoms(unsigned rel_atoms, float3 grid_origin,
-        const float3 *coord_data, const float *tdata, unsigned ntypes,
-        const float *radii, Dtype *data) {
+        const float *tdata, unsigned ntypes, const float *radii, Dtype *data) {
       //figure out what grid point we are
       unsigned xi = threadIdx.x + blockIdx.x * blockDim.x;
       unsigned yi = threadIdx.y + blockIdx.y * blockDim.y;
-      unsigned zi = threadIdx.z + blockIdx.z * blockDim.z;
+      unsigned zi = threadIdx.z + spatial_block_z(dim) * blockDim.z;
 
       if(xi >= dim || yi >= dim || zi >= dim)
         return;//bail if we're off-grid, this should not be common
@@ -314,8 +1194,8 @@ namespace libmolgrid {
 
       //iterate over all possibly relevant atoms
       for(unsigned ai = 0; ai < rel_atoms; ai++) {
-        unsigned i = atomIndices[ai];
-        float3 c = coord_data[i];
+        unsigned i = chunkAtoms[ai].index;
+        float3 c = chunkAtoms[ai].coord;
         float val = 0;
         if(!RadiiFromTypes) {
           val = calc_point<Binary>(c.x, c.y, c.z, radii[i], grid_coords);
@@ -333,9 +1213,9 @@ namespace libmolgrid {
             }
 
             if(Binary) {
-              data[atype*chmult+goffset] += tmult;
+              accumulate(data+atype*chmult+goffset, tmult);
             } else  {
-              data[atype*chmult+goffset] += val*tmult;
+              accumulate(data+atype*chmult+goffset, val*tmult);
             }
           }
         }
@@ -343,119 +1223,195 @@ namespace libmolgrid {
     }
 
 
+    //sum the density of this thread's voxel in the channels [first, first+LMG_REDUCED_CHANNELS) over the
+    //rel_atoms atoms of chunkAtoms into sum, as GridMaker::set_atoms adds vector typed atoms to a grid
+    template <bool Binary, bool RadiiFromTypes>
+    __device__ void sum_vector_atoms(const GridMaker& gmaker, unsigned rel_atoms, float3 grid_coords,
+        const float *tdata, unsigned ntypes, const float *radii, unsigned first, float (&sum)[LMG_REDUCED_CHANNELS]) {
+      for(unsigned ai = 0; ai < rel_atoms; ai++) {
+        unsigned i = chunkAtoms[ai].index;
+        float3 c = chunkAtoms[ai].coord;
+        float val = 0;
+        if(!RadiiFromTypes) {
+          val = gmaker.calc_point<Binary>(c.x, c.y, c.z, radii[i], grid_coords);
+          if(val == 0) continue;
+        }
+
+        const float *atom_type_mult = tdata+(ntypes*i); //type vector for this atom
+        #pragma unroll
+        for(unsigned g = 0; g < LMG_REDUCED_CHANNELS; g++) {
+          unsigned atype = first + g;
+          float tmult = atype < ntypes ? atom_type_mult[atype] : 0;
+          if(tmult != 0) {
+            if(RadiiFromTypes) val = gmaker.calc_point<Binary>(c.x, c.y, c.z, radii[atype], grid_coords);
+            if(val != 0) sum[g] += Binary ? tmult : val*tmult;
+          }
+        }
+      }
+    }
+
+    //add the atoms of chunkAtoms to out
+    template <typename Dtype, bool Binary, bool RadiiFromTypes>
+    __device__ inline void add_vector_atoms(GridMaker& gmaker, unsigned rel_atoms, float3 grid_origin, float3,
+        const float *types, unsigned ntypes, const float *radii, unsigned, float (&)[LMG_REDUCED_CHANNELS],
+        Dtype *out, std::false_type) {
+      gmaker.set_atoms<Dtype, Binary, RadiiFromTypes>(rel_atoms, grid_origin, types, ntypes, radii, out);
+    }
+
+    //add the atoms of chunkAtoms to the register sums of a reduced precision grid, stored once they are complete
+    template <typename Dtype, bool Binary, bool RadiiFromTypes>
+    __device__ inline void add_vector_atoms(GridMaker& gmaker, unsigned rel_atoms, float3, float3 grid_coords,
+        const float *types, unsigned ntypes, const float *radii, unsigned first, float (&sum)[LMG_REDUCED_CHANNELS],
+        Dtype *, std::true_type) {
+      sum_vector_atoms<Binary, RadiiFromTypes>(gmaker, rel_atoms, grid_coords, types, ntypes, radii, first, sum);
+    }
+
     template <typename Dtype, bool Binary, bool RadiiTypeIndexed>
     __global__ void
-  //  __launch_bounds__(LMG_CUDA_NUM_THREADS)
+    __launch_bounds__(LMG_CUDA_NUM_THREADS)
     forward_gpu_vec(GridMaker gmaker, float3 grid_origin,
         const Grid<float, 2, true> coords, const Grid<float, 2, true> type_vector,
-        const Grid<float, 1, true> radii, float maxradius, Grid<Dtype, 4, true> out) {
+        const Grid<float, 1, true> radii, atom_bins bins, unsigned chunk, Grid<Dtype, 4, true> out) {
       //this is the thread's index within its block, used to parallelize over atoms
       unsigned total_atoms = coords.dimension(0);
       unsigned tidx = ((threadIdx.z * blockDim.y) + threadIdx.y) * blockDim.x + threadIdx.x; //thread index
+      unsigned nthreads = blockDim.x * blockDim.y * blockDim.z;
       float3 *coord_data = (float3*)coords.data();
       float *types = type_vector.data();
       unsigned ntypes = type_vector.dimension(1);
       float *radii_data = radii.data();
       Dtype *outgrid = out.data();
+      float maxradius = RadiiTypeIndexed ? *bins.maxradius : 0;
 
-      //if there are more then LMG_CUDA_NUM_THREADS atoms, chunk them
-      for(unsigned atomoffset = 0; atomoffset < total_atoms; atomoffset += LMG_CUDA_NUM_THREADS) {
-        //first parallelize over atoms to figure out if they might overlap this block
-        unsigned aidx = atomoffset + tidx;
-
-        if(aidx < total_atoms) {
-          //assume radii are about the same so can approximate with maxradius
-          if(RadiiTypeIndexed)
-            atomMask[tidx] = atom_overlaps_block(aidx, grid_origin, gmaker.get_resolution(), coord_data, maxradius, gmaker.get_radiusmultiple());
-          else
-            atomMask[tidx] = atom_overlaps_block(aidx, grid_origin, gmaker.get_resolution(), coord_data, radii[aidx], gmaker.get_radiusmultiple());
-        }
-        else {
-          atomMask[tidx] = 0;
-        }
-
-        __syncthreads();
+      //reduced precision grids are summed in registers a group of channels at a time, as in forward_gpu_block
+      const bool reduced = reduced_precision<Dtype>::value;
+      unsigned dim = gmaker.get_first_dim();
+      float resolution = gmaker.get_resolution();
+      unsigned xi = threadIdx.x + blockIdx.x * blockDim.x;
+      unsigned yi = threadIdx.y + blockIdx.y * blockDim.y;
+      unsigned zi = threadIdx.z + spatial_block_z(dim) * blockDim.z;
+      bool ongrid = xi < dim && yi < dim && zi < dim;
+      float3 grid_coords = make_float3(xi * resolution + grid_origin.x, yi * resolution + grid_origin.y,
+          zi * resolution + grid_origin.z);
+
+      unsigned nranges = 0;
+      unsigned ncandidates = gather_bins(bins, gmaker.get_first_dim(), tidx, nranges);
+      if(nranges == 0) ncandidates = total_atoms;
+
+      for(unsigned first = 0; first < (reduced ? ntypes : 1); first += LMG_REDUCED_CHANNELS) {
+        float sum[LMG_REDUCED_CHANNELS];
+        #pragma unroll
+        for(unsigned g = 0; g < LMG_REDUCED_CHANNELS; g++) sum[g] = 0;
+
+        //if there are more then chunk atoms, chunk them
+        for(unsigned atomoffset = 0; atomoffset < ncandidates; atomoffset += chunk) {
+          unsigned rel_atoms = 0;
+          for(unsigned pass = 0; pass < chunk && atomoffset + pass < ncandidates; pass += nthreads) {
+            //first parallelize over atoms to figure out if they might overlap this block
+            unsigned cidx = atomoffset + pass + tidx;
+            unsigned aidx = cidx;
+            if(cidx < ncandidates && nranges) aidx = binned_atom(bins, nranges, cidx);
+
+            float3 a;
+            bool overlaps = false;
+            if(cidx < ncandidates) {
+              a = coord_data[aidx];
+              //assume radii are about the same so can approximate with maxradius
+              if(RadiiTypeIndexed)
+                overlaps = atom_overlaps_block(a, grid_origin, gmaker.get_resolution(), gmaker.get_first_dim(), maxradius, gmaker.get_radiusmultiple());
+              else
+                overlaps = atom_overlaps_block(a, grid_origin, gmaker.get_resolution(), gmaker.get_first_dim(), radii[aidx], gmaker.get_radiusmultiple());
+            }
 
-        //scan the mask to get just relevant indices
-        sharedMemExclusiveScan(tidx, atomMask, scanOutput);
+            //do scatter (stream compaction), which keeps the atoms in order
+            unsigned found = 0;
+            unsigned pos = rel_atoms + block_compact_index(tidx, nthreads, overlaps, found);
+            if(overlaps) chunkAtoms[pos] = shared_atom{a, aidx};
+            rel_atoms += found;
+          }
+          __syncthreads();
 
-        __syncthreads();
+          //chunkAtoms is now a list of rel_atoms possibly relevant atoms
+          //there should be plenty of parallelism just distributing across grid points, don't bother across types
+          if(ongrid || !reduced) {
+            add_vector_atoms<Dtype, Binary, RadiiTypeIndexed>(gmaker, rel_atoms, grid_origin, grid_coords, types, ntypes,
+                radii_data, first, sum, outgrid, reduced_tag<Dtype>());
+          }
 
-        //do scatter (stream compaction)
-        if(atomMask[tidx])
-        {
-          atomIndices[scanOutput[tidx]] = tidx + atomoffset;
+          __syncthreads();//everyone needs to finish before we muck with chunkAtoms again
+        }
+        if(reduced && ongrid) {
+          size_t chmult = size_t(dim) * dim * dim;
+          store_channels(sum, first, ntypes, chmult, outgrid + ((size_t(xi) * dim) + yi) * dim + zi);
         }
-        __syncthreads();
-
-        unsigned rel_atoms = scanOutput[LMG_CUDA_NUM_THREADS - 1] + atomMask[LMG_CUDA_NUM_THREADS - 1];
-        //atomIndex is now a list of rel_atoms possibly relevant atom indices
-        //there should be plenty of parallelism just distributing across grid points, don't bother across types
-        gmaker.set_atoms<Dtype, Binary, RadiiTypeIndexed>(rel_atoms, grid_origin, coord_data, types, ntypes, radii_data, outgrid);
-
-        __syncthreads();//everyone needs to finish before we muck with atomIndices again
       }
     }
 
     template <typename Dtype>
     void GridMaker::forward(float3 grid_center, const Grid<float, 2, true>& coords,
         const Grid<float, 2, true>& type_vector, const Grid<float, 1, true>& radii,
-        Grid<Dtype, 4, true>& out) const {
-
-      //threads are laid out in three dimensions to match the voxel grid,
-      //8x8x8=512 threads per block
-      dim3 threads(LMG_CUDA_BLOCKDIM, LMG_CUDA_BLOCKDIM, LMG_CUDA_BLOCKDIM);
-      unsigned blocksperside = ceil(dim / float(LMG_CUDA_BLOCKDIM));
-      dim3 blocks(blocksperside, blocksperside, blocksperside);
+        Grid<Dtype, 4, true>& out, cudaStream_t stream) const {
+      //threads are laid out in three dimensions to match the voxel grid
       float3 grid_origin = get_grid_origin(grid_center);
       unsigned ntypes = type_vector.dimension(1);
 
       check_vector_args(coords, type_vector, radii, out);
       //zero out grid to start
-      LMG_CUDA_CHECK(cudaMemset(out.data(), 0, out.size() * sizeof(float)));
+      LMG_CUDA_CHECK(cudaMemsetAsync(out.data(), 0, out.size() * sizeof(Dtype), stream));
 
       if(coords.dimension(0) == 0) return; //no atoms
 
-      float maxr = 0;
-      if(radii_type_indexed) {
-        thrust::device_ptr<float> rptr = thrust::device_pointer_cast(radii.data());
-        thrust::device_ptr<float> maxptr = thrust::max_element(rptr, rptr+radii.size());
-        maxr = *maxptr;
-      }
-
-      if(binary) {
-        if(radii_type_indexed)
-          forward_gpu_vec<Dtype, true, true><<<blocks, threads>>>(*this, grid_origin, coords, type_vector, radii, maxr, out);
-        else
-          forward_gpu_vec<Dtype, true, false><<<blocks, threads>>>(*this, grid_origin, coords, type_vector, radii, maxr, out);
-      } else {
-        if(radii_type_indexed)
-          forward_gpu_vec<Dtype, false, true><<<blocks, threads>>>(*this, grid_origin, coords, type_vector, radii, maxr, out);
-        else
-          forward_gpu_vec<Dtype, false, false><<<blocks, threads>>>(*this, grid_origin, coords, type_vector, radii, maxr, out);
-      }
+      KernelTimer timer(STAGE_FORWARD_GPU, stream);
+      //with type indexed radii every atom is binned with the largest radius, which
+      //is found on the device so the host never waits
+      static thread_local stream_scratch<unsigned> bin_scratch;
+      atom_bins bins = bin_atoms(*this, grid_origin, coords.dimension(0), (float3*)coords.data(), nullptr,
+          nullptr, radii.data(), radii_type_indexed ? radii.size() : 0, bin_scratch, stream);
+      GridMaker gmaker = device_copy();
+      auto launch = [&](const forward_launch& l) {
+        dim3 blocks = l.blocks(dim);
+        size_t bytes = l.shared_bytes();
+        if(binary) {
+          if(radii_type_indexed)
+            forward_gpu_vec<Dtype, true, true><<<blocks, l.threads, bytes, stream>>>(gmaker, grid_origin, coords, type_vector, radii, bins, l.chunk, out);
+          else
+            forward_gpu_vec<Dtype, true, false><<<blocks, l.threads, bytes, stream>>>(gmaker, grid_origin, coords, type_vector, radii, bins, l.chunk, out);
+        } else {
+          if(radii_type_indexed)
+            forward_gpu_vec<Dtype, false, true><<<blocks, l.threads, bytes, stream>>>(gmaker, grid_origin, coords, type_vector, radii, bins, l.chunk, out);
+          else
+            forward_gpu_vec<Dtype, false, false><<<blocks, l.threads, bytes, stream>>>(gmaker, grid_origin, coords, type_vector, radii, bins, l.chunk, out);
+        }
+      };
+      launch(tuned_forward_launch(gmaker, FORWARD_VECTOR, sizeof(Dtype), out.dimension(0), out.data(), out.size() * sizeof(Dtype), stream, launch));
 
       LMG_CUDA_CHECK(cudaPeekAtLastError());
+      bin_scratch.release(stream);
     }
 
     template void GridMaker::forward(float3 grid_center, const Grid<float, 2, true>& coords,
-        const Grid<float, 2, true>& type_vector, const Grid<float, 1, true>& radii, Grid<float, 4, true>& out) const;
+        const Grid<float, 2, true>& type_vector, const Grid<float, 1, true>& radii, Grid<float, 4, true>& out, cudaStream_t) const;
+    template void GridMaker::forward(float3 grid_center, const Grid<float, 2, true>& coords,
+        const Grid<float, 2, true>& type_vector, const Grid<float, 1, true>& radii, Grid<double, 4, true>& out, cudaStream_t) const;
     template void GridMaker::forward(float3 grid_center, const Grid<float, 2, true>& coords,
-        const Grid<float, 2, true>& type_vector, const Grid<float, 1, true>& radii, Grid<double, 4, true>& out) const;
+        const Grid<float, 2, true>& type_vector, const Grid<float, 1, true>& radii, Grid<__half, 4, true>& out, cudaStream_t) const;
+    template void GridMaker::forward(float3 grid_center, const Grid<float, 2, true>& coords,
+        const Grid<float, 2, true>& type_vector, const Grid<float, 1, true>& radii, Grid<__nv_bfloat16, 4, true>& out, cudaStream_t) const;
 
-    //kernel launch - parallelize across whole atoms
+    //kernel launch - parallelize across whole atoms, block.y is the example
     //TODO: accelerate this more
     template<typename Dtype>
     __global__
-    void set_atom_gradients(GridMaker G, float3 grid_origin, Grid2fCUDA coords, Grid1fCUDA type_index,
-        Grid1fCUDA radii, Grid<Dtype, 4, true> grid, Grid<Dtype, 2, true> atom_gradients) {
+    void set_atom_gradients(GridMaker G, float3 grid_origin, Grid3fCUDA coords, Grid2fCUDA type_index,
+        Grid2fCUDA radii, Grid<Dtype, 5, true> grid, Grid<Dtype, 3, true> atom_gradients) {
       int idx = blockDim.x * blockIdx.x + threadIdx.x;
-      if(idx >= type_index.dimension(0)) return;
+      if(idx >= type_index.dimension(1)) return;
+      unsigned b = blockIdx.y;
 
       //calculate gradient for atom at idx
       float3 agrad{0,0,0};
-      float3 a{coords(idx,0),coords(idx,1),coords(idx,2)}; //atom coordinate
-      float radius = radii(idx);
+      float3 a{coords(b,idx,0),coords(b,idx,1),coords(b,idx,2)}; //atom coordinate
+      float radius = radii(b,idx);
 
       float r = radius * G.radius_scale * G.final_radius_multiple;
       uint2 ranges[3];
@@ -463,9 +1419,9 @@ namespace libmolgrid {
       ranges[1] = G.get_bounds_1d(grid_origin.y, a.y, r);
       ranges[2] = G.get_bounds_1d(grid_origin.z, a.z, r);
 
-      int whichgrid = round(type_index[idx]);
+      int whichgrid = round(type_index(b,idx));
       if(whichgrid < 0) return;
-      Grid<Dtype, 3, true> diff = grid[whichgrid];
+      Grid<Dtype, 3, true> diff = grid[b][whichgrid];
 
       //for every grid point possibly overlapped by this atom
       for (unsigned i = ranges[0].x, iend = ranges[0].y; i < iend; ++i) {
@@ -480,29 +1436,31 @@ namespace libmolgrid {
           }
         }
       }
-      atom_gradients(idx,0) = agrad.x;
-      atom_gradients(idx,1) = agrad.y;
-      atom_gradients(idx,2) = agrad.z;
+      atom_gradients(b,idx,0) = agrad.x;
+      atom_gradients(b,idx,1) = agrad.y;
+      atom_gradients(b,idx,2) = agrad.z;
     }
 
-    //type vector version block.y is the type
+    //type vector version block.y is the type, block.z the example
     template<typename Dtype, bool RadiiFromTypes>
     __global__
-    void set_atom_type_gradients(GridMaker G, float3 grid_origin, Grid2fCUDA coords, Grid2fCUDA type_vector,
-        unsigned ntypes, Grid1fCUDA radii, Grid<Dtype, 4, true> grid, Grid<Dtype, 2, true> atom_gradients,
-        Grid<Dtype, 2, true> type_gradients) {
+    void set_atom_type_gradients(GridMaker G, float3 grid_origin, Grid3fCUDA coords, Grid3fCUDA type_vector,
+        unsigned ntypes, Grid2fCUDA radii, Grid<Dtype, 5, true> grid, Grid<Dtype, 3, true> atom_gradients,
+        Grid<Dtype, 3, true> type_gradients) {
       int idx = blockDim.x * blockIdx.x + threadIdx.x;
-      if(idx >= coords.dimension(0)) return;
+      if(idx >= coords.dimension(1)) return;
       unsigned whicht = blockIdx.y;
+      unsigned b = blockIdx.z;
 
       //calculate gradient for atom at idx
       float3 agrad{0,0,0};
-      float3 a{coords(idx,0),coords(idx,1),coords(idx,2)}; //atom coordinate
+      float3 a{coords(b,idx,0),coords(b,idx,1),coords(b,idx,2)}; //atom coordinate
       float radius = 0;
       if(RadiiFromTypes)
-        radius = radii(whicht);
+        radius = radii(b,whicht);
       else
-        radius = radii(idx);
+        radius = radii(b,idx);
+      if(radius <= 0) return; //padding, gradients were zeroed
 
       float r = radius * G.radius_scale * G.final_radius_multiple;
       uint2 ranges[3];
@@ -510,7 +1468,7 @@ namespace libmolgrid {
       ranges[1] = G.get_bounds_1d(grid_origin.y, a.y, r);
       ranges[2] = G.get_bounds_1d(grid_origin.z, a.z, r);
 
-      Grid<Dtype, 3, true> diff = grid[whicht];
+      Grid<Dtype, 3, true> diff = grid[b][whicht];
 
       //for every grid point possibly overlapped by this atom
       float tgrad = 0.0;
@@ -534,72 +1492,144 @@ namespace libmolgrid {
           }
         }
       }
-      float tmult = type_vector(idx,whicht);
+      float tmult = type_vector(b,idx,whicht);
       agrad.x *= tmult;
       agrad.y *= tmult;
       agrad.z *= tmult;
 
-      atomicAdd(&atom_gradients(idx,0), (Dtype)agrad.x);
-      atomicAdd(&atom_gradients(idx,1), (Dtype)agrad.y);
-      atomicAdd(&atom_gradients(idx,2), (Dtype)agrad.z);
+      atomicAdd(&atom_gradients(b,idx,0), (Dtype)agrad.x);
+      atomicAdd(&atom_gradients(b,idx,1), (Dtype)agrad.y);
+      atomicAdd(&atom_gradients(b,idx,2), (Dtype)agrad.z);
+
+      type_gradients(b,idx,whicht) = tgrad;
+    }
 
-      type_gradients(idx,whicht) = tgrad;
+    //view a single example as a batch of one
+    template <typename Dtype, std::size_t N>
+    static Grid<Dtype, N+1, true> as_batch(const Grid<Dtype, N, true>& g) {
+      size_t dims[N+1] = {1,};
+      for(unsigned i = 0; i < N; i++) dims[i+1] = g.dimension(i);
+      return Grid<Dtype, N+1, true>(g.data(), dims);
     }
 
     //gpu accelerated gradient calculation
     template <typename Dtype>
     void GridMaker::backward(float3 grid_center, const Grid<float, 2, true>& coords,
         const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii,
-        const Grid<Dtype, 4, true>& grid, Grid<Dtype, 2, true>& atom_gradients) const {
-      atom_gradients.fill_zero();
-      unsigned n = coords.dimension(0);
-      if(n != type_index.size()) throw std::invalid_argument("Type dimension doesn't equal number of coordinates.");
-      if(n != radii.size()) throw std::invalid_argument("Radii dimension doesn't equal number of coordinates");
-      if(n != atom_gradients.dimension(0)) throw std::invalid_argument("Gradient dimension doesn't equal number of coordinates");
+        const Grid<Dtype, 4, true>& grid, Grid<Dtype, 2, true>& atom_gradients, cudaStream_t stream) const {
       if(coords.dimension(1) != 3) throw std::invalid_argument("Coordinates wrong secondary dimension (!= 3)");
+      Grid<Dtype, 3, true> bgrads = as_batch(atom_gradients);
+      backward(grid_center, as_batch(coords), as_batch(type_index), as_batch(radii), as_batch(grid), bgrads, stream);
+    }
+
+    template void GridMaker::backward(float3 grid_center, const Grid<float, 2, true>& coords,
+        const Grid<float, 1, true>& type_index,const Grid<float, 1, true>& radii,
+        const Grid<float, 4, true>& grid, Grid<float, 2, true>& atom_gradients, cudaStream_t) const;
+    template void GridMaker::backward(float3 grid_center, const Grid<float, 2, true>& coords,
+        const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii,
+        const Grid<double, 4, true>& grid, Grid<double, 2, true>& atom_gradients, cudaStream_t) const;
+    template void GridMaker::backward(float3 grid_center, const Grid<float, 2, true>& coords,
+        const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii,
+        const Grid<__half, 4, true>& grid, Grid<__half, 2, true>& atom_gradients, cudaStream_t) const;
+    template void GridMaker::backward(float3 grid_center, const Grid<float, 2, true>& coords,
+        const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii,
+        const Grid<__nv_bfloat16, 4, true>& grid, Grid<__nv_bfloat16, 2, true>& atom_gradients, cudaStream_t) const;
+
+    template <typename Dtype>
+    void GridMaker::backward(float3 grid_center, const Grid<float, 3, true>& coords,
+        const Grid<float, 2, true>& type_index, const Grid<float, 2, true>& radii,
+        const Grid<Dtype, 5, true>& grid, Grid<Dtype, 3, true>& atom_gradients, cudaStream_t stream) const {
+      KernelTimer timer(STAGE_BACKWARD_GPU, stream);
+      atom_gradients.fill_zero(stream);
+      unsigned batch = coords.dimension(0);
+      unsigned n = coords.dimension(1);
+      if(batch != type_index.dimension(0) || batch != radii.dimension(0) || batch != grid.dimension(0) || batch != atom_gradients.dimension(0))
+        throw std::invalid_argument("Inconsistent batch sizes in backward");
+      if(n != type_index.dimension(1)) throw std::invalid_argument("Type dimension doesn't equal number of coordinates.");
+      if(n != radii.dimension(1)) throw std::invalid_argument("Radii dimension doesn't equal number of coordinates");
+      if(n != atom_gradients.dimension(1)) throw std::invalid_argument("Gradient dimension doesn't equal number of coordinates");
+      if(coords.dimension(2) != 3) throw std::invalid_argument("Coordinates wrong secondary dimension (!= 3)");
       if(radii_type_indexed) {
         throw std::invalid_argument("Type indexed radii not supported with index types.");
       }
+      if(batch > 65535) throw std::invalid_argument("Batch size too large for a single launch: "+itoa(batch));
+      if(n == 0 || batch == 0) return;
 
       float3 grid_origin = get_grid_origin(grid_center);
 
       unsigned blocks =  LMG_GET_BLOCKS(n);
       unsigned nthreads = LMG_GET_THREADS(n);
-      set_atom_gradients<<<blocks, nthreads>>>(*this, grid_origin, coords, type_index, radii, grid, atom_gradients);
+      dim3 B(blocks, batch, 1);
+      set_atom_gradients<<<B, nthreads, 0, stream>>>(*this, grid_origin, coords, type_index, radii, grid, atom_gradients);
+      LMG_CUDA_CHECK(cudaPeekAtLastError());
     }
 
-    template void GridMaker::backward(float3 grid_center, const Grid<float, 2, true>& coords,
-        const Grid<float, 1, true>& type_index,const Grid<float, 1, true>& radii,
-        const Grid<float, 4, true>& grid, Grid<float, 2, true>& atom_gradients) const;
-    template void GridMaker::backward(float3 grid_center, const Grid<float, 2, true>& coords,
-        const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii,
-        const Grid<double, 4, true>& grid, Grid<double, 2, true>& atom_gradients) const;
+    template void GridMaker::backward(float3, const Grid<float, 3, true>&,
+        const Grid<float, 2, true>&, const Grid<float, 2, true>&,
+        const Grid<float, 5, true>&, Grid<float, 3, true>&, cudaStream_t) const;
+    template void GridMaker::backward(float3, const Grid<float, 3, true>&,
+        const Grid<float, 2, true>&, const Grid<float, 2, true>&,
+        const Grid<double, 5, true>&, Grid<double, 3, true>&, cudaStream_t) const;
+    template void GridMaker::backward(float3, const Grid<float, 3, true>&,
+        const Grid<float, 2, true>&, const Grid<float, 2, true>&,
+        const Grid<__half, 5, true>&, Grid<__half, 3, true>&, cudaStream_t) const;
+    template void GridMaker::backward(float3, const Grid<float, 3, true>&,
+        const Grid<float, 2, true>&, const Grid<float, 2, true>&,
+        const Grid<__nv_bfloat16, 5, true>&, Grid<__nv_bfloat16, 3, true>&, cudaStream_t) const;
 
     template<typename Dtype>
     void GridMaker::backward(float3 grid_center, const Grid<float, 2, true>& coords,
         const Grid<float, 2, true>& type_vector, const Grid<float, 1, true>& radii,
         const Grid<Dtype, 4, true>& grid,
-        Grid<Dtype, 2, true>& atom_gradients, Grid<Dtype, 2, true>& type_gradients) const {
-      atom_gradients.fill_zero();
-      type_gradients.fill_zero();
-      unsigned n = coords.dimension(0);
-      unsigned ntypes = type_vector.dimension(1);
+        Grid<Dtype, 2, true>& atom_gradients, Grid<Dtype, 2, true>& type_gradients, cudaStream_t stream) const {
+      if (coords.dimension(1) != 3) throw std::invalid_argument("Need x,y,z,r for coord_radius");
+      if(radii_type_indexed) { //radii should be size of types
+        if(type_vector.dimension(1) != radii.size()) throw std::invalid_argument("Radii dimension doesn't equal number of types");
+      } else { //radii should be size of atoms
+        if(coords.dimension(0) != radii.size()) throw std::invalid_argument("Radii dimension doesn't equal number of coordinates");
+      }
+      Grid<Dtype, 3, true> bagrads = as_batch(atom_gradients);
+      Grid<Dtype, 3, true> btgrads = as_batch(type_gradients);
+      backward(grid_center, as_batch(coords), as_batch(type_vector), as_batch(radii), as_batch(grid), bagrads, btgrads, stream);
+    }
+
+    template void GridMaker::backward(float3 grid_center, const Grid<float, 2, true>& coords,
+        const Grid<float, 2, true>& type_vectors, const Grid<float, 1, true>& radii,
+        const Grid<float, 4, true>& grid,
+        Grid<float, 2, true>& atom_gradients, Grid<float, 2, true>& type_gradients, cudaStream_t) const;
 
-      if (n != type_vector.dimension(0)) throw std::invalid_argument("Type dimension doesn't equal number of coordinates.");
-      if (ntypes != grid.dimension(0)) throw std::invalid_argument("Channels in diff doesn't equal number of types");
-      if (n != atom_gradients.dimension(0))
+    template<typename Dtype>
+    void GridMaker::backward(float3 grid_center, const Grid<float, 3, true>& coords,
+        const Grid<float, 3, true>& type_vector, const Grid<float, 2, true>& radii,
+        const Grid<Dtype, 5, true>& grid,
+        Grid<Dtype, 3, true>& atom_gradients, Grid<Dtype, 3, true>& type_gradients, cudaStream_t stream) const {
+      KernelTimer timer(STAGE_BACKWARD_GPU, stream);
+      atom_gradients.fill_zero(stream);
+      type_gradients.fill_zero(stream);
+      unsigned batch = coords.dimension(0);
+      unsigned n = coords.dimension(1);
+      unsigned ntypes = type_vector.dimension(2);
+
+      if(batch != type_vector.dimension(0) || batch != radii.dimension(0) || batch != grid.dimension(0) ||
+          batch != atom_gradients.dimension(0) || batch != type_gradients.dimension(0))
+        throw std::invalid_argument("Inconsistent batch sizes in backward");
+      if (n != type_vector.dimension(1)) throw std::invalid_argument("Type dimension doesn't equal number of coordinates.");
+      if (ntypes != grid.dimension(1)) throw std::invalid_argument("Channels in diff doesn't equal number of types");
+      if (n != atom_gradients.dimension(1))
         throw std::invalid_argument("Atom gradient dimension doesn't equal number of coordinates");
-      if (n != type_gradients.dimension(0))
+      if (n != type_gradients.dimension(1))
         throw std::invalid_argument("Type gradient dimension doesn't equal number of coordinates");
-      if (type_gradients.dimension(1) != ntypes)
+      if (type_gradients.dimension(2) != ntypes)
         throw std::invalid_argument("Type gradient dimension has wrong number of types");
-      if (coords.dimension(1) != 3) throw std::invalid_argument("Need x,y,z,r for coord_radius");
+      if (coords.dimension(2) != 3) throw std::invalid_argument("Need x,y,z,r for coord_radius");
 
       if(radii_type_indexed) { //radii should be size of types
-        if(ntypes != radii.size()) throw std::invalid_argument("Radii dimension doesn't equal number of types");
+        if(ntypes != radii.dimension(1)) throw std::invalid_argument("Radii dimension doesn't equal number of types");
       } else { //radii should be size of atoms
-        if(n != radii.size()) throw std::invalid_argument("Radii dimension doesn't equal number of coordinates");
+        if(n != radii.dimension(1)) throw std::invalid_argument("Radii dimension doesn't equal number of coordinates");
       }
+      if(batch > 65535) throw std::invalid_argument("Batch size too large for a single launch: "+itoa(batch));
+      if(n == 0 || batch == 0 || ntypes == 0) return;
 
       float3 grid_origin = get_grid_origin(grid_center);
 
@@ -608,18 +1638,20 @@ namespace libmolgrid {
       unsigned nthreads = LMG_GET_THREADS(n);
       if(ntypes >= 1024)
         throw std::invalid_argument("Really? More than 1024 types?  The GPU can't handle that.  Are you sure this is a good idea?  I'm giving up.");
-      dim3 B(blocks, ntypes, 1); //in theory could support more 1024 by using z, but really..
+      dim3 B(blocks, ntypes, batch);
+      GridMaker gmaker = device_copy();
       if(radii_type_indexed)
-        set_atom_type_gradients<Dtype,true><<<B, nthreads>>>(*this, grid_origin, coords, type_vector, ntypes, radii, grid, atom_gradients, type_gradients);
+        set_atom_type_gradients<Dtype,true><<<B, nthreads, 0, stream>>>(gmaker, grid_origin, coords, type_vector, ntypes, radii, grid, atom_gradients, type_gradients);
       else
-        set_atom_type_gradients<Dtype,false><<<B, nthreads>>>(*this, grid_origin, coords, type_vector, ntypes, radii, grid, atom_gradients, type_gradients);
+        set_atom_type_gradients<Dtype,false><<<B, nthreads, 0, stream>>>(gmaker, grid_origin, coords, type_vector, ntypes, radii, grid, atom_gradients, type_gradients);
+      LMG_CUDA_CHECK(cudaPeekAtLastError());
 
     }
 
-    template void GridMaker::backward(float3 grid_center, const Grid<float, 2, true>& coords,
-        const Grid<float, 2, true>& type_vectors, const Grid<float, 1, true>& radii,
-        const Grid<float, 4, true>& grid,
-        Grid<float, 2, true>& atom_gradients, Grid<float, 2, true>& type_gradients) const;
+    template void GridMaker::backward(float3, const Grid<float, 3, true>&,
+        const Grid<float, 3, true>&, const Grid<float, 2, true>&,
+        const Grid<float, 5, true>&,
+        Grid<float, 3, true>&, Grid<float, 3, true>&, cudaStream_t) const;
 
     //atomicAdd isn't working with doubles??
 
@@ -655,18 +1687,19 @@ namespace libmolgrid {
       }
     }
 
-    //kernel launch - parallelize across whole atoms
+    //kernel launch - parallelize across whole atoms, block.y is the example
     template<typename Dtype>
     __global__
-    void set_atom_relevance(GridMaker G, float3 grid_origin, Grid2fCUDA coords, Grid1fCUDA type_index,  Grid1fCUDA radii,
-        Grid<Dtype, 4, true> densitygrid, Grid<Dtype, 4, true> diffgrid, Grid<Dtype, 1, true> relevance) {
+    void set_atom_relevance(GridMaker G, float3 grid_origin, Grid3fCUDA coords, Grid2fCUDA type_index,  Grid2fCUDA radii,
+        Grid<Dtype, 5, true> densitygrid, Grid<Dtype, 5, true> diffgrid, Grid<Dtype, 2, true> relevance) {
       int idx = blockDim.x * blockIdx.x + threadIdx.x;
-      if(idx >= type_index.dimension(0)) return;
-      if(idx >= radii.dimension(0)) return;
+      if(idx >= type_index.dimension(1)) return;
+      if(idx >= radii.dimension(1)) return;
+      unsigned b = blockIdx.y;
 
       //calculate gradient for atom at idx
-      float3 a{coords(idx,0),coords(idx,1),coords(idx,2)}; //atom coordinate
-      float radius = radii(idx);
+      float3 a{coords(b,idx,0),coords(b,idx,1),coords(b,idx,2)}; //atom coordinate
+      float radius = radii(b,idx);
 
       float r = radius * G.radius_scale * G.final_radius_multiple;
       uint2 ranges[3];
@@ -674,10 +1707,10 @@ namespace libmolgrid {
       ranges[1] = G.get_bounds_1d(grid_origin.y, a.y, r);
       ranges[2] = G.get_bounds_1d(grid_origin.z, a.z, r);
 
-      int whichgrid = round(type_index[idx]);
+      int whichgrid = round(type_index(b,idx));
       if(whichgrid < 0) return;
-      Grid<Dtype, 3, true> diff = diffgrid[whichgrid];
-      Grid<Dtype, 3, true> density = densitygrid[whichgrid];
+      Grid<Dtype, 3, true> diff = diffgrid[b][whichgrid];
+      Grid<Dtype, 3, true> density = densitygrid[b][whichgrid];
 
       //for every grid point possibly overlapped by this atom
       float ret = 0;
@@ -705,34 +1738,111 @@ namespace libmolgrid {
           }
         }
       }
-      relevance(idx) = ret;
+      relevance(b,idx) = ret;
     }
 
     template <typename Dtype>
     void GridMaker::backward_relevance(float3 grid_center,  const Grid<float, 2, true>& coords,
         const Grid<float, 1, true>& type_index, const Grid<float, 1, true>& radii,
         const Grid<Dtype, 4, true>& density, const Grid<Dtype, 4, true>& diff,
-        Grid<Dtype, 1, true>& relevance) const {
-
-      relevance.fill_zero();
-      unsigned n = coords.dimension(0);
-      if(n != type_index.size()) throw std::invalid_argument("Type dimension doesn't equal number of coordinates.");
-      if(n != relevance.size()) throw std::invalid_argument("Relevance dimension doesn't equal number of coordinates");
-      if(n != radii.size()) throw std::invalid_argument("Radii dimension doesn't equal number of coordinates");
+        Grid<Dtype, 1, true>& relevance, cudaStream_t stream) const {
       if(coords.dimension(1) != 3) throw std::invalid_argument("Coordinates and radius wrong secondary dimension");
+      Grid<Dtype, 2, true> brel = as_batch(relevance);
+      backward_relevance(grid_center, as_batch(coords), as_batch(type_index), as_batch(radii), as_batch(density), as_batch(diff), brel, stream);
+    }
+
+    template void GridMaker::backward_relevance(float3,  const Grid<float, 2, true>&,
+        const Grid<float, 1, true>&, const Grid<float, 1, true>&, const Grid<float, 4, true>&,
+        const Grid<float, 4, true>&, Grid<float, 1, true>&, cudaStream_t) const;
+    template void GridMaker::backward_relevance(float3,  const Grid<float, 2, true>&,
+        const Grid<float, 1, true>&, const Grid<float, 1, true>&, const Grid<double, 4, true>&,
+        const Grid<double, 4, true>&, Grid<double, 1, true>&, cudaStream_t) const;
+    template void GridMaker::backward_relevance(float3,  const Grid<float, 2, true>&,
+        const Grid<float, 1, true>&, const Grid<float, 1, true>&, const Grid<__half, 4, true>&,
+        const Grid<__half, 4, true>&, Grid<__half, 1, true>&, cudaStream_t) const;
+    template void GridMaker::backward_relevance(float3,  const Grid<float, 2, true>&,
+        const Grid<float, 1, true>&, const Grid<float, 1, true>&, const Grid<__nv_bfloat16, 4, true>&,
+        const Grid<__nv_bfloat16, 4, true>&, Grid<__nv_bfloat16, 1, true>&, cudaStream_t) const;
+
+    template <typename Dtype>
+    void GridMaker::backward_relevance(float3 grid_center,  const Grid<float, 3, true>& coords,
+        const Grid<float, 2, true>& type_index, const Grid<float, 2, true>& radii,
+        const Grid<Dtype, 5, true>& density, const Grid<Dtype, 5, true>& diff,
+        Grid<Dtype, 2, true>& relevance, cudaStream_t stream) const {
+      KernelTimer timer(STAGE_BACKWARD_GPU, stream);
+
+      relevance.fill_zero(stream);
+      unsigned batch = coords.dimension(0);
+      unsigned n = coords.dimension(1);
+      if(batch != type_index.dimension(0) || batch != radii.dimension(0) || batch != density.dimension(0) ||
+          batch != diff.dimension(0) || batch != relevance.dimension(0))
+        throw std::invalid_argument("Inconsistent batch sizes in backward_relevance");
+      if(n != type_index.dimension(1)) throw std::invalid_argument("Type dimension doesn't equal number of coordinates.");
+      if(n != relevance.dimension(1)) throw std::invalid_argument("Relevance dimension doesn't equal number of coordinates");
+      if(n != radii.dimension(1)) throw std::invalid_argument("Radii dimension doesn't equal number of coordinates");
+      if(coords.dimension(2) != 3) throw std::invalid_argument("Coordinates and radius wrong secondary dimension");
+      if(batch > 65535) throw std::invalid_argument("Batch size too large for a single launch: "+itoa(batch));
+      if(n == 0 || batch == 0) return;
 
       float3 grid_origin = get_grid_origin(grid_center);
 
       unsigned blocks =  LMG_GET_BLOCKS(n);
       unsigned nthreads = LMG_GET_THREADS(n);
-      set_atom_relevance<<<blocks, nthreads>>>(*this, grid_origin, coords, type_index, radii, density, diff, relevance);
+      dim3 B(blocks, batch, 1);
+      set_atom_relevance<<<B, nthreads, 0, stream>>>(device_copy(), grid_origin, coords, type_index, radii, density, diff, relevance);
+      LMG_CUDA_CHECK(cudaPeekAtLastError());
+    }
+
+    template void GridMaker::backward_relevance(float3,  const Grid<float, 3, true>&,
+        const Grid<float, 2, true>&, const Grid<float, 2, true>&, const Grid<float, 5, true>&,
+        const Grid<float, 5, true>&, Grid<float, 2, true>&, cudaStream_t) const;
+    template void GridMaker::backward_relevance(float3,  const Grid<float, 3, true>&,
+        const Grid<float, 2, true>&, const Grid<float, 2, true>&, const Grid<double, 5, true>&,
+        const Grid<double, 5, true>&, Grid<double, 2, true>&, cudaStream_t) const;
+    template void GridMaker::backward_relevance(float3,  const Grid<float, 3, true>&,
+        const Grid<float, 2, true>&, const Grid<float, 2, true>&, const Grid<__half, 5, true>&,
+        const Grid<__half, 5, true>&, Grid<__half, 2, true>&, cudaStream_t) const;
+    template void GridMaker::backward_relevance(float3,  const Grid<float, 3, true>&,
+        const Grid<float, 2, true>&, const Grid<float, 2, true>&, const Grid<__nv_bfloat16, 5, true>&,
+        const Grid<__nv_bfloat16, 5, true>&, Grid<__nv_bfloat16, 2, true>&, cudaStream_t) const;
+
+    //add sign times the density of an atom to its channel, one block per atom
+    __global__
+    void add_atoms_kernel(GridMaker G, float3 grid_origin, unsigned natoms, const float *atoms, Grid<float, 4, true> out) {
+      const float *a = atoms + 6 * blockIdx.x;
+      float radius = a[3];
+      float r = radius * G.radius_scale * G.final_radius_multiple;
+      uint2 ranges[3];
+      ranges[0] = G.get_bounds_1d(grid_origin.x, a[0], r);
+      ranges[1] = G.get_bounds_1d(grid_origin.y, a[1], r);
+      ranges[2] = G.get_bounds_1d(grid_origin.z, a[2], r);
+      unsigned ni = ranges[0].y - ranges[0].x, nj = ranges[1].y - ranges[1].x, nk = ranges[2].y - ranges[2].x;
+      Grid<float, 3, true> channel = out[unsigned(a[4])];
+
+      //threads stride over the bounding box of the atom
+      for(unsigned p = threadIdx.x, np = ni * nj * nk; p < np; p += blockDim.x) {
+        unsigned i = ranges[0].x + p / (nj * nk);
+        unsigned j = ranges[1].x + (p / nk) % nj;
+        unsigned k = ranges[2].x + p % nk;
+        float3 pt{grid_origin.x + i * G.resolution, grid_origin.y + j * G.resolution, grid_origin.z + k * G.resolution};
+        float val = G.calc_point<false>(a[0], a[1], a[2], radius, pt);
+        if(val != 0) atomicAdd(&channel(i, j, k), a[5] * val);
+      }
+    }
+
+    void GridMaker::add_atoms(float3 grid_origin, const std::vector<float>& atoms, Grid<float, 4, true>& out, cudaStream_t stream) const {
+      unsigned natoms = atoms.size() / 6;
+      if(natoms == 0) return;
+      static thread_local stream_scratch<float> atom_scratch;
+      ManagedGrid<float, 1>& buffer = atom_scratch.acquire(atoms.size());
+      buffer.tocpu(false);
+      memcpy(buffer.cpu().data(), atoms.data(), atoms.size() * sizeof(float));
+      buffer.togpu(stream);
+      KernelTimer timer(STAGE_FORWARD_GPU, stream);
+      add_atoms_kernel<<<natoms, LMG_CUDA_NUM_THREADS, 0, stream>>>(device_copy(), grid_origin, natoms, buffer.gpu().data(), out);
+      LMG_CUDA_CHECK(cudaPeekAtLastError());
+      atom_scratch.release(stream);
     }
 
-    template void GridMaker::backward_relevance(float3,  const Grid<float, 2, true>&,
-        const Grid<float, 1, true>&, const Grid<float, 1, true>&, const Grid<float, 4, true>&,
-        const Grid<float, 4, true>&, Grid<float, 1, true>&) const;
-    template void GridMaker::backward_relevance(float3,  const Grid<float, 2, true>&,
-        const Grid<float, 1, true>&, const Grid<float, 1, true>&, const Grid<double, 4, true>&,
-        const Grid<double, 4, true>&, Grid<double, 1, true>& ) const;
 
 } /* namespace libmolgrid */
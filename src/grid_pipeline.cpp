@@ -0,0 +1,183 @@
+/** \file grid_pipeline.cpp
+ *  \brief Background extraction, transfer and gridding of batches.
+ */
+#include "libmolgrid/grid_pipeline.h"
+#include <chrono>
+
+namespace libmolgrid {
+
+using namespace std;
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+  return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+GridPipeline::GridPipeline(ExampleProvider& p, const GridMaker& g, unsigned bsize, const RandomTransforms& r, unsigned depth):
+    provider(p), gmaker(g), random(r), batch_size(bsize), device(DeviceGuard::current_device()) {
+  if(batch_size == 0) throw invalid_argument("GridPipeline batch size must be positive");
+  if(depth == 0) throw invalid_argument("GridPipeline depth must be positive");
+
+  float3 dims = gmaker.get_grid_dims();
+  slots.resize(depth);
+  for(unsigned i = 0; i < depth; i++) {
+    Slot& slot = slots[i];
+    slot.grid = MGrid5f(batch_size, provider.num_types(), dims.x, dims.y, dims.z);
+    slot.labels = MGrid2f(batch_size, provider.num_labels());
+    slot.grid.togpu(false);
+    slot.labels.togpu(false);
+    LMG_CUDA_CHECK(cudaStreamCreateWithFlags(&slot.stream, cudaStreamNonBlocking));
+    LMG_CUDA_CHECK(cudaEventCreate(&slot.start));
+    LMG_CUDA_CHECK(cudaEventCreate(&slot.ready));
+    LMG_CUDA_CHECK(cudaEventCreateWithFlags(&slot.consumed, cudaEventDisableTiming));
+    free_slots.push_back(i);
+  }
+  worker = thread(&GridPipeline::run, this);
+}
+
+GridPipeline::~GridPipeline() {
+  {
+    lock_guard<mutex> lock(mtx);
+    stop = true;
+  }
+  free_cv.notify_all();
+  worker.join();
+
+  DeviceGuard guard(device);
+  for(Slot& slot : slots) {
+    //the consumer's stream may still be using the held slot
+    cudaEventSynchronize(slot.consumed);
+    cudaStreamSynchronize(slot.stream);
+    cudaStreamDestroy(slot.stream);
+    cudaEventDestroy(slot.start);
+    cudaEventDestroy(slot.ready);
+    cudaEventDestroy(slot.consumed);
+  }
+  cudaGetLastError();
+}
+
+void GridPipeline::run() {
+  DeviceGuard guard(device);
+  vector<Example> batch;
+  try {
+    while(true) {
+      unsigned s = 0;
+      {
+        auto start = chrono::steady_clock::now();
+        unique_lock<mutex> lock(mtx);
+        free_cv.wait(lock, [this] { return stop || free_slots.size(); });
+        if(stop) return;
+        s = free_slots.front();
+        free_slots.pop_front();
+        stats.stalled_seconds += seconds_since(start);
+      }
+      Slot& slot = slots[s];
+
+      auto start = chrono::steady_clock::now();
+      provider.next_batch(batch, batch_size);
+      //the previous upload of the labels must be done before the host copy is overwritten,
+      //which also makes the time of the previous batch of this slot available
+      LMG_CUDA_CHECK(cudaEventSynchronize(slot.ready));
+      double grid_seconds = 0;
+      if(slot.timed) {
+        float ms = 0;
+        LMG_CUDA_CHECK(cudaEventElapsedTime(&ms, slot.start, slot.ready));
+        grid_seconds = ms / 1000.0;
+      }
+      slot.labels.tocpu(false);
+      Grid<float, 2, false> hostlabels = slot.labels.cpu();
+      Example::extract_labels(batch, hostlabels);
+      double extract_seconds = seconds_since(start);
+
+      //queue the batch behind the consumer's use of the previous contents of the slot
+      start = chrono::steady_clock::now();
+      LMG_CUDA_CHECK(cudaStreamWaitEvent(slot.stream, slot.consumed, 0));
+      LMG_CUDA_CHECK(cudaEventRecord(slot.start, slot.stream));
+      slot.grid.togpu(slot.stream, false);
+      Grid<float, 5, true> grid = slot.grid.gpu();
+      gmaker.forward(batch, grid, random, next_index, slot.stream);
+      slot.labels.togpu(slot.stream);
+      LMG_CUDA_CHECK(cudaEventRecord(slot.ready, slot.stream));
+      slot.timed = true;
+      next_index += batch_size;
+      double submit_seconds = seconds_since(start);
+
+      {
+        lock_guard<mutex> lock(mtx);
+        stats.extract_seconds += extract_seconds;
+        stats.submit_seconds += submit_seconds;
+        stats.grid_seconds += grid_seconds;
+        ready_slots.push_back(s);
+      }
+      ready_cv.notify_one();
+    }
+  } catch(...) {
+    {
+      lock_guard<mutex> lock(mtx);
+      error = current_exception();
+    }
+    ready_cv.notify_all();
+  }
+}
+
+void GridPipeline::release(unsigned s, cudaStream_t stream) {
+  LMG_CUDA_CHECK(cudaEventRecord(slots[s].consumed, stream));
+  free_slots.push_back(s);
+  free_cv.notify_one();
+}
+
+unsigned GridPipeline::take_ready(cudaStream_t stream) {
+  DeviceGuard guard(device);
+  auto start = chrono::steady_clock::now();
+  unique_lock<mutex> lock(mtx);
+  if(held >= 0) {
+    release(held, stream);
+    held = -1;
+  }
+  ready_cv.wait(lock, [this] { return ready_slots.size() || error; });
+  if(ready_slots.empty()) rethrow_exception(error);
+  unsigned s = ready_slots.front();
+  ready_slots.pop_front();
+  stats.starved_seconds += seconds_since(start);
+  stats.batches++;
+  LMG_CUDA_CHECK(cudaStreamWaitEvent(stream, slots[s].ready, 0));
+  return s;
+}
+
+void GridPipeline::next(MGrid5f& grid, MGrid2f& labels, cudaStream_t stream) {
+  unsigned s = take_ready(stream);
+  lock_guard<mutex> lock(mtx);
+  held = s;
+  grid = slots[s].grid;
+  labels = slots[s].labels;
+}
+
+void GridPipeline::next(Grid<float, 5, true>& grid, Grid<float, 2, true>& labels, cudaStream_t stream) {
+  const Slot& slot = slots[0];
+  for(unsigned i = 0; i < 5; i++) {
+    if(grid.dimension(i) != slot.grid.dimension(i))
+      throw out_of_range("Output grid dimension incorrect: "+itoa(grid.dimension(i))+" vs "+itoa(slot.grid.dimension(i)));
+  }
+  if(labels.dimension(0) != slot.labels.dimension(0) || labels.dimension(1) != slot.labels.dimension(1))
+    throw out_of_range("Label grid dimensions incorrect: "+itoa(labels.dimension(0))+"x"+itoa(labels.dimension(1))+" vs "+
+        itoa(slot.labels.dimension(0))+"x"+itoa(slot.labels.dimension(1)));
+
+  unsigned s = take_ready(stream);
+  DeviceGuard guard(device);
+  const Slot& ready = slots[s];
+  LMG_CUDA_CHECK(cudaMemcpyAsync(grid.data(), ready.grid.gpu().data(), grid.size() * sizeof(float), cudaMemcpyDeviceToDevice, stream));
+  LMG_CUDA_CHECK(cudaMemcpyAsync(labels.data(), ready.labels.gpu().data(), labels.size() * sizeof(float), cudaMemcpyDeviceToDevice, stream));
+  lock_guard<mutex> lock(mtx);
+  release(s, stream);
+}
+
+GridPipelineStats GridPipeline::get_stats() {
+  lock_guard<mutex> lock(mtx);
+  return stats;
+}
+
+void GridPipeline::reset_stats() {
+  lock_guard<mutex> lock(mtx);
+  stats = GridPipelineStats();
+}
+
+} /* namespace libmolgrid */
@@ -0,0 +1,200 @@
+/** \file instrumentation.cpp
+ *  \brief Totals of the instrumented pipeline stages.
+ */
+#include "libmolgrid/instrumentation.h"
+#include <map>
+#include <mutex>
+
+namespace libmolgrid {
+
+namespace instrumentation_detail {
+  std::atomic<bool> enabled(false);
+}
+
+namespace {
+  struct StageTotals {
+    std::atomic<size_t> count;
+    std::atomic<size_t> nanoseconds;
+    std::atomic<size_t> bytes;
+  };
+
+  StageTotals totals[NUM_INSTRUMENTED_STAGES];
+
+  const char *names[NUM_INSTRUMENTED_STAGES] = {
+      "nextref", "set_coords", "read_molcache", "read_gninatypes", "parse_openbabel", "typing",
+      "store_hit", "store_miss", "merge_coordinates", "host_to_device", "device_to_host",
+      "forward_cpu", "backward_cpu", "forward_gpu", "backward_gpu"
+  };
+
+  //event pairs of kernels that may not have completed yet
+  struct PendingKernel {
+    InstrumentedStage stage;
+    int device;
+    size_t bytes;
+    cudaEvent_t start;
+    cudaEvent_t stop;
+  };
+
+  //events of one thread, the mutex is only contended when stats are read;
+  //events are never destroyed, thread exit may follow context teardown
+  struct KernelEvents {
+    std::mutex mtx;
+    std::vector<PendingKernel> pending;
+    std::map<int, std::vector<cudaEvent_t> > free_events; //by device
+  };
+
+  //every KernelEvents ever made, those of exited threads are handed to new threads
+  struct EventRegistry {
+    std::mutex mtx;
+    std::vector<KernelEvents*> all;
+    std::vector<KernelEvents*> unused;
+  };
+
+  EventRegistry& event_registry() {
+    static EventRegistry *registry = new EventRegistry;
+    return *registry;
+  }
+
+  struct ThreadEvents {
+    KernelEvents *events = nullptr;
+    ~ThreadEvents() {
+      if(!events) return;
+      EventRegistry& registry = event_registry();
+      std::lock_guard<std::mutex> lock(registry.mtx);
+      registry.unused.push_back(events);
+    }
+  };
+
+  //the calling thread's events
+  KernelEvents& kernel_events() {
+    static thread_local ThreadEvents mine;
+    if(!mine.events) {
+      EventRegistry& registry = event_registry();
+      std::lock_guard<std::mutex> lock(registry.mtx);
+      if(registry.unused.size()) {
+        mine.events = registry.unused.back();
+        registry.unused.pop_back();
+      } else {
+        mine.events = new KernelEvents;
+        registry.all.push_back(mine.events);
+      }
+    }
+    return *mine.events;
+  }
+
+  //event on the current device, events must be recorded on streams of their device
+  cudaEvent_t take_event(KernelEvents& events, int device) {
+    std::vector<cudaEvent_t>& available = events.free_events[device];
+    if(available.size()) {
+      cudaEvent_t e = available.back();
+      available.pop_back();
+      return e;
+    }
+    cudaEvent_t e = nullptr;
+    if(cudaEventCreate(&e) != cudaSuccess) {
+      cudaGetLastError();
+      return nullptr;
+    }
+    return e;
+  }
+
+  //add the times of completed kernels, events must be locked
+  void collect_kernels(KernelEvents& events) {
+    unsigned kept = 0;
+    for(unsigned i = 0, n = events.pending.size(); i < n; i++) {
+      PendingKernel& k = events.pending[i];
+      cudaError_t status = cudaEventQuery(k.stop);
+      if(status == cudaErrorNotReady) {
+        events.pending[kept++] = k;
+        continue;
+      }
+      float ms = 0;
+      if(status == cudaSuccess && cudaEventElapsedTime(&ms, k.start, k.stop) == cudaSuccess) {
+        record_stage(k.stage, ms / 1000.0, k.bytes);
+      }
+      cudaGetLastError();
+      events.free_events[k.device].push_back(k.start);
+      events.free_events[k.device].push_back(k.stop);
+    }
+    events.pending.resize(kept);
+  }
+
+  //add the times of completed kernels of every thread
+  void collect_all_kernels() {
+    EventRegistry& registry = event_registry();
+    std::lock_guard<std::mutex> lock(registry.mtx);
+    for(KernelEvents *events : registry.all) {
+      std::lock_guard<std::mutex> elock(events->mtx);
+      collect_kernels(*events);
+    }
+  }
+}
+
+void set_instrumentation(bool enable) { instrumentation_detail::enabled = enable; }
+
+void reset_instrumentation() {
+  collect_all_kernels(); //so completed kernels are not counted after the reset
+  for(StageTotals& t : totals) {
+    t.count = 0;
+    t.nanoseconds = 0;
+    t.bytes = 0;
+  }
+}
+
+std::vector<StageStats> get_instrumentation_stats() {
+  collect_all_kernels();
+  std::vector<StageStats> ret(NUM_INSTRUMENTED_STAGES);
+  for(unsigned i = 0; i < NUM_INSTRUMENTED_STAGES; i++) {
+    ret[i].name = names[i];
+    ret[i].count = totals[i].count;
+    ret[i].seconds = totals[i].nanoseconds * 1e-9;
+    ret[i].bytes = totals[i].bytes;
+  }
+  return ret;
+}
+
+const char* stage_name(InstrumentedStage s) {
+  return s < NUM_INSTRUMENTED_STAGES ? names[s] : "unknown";
+}
+
+void record_stage(InstrumentedStage s, double seconds, size_t bytes, size_t count) {
+  StageTotals& t = totals[s];
+  t.count.fetch_add(count, std::memory_order_relaxed);
+  t.nanoseconds.fetch_add(size_t(seconds * 1e9), std::memory_order_relaxed);
+  if(bytes) t.bytes.fetch_add(bytes, std::memory_order_relaxed);
+}
+
+void KernelTimer::begin() {
+  int device = 0;
+  if(cudaGetDevice(&device) != cudaSuccess) {
+    cudaGetLastError();
+    return;
+  }
+  KernelEvents& events = kernel_events();
+  std::lock_guard<std::mutex> lock(events.mtx);
+  start = take_event(events, device);
+  if(start && cudaEventRecord(start, stream) != cudaSuccess) {
+    cudaGetLastError();
+    events.free_events[device].push_back(start);
+    start = nullptr;
+  }
+}
+
+void KernelTimer::end() {
+  int device = 0;
+  cudaGetDevice(&device);
+  KernelEvents& events = kernel_events();
+  std::lock_guard<std::mutex> lock(events.mtx);
+  cudaEvent_t stop = take_event(events, device);
+  if(!stop || cudaEventRecord(stop, stream) != cudaSuccess) {
+    cudaGetLastError();
+    events.free_events[device].push_back(start);
+    if(stop) events.free_events[device].push_back(stop);
+    return;
+  }
+  events.pending.push_back(PendingKernel{stage, device, bytes, start, stop});
+  //keep the number of outstanding events bounded when stats are never read
+  if(events.pending.size() >= 256) collect_kernels(events);
+}
+
+} /* namespace libmolgrid */
@@ -6,10 +6,196 @@
 #include "libmolgrid/grid.h"
 #include "libmolgrid/managed_grid.h"
 #include "libmolgrid/transform.h"
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
 
 namespace libmolgrid {
     std::default_random_engine random_engine;
+    std::mutex random_engine_mutex;
 
+//one event per stream, recorded again each time the stream uses the memory
+struct StreamUses {
+  std::vector<std::pair<cudaStream_t, cudaEvent_t> > events;
+  StreamUses() = default;
+  StreamUses(const StreamUses&) = delete;
+  StreamUses& operator=(const StreamUses&) = delete;
+  ~StreamUses() {
+    for(auto& e : events) cudaEventDestroy(e.second);
+  }
+};
+
+void record_stream_use(StreamUses*& uses, cudaStream_t stream) {
+  if(uses == nullptr) uses = new StreamUses;
+  cudaEvent_t event = nullptr;
+  for(auto& e : uses->events) {
+    if(e.first == stream) event = e.second;
+  }
+  if(event == nullptr) {
+    LMG_CUDA_CHECK(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+    uses->events.push_back(std::make_pair(stream, event));
+  }
+  LMG_CUDA_CHECK(cudaEventRecord(event, stream));
+}
+
+namespace {
+  //events that complete once the work queued before a grid was freed is done, shared by its host and device blocks
+  struct FreeFence {
+    cudaEvent_t legacy = nullptr; //on the legacy default stream, which blocking streams are ordered before
+    std::unique_ptr<StreamUses> uses; //every other stream that used the blocks
+    FreeFence() = default;
+    FreeFence(const FreeFence&) = delete;
+    FreeFence& operator=(const FreeFence&) = delete;
+    ~FreeFence() {
+      if(legacy) cudaEventDestroy(legacy);
+    }
+    bool done() const {
+      bool ret = !legacy || cudaEventQuery(legacy) == cudaSuccess;
+      if(uses) {
+        for(auto& e : uses->events) {
+          if(ret && cudaEventQuery(e.second) != cudaSuccess) ret = false;
+        }
+      }
+      cudaGetLastError(); //clear cudaErrorNotReady
+      return ret;
+    }
+  };
+
+  struct PooledBlock {
+    void *ptr;
+    std::shared_ptr<FreeFence> fence; //null if the block may be reused at once
+  };
+
+  //unused blocks by size class, so blocks are reused across similar sizes
+  struct MemoryPool {
+    std::mutex mtx;
+    std::map<std::pair<int, size_t>, std::vector<PooledBlock> > free_blocks; //keyed by device and size
+  };
+
+  //pools are never destroyed so grids freed during exit can still return their memory
+  MemoryPool& host_pool() {
+    static MemoryPool *pool = new MemoryPool;
+    return *pool;
+  }
+
+  MemoryPool& gpu_pool() {
+    static MemoryPool *pool = new MemoryPool;
+    return *pool;
+  }
+
+  std::atomic<bool> memory_pooling(false);
+
+  //eight size classes per power of two, so at most an eighth of a block is unused
+  size_t pool_block_size(size_t bytes) {
+    const size_t minblock = 256;
+    if(bytes <= minblock) return minblock;
+    size_t high = minblock;
+    while(high <= bytes/2) high <<= 1;
+    size_t step = std::max(high/8, minblock);
+    return (bytes + step - 1) / step * step;
+  }
+
+  //take a block whose pending work is done
+  void *pool_take(MemoryPool& pool, int device, size_t bytes) {
+    std::lock_guard<std::mutex> lock(pool.mtx);
+    auto found = pool.free_blocks.find(std::make_pair(device, bytes));
+    if(found == pool.free_blocks.end()) return nullptr;
+    std::vector<PooledBlock>& blocks = found->second;
+    //check the oldest blocks first, the most recently freed are the least likely to be done
+    for(size_t i = 0, n = blocks.size(); i < n; i++) {
+      if(blocks[i].fence && !blocks[i].fence->done()) continue;
+      void *ptr = blocks[i].ptr;
+      blocks[i] = blocks.back();
+      blocks.pop_back();
+      return ptr;
+    }
+    return nullptr;
+  }
+
+  void pool_give(MemoryPool& pool, int device, size_t bytes, void *ptr, const std::shared_ptr<FreeFence>& fence) {
+    std::lock_guard<std::mutex> lock(pool.mtx);
+    pool.free_blocks[std::make_pair(device, bytes)].push_back(PooledBlock{ptr, fence});
+  }
+}
+
+void set_memory_pooling(bool pool) { memory_pooling = pool; }
+
+bool get_memory_pooling() { return memory_pooling; }
+
+void release_memory_pools() {
+  {
+    MemoryPool& pool = host_pool();
+    std::lock_guard<std::mutex> lock(pool.mtx);
+    //cudaFreeHost and cudaFree synchronize, so pending work is done before the memory goes
+    for(auto& blocks : pool.free_blocks) {
+      for(PooledBlock& block : blocks.second) cudaFreeHost(block.ptr);
+    }
+    pool.free_blocks.clear();
+  }
+  {
+    MemoryPool& pool = gpu_pool();
+    std::lock_guard<std::mutex> lock(pool.mtx);
+    for(auto& blocks : pool.free_blocks) {
+      DeviceGuard guard(blocks.first.first);
+      for(PooledBlock& block : blocks.second) cudaFree(block.ptr);
+    }
+    pool.free_blocks.clear();
+  }
+  cudaGetLastError();
+}
+
+void *pooled_host_alloc(size_t& bytes) {
+  bytes = pool_block_size(bytes);
+  void *ptr = pool_take(host_pool(), 0, bytes);
+  if(ptr) return ptr;
+  //portable so the memory is page-locked for every device
+  if(cudaHostAlloc(&ptr, bytes, cudaHostAllocPortable) != cudaSuccess) {
+    cudaGetLastError(); //no usable gpu, caller falls back to regular memory
+    return nullptr;
+  }
+  return ptr;
+}
+
+void *pooled_gpu_alloc(size_t& bytes, int& device) {
+  bytes = pool_block_size(bytes);
+  if(cudaGetDevice(&device) != cudaSuccess) {
+    cudaGetLastError();
+    return nullptr;
+  }
+  void *ptr = pool_take(gpu_pool(), device, bytes);
+  if(ptr) return ptr;
+  if(cudaMalloc(&ptr, bytes) != cudaSuccess) {
+    cudaGetLastError();
+    //out of memory may just be memory held by the pool
+    release_memory_pools();
+    if(cudaMalloc(&ptr, bytes) != cudaSuccess) {
+      cudaGetLastError();
+      return nullptr;
+    }
+  }
+  return ptr;
+}
+
+void pooled_free(void *host, size_t hostbytes, void *gpu, size_t gpubytes, int device, StreamUses *uses) {
+  std::shared_ptr<FreeFence> fence = std::make_shared<FreeFence>();
+  fence->uses.reset(uses);
+  {
+    DeviceGuard guard(device);
+    if(cudaEventCreateWithFlags(&fence->legacy, cudaEventDisableTiming) != cudaSuccess ||
+        cudaEventRecord(fence->legacy, cudaStreamLegacy) != cudaSuccess) {
+      //without the event the blocks are only safe to reuse once everything is done
+      cudaGetLastError();
+      cudaDeviceSynchronize();
+      cudaGetLastError();
+      fence.reset();
+    }
+  }
+  if(host) pool_give(host_pool(), 0, hostbytes, host, fence);
+  if(gpu) pool_give(gpu_pool(), device, gpubytes, gpu, fence);
+}
 
 #define INSTANTIATE_GRID_DEFINITIONS(SIZE) \
     template class Grid<float, SIZE, false>; \
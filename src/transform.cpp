@@ -12,6 +12,7 @@ namespace libmolgrid {
 
 Transform::Transform(float3 c, float random_translate /*= 0.0*/, bool random_rotate /*= false*/): center(c) {
       std::uniform_real_distribution<double> R(-1.0,1);
+      std::lock_guard<std::mutex> lock(random_engine_mutex);
       translate.x = R(random_engine)*random_translate;
       translate.y = R(random_engine)*random_translate;
       translate.z = R(random_engine)*random_translate;
@@ -32,22 +33,28 @@ Transform::Transform(float3 c, float random_translate /*= 0.0*/, bool random_rot
       } //else Quaternion constructor is identity
 }
 
-void Transform::forward(const Example& in, Example& out, bool dotranslate) const {
+void Transform::forward(const Example& in, Example& out, bool dotranslate, cudaStream_t stream) const {
   //transform each coordset
   if(in.sets.size() != out.sets.size()) {
     throw std::invalid_argument("Incompatible example sizes"); //todo, resize out
   }
   for(unsigned i = 0, n = in.sets.size(); i < n; i++) {
-    forward(in.sets[i],out.sets[i],dotranslate);
+    forward(in.sets[i],out.sets[i],dotranslate,stream);
   }
 }
 
-void Transform::forward(const CoordinateSet& in, CoordinateSet& out, bool dotranslate) const {
+void Transform::forward(const CoordinateSet& in, CoordinateSet& out, bool dotranslate, cudaStream_t stream) const {
   if(in.coords.dimension(0) != out.coords.dimension(0)) {
     throw std::invalid_argument("Incompatible coordinateset sizes"); //todo, resize out
   }
+  //copy on write, coordinates may be shared with duplicated or cached sets
+  if(out.coords.shared()) {
+    if(&in == &out) out.own_coords();
+    else out.coords = MGrid2f(in.coords.dimension(0), 3);
+  }
   if(in.coords.ongpu()) {
-    forward(in.coords.gpu(), out.coords.gpu(), dotranslate);
+    out.coords.togpu(stream, false); //no-op when transforming in place, otherwise out is overwritten
+    forward(in.coords.gpu(), out.coords.gpu(), dotranslate, stream);
   } else {
     forward(in.coords.cpu(), out.coords.cpu(), dotranslate);
   }
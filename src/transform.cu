@@ -64,36 +64,37 @@ __global__ void transform_rotate_kernel(unsigned n, Quaternion Q, float3 center,
 
 
 template <typename Dtype>
- __host__ void Transform::forward(const Grid<Dtype, 2, true>& in, Grid<Dtype, 2, true>& out, bool dotranslate) const {
+ __host__ void Transform::forward(const Grid<Dtype, 2, true>& in, Grid<Dtype, 2, true>& out, bool dotranslate, cudaStream_t stream) const {
   checkGrids(in,out);
 
   unsigned N = in.dimension(0);
   if(dotranslate)
-    transform_forward_kernel<float, true><<<LMG_GET_BLOCKS(N), LMG_GET_THREADS(N)>>>(N, Q, center, translate, in, out);
+    transform_forward_kernel<float, true><<<LMG_GET_BLOCKS(N), LMG_GET_THREADS(N), 0, stream>>>(N, Q, center, translate, in, out);
   else
-    transform_forward_kernel<float, false><<<LMG_GET_BLOCKS(N), LMG_GET_THREADS(N)>>>(N, Q, center, translate, in, out);
+    transform_forward_kernel<float, false><<<LMG_GET_BLOCKS(N), LMG_GET_THREADS(N), 0, stream>>>(N, Q, center, translate, in, out);
+  LMG_CUDA_CHECK(cudaPeekAtLastError());
 }
 
-template __host__ void Transform::forward(const Grid<float, 2, true>&, Grid<float, 2, true>&, bool) const;
+template __host__ void Transform::forward(const Grid<float, 2, true>&, Grid<float, 2, true>&, bool, cudaStream_t) const;
 
 template <typename Dtype>
- __host__  void Transform::backward(const Grid<Dtype, 2, true>& in, Grid<Dtype, 2, true>& out, bool dotranslate) const {
+ __host__  void Transform::backward(const Grid<Dtype, 2, true>& in, Grid<Dtype, 2, true>& out, bool dotranslate, cudaStream_t stream) const {
   checkGrids(in,out);
   unsigned N = in.dimension(0);
   Quaternion invQ = Q.inverse();
 
   if(dotranslate) {
     float3 untranslate = make_float3(-translate.x,-translate.y,-translate.z);
-    transform_translate_kernel<Dtype><<<LMG_GET_BLOCKS(N), LMG_GET_THREADS(N)>>>(N, untranslate, in, out);
-    transform_rotate_kernel<Dtype><<<LMG_GET_BLOCKS(N), LMG_GET_THREADS(N)>>>(N,invQ,center,out,out);
+    transform_translate_kernel<Dtype><<<LMG_GET_BLOCKS(N), LMG_GET_THREADS(N), 0, stream>>>(N, untranslate, in, out);
+    transform_rotate_kernel<Dtype><<<LMG_GET_BLOCKS(N), LMG_GET_THREADS(N), 0, stream>>>(N,invQ,center,out,out);
   } else {
-    transform_rotate_kernel<Dtype><<<LMG_GET_BLOCKS(N), LMG_GET_THREADS(N)>>>(N,invQ,center,in,out);
+    transform_rotate_kernel<Dtype><<<LMG_GET_BLOCKS(N), LMG_GET_THREADS(N), 0, stream>>>(N,invQ,center,in,out);
   }
   LMG_CUDA_CHECK(cudaPeekAtLastError());
 }
 
-template __host__ void Transform::backward(const Grid<float, 2, true>&, Grid<float, 2, true>&, bool) const;
-template __host__ void Transform::backward(const Grid<double, 2, true>&, Grid<double, 2, true>&, bool) const;
+template __host__ void Transform::backward(const Grid<float, 2, true>&, Grid<float, 2, true>&, bool, cudaStream_t) const;
+template __host__ void Transform::backward(const Grid<double, 2, true>&, Grid<double, 2, true>&, bool, cudaStream_t) const;
 
 
 }
@@ -0,0 +1,63 @@
+#define BOOST_TEST_MODULE example_test
+#include <boost/test/unit_test.hpp>
+#include "libmolgrid/example.h"
+#include "libmolgrid/exampleref_providers.h"
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace libmolgrid;
+using namespace std;
+
+BOOST_AUTO_TEST_CASE(string_cache_identity) {
+  const char *a = string_cache.get("rec.gninatypes");
+  string longname(100000, 'x'); //larger than an arena block
+  const char *b = string_cache.get(longname);
+  BOOST_CHECK_EQUAL(a, string_cache.get(string("rec.") + "gninatypes"));
+  BOOST_CHECK_EQUAL(b, string_cache.get(longname));
+  BOOST_CHECK_EQUAL(string(a), "rec.gninatypes");
+  BOOST_CHECK_EQUAL(string(b), longname);
+  //strings added after a long one get a new block and do not move it
+  vector<const char*> many;
+  for(unsigned i = 0; i < 10000; i++) many.push_back(string_cache.get("lig"+to_string(i)));
+  for(unsigned i = 0; i < 10000; i++) BOOST_CHECK_EQUAL(string(many[i]), "lig"+to_string(i));
+  BOOST_CHECK_EQUAL(string(b), longname);
+}
+
+BOOST_AUTO_TEST_CASE(ref_store) {
+  stringstream lines;
+  lines << "1 3.5 rec.pdb lig.sdf\n";
+  lines << "0 -2 rec2.pdb lig2.sdf lig3.sdf\n";
+  lines << "\n";
+  lines << "1 0.5 rec.pdb lig4.sdf\n";
+  ExampleRefStore refs = parse_example_refs(lines, -1, false, 1);
+  BOOST_CHECK_EQUAL(refs.size(), 3);
+
+  ExampleRef ref;
+  refs.get(1, ref);
+  BOOST_CHECK_EQUAL(ref.labels.size(), 2);
+  BOOST_CHECK_EQUAL(ref.labels[1], -2.0f);
+  BOOST_CHECK_EQUAL(ref.files.size(), 3);
+  BOOST_CHECK_EQUAL(ref.files[2], string_cache.get("lig3.sdf"));
+  refs.get(2, ref); //reuses the storage of ref
+  BOOST_CHECK_EQUAL(ref.files.size(), 2);
+  BOOST_CHECK_EQUAL(ref.files[0], refs[0].files[0]);
+  BOOST_CHECK_EQUAL(ref.labels[1], 0.5f);
+
+  //copies within and between stores keep every field
+  ExampleRefStore copy;
+  copy.push_back(refs, 2);
+  copy.append(refs);
+  BOOST_CHECK_EQUAL(copy.size(), 4);
+  for(unsigned i = 0; i < 4; i++) {
+    ExampleRef expected = refs[i == 0 ? 2 : i - 1];
+    ExampleRef actual = copy[i];
+    BOOST_CHECK(expected.files == actual.files);
+    BOOST_CHECK(expected.labels == actual.labels);
+    BOOST_CHECK_EQUAL(expected.group, actual.group);
+  }
+
+  shard_example_refs(copy, 1, 3, false);
+  BOOST_CHECK_EQUAL(copy.size(), 2);
+  BOOST_CHECK(copy[0].files == refs[0].files);
+}
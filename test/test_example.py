@@ -58,4 +58,46 @@ def test_examplevec():
     ex2.coord_sets.append(c2)
     ex2.labels.append(1)
     
-    evec = molgrid.ExampleVec([ex,ex2])    
\ No newline at end of file
+    evec = molgrid.ExampleVec([ex,ex2])    
+
+def test_merge_into():
+    m = pybel.readstring('smi','c1ccccc1CO')
+    m.addh()
+    m.make3D()
+
+    c = molgrid.CoordinateSet(m,molgrid.ElementIndexTyper())
+    c2 = molgrid.CoordinateSet(m)
+    ex = molgrid.Example()
+    ex.coord_sets.append(c)
+    ex.coord_sets.append(c2)
+    expected = ex.merge_coordinates()
+
+    #the same set is refilled, on either device
+    out = molgrid.CoordinateSet()
+    for gpu in [False, True, False]:
+        ex.merge_coordinates(out, gpu=gpu)
+        assert out.max_type == expected.max_type
+        np.testing.assert_allclose(out.coords.tonumpy(), expected.coords.tonumpy())
+        assert np.array_equal(out.type_index.tonumpy(), expected.type_index.tonumpy())
+        np.testing.assert_allclose(out.radii.tonumpy(), expected.radii.tonumpy())
+
+    #a smaller merge reuses the memory
+    ex.merge_coordinates(out, 1)
+    assert out.coords.tonumpy().shape == (c2.size(),3)
+    assert np.array_equal(out.type_index.tonumpy(), c2.type_index.tonumpy())
+
+    #vector types
+    v = molgrid.CoordinateSet(m,molgrid.ElementIndexTyper())
+    v.make_vector_types()
+    v2 = molgrid.CoordinateSet(m)
+    v2.make_vector_types()
+    vex = molgrid.Example()
+    vex.coord_sets.append(v)
+    vex.coord_sets.append(v2)
+    vexpected = vex.merge_coordinates()
+    for gpu in [False, True]:
+        vex.merge_coordinates(out, gpu=gpu)
+        assert out.has_vector_types()
+        assert out.max_type == vexpected.max_type
+        np.testing.assert_allclose(out.type_vector.tonumpy(), vexpected.type_vector.tonumpy())
+        np.testing.assert_allclose(out.coords.tonumpy(), vexpected.coords.tonumpy())
@@ -1,6 +1,7 @@
 import pytest
 import molgrid
 import numpy as np
+import struct
 import os
 import torch
 
@@ -92,6 +93,31 @@ def test_gnina_example_provider():
     assert list(clig.type_index) == [8.0, 1.0, 1.0, 9.0, 10.0, 0.0, 0.0, 1.0, 9.0, 8.0]
 
 
+def test_write_molcache(tmpdir):
+    fname = datadir+"/small.types"
+    settings = molgrid.ExampleProviderSettings()
+    settings.data_root = datadir+"/structs"
+    rec = str(tmpdir.join('rec.molcache2'))
+    lig = str(tmpdir.join('lig.molcache2'))
+    lines = [line.split() for line in open(fname) if line.strip()]
+    assert molgrid.write_molcache(rec, fname, settings, column=0, num_threads=4) == len(set(l[3] for l in lines))
+    assert molgrid.write_molcache(lig, fname, settings, column=1, num_threads=4) == len(set(l[4] for l in lines))
+
+    #the built caches must provide the same atoms as the files they were built from
+    files = molgrid.ExampleProvider(data_root=datadir+"/structs")
+    files.populate(fname)
+    cached = molgrid.ExampleProvider(recmolcache=rec, ligmolcache=lig)
+    cached.populate(fname)
+    for i in range(len(lines)):
+        ex = files.next()
+        cex = cached.next()
+        for c, cc in zip(ex.coord_sets, cex.coord_sets):
+            assert c.src == cc.src
+            np.testing.assert_array_equal(c.coords.tonumpy(), cc.coords.tonumpy())
+            np.testing.assert_array_equal(c.type_index.tonumpy(), cc.type_index.tonumpy())
+            np.testing.assert_array_equal(c.radii.tonumpy(), cc.radii.tonumpy())
+
+
 def test_cached_example_provider():
     fname = datadir+"/small.types"
     e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
@@ -283,4 +309,504 @@ def test_copied_examples():
     
     np.testing.assert_allclose(orig,new0)
     sqsum = np.square(new1-orig).sum()
-    assert sqsum > 0
\ No newline at end of file
+    assert sqsum > 0
+
+def test_shared_coordinates(tmp_path):
+    #duplicated receptors share memory until transformed, repeated reads of a file are copies
+    rec, lig = open(datadir+"/smallmol.types").readline().split()[2:4]
+    fname = str(tmp_path / "poses.types")
+    with open(fname,'w') as f:
+        f.write('1 3.3747 %s %s %s\n' % (rec, lig, lig))
+    e = molgrid.ExampleProvider(data_root=datadir+"/structs", duplicate_first=True)
+    e.populate(fname)
+    ex = e.next()
+    assert ex.coord_sets[0].size() == ex.coord_sets[2].size()
+    orig = ex.coord_sets[0].coords.tonumpy()
+
+    t = molgrid.Transform(ex.coord_sets[2].center(), 2, random_rotation=True)
+    t.forward(ex.coord_sets[2], ex.coord_sets[2])
+    np.testing.assert_allclose(orig, ex.coord_sets[0].coords.tonumpy())
+    assert np.square(ex.coord_sets[2].coords.tonumpy() - orig).sum() > 0
+
+    #the stored receptor is unchanged
+    ex2 = e.next()
+    t.forward(ex2.coord_sets[0], ex2.coord_sets[0])
+    np.testing.assert_allclose(orig, ex.coord_sets[0].coords.tonumpy())
+    np.testing.assert_allclose(orig, e.next().coord_sets[0].coords.tonumpy())
+
+    #so are other copies when coordinates are transformed through their grid
+    ex3 = e.next()
+    coords = ex3.coord_sets[0].coords
+    t.forward(coords.cpu(), coords.cpu())
+    assert np.square(ex3.coord_sets[0].coords.tonumpy() - orig).sum() > 0
+    np.testing.assert_allclose(orig, e.next().coord_sets[0].coords.tonumpy())
+
+def test_prefetch_example_provider():
+    fname = datadir+"/small.types"
+    batch_size = 16
+    molgrid.set_random_seed(0)
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2',shuffle=True)
+    e.populate(fname)
+    expected = [e.next_batch(batch_size) for i in range(5)]
+
+    #prefetching must produce the same examples in the same order
+    molgrid.set_random_seed(0)
+    p = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2',shuffle=True,
+                                num_prefetch_threads=4,prefetch_depth=3)
+    assert p.settings().num_prefetch_threads == 4
+    p.populate(fname)
+    for batch in expected:
+        pbatch = p.next_batch(batch_size)
+        assert len(pbatch) == batch_size
+        for ex,pex in zip(batch,pbatch):
+            assert list(ex.labels) == approx(list(pex.labels))
+            for c,pc in zip(ex.coord_sets,pex.coord_sets):
+                assert c.src == pc.src
+                np.testing.assert_allclose(c.coords.tonumpy(), pc.coords.tonumpy())
+                np.testing.assert_allclose(c.type_index.tonumpy(), pc.type_index.tonumpy())
+
+def test_block_shuffle():
+    fname = datadir+"/small.types"
+    ligs = [line.split()[4] for line in open(fname) if line.strip()]
+    index = {name: i for i, name in enumerate(ligs)}
+    block, window = 10, 4
+    molgrid.set_random_seed(0)
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2',shuffle=True,
+                                shuffle_block_size=block,shuffle_window=window,molcache_readahead=1<<16)
+    e.populate(fname)
+
+    for epoch in range(2):
+        order = [index[ex.coord_sets[1].src] for ex in e.next_batch(len(ligs))]
+        #every example once per epoch, not in file order
+        assert sorted(order) == list(range(len(ligs)))
+        assert order != list(range(len(ligs)))
+        #each window of examples is drawn from window blocks
+        for start in range(0, len(order), block*window):
+            assert len(set(i // block for i in order[start:start+block*window])) == window
+
+def test_sharded_example_provider():
+    fname = datadir+"/small.types"
+    ligs = [line.split()[4] for line in open(fname) if line.strip()]
+    world = 3
+    shards = []
+    for rank in range(world):
+        e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2',
+                                    rank=rank,world_size=world,shuffle=True)
+        e.populate(fname)
+        #every rank has the same number of examples so epochs end together
+        assert e.size() == (len(ligs) + world - 1) // world
+        shards.append([ex.coord_sets[1].src for ex in e.next_batch(e.size())])
+    #padding repeats a shard's own examples, never those of another rank
+    assert set(shards[0]).isdisjoint(shards[1]) and set(shards[1]).isdisjoint(shards[2])
+    assert set(shards[0]).isdisjoint(shards[2])
+    assert set(shards[0]) | set(shards[1]) | set(shards[2]) == set(ligs)
+
+    #groups are never split across ranks
+    groups = set()
+    for rank in range(world):
+        e = molgrid.ExampleProvider(data_root=datadir+"/structs",max_group_size=5,group_batch_size=1,rank=rank,world_size=world)
+        e.populate(datadir+"/grouped.types")
+        mine = set(e.next_batch(1)[0].group for _ in range(e.size()*5))
+        assert mine.isdisjoint(groups)
+        groups |= mine
+    assert groups == set(int(line.split()[0]) for line in open(datadir+"/grouped.types") if line.strip())
+
+    #shards with fewer groups are padded with a copy of their first group under a new group id
+    order = [] #groups in order of first appearance
+    for line in open(datadir+"/grouped.types"):
+        if line.strip() and int(line.split()[0]) not in order:
+            order.append(int(line.split()[0]))
+    world = 4
+    for rank in range(world):
+        e = molgrid.ExampleProvider(data_root=datadir+"/structs",max_group_size=5,group_batch_size=1,rank=rank,world_size=world)
+        e.populate(datadir+"/grouped.types")
+        assert e.size() == 2
+        got = {}
+        for _ in range(e.size()*5):
+            ex = e.next_batch(1)[0]
+            if ex.coord_sets[1].src:
+                got.setdefault(ex.group, set()).add(ex.coord_sets[1].src)
+        own = sorted(g for g in got if g in order)
+        assert own == sorted(order[rank::world])
+        if len(own) == 1:
+            pad = [g for g in got if g not in order]
+            assert pad == [max(order)+1]
+            assert got[pad[0]] == got[own[0]]
+
+    with pytest.raises(ValueError):
+        e = molgrid.ExampleProvider(data_root=datadir+"/structs",max_group_size=5,group_batch_size=1,rank=0,world_size=7)
+        e.populate(datadir+"/grouped.types")
+    with pytest.raises(ValueError):
+        molgrid.ExampleProvider(rank=3,world_size=3)
+
+def test_provider_state():
+    def refs(batch):
+        #padded frames of groups have nan labels
+        return [(tuple(c.src for c in ex.coord_sets), tuple(None if l != l else l for l in ex.labels), ex.group) for ex in batch]
+
+    caches = dict(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    configs = [(datadir+"/small.types", dict(caches, shuffle=True), 10),
+               (datadir+"/small.types", dict(caches, shuffle=True, num_copies=2, shuffle_block_size=8), 10),
+               (datadir+"/small.types", dict(caches, shuffle=True, balanced=True, stratify_receptor=True), 10),
+               (datadir+"/small.types", dict(caches, shuffle=True, stratify_min=0, stratify_max=10, stratify_step=2, stratify_pos=1, balanced=True), 10),
+               (datadir+"/small.types", dict(caches, shuffle=True, num_prefetch_threads=2), 10),
+               (datadir+"/grouped.types", dict(data_root=datadir+"/structs", max_group_size=5, group_batch_size=3, shuffle=True), 3)]
+    for fname, settings, batch_size in configs:
+        molgrid.set_random_seed(1)
+        e = molgrid.ExampleProvider(**settings)
+        e.populate(fname)
+        for _ in range(7): #past the end of the first epoch of some of the providers
+            e.next_batch(batch_size)
+        state = e.save_state()
+        expected = [refs(e.next_batch(batch_size)) for _ in range(150)]
+
+        molgrid.set_random_seed(2)
+        restored = molgrid.ExampleProvider(**settings)
+        restored.populate(fname)
+        restored.load_state(state)
+        assert [refs(restored.next_batch(batch_size)) for _ in range(150)] == expected
+
+    #the state is of the populated examples
+    e = molgrid.ExampleProvider(**caches)
+    e.populate(datadir+"/small.types")
+    other = molgrid.ExampleProvider(**caches)
+    other.populate(datadir+"/grouped.types")
+    with pytest.raises(ValueError):
+        other.load_state(e.save_state())
+    with pytest.raises(ValueError):
+        other.load_state(b'not a state')
+
+    #positions are checked, here that of a balanced provider, a uint64 that
+    #follows the header of an 8 byte magic and a uint32 version
+    b = molgrid.ExampleProvider(balanced=True, **caches)
+    b.populate(datadir+"/small.types")
+    state = bytearray(b.save_state())
+    position_offset = struct.calcsize('=8sI')
+    magic, version, position = struct.unpack_from('=8sIQ', state)
+    assert magic == b'LMGSTATE' and position in (0, 1)
+    struct.pack_into('=Q', state, position_offset, 5)
+    with pytest.raises(ValueError):
+        b.load_state(bytes(state))
+
+def test_molcache_prefetch():
+    fname = datadir+"/small.types"
+    caches = dict(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    e = molgrid.ExampleProvider(**caches)
+    e.populate(fname)
+    expected = e.next_batch(20)
+    for policy in ['none', 'background', 'referenced']:
+        p = molgrid.ExampleProvider(molcache_prefetch=policy, molcache_huge_pages=True, **caches)
+        p.populate(fname)
+        for ex, pex in zip(expected, p.next_batch(20)):
+            for c, pc in zip(ex.coord_sets, pex.coord_sets):
+                assert c.src == pc.src
+                np.testing.assert_array_equal(c.coords.tonumpy(), pc.coords.tonumpy())
+
+    with pytest.raises(ValueError):
+        molgrid.ExampleProvider(molcache_prefetch='sometimes', **caches)
+
+def test_batch_coordinates():
+    fname = datadir+"/small.types"
+    batch_size, N = 8, 2000
+    e = molgrid.ExampleProvider(data_root=datadir+"/structs")
+    e.populate(fname)
+    batch = e.next_batch(batch_size)
+    p = molgrid.ExampleProvider(data_root=datadir+"/structs")
+    p.populate(fname)
+
+    coords = torch.ones(batch_size, N, 3)
+    types = torch.ones(batch_size, N)
+    radii = torch.ones(batch_size, N)
+    counts = torch.zeros(batch_size)
+    labels = torch.zeros(batch_size, 3)
+    p.next_batch_coordinates(coords, types, radii, counts, labels)
+    for i, ex in enumerate(batch):
+        c = ex.merge_coordinates()
+        n = c.size()
+        assert counts[i] == n
+        np.testing.assert_allclose(coords[i,:n].numpy(), c.coords.tonumpy())
+        np.testing.assert_allclose(types[i,:n].numpy(), c.type_index.tonumpy())
+        np.testing.assert_allclose(radii[i,:n].numpy(), c.radii.tonumpy())
+        assert list(labels[i]) == approx(list(ex.labels))
+        #padding is ignored by gridding
+        assert (coords[i,n:] == 0).all() and (types[i,n:] == -1).all() and (radii[i,n:] == 0).all()
+
+    #vector types on the gpu
+    v = molgrid.ExampleProvider(data_root=datadir+"/structs", make_vector_types=True)
+    v.populate(fname)
+    vbatch = v.next_batch(batch_size)
+    ntypes = vbatch[0].num_types()
+    coords = torch.ones(batch_size, N, 3, device='cuda')
+    vtypes = torch.ones(batch_size, N, ntypes, device='cuda')
+    radii = torch.ones(batch_size, N, device='cuda')
+    counts = torch.zeros(batch_size, device='cuda')
+    vbatch.extract_coordinates(coords, vtypes, radii, counts)
+    for i, ex in enumerate(vbatch):
+        c = ex.merge_coordinates()
+        n = c.size()
+        assert counts[i] == n
+        np.testing.assert_allclose(coords[i,:n].cpu().numpy(), c.coords.tonumpy())
+        np.testing.assert_allclose(vtypes[i,:n].cpu().numpy(), c.type_vector.tonumpy())
+        assert (vtypes[i,n:] == 0).all()
+
+    #copies queued on a stream, twice so the second batch waits for the staging of the first
+    stream = torch.cuda.Stream()
+    scoords = torch.ones(batch_size, N, 3, device='cuda')
+    torch.cuda.synchronize()
+    for i in range(2):
+        vbatch.extract_coordinates(scoords, vtypes, radii, counts, stream=stream.cuda_stream)
+    stream.synchronize()
+    assert torch.equal(scoords, coords)
+
+    #too many atoms for the padding
+    with pytest.raises(IndexError):
+        p.next_batch_coordinates(torch.zeros(2, 1, 3), torch.zeros(2, 1), torch.zeros(2, 1), torch.zeros(2))
+
+def test_molcache_subset_typing():
+    #molcache types are remapped per typer, atoms the typer drops must be removed
+    fname = datadir+"/small.types"
+    full = molgrid.GninaIndexTyper()
+    heavy = molgrid.SubsettedGninaTyper(list(range(2,28)), catchall=False)
+    e = molgrid.ExampleProvider(full,full,ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    e.populate(fname)
+    h = molgrid.ExampleProvider(heavy,heavy,ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    h.populate(fname)
+
+    for _ in range(3):
+        for ex, hex in zip(e.next_batch(10), h.next_batch(10)):
+            for c, hc in zip(ex.coord_sets, hex.coord_sets):
+                types = np.array(c.type_index.tonumpy())
+                keep = types >= 2
+                assert hc.size() == keep.sum()
+                assert hc.num_types() == 26
+                np.testing.assert_array_equal(hc.coords.tonumpy(), c.coords.tonumpy()[keep])
+                np.testing.assert_array_equal(hc.type_index.tonumpy(), types[keep]-2)
+
+def test_shared_atom_store(capsys):
+    fname = datadir+"/smallmol.types"
+    #providers with different typers share parsed atoms, but must type them as if read separately
+    gnina = molgrid.ExampleProvider(data_root=datadir+"/structs")
+    element = molgrid.ExampleProvider(molgrid.ElementIndexTyper(80), data_root=datadir+"/structs")
+    vector = molgrid.ExampleProvider(data_root=datadir+"/structs", make_vector_types=True)
+    uncached = molgrid.ExampleProvider(molgrid.ElementIndexTyper(80), data_root=datadir+"/structs", cache_structs=False)
+    for e in (gnina, element, vector, uncached):
+        e.populate(fname)
+
+    with capsys.disabled():
+        for i in range(3):
+            g = gnina.next()
+            el = element.next()
+            v = vector.next()
+            u = uncached.next()
+            for s in range(2):
+                np.testing.assert_array_equal(el.coord_sets[s].coords.tonumpy(), u.coord_sets[s].coords.tonumpy())
+                np.testing.assert_array_equal(el.coord_sets[s].type_index.tonumpy(), u.coord_sets[s].type_index.tonumpy())
+                np.testing.assert_array_equal(el.coord_sets[s].radii.tonumpy(), u.coord_sets[s].radii.tonumpy())
+                assert el.coord_sets[s].max_type == 80
+                assert g.coord_sets[s].max_type != 80
+                np.testing.assert_array_equal(g.coord_sets[s].coords.tonumpy(), v.coord_sets[s].coords.tonumpy())
+                assert v.coord_sets[s].has_vector_types()
+                np.testing.assert_array_equal(np.argmax(v.coord_sets[s].type_vector.tonumpy(),axis=1), g.coord_sets[s].type_index.tonumpy())
+
+def test_atom_store_parses_once():
+    fname = datadir+"/smallmol.types"
+    #a budget no other test uses, so the store starts empty
+    settings = dict(data_root=datadir+"/structs", cache_bytes=(1<<40)+1)
+    gnina = molgrid.ExampleProvider(**settings)
+    element = molgrid.ExampleProvider(molgrid.ElementIndexTyper(80), **settings)
+    for e in (gnina, element):
+        e.populate(fname)
+
+    molgrid.reset_instrumentation()
+    molgrid.set_instrumentation(True)
+    try:
+        for i in range(gnina.size()):
+            g = gnina.next()
+            el = element.next()
+        stats = molgrid.get_instrumentation_stats()
+    finally:
+        molgrid.set_instrumentation(False)
+    molgrid.reset_instrumentation()
+
+    #only the files of the first example are parsed again for the second typer
+    assert stats['parse_openbabel']['count'] == 2*gnina.size() + 2
+    assert element.get_cache_stats().misses == 2*gnina.size() + 2
+    assert el.coord_sets[0].max_type == 80 and g.coord_sets[0].max_type != 80
+
+def test_cache_budget(capsys):
+    fname = datadir+"/smallmol.types"
+    unlimited = molgrid.ExampleProvider(data_root=datadir+"/structs", cache_bytes=1<<40)
+    unlimited.populate(fname)
+    with capsys.disabled():
+        for i in range(2*unlimited.size()):
+            unlimited.next()
+    stats = unlimited.get_cache_stats()
+    assert stats.evictions == 0
+    assert stats.misses == stats.entries
+    assert stats.hits == 2*2*unlimited.size() - stats.misses
+    assert stats.bytes > 0
+
+    #a budget smaller than the unlimited footprint must evict, but give the same examples
+    budget = stats.bytes // 2
+    bounded = molgrid.ExampleProvider(data_root=datadir+"/structs", cache_bytes=budget)
+    bounded.populate(fname)
+    reference = molgrid.ExampleProvider(data_root=datadir+"/structs", cache_structs=False)
+    reference.populate(fname)
+    with capsys.disabled():
+        for i in range(2*bounded.size()):
+            b = bounded.next()
+            r = reference.next()
+            for s in range(2):
+                np.testing.assert_array_equal(b.coord_sets[s].coords.tonumpy(), r.coord_sets[s].coords.tonumpy())
+                np.testing.assert_array_equal(b.coord_sets[s].type_index.tonumpy(), r.coord_sets[s].type_index.tonumpy())
+    stats = bounded.get_cache_stats()
+    assert stats.evictions > 0
+    assert stats.bytes <= budget or stats.entries == 1
+    assert reference.get_cache_stats().entries == 0
+
+def test_parallel_and_indexed_populate(tmp_path):
+    lines = open(datadir+"/small.types").readlines()
+    fname = str(tmp_path / "big.types")
+    with open(fname,'w') as f:
+        for i in range(20): #big enough to be split between threads
+            f.writelines(lines)
+            f.write('\n') #blank lines are ignored
+
+    def labels(**kwargs):
+        e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2', **kwargs)
+        e.populate(fname)
+        assert e.size() == 20*len(lines)
+        return [tuple(e.next().labels) for i in range(len(lines)+5)]
+
+    serial = labels(num_parse_threads=1)
+    assert labels(num_parse_threads=7) == serial
+    assert not os.path.exists(fname+'.refidx')
+    assert labels(index_example_files=True) == serial #writes index
+    assert os.path.exists(fname+'.refidx')
+    assert labels(index_example_files=True) == serial #reads index
+
+    #a corrupt index is ignored and rewritten
+    with open(fname+'.refidx','r+b') as f:
+        f.truncate(100)
+    assert labels(index_example_files=True) == serial
+    assert os.path.getsize(fname+'.refidx') > 100
+
+    #an edit that keeps the size and modification time is still detected
+    st = os.stat(fname)
+    with open(fname,'r+b') as f:
+        first = f.read(1)
+        f.seek(0)
+        f.write(b'0' if first == b'1' else b'1')
+    os.utime(fname, ns=(st.st_atime_ns, st.st_mtime_ns))
+    edited = labels(index_example_files=True)
+    assert edited[0][0] != serial[0][0] and edited[1:] == serial[1:]
+
+def test_instrumentation():
+    molgrid.reset_instrumentation()
+    assert not molgrid.get_instrumentation()
+    e = molgrid.ExampleProvider(data_root=datadir+"/structs", cache_structs=False)
+    e.populate(datadir+"/small.types")
+    e.next_batch(4)
+    assert molgrid.get_instrumentation_stats()['nextref']['count'] == 0 #off by default
+
+    molgrid.set_instrumentation(True)
+    try:
+        batch = e.next_batch(4)
+        gmaker = molgrid.GridMaker()
+        dims = gmaker.grid_dimensions(e.num_types())
+        cpu = molgrid.MGrid5f(4, *dims)
+        gmaker.forward(batch, cpu.cpu())
+        gpu = molgrid.MGrid5f(4, *dims)
+        gmaker.forward(batch, gpu.gpu())
+        torch.cuda.synchronize()
+        gpu.tonumpy()
+        stats = molgrid.get_instrumentation_stats()
+    finally:
+        molgrid.set_instrumentation(False)
+
+    assert stats['nextref']['count'] == 4
+    assert stats['set_coords']['count'] == 8
+    assert stats['read_gninatypes']['count'] == 8
+    assert stats['set_coords']['seconds'] >= stats['read_gninatypes']['seconds'] > 0
+    assert stats['forward_cpu']['count'] == 4
+    assert stats['forward_gpu']['count'] == 1 and stats['forward_gpu']['seconds'] > 0
+    assert stats['host_to_device']['bytes'] > 0
+    assert stats['device_to_host']['bytes'] >= cpu.size()*4
+
+    molgrid.reset_instrumentation()
+    assert molgrid.get_instrumentation_stats()['nextref']['count'] == 0
+
+def test_concurrent_next_batch():
+    import threading
+    fname = datadir+"/small.types"
+    batch_size = 10
+    nbatches = 12
+
+    def batches(**kwargs):
+        e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2',
+                                    shuffle=True,**kwargs)
+        e.populate(fname)
+        return e
+
+    def key(batch):
+        return tuple((ex.coord_sets[0].src, ex.coord_sets[1].src, tuple(ex.labels)) for ex in batch)
+
+    molgrid.set_random_seed(0)
+    e = batches()
+    expected = [key(e.next_batch(batch_size)) for i in range(nbatches)]
+
+    #threads receive the same batches as sequential calls, in some order, and gridding overlaps
+    for kwargs in [{}, dict(num_prefetch_threads=2)]:
+        molgrid.set_random_seed(0)
+        e = batches(**kwargs)
+        gmaker = molgrid.GridMaker()
+        results = []
+        lock = threading.Lock()
+        def worker():
+            grid = molgrid.MGrid4f(*gmaker.grid_dimensions(e.num_types()))
+            for i in range(nbatches // 4):
+                b = e.next_batch(batch_size)
+                gmaker.forward(b[0], grid.cpu())
+                with lock:
+                    results.append(key(b))
+        threads = [threading.Thread(target=worker) for i in range(4)]
+        for t in threads: t.start()
+        for t in threads: t.join()
+        assert sorted(results) == sorted(expected)
+
+def test_grid_pipeline():
+    '''pipelined batches match gridding the provider's batches directly'''
+    fname = datadir+"/small.types"
+    batch_size = 10
+    gmaker = molgrid.GridMaker()
+    random = molgrid.RandomTransforms(3, 2.0, True)
+    expected = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    expected.populate(fname)
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2',num_prefetch_threads=2)
+    e.populate(fname)
+    pipeline = molgrid.GridPipeline(e, gmaker, batch_size, random, depth=3)
+    assert pipeline.get_depth() == 3
+    dims = gmaker.grid_dimensions(e.num_types())
+
+    grid = molgrid.MGrid5f(batch_size, *dims)
+    labels = molgrid.MGrid2f(batch_size, e.num_labels())
+    copied = torch.zeros((batch_size,)+dims, dtype=torch.float32, device='cuda')
+    copiedlabels = torch.zeros((batch_size, e.num_labels()), dtype=torch.float32, device='cuda')
+    for i in range(4):
+        batch = expected.next_batch(batch_size)
+        gmaker.forward(batch, grid.gpu(), random, i*batch_size)
+        batch.extract_labels(labels.cpu())
+        if i % 2:
+            pipeline.next(copied, copiedlabels)
+            g, l = copied.cpu().numpy(), copiedlabels.cpu().numpy()
+        else:
+            g, l = pipeline.next()
+            g, l = g.tonumpy(), l.tonumpy()
+        np.testing.assert_allclose(g, grid.tonumpy(), atol=1e-5)
+        np.testing.assert_array_equal(l, labels.tonumpy())
+
+    stats = pipeline.get_stats()
+    assert stats.batches == 4
+    assert stats.extract_seconds > 0
+    pipeline.reset_stats()
+    assert pipeline.get_stats().batches == 0
@@ -2,6 +2,7 @@ import pytest
 import molgrid
 import numpy as np
 import os
+import struct
 import torch
 
                  
@@ -47,3 +48,80 @@ def test_dx():
     np.testing.assert_array_almost_equal(mgridout.tonumpy(), 2.0*checkgrid.tonumpy(),decimal=5)
     
     
+
+def test_grid_file(tmpdir):
+    fname = datadir+"/small.types"
+    e = molgrid.ExampleProvider(data_root=datadir+"/structs")
+    e.populate(fname)
+    ex = e.next()
+    c = ex.coord_sets[1]
+
+    gmaker = molgrid.GridMaker()
+    dims = gmaker.grid_dimensions(e.num_types())
+    center = tuple(c.center())
+    mgrid = molgrid.MGrid4f(*dims)
+    gmaker.forward(center, c, mgrid.cpu())
+    names = list(e.get_type_names())
+    expected = mgrid.tonumpy()
+
+    for encoding in [molgrid.GridEncoding.raw, molgrid.GridEncoding.deflate]:
+        gname = str(tmpdir.join('grid%d.lmg' % int(encoding)))
+        molgrid.write_grid_file(gname, mgrid.cpu(), center, 0.5, names, encoding)
+        gf = molgrid.GridFile(gname)
+        assert gf.num_channels() == dims[0]
+        assert gf.dimensions() == tuple(dims[1:])
+        assert center == approx(list(gf.center()))
+        assert gf.resolution() == 0.5
+        assert gf.channel_names() == names
+        np.testing.assert_array_equal(gf.read().tonumpy(), expected)
+
+        #a ligand leaves most channels empty
+        encodings = [gf.encoding(i) for i in range(gf.num_channels())]
+        assert molgrid.GridEncoding.sparse in encodings
+        for i, enc in enumerate(encodings):
+            if enc == molgrid.GridEncoding.raw:
+                np.testing.assert_array_equal(gf.channel(i).tonumpy(), expected[i])
+
+    #without sparse channels raw grids can be viewed whole
+    gname = str(tmpdir.join('dense.lmg'))
+    molgrid.write_grid_file(gname, mgrid.cpu(), center, 0.5, sparse=False)
+    gf = molgrid.GridFile(gname)
+    assert gf.channel_names() == ['']*dims[0]
+    np.testing.assert_array_equal(gf.view().tonumpy(), expected)
+    out = molgrid.MGrid4f(*dims)
+    gf.read(out.cpu())
+    np.testing.assert_array_equal(out.tonumpy(), expected)
+
+def test_grid_file_raw_roundtrip(tmpdir):
+    '''raw channels are read back from exactly where they were written'''
+    nchannels, dim = 3, 5
+    values = np.arange(nchannels*dim**3, dtype=np.float32).reshape(nchannels, dim, dim, dim) + 1
+    grid = molgrid.Grid4f(values)
+    #channel names change the size of the channel table
+    for names in [[], ['a', 'bb', 'ccc']]:
+        gname = str(tmpdir.join('raw%d.lmg' % len(names)))
+        molgrid.write_grid_file(gname, grid, (1, 2, 3), 0.25, names, molgrid.GridEncoding.raw, False)
+        gf = molgrid.GridFile(gname)
+        for c in range(nchannels):
+            assert gf.encoding(c) == molgrid.GridEncoding.raw
+            np.testing.assert_array_equal(gf.channel(c).tonumpy(), values[c])
+        np.testing.assert_array_equal(gf.view().tonumpy(), values)
+        #the raw channels are the last bytes of the file
+        raw = np.fromfile(gname, dtype=np.uint8)[-values.nbytes:].view(np.float32)
+        np.testing.assert_array_equal(raw, values.flatten())
+
+def test_grid_file_invalid_dims(tmpdir):
+    '''dimensions whose product wraps around, or outgrows the stored data, are rejected'''
+    values = np.ones((2, 4, 4, 4), dtype=np.float32)
+    #header: magic, version, bytes per value, channels, then the x, y, z dimensions
+    dims_offset = struct.calcsize('=8sIII')
+    for encoding in [molgrid.GridEncoding.raw, molgrid.GridEncoding.deflate]:
+        gname = str(tmpdir.join('dims%d.lmg' % int(encoding)))
+        molgrid.write_grid_file(gname, molgrid.Grid4f(values), (0, 0, 0), 0.5, [], encoding, False)
+        data = bytearray(open(gname, 'rb').read())
+        for dims in [(2**32-1,)*3, (2**21, 2**21, 2**22), (4096, 4096, 4096)]:
+            struct.pack_into('=III', data, dims_offset, *dims)
+            bad = str(tmpdir.join('bad.lmg'))
+            open(bad, 'wb').write(data)
+            with pytest.raises(ValueError):
+                molgrid.GridFile(bad)
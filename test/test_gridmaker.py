@@ -384,3 +384,540 @@ def test_type_radii():
     np.testing.assert_allclose(gpuatoms.tonumpy(),cpuatoms.tonumpy(),atol=1e-5)
     np.testing.assert_allclose(gputypes.tonumpy(),cputypes.tonumpy(),atol=1e-5)
 
+
+def test_batched_forward():
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    e.populate(datadir+"/small.types")
+    batch_size = 8
+    batch = e.next_batch(batch_size)
+    gmaker = molgrid.GridMaker()
+    dims = gmaker.grid_dimensions(e.num_types())
+
+    #the batched gpu path must match gridding each example separately with the same random transforms
+    molgrid.set_random_seed(0)
+    batched = molgrid.MGrid5f(batch_size,*dims)
+    gmaker.forward(batch, batched.gpu(), random_translation=2.0, random_rotation=True)
+
+    molgrid.set_random_seed(0)
+    single = molgrid.MGrid5f(batch_size,*dims)
+    for i in range(batch_size):
+        gmaker.forward(batch[i], single[i].gpu(), random_translation=2.0, random_rotation=True)
+
+    cpu = molgrid.MGrid5f(batch_size,*dims)
+    molgrid.set_random_seed(0)
+    gmaker.forward(batch, cpu.cpu(), random_translation=2.0, random_rotation=True)
+
+    assert batched.tonumpy().sum() > 0
+    np.testing.assert_allclose(batched.tonumpy(), single.tonumpy(), atol=1e-5)
+    np.testing.assert_allclose(batched.tonumpy(), cpu.tonumpy(), atol=1e-4)
+
+def test_batched_forward_empty_receptor(tmp_path):
+    #examples without a receptor grid their ligand in the same channels batched or not
+    lines = open(datadir+"/small.types").readlines()[:6]
+    fname = str(tmp_path / "norec.types")
+    with open(fname,'w') as f:
+        for i, line in enumerate(lines):
+            vals = line.split()
+            if i % 2 == 0: vals[3] = 'none'
+            f.write(' '.join(vals)+'\n')
+    e = molgrid.ExampleProvider(data_root=datadir+"/structs")
+    e.populate(fname)
+    batch_size = len(lines)
+    batch = e.next_batch(batch_size)
+    assert batch[0].coord_sets[0].size() == 0 and batch[1].coord_sets[0].size() > 0
+    gmaker = molgrid.GridMaker()
+    dims = gmaker.grid_dimensions(e.num_types())
+
+    molgrid.set_random_seed(0)
+    batched = molgrid.MGrid5f(batch_size,*dims)
+    gmaker.forward(batch, batched.gpu(), random_translation=2.0, random_rotation=True)
+
+    molgrid.set_random_seed(0)
+    single = molgrid.MGrid5f(batch_size,*dims)
+    for i in range(batch_size):
+        gmaker.forward(batch[i], single[i].cpu(), random_translation=2.0, random_rotation=True)
+
+    assert batched.tonumpy()[0].sum() > 0
+    np.testing.assert_allclose(batched.tonumpy(), single.tonumpy(), atol=1e-4)
+
+def test_threaded_cpu_forward():
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    e.populate(datadir+"/small.types")
+    ex = e.next()
+    dims = molgrid.GridMaker().grid_dimensions(e.num_types())
+
+    for binary in (False, True):
+        gmaker = molgrid.GridMaker(binary=binary)
+        assert gmaker.get_cpu_threads() == 1
+        serial = molgrid.MGrid4f(*dims)
+        gmaker.forward(ex, serial.cpu())
+
+        #slabs are independent so any thread count must give the same grid
+        for n in (0, 3, 8):
+            gmaker.set_cpu_threads(n)
+            threaded = molgrid.MGrid4f(*dims)
+            gmaker.forward(ex, threaded.cpu())
+            np.testing.assert_array_equal(serial.tonumpy(), threaded.tonumpy())
+
+        gpu = molgrid.MGrid4f(*dims)
+        gmaker.forward(ex, gpu.gpu())
+        np.testing.assert_allclose(serial.tonumpy(), gpu.tonumpy(), atol=1e-5)
+
+def test_threaded_cpu_backward():
+    rng = np.random.RandomState(9)
+    n = 120
+    c = rng.uniform(-8,8,(n,3)).astype(np.float32)
+    t = rng.randint(-1,4,n).astype(np.float32)
+    r = rng.uniform(1.0,2.0,n).astype(np.float32)
+    tv = rng.uniform(0,1,(n,4)).astype(np.float32)
+    index = molgrid.CoordinateSet(molgrid.Grid2f(c),molgrid.Grid1f(t),molgrid.Grid1f(r),4)
+    vector = molgrid.CoordinateSet(molgrid.Grid2f(c),molgrid.Grid2f(tv),molgrid.Grid1f(r))
+    gmaker = molgrid.GridMaker(resolution=0.5,dimension=16.0)
+    dims = gmaker.grid_dimensions(4)
+    diff = molgrid.MGrid4f(*dims)
+    diff.copyFrom(molgrid.Grid4f(rng.uniform(-1,1,dims).astype(np.float32)))
+    density = molgrid.MGrid4f(*dims)
+    gmaker.forward((0,0,0), index, density.cpu())
+
+    def gradients():
+        agrad = molgrid.MGrid2f(n,3)
+        gmaker.backward((0,0,0), index, diff.cpu(), agrad.cpu())
+        vgrad = molgrid.MGrid2f(n,3)
+        tgrad = molgrid.MGrid2f(n,4)
+        gmaker.backward((0,0,0), vector, diff.cpu(), vgrad.cpu(), tgrad.cpu())
+        rel = molgrid.MGrid1f(n)
+        gmaker.backward_relevance((0,0,0), index.coords.cpu(), index.type_index.cpu(), index.radii.cpu(),
+                                  density.cpu(), diff.cpu(), rel.cpu())
+        return [g.tonumpy() for g in (agrad, vgrad, tgrad, rel)]
+
+    serial = gradients()
+    assert np.abs(serial[0]).sum() > 0 and np.abs(serial[3]).sum() > 0
+    #atoms are independent so any thread count must give the same gradients
+    for threads in (0, 3, 8):
+        gmaker.set_cpu_threads(threads)
+        for s, p in zip(serial, gradients()):
+            np.testing.assert_array_equal(s, p)
+
+def test_density_table():
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    e.populate(datadir+"/small.types")
+    ex = e.next()
+
+    for grm in (1.0, 1.5):
+        gmaker = molgrid.GridMaker(gaussian_radius_multiple=grm)
+        dims = gmaker.grid_dimensions(e.num_types())
+        exact = molgrid.MGrid4f(*dims)
+        gmaker.forward(ex, exact.cpu())
+
+        assert not gmaker.get_density_table()
+        assert gmaker.get_density_table_error() == 0
+        gmaker.set_density_table(True)
+        assert gmaker.get_density_table()
+        err = gmaker.get_density_table_error()
+        assert 0 < err < 1e-4
+
+        cpu = molgrid.MGrid4f(*dims)
+        gpu = molgrid.MGrid4f(*dims)
+        gmaker.forward(ex, cpu.cpu())
+        gmaker.forward(ex, gpu.gpu())
+        #every voxel sums the density of a handful of atoms, each off by at most err
+        np.testing.assert_allclose(cpu.tonumpy(), exact.tonumpy(), atol=err*16)
+        np.testing.assert_allclose(gpu.tonumpy(), cpu.tonumpy(), atol=1e-5)
+
+        gmaker.set_density_table(False)
+        off = molgrid.MGrid4f(*dims)
+        gmaker.forward(ex, off.cpu())
+        np.testing.assert_array_equal(off.tonumpy(), exact.tonumpy())
+
+def test_binned_gpu_forward():
+    #atoms spread inside and outside the grid, some with no type, must match the cpu
+    rng = np.random.RandomState(17)
+    n = 3000
+    c = rng.uniform(-16,16,(n,3)).astype(np.float32)
+    t = rng.randint(-1,4,n).astype(np.float32)
+    for radius in (1.5, 20.0): #the large radius is too far reaching to bin
+        r = rng.uniform(0.8,radius,n).astype(np.float32)
+        for binary in (False, True):
+            gmaker = molgrid.GridMaker(resolution=0.5,dimension=24.0,binary=binary)
+            shape = gmaker.grid_dimensions(4)
+            cpugrid = molgrid.MGrid4f(*shape)
+            gpugrid = molgrid.MGrid4f(*shape)
+            coords = molgrid.CoordinateSet(molgrid.Grid2f(c),molgrid.Grid1f(t),molgrid.Grid1f(r),4)
+            gmaker.forward((0,0,0),coords, cpugrid.cpu())
+            gmaker.forward((0,0,0),coords, gpugrid.gpu())
+            assert cpugrid.tonumpy().sum() > 0
+            np.testing.assert_allclose(cpugrid.tonumpy(),gpugrid.tonumpy(),rtol=1e-4,atol=1e-4)
+
+            #vector types take the same binned path
+            tv = np.zeros((n,4),np.float32)
+            valid = t >= 0
+            tv[np.arange(n)[valid],t[valid].astype(int)] = 1.0
+            vcoords = molgrid.CoordinateSet(molgrid.Grid2f(c),molgrid.Grid2f(tv),molgrid.Grid1f(r))
+            vecgrid = molgrid.MGrid4f(*shape)
+            gmaker.forward((0,0,0),vcoords, vecgrid.gpu())
+            np.testing.assert_allclose(cpugrid.tonumpy(),vecgrid.tonumpy(),rtol=1e-4,atol=1e-4)
+
+def test_fused_transform_forward(tmp_path):
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    e.populate(datadir+"/small.types")
+    ex = e.next()
+    gmaker = molgrid.GridMaker()
+    dims = gmaker.grid_dimensions(e.num_types())
+
+    #transforming atoms as they are gridded must match transforming a copy on the cpu
+    molgrid.set_random_seed(0)
+    t = molgrid.Transform(ex.coord_sets[1].center(), 4.0, True)
+    cpu = molgrid.MGrid4f(*dims)
+    gmaker.forward(ex, t, cpu.cpu())
+    gpu = molgrid.MGrid4f(*dims)
+    gmaker.forward(ex, t, gpu.gpu())
+    assert cpu.tonumpy().sum() > 0
+    np.testing.assert_allclose(gpu.tonumpy(), cpu.tonumpy(), atol=1e-4)
+
+    #sets already on the gpu are packed without a round trip and are not modified
+    before = ex.coord_sets[1].coords.tonumpy()
+    for s in ex.coord_sets:
+        s.togpu()
+    resident = molgrid.MGrid4f(*dims)
+    gmaker.forward(ex, t, resident.gpu())
+    np.testing.assert_allclose(resident.tonumpy(), cpu.tonumpy(), atol=1e-4)
+    np.testing.assert_array_equal(ex.coord_sets[1].coords.tonumpy(), before)
+
+    #an empty set does not offset the channels of later sets on either device
+    vals = open(datadir+"/small.types").readline().split()
+    vals[3] = 'none'
+    fname = str(tmp_path / "norec.types")
+    with open(fname,'w') as f:
+        f.write(' '.join(vals)+'\n')
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    e.populate(fname)
+    ex = e.next()
+    assert ex.coord_sets[0].size() == 0
+    t = molgrid.Transform(ex.coord_sets[1].center(), 4.0, True)
+    cpu = molgrid.MGrid4f(*dims)
+    gmaker.forward(ex, t, cpu.cpu())
+    gpu = molgrid.MGrid4f(*dims)
+    gmaker.forward(ex, t, gpu.gpu())
+    assert cpu.tonumpy().sum() > 0
+    np.testing.assert_allclose(gpu.tonumpy(), cpu.tonumpy(), atol=1e-4)
+
+def test_sparse_forward():
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    e.populate(datadir+"/small.types")
+    ex = e.next()
+    gmaker = molgrid.GridMaker()
+    dims = gmaker.grid_dimensions(e.num_types())
+    t = molgrid.Transform(ex.coord_sets[1].center(), 2.0, True)
+    dense = molgrid.MGrid4f(*dims)
+    gmaker.forward(ex, t, dense.cpu())
+
+    for gpu in (False, True):
+        sparse = molgrid.SparseGrid()
+        gmaker.forward_sparse(ex, t, sparse, gpu)
+        assert sparse.channels == dims[0] and sparse.dim == dims[1]
+        assert 0 < len(sparse) == np.count_nonzero(dense.tonumpy())
+        idx = sparse.indices.tonumpy().astype(int)
+        assert np.all(np.diff(np.ravel_multi_index(idx.T, dims)) > 0) #ordered by channel then position
+        np.testing.assert_allclose(sparse.todense().tonumpy(), dense.tonumpy(), atol=1e-5)
+
+    #vector types skip channels without weight
+    lig = ex.coord_sets[1]
+    lig.make_vector_types()
+    center = tuple(lig.center())
+    vdense = molgrid.MGrid4f(*gmaker.grid_dimensions(lig.num_types()))
+    gmaker.forward(center, lig, vdense.cpu())
+    for gpu in (False, True):
+        vsparse = molgrid.SparseGrid()
+        gmaker.forward_sparse(center, lig, vsparse, gpu)
+        np.testing.assert_allclose(vsparse.todense().tonumpy(), vdense.tonumpy(), atol=1e-5)
+
+    #a batch matches gridding each example on its own
+    batch = e.next_batch(3)
+    transforms = [molgrid.Transform(b.coord_sets[1].center(), 2.0, True) for b in batch]
+    for gpu in (False, True):
+        sparse = gmaker.forward_sparse(batch, transforms, gpu)
+        assert len(sparse) == 3
+        for b, t, s in zip(batch, transforms, sparse):
+            single = molgrid.SparseGrid()
+            gmaker.forward_sparse(b, t, single, gpu)
+            assert len(s) == len(single)
+            np.testing.assert_allclose(s.todense().tonumpy(), single.todense().tonumpy(), atol=1e-5)
+
+def test_receptor_cache_forward():
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    e.populate(datadir+"/small.types")
+    ex = e.next()
+    gmaker = molgrid.GridMaker()
+    dims = gmaker.grid_dimensions(e.num_types())
+    t = molgrid.Transform(ex.coord_sets[1].center(), 2.0, True)
+    expected = molgrid.MGrid4f(*dims)
+    gmaker.forward(ex, t, expected.cpu())
+
+    for gpu in (False, True):
+        cache = molgrid.ReceptorGridCache()
+        for i in range(3):
+            g = molgrid.MGrid4f(*dims)
+            gmaker.forward(ex, t, g.gpu() if gpu else g.cpu(), cache)
+            np.testing.assert_allclose(g.tonumpy(), expected.tonumpy(), atol=1e-4)
+        assert cache.get_misses() == 1 and cache.get_hits() == 2
+
+        #a different transform grids the receptor again
+        t2 = molgrid.Transform(ex.coord_sets[1].center(), 2.0, True)
+        moved = molgrid.MGrid4f(*dims)
+        gmaker.forward(ex, t2, moved.cpu())
+        g = molgrid.MGrid4f(*dims)
+        gmaker.forward(ex, t2, g.gpu() if gpu else g.cpu(), cache)
+        np.testing.assert_allclose(g.tonumpy(), moved.tonumpy(), atol=1e-4)
+        assert cache.get_misses() == 2
+
+        #as do different gridding settings
+        g2maker = molgrid.GridMaker(resolution=0.25, dimension=12.0)
+        fine = molgrid.MGrid4f(*g2maker.grid_dimensions(e.num_types()))
+        g2maker.forward(ex, t2, fine.cpu())
+        g = molgrid.MGrid4f(*g2maker.grid_dimensions(e.num_types()))
+        g2maker.forward(ex, t2, g.gpu() if gpu else g.cpu(), cache)
+        np.testing.assert_allclose(g.tonumpy(), fine.tonumpy(), atol=1e-4)
+        assert cache.get_misses() == 3
+
+        #a receptor without a source is gridded every time
+        rec = ex.coord_sets[0]
+        anon = molgrid.Example()
+        anon.coord_sets.append(molgrid.CoordinateSet(rec.coords.cpu(), rec.type_index.cpu(), rec.radii.cpu(), rec.max_type))
+        anon.coord_sets.append(ex.coord_sets[1])
+        for i in range(2):
+            g = molgrid.MGrid4f(*dims)
+            gmaker.forward(anon, t, g.gpu() if gpu else g.cpu(), cache)
+            np.testing.assert_allclose(g.tonumpy(), expected.tonumpy(), atol=1e-4)
+        assert cache.get_misses() == 5 and cache.get_hits() == 2
+
+def test_sharded_forward():
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    e.populate(datadir+"/small.types")
+    batch_size = 7
+    batch = e.next_batch(batch_size)
+    gmaker = molgrid.GridMaker()
+    dims = gmaker.grid_dimensions(e.num_types())
+
+    molgrid.set_random_seed(0)
+    expected = molgrid.MGrid5f(batch_size,*dims)
+    gmaker.forward(batch, expected.gpu(), random_translation=2.0, random_rotation=True)
+
+    #the same device may be given more than once, so this runs with a single gpu
+    ngpus = torch.cuda.device_count()
+    devices = list(range(ngpus)) + [0]
+    for ongpu in (False, True):
+        molgrid.set_random_seed(0)
+        out = molgrid.MGrid5f(batch_size,*dims)
+        if ongpu:
+            out.set_device(ngpus-1)
+            out.gpu()
+        gmaker.forward(batch, out, devices, random_translation=2.0, random_rotation=True)
+        assert out.ongpu() == ongpu
+        np.testing.assert_allclose(out.tonumpy(), expected.tonumpy(), atol=1e-5)
+
+    #grids remember their device
+    g = molgrid.MGrid3f(2,2,2)
+    assert g.device() < 0
+    g.set_device(ngpus-1)
+    g.gpu()
+    assert g.device() == ngpus-1
+    assert g.clone(0).device() == 0
+    with pytest.raises(RuntimeError):
+        g.set_device(ngpus)
+
+def test_forward_delta():
+    rng = np.random.RandomState(3)
+    n = 200
+    c = rng.uniform(-10,10,(n,3)).astype(np.float32)
+    t = rng.randint(-1,4,n).astype(np.float32)
+    r = rng.uniform(1.0,2.0,n).astype(np.float32)
+    gmaker = molgrid.GridMaker(resolution=0.5,dimension=16.0)
+    dims = gmaker.grid_dimensions(4)
+    frame = lambda c, t: molgrid.CoordinateSet(molgrid.Grid2f(c),molgrid.Grid1f(t),molgrid.Grid1f(r),4)
+
+    #move a few atoms, including out of and into the grid, and retype one
+    c2 = c.copy()
+    t2 = t.copy()
+    c2[:10] += rng.uniform(-1.5,1.5,(10,3)).astype(np.float32)
+    c2[10] = (30,30,30)
+    t2[11] = (t2[11]+2) % 4
+    c2[12:] += rng.uniform(-1e-4,1e-4,(n-12,3)).astype(np.float32) #jitter below tolerance
+    nxt = frame(c2, t2)
+
+    for gpu in (False, True):
+        expected = molgrid.MGrid4f(*dims)
+        grid = molgrid.MGrid4f(*dims)
+        gmaker.forward((0,0,0), nxt, expected.cpu())
+        prev = frame(c, t)
+        if gpu:
+            gmaker.forward((0,0,0), prev, grid.gpu())
+            assert gmaker.forward_delta((0,0,0), prev, nxt, grid.gpu(), tolerance=1e-3) == 12
+        else:
+            gmaker.forward((0,0,0), prev, grid.cpu())
+            assert gmaker.forward_delta((0,0,0), prev, nxt, grid.cpu(), tolerance=1e-3) == 12
+        assert expected.tonumpy().sum() > 0
+        np.testing.assert_allclose(grid.tonumpy(), expected.tonumpy(), atol=1e-4)
+        #prev is updated to the gridded atoms, jittered atoms are left where they were gridded
+        pc = prev.coords.tonumpy()
+        np.testing.assert_array_equal(pc[:12], c2[:12])
+        np.testing.assert_array_equal(pc[12:], c[12:])
+        np.testing.assert_array_equal(prev.type_index.tonumpy(), t2)
+
+        #too many moved atoms is a full regrid that ignores the tolerance
+        prev = frame(c, t)
+        full = molgrid.MGrid4f(*dims)
+        g = full.gpu() if gpu else full.cpu()
+        assert gmaker.forward_delta((0,0,0), prev, nxt, g, max_fraction=0.05, tolerance=1e-3) == n
+        np.testing.assert_allclose(full.tonumpy(), expected.tonumpy(), atol=1e-5)
+        np.testing.assert_array_equal(prev.coords.tonumpy(), c2)
+
+    #binary density is not additive
+    bmaker = molgrid.GridMaker(resolution=0.5,dimension=16.0,binary=True)
+    bexpected = molgrid.MGrid4f(*dims)
+    bmaker.forward((0,0,0), nxt, bexpected.cpu())
+    bgrid = molgrid.MGrid4f(*dims)
+    assert bmaker.forward_delta((0,0,0), frame(c, t), nxt, bgrid.cpu()) == n
+    np.testing.assert_array_equal(bgrid.tonumpy(), bexpected.tonumpy())
+
+def test_forward_delta_drift():
+    #atoms that move less than the tolerance every frame are regridded once they drift past it
+    rng = np.random.RandomState(5)
+    n = 100
+    c = rng.uniform(-6,6,(n,3)).astype(np.float32)
+    t = rng.randint(0,4,n).astype(np.float32)
+    r = rng.uniform(1.0,2.0,n).astype(np.float32)
+    gmaker = molgrid.GridMaker(resolution=0.5,dimension=16.0)
+    dims = gmaker.grid_dimensions(4)
+    tol = 0.05
+    for gpu in (False, True):
+        gridded = molgrid.CoordinateSet(molgrid.Grid2f(c),molgrid.Grid1f(t),molgrid.Grid1f(r),4)
+        grid = molgrid.MGrid4f(*dims)
+        gmaker.forward((0,0,0), gridded, grid.gpu() if gpu else grid.cpu())
+        pos = c.copy()
+        total = 0
+        for f in range(100):
+            pos += rng.uniform(-0.02,0.02,(n,3)).astype(np.float32)
+            nxt = molgrid.CoordinateSet(molgrid.Grid2f(pos),molgrid.Grid1f(t),molgrid.Grid1f(r),4)
+            g = grid.gpu() if gpu else grid.cpu()
+            total += gmaker.forward_delta((0,0,0), gridded, nxt, g, max_fraction=1.0, tolerance=tol)
+            assert np.abs(gridded.coords.tonumpy() - pos).max() <= tol
+        #every atom drifted past the tolerance at some point, but far fewer than every frame
+        assert n < total < 100*n
+        expected = molgrid.MGrid4f(*dims)
+        gmaker.forward((0,0,0), gridded, expected.cpu())
+        np.testing.assert_allclose(grid.tonumpy(), expected.tonumpy(), atol=1e-3)
+
+def test_counter_random_forward():
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    e.populate(datadir+"/small.types")
+    batch = e.next_batch(4)
+    gmaker = molgrid.GridMaker()
+    dims = gmaker.grid_dimensions(e.num_types())
+    random = molgrid.RandomTransforms(11, 2.0, True)
+
+    #each example is gridded with the transformation of its index
+    expected = molgrid.MGrid5f(4,*dims)
+    for i, ex in enumerate(batch):
+        t = random.get(ex.coord_sets[-1].center(), 10+i)
+        gmaker.forward(ex, t, expected[i].cpu())
+    cpu = molgrid.MGrid5f(4,*dims)
+    gmaker.forward(batch, cpu.cpu(), random, 10)
+    np.testing.assert_allclose(cpu.tonumpy(), expected.tonumpy(), atol=1e-5)
+
+    #the gpu generates the same transformations, up to rounding of trig functions
+    molgrid.set_random_seed(5)
+    gpu = molgrid.MGrid5f(4,*dims)
+    gmaker.forward(batch, gpu.gpu(), random, 10)
+    np.testing.assert_allclose(gpu.tonumpy(), expected.tonumpy(), atol=1e-4)
+    again = molgrid.MGrid5f(4,*dims)
+    gmaker.forward(batch, again.gpu(), random, 10)
+    np.testing.assert_array_equal(again.tonumpy(), gpu.tonumpy())
+
+    other = molgrid.MGrid5f(4,*dims)
+    gmaker.forward(batch, other.cpu(), random, 14)
+    assert not np.allclose(other.tonumpy(), cpu.tonumpy())
+
+def test_grid_pyramid():
+    rng = np.random.RandomState(5)
+    n = 150
+    c = rng.uniform(-12,12,(n,3)).astype(np.float32)
+    t = rng.randint(-1,4,n).astype(np.float32)
+    r = rng.uniform(1.0,2.0,n).astype(np.float32)
+    tv = np.zeros((n,4),np.float32)
+    tv[np.arange(n),np.maximum(t,0).astype(int)] = rng.uniform(0.5,1.5,n)
+    index = molgrid.CoordinateSet(molgrid.Grid2f(c),molgrid.Grid1f(t),molgrid.Grid1f(r),4)
+    vector = molgrid.CoordinateSet(molgrid.Grid2f(c),molgrid.Grid2f(tv),molgrid.Grid1f(r))
+
+    levels = [(1.0,24.0),(0.5,16.0),(0.25,8.0)]
+    for binary in (False, True):
+        pyramid = molgrid.GridPyramid(levels,binary=binary)
+        assert pyramid.num_levels() == 3
+        dims = pyramid.grid_dimensions(4)
+        assert dims == [(4,25,25,25),(4,33,33,33),(4,33,33,33)]
+        for coords in (index, vector):
+            for threads, gpu in ((1,False),(3,False),(1,True)):
+                pyramid.set_cpu_threads(threads)
+                grids = [molgrid.MGrid4f(*d) for d in dims]
+                pyramid.forward((1,-1,0.5), coords, [g.gpu() if gpu else g.cpu() for g in grids])
+                for (res,dim), g in zip(levels, grids):
+                    expected = molgrid.MGrid4f(*g.shape)
+                    molgrid.GridMaker(resolution=res,dimension=dim,binary=binary).forward((1,-1,0.5), coords, expected.cpu())
+                    assert expected.tonumpy().sum() > 0
+                    np.testing.assert_allclose(g.tonumpy(), expected.tonumpy(), atol=1e-5)
+
+    pyramid = molgrid.GridPyramid(levels)
+    with pytest.raises(ValueError):
+        pyramid.forward((0,0,0), index, [molgrid.MGrid4f(*dims[0]).cpu()])
+
+def test_specialized_kernels():
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    e.populate(datadir+"/small.types")
+    batch = e.next_batch(4)
+    rt = molgrid.RandomTransforms(seed=7,random_translation=2.0,random_rotation=True)
+
+    #23.5 and 11.5A grids at 0.5 have specialized kernels, 16A does not
+    for dimension in (23.5, 11.5, 16.0):
+        for binary in (False, True):
+            gmaker = molgrid.GridMaker(resolution=0.5,dimension=dimension,binary=binary)
+            dims = gmaker.grid_dimensions(e.num_types())
+            results = []
+            for specialized in (False, True):
+                gmaker.set_specialized_kernels(specialized)
+                assert gmaker.get_specialized_kernels() == specialized
+                single = molgrid.MGrid4f(*dims)
+                batched = molgrid.MGrid5f(len(batch),*dims)
+                gmaker.forward(batch[0], molgrid.Transform(batch[0].coord_sets[1].center()), single.gpu())
+                gmaker.forward(batch, batched.gpu(), rt)
+                results.append((single.tonumpy(), batched.tonumpy()))
+            assert results[0][0].sum() > 0
+            np.testing.assert_array_equal(results[0][0], results[1][0])
+            np.testing.assert_array_equal(results[0][1], results[1][1])
+
+def test_autotune():
+    e = molgrid.ExampleProvider(ligmolcache=datadir+'/lig.molcache2',recmolcache=datadir+'/rec.molcache2')
+    e.populate(datadir+"/small.types")
+    batch = e.next_batch(4)
+    rt = molgrid.RandomTransforms(seed=7,random_translation=2.0,random_rotation=True)
+
+    #tuned launch configurations grid exactly as the default one, on first use and once cached
+    for binary in (False, True):
+        gmaker = molgrid.GridMaker(binary=binary)
+        dims = gmaker.grid_dimensions(e.num_types())
+        results = []
+        for tune in (False, True, True):
+            gmaker.set_autotune(tune)
+            assert gmaker.get_autotune() == tune
+            single = molgrid.MGrid4f(*dims)
+            batched = molgrid.MGrid5f(len(batch),*dims)
+            vec = molgrid.MGrid4f(*dims)
+            ex = batch[1]
+            gmaker.forward(batch[0], molgrid.Transform(batch[0].coord_sets[1].center()), single.gpu())
+            gmaker.forward(batch, batched.gpu(), rt)
+            c = ex.merge_coordinates()
+            c.make_vector_types()
+            gmaker.forward(c.center(), c.coords.gpu(), c.type_vector.gpu(), c.radii.gpu(), vec.gpu())
+            results.append((single.tonumpy(), batched.tonumpy(), vec.tonumpy()))
+        assert results[0][0].sum() > 0
+        for r in results[1:]:
+            for expected, actual in zip(results[0], r):
+                np.testing.assert_array_equal(expected, actual)
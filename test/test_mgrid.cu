@@ -9,8 +9,11 @@
 #include <boost/test/unit_test.hpp>
 #include <thrust/reduce.h>
 #include <thrust/execution_policy.h>
+#include <atomic>
+#include <thread>
 
 #include "libmolgrid/managed_grid.h"
+#include "libmolgrid/instrumentation.h"
 
 using namespace libmolgrid;
 
@@ -60,3 +63,101 @@ BOOST_AUTO_TEST_CASE( grid_conversion )
   cudaError_t error = cudaGetLastError();
   BOOST_CHECK_EQUAL(error,cudaSuccess);
 }
+
+BOOST_AUTO_TEST_CASE( pooled_async )
+{
+  set_memory_pooling(true);
+  float *cpuptr = nullptr, *gpuptr = nullptr;
+  {
+    MGrid1f g(1000);
+    g.togpu();
+    cpuptr = g.cpu().data();
+    gpuptr = g.gpu().data();
+  }
+  //blocks are reused once the work queued before they were freed is done
+  LMG_CUDA_CHECK(cudaDeviceSynchronize());
+  //a grid of similar size should reuse the freed blocks
+  MGrid1f g(980);
+  for(unsigned i = 0; i < 980; i++) {
+    g[i] = i;
+  }
+  BOOST_CHECK_EQUAL(g.cpu().data(), cpuptr);
+
+  cudaStream_t stream;
+  LMG_CUDA_CHECK(cudaStreamCreate(&stream));
+  g.togpu(stream);
+  BOOST_CHECK_EQUAL(g.gpu().data(), gpuptr);
+  float sum = thrust::reduce(thrust::cuda::par.on(stream), g.gpu().data(), g.gpu().data()+g.size());
+  BOOST_CHECK_EQUAL(sum, 479710);
+
+  g.tocpu(stream);
+  LMG_CUDA_CHECK(cudaStreamSynchronize(stream));
+  BOOST_CHECK_EQUAL(g[979], 979);
+  LMG_CUDA_CHECK(cudaStreamDestroy(stream));
+
+  set_memory_pooling(false);
+  release_memory_pools();
+  cudaError_t error = cudaGetLastError();
+  BOOST_CHECK_EQUAL(error,cudaSuccess);
+}
+
+//host function that holds up its stream until flag is set
+static void CUDART_CB wait_for_flag(void *flag) {
+  while(!((std::atomic<bool>*)flag)->load()) std::this_thread::yield();
+}
+
+BOOST_AUTO_TEST_CASE( pooled_nonblocking_stream )
+{
+  //memory used on a non-blocking stream is not reused until the work queued on it is done
+  set_memory_pooling(true);
+  release_memory_pools();
+  cudaStream_t stream;
+  LMG_CUDA_CHECK(cudaStreamCreateWithFlags(&stream, cudaStreamNonBlocking));
+  std::atomic<bool> go(false);
+  LMG_CUDA_CHECK(cudaLaunchHostFunc(stream, wait_for_flag, &go));
+  float *gpuptr = nullptr;
+  {
+    MGrid1f g(1000);
+    g.togpu(false);
+    gpuptr = g.gpu().data();
+    LMG_CUDA_CHECK(cudaMemsetAsync(gpuptr, 0, g.size()*sizeof(float), stream));
+    g.record_stream(stream);
+  }
+  MGrid1f busy(1000);
+  busy.togpu(false);
+  BOOST_CHECK_NE(busy.gpu().data(), gpuptr);
+
+  go = true;
+  LMG_CUDA_CHECK(cudaStreamSynchronize(stream));
+  MGrid1f reused(1000);
+  reused.togpu(false);
+  BOOST_CHECK_EQUAL(reused.gpu().data(), gpuptr);
+  LMG_CUDA_CHECK(cudaStreamDestroy(stream));
+
+  set_memory_pooling(false);
+  release_memory_pools();
+  cudaError_t error = cudaGetLastError();
+  BOOST_CHECK_EQUAL(error,cudaSuccess);
+}
+
+BOOST_AUTO_TEST_CASE( async_transfer_timing )
+{
+  //asynchronous transfers are timed on their stream, so are counted once they complete
+  set_instrumentation(true);
+  reset_instrumentation();
+  cudaStream_t stream;
+  LMG_CUDA_CHECK(cudaStreamCreate(&stream));
+  MGrid1f g(1000);
+  g.togpu(stream);
+  g.tocpu(stream);
+  LMG_CUDA_CHECK(cudaStreamSynchronize(stream));
+  std::vector<StageStats> stats = get_instrumentation_stats();
+  set_instrumentation(false);
+  BOOST_CHECK_EQUAL(stats[STAGE_HOST_TO_DEVICE].count, 1u);
+  BOOST_CHECK_EQUAL(stats[STAGE_HOST_TO_DEVICE].bytes, 4000u);
+  BOOST_CHECK_EQUAL(stats[STAGE_DEVICE_TO_HOST].count, 1u);
+  BOOST_CHECK_EQUAL(stats[STAGE_DEVICE_TO_HOST].bytes, 4000u);
+  BOOST_CHECK(stats[STAGE_HOST_TO_DEVICE].seconds > 0);
+  LMG_CUDA_CHECK(cudaStreamDestroy(stream));
+  reset_instrumentation();
+}
@@ -176,6 +176,50 @@ def test_batched_function():
         assert vt.grad[1][0].cpu().numpy() == approx([0.60653,-0.60653,0],abs=1e-4)
         assert vt.grad[1][1].cpu().numpy() == approx([0.60653,-0.60653,0],abs=1e-4)    
 
+def test_batched_backward():
+    '''single batched backward call matches per-example calls, padding atoms get zero gradient'''
+    rng = np.random.RandomState(7)
+    B, N, T = 3, 40, 4
+    for dev in ('cuda','cpu'):
+        gmaker = molgrid.GridMaker(resolution=0.5, dimension=12.0)
+        c = torch.tensor(rng.uniform(-5,5,(B,N,3)),dtype=torch.float32,device=dev)
+        t = torch.tensor(rng.randint(0,T,(B,N)),dtype=torch.float32,device=dev)
+        r = torch.tensor(rng.uniform(1,2,(B,N)),dtype=torch.float32,device=dev)
+        vt = torch.tensor(rng.uniform(0,1,(B,N,T)),dtype=torch.float32,device=dev)
+        t[1,30:] = -1 #padding
+        vt[1,30:] = 0
+        r[1,30:] = 0
+        shape = gmaker.grid_dimensions(T)
+        diff = torch.tensor(rng.uniform(-1,1,(B,)+tuple(shape)),dtype=torch.float32,device=dev)
+        density = torch.tensor(rng.uniform(0.5,1,(B,)+tuple(shape)),dtype=torch.float32,device=dev)
+
+        agrad = torch.ones(B,N,3,dtype=torch.float32,device=dev)
+        gmaker.backward((0,0,0), c, t, r, diff, agrad)
+        vagrad = torch.ones(B,N,3,dtype=torch.float32,device=dev)
+        vtgrad = torch.ones(B,N,T,dtype=torch.float32,device=dev)
+        gmaker.backward((0,0,0), c, vt, r, diff, vagrad, vtgrad)
+        rel = torch.ones(B,N,dtype=torch.float32,device=dev)
+        gmaker.backward_relevance((0,0,0), c, t, r, density, diff, rel)
+
+        for b in range(B):
+            expa = torch.zeros(N,3,dtype=torch.float32,device=dev)
+            gmaker.backward((0,0,0), c[b], t[b], r[b], diff[b], expa)
+            assert agrad[b].cpu().numpy() == approx(expa.cpu().numpy(),abs=1e-4)
+            n = 30 if b == 1 else N #skip padding, which has zero radius
+            expa = torch.zeros(n,3,dtype=torch.float32,device=dev)
+            expt = torch.zeros(n,T,dtype=torch.float32,device=dev)
+            gmaker.backward((0,0,0), c[b,:n].contiguous(), vt[b,:n].contiguous(), r[b,:n].contiguous(), diff[b], expa, expt)
+            assert vagrad[b,:n].cpu().numpy() == approx(expa.cpu().numpy(),abs=1e-4)
+            assert vtgrad[b,:n].cpu().numpy() == approx(expt.cpu().numpy(),abs=1e-4)
+            expr = torch.zeros(N,dtype=torch.float32,device=dev)
+            gmaker.backward_relevance((0,0,0), c[b], t[b], r[b], density[b], diff[b], expr)
+            assert rel[b].cpu().numpy() == approx(expr.cpu().numpy(),abs=1e-4)
+
+        assert float(agrad[1,30:].abs().sum()) == 0
+        assert float(vagrad[1,30:].abs().sum()) == 0
+        assert float(vtgrad[1,30:].abs().sum()) == 0
+        assert float(rel[1,30:].abs().sum()) == 0
+
 def test_coords2grid():
     gmaker = molgrid.GridMaker(resolution=0.5,
                            dimension=23.5,
@@ -218,3 +262,83 @@ def test_coords2grid():
     print(coords.grad.detach().cpu().numpy())
 
 
+
+def test_gridmaker_stream():
+    '''work queued on a non-default stream matches the default stream'''
+    rng = np.random.RandomState(3)
+    n = 500
+    c = rng.uniform(-10,10,(n,3)).astype(np.float32)
+    t = rng.randint(0,4,n).astype(np.float32)
+    r = rng.uniform(1,2,n).astype(np.float32)
+    gmaker = molgrid.GridMaker(resolution=0.5, dimension=16.0)
+    shape = gmaker.grid_dimensions(4)
+    coords = molgrid.CoordinateSet(molgrid.Grid2f(c),molgrid.Grid1f(t),molgrid.Grid1f(r),4)
+    transform = molgrid.Transform(coords.center(), 2.0, True)
+
+    def run(stream):
+        cs = coords.clone()
+        cs.togpu()
+        grid = torch.zeros(shape, dtype=torch.float32, device='cuda')
+        agrad = torch.zeros((n,3), dtype=torch.float32, device='cuda')
+        transform.forward(cs, cs, stream=stream)
+        gmaker.forward(transform.get_rotation_center(), cs, tensor_as_grid(grid), stream=stream)
+        gmaker.backward(transform.get_rotation_center(), cs, tensor_as_grid(grid), tensor_as_grid(agrad), stream=stream)
+        return grid, agrad
+
+    grid, agrad = run(0)
+    stream = torch.cuda.Stream()
+    with torch.cuda.stream(stream):
+        sgrid, sagrad = run(stream.cuda_stream)
+    stream.synchronize()
+    assert float(grid.sum()) > 0
+    assert torch.equal(grid, sgrid)
+    assert torch.equal(agrad, sagrad)
+
+def test_reduced_precision_forward():
+    '''half and bfloat16 grids are float grids rounded once'''
+    rng = np.random.RandomState(11)
+    n, T = 200, 4
+    c = torch.tensor(rng.uniform(-8,8,(n,3)),dtype=torch.float32,device='cuda')
+    t = torch.tensor(rng.randint(0,T,n),dtype=torch.float32,device='cuda')
+    vt = torch.tensor(rng.uniform(0,1,(n,T)),dtype=torch.float32,device='cuda')
+    r = torch.tensor(rng.uniform(1,2,n),dtype=torch.float32,device='cuda')
+    gmaker = molgrid.GridMaker(resolution=0.5, dimension=16.0)
+    shape = gmaker.grid_dimensions(T)
+
+    ref = torch.zeros(shape,dtype=torch.float32,device='cuda')
+    vref = torch.zeros(shape,dtype=torch.float32,device='cuda')
+    gmaker.forward((0,0,0), c, t, r, ref)
+    gmaker.forward((0,0,0), c, vt, r, vref)
+    for dtype in (torch.float16, torch.bfloat16):
+        #densities are summed in single precision and only rounded when stored
+        out = torch.ones(shape,dtype=dtype,device='cuda')
+        gmaker.forward((0,0,0), c, t, r, out)
+        assert torch.equal(out, ref.to(dtype))
+        out = torch.ones(shape,dtype=dtype,device='cuda')
+        gmaker.forward((0,0,0), c, vt, r, out)
+        assert torch.equal(out, vref.to(dtype))
+
+    #through examples and managed grids
+    datadir = os.path.dirname(__file__)+'/data'
+    e = molgrid.ExampleProvider(data_root=datadir+'/structs')
+    e.populate(datadir+'/small.types')
+    ex = e.next()
+    center = ex.coord_sets[-1].center()
+    ntypes = e.num_types()
+    fgrid = molgrid.MGrid4f(*gmaker.grid_dimensions(ntypes))
+    hgrid = molgrid.MGrid4h(*gmaker.grid_dimensions(ntypes))
+    transform = molgrid.Transform(center)
+    gmaker.forward(ex, transform, fgrid.gpu())
+    gmaker.forward(ex, transform, hgrid.gpu())
+    assert hgrid.type() == 'float16'
+    np.testing.assert_array_equal(hgrid.tonumpy(), fgrid.tonumpy().astype(np.float16))
+
+    #torch layer writes reduced precision grids, gradients are single precision
+    coords = c.clone().requires_grad_(True)
+    types = vt.clone().requires_grad_(True)
+    c2grid = molgrid.Coords2Grid(gmaker, dtype=torch.float16)
+    grid = c2grid(coords, types, r)
+    assert grid.dtype == torch.float16
+    grid.float().sum().backward()
+    assert coords.grad.dtype == torch.float32
+    assert float(types.grad.abs().sum()) > 0
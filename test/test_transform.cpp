@@ -54,6 +54,39 @@ BOOST_AUTO_TEST_CASE( random_transform)
   eqPt(c1,t.get_translation());
 }
 
+BOOST_AUTO_TEST_CASE(counter_random_transform)
+{
+  //Philox4x32-10 known answer for a zero counter and key
+  uint32_t r[4];
+  RandomTransforms::philox(0, 0, 0, r);
+  BOOST_CHECK_EQUAL(r[0], 0x6627e8d5u);
+  BOOST_CHECK_EQUAL(r[1], 0xe169c58du);
+  BOOST_CHECK_EQUAL(r[2], 0xbc57ac4cu);
+  BOOST_CHECK_EQUAL(r[3], 0x9b00dbd8u);
+
+  float3 c = make_float3(1,2,3);
+  RandomTransforms random(7, 4.0, true);
+  Transform t1 = random.get(c, 5);
+  random_engine.seed(1); //the global engine plays no part
+  Transform t2 = random.get(c, 5);
+  Transform t3 = random.get(c, 6);
+  Transform t4 = RandomTransforms(8, 4.0, true).get(c, 5);
+
+  eqQ(t1.get_quaternion(), t2.get_quaternion());
+  eqPt(t1.get_translation(), t2.get_translation());
+  neqQ(t1.get_quaternion(), t3.get_quaternion());
+  neqPt(t1.get_translation(), t3.get_translation());
+  neqQ(t1.get_quaternion(), t4.get_quaternion());
+  eqPt(c, t1.get_rotation_center());
+
+  Quaternion q = t1.get_quaternion();
+  BOOST_CHECK_SMALL(q.norm() - 1.0f, TOL);
+  float3 t = t1.get_translation();
+  BOOST_CHECK(fabs(t.x) <= 4 && fabs(t.y) <= 4 && fabs(t.z) <= 4);
+
+  eqQ(RandomTransforms(7, 4.0, false).get(c, 5).get_quaternion(), Quaternion());
+}
+
 BOOST_AUTO_TEST_CASE(apply_transform)
 {
   //non-random transform
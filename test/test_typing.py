@@ -411,3 +411,24 @@ def test_callbackvector_typing():
         else: #hydrogen
             assert tvec[0] == 1
             assert tvec[1] == 1
+
+
+def test_molecule_typing_matches_atom_typing():
+    '''typing a whole molecule at once matches typing each atom'''
+    m = pybel.readstring('smi','c1ccc[nH]1C(=O)N[C@@H](CS)C(=O)O[Se]C.[Zn]')
+    m.addh()
+    m.make3D()
+
+    for t in [molgrid.GninaIndexTyper(), molgrid.GninaIndexTyper(True), molgrid.defaultGninaLigandTyper,
+              molgrid.defaultGninaReceptorTyper, molgrid.ElementIndexTyper()]:
+        typs = [t.get_atom_type_index(a.OBAtom) for a in m.atoms]
+        typs = [tr for tr in typs if tr[0] >= 0]
+        c = molgrid.CoordinateSet(m, t)
+        assert list(c.type_index.tonumpy()) == [tr[0] for tr in typs]
+        assert c.radii.tonumpy() == approx([tr[1] for tr in typs])
+
+    t = molgrid.GninaVectorTyper()
+    typs = [t.get_atom_type_vector(a.OBAtom) for a in m.atoms]
+    c = molgrid.CoordinateSet(m, t)
+    assert c.type_vector.tonumpy() == approx(np.array([list(tv) for tv,r in typs]))
+    assert c.radii.tonumpy() == approx([r for tv,r in typs])